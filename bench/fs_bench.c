@@ -0,0 +1,1255 @@
+/*
+ * In-process metadata benchmark: drives the fs_* calls directly, without
+ * the kernel or libfuse in the way, so it measures stackfs' own cost.
+ *
+ *   make bench && ./fs_bench [-n files] [-r rounds] [-d dirs] [-m MB] [-t threads] [-s MB] [-a MB] [-c files] [-u depth] [-o MB] [-p MB] [-b files] [-l files] [-x files] [-g files] [-e files] /tmp/access
+ *
+ * -d also builds a two level tree of that many directories and stats them
+ * in a scattered order, which shows lookup cost once the namespace no
+ * longer fits in cache. -m caps the dentries at that many MB, so the
+ * lookups fault evicted directories back in. -t repeats the create/stat
+ * rounds with 1, 2, 4 ... up to that many threads, each in its own
+ * directory, the -n files split between them, and reports the aggregate
+ * rate per thread count. -s streams a file of that many MB through
+ * fs_write/fs_read and through fs_write_buf/fs_read_buf, with a pipe in
+ * place of /dev/fuse: the first pair moves every chunk through a user
+ * buffer like libfuse does for them, the second splices. -a appends that
+ * many MB in APPEND_CHUNK writes, once straight through and once with a
+ * write behind buffer coalescing them. -c writes that many SMALL_SIZE
+ * byte files and reads them all whole SMALL_PASSES times after a warm up
+ * pass, once from the backend and once through the page cache. -u reads
+ * a file at random in URING_OPS 4KB requests with 1, 2, 4 ... up to that
+ * many in flight: first from as many threads calling pread, the way FUSE
+ * workers do, then from one thread keeping them in flight on io_uring.
+ * -o writes a checkpoint of that many MB in STREAM_CHUNK writes, fsyncs
+ * it and reads it back, through a buffered handle and through an
+ * O_DIRECT one, and reports how much of each file the kernel still
+ * caches afterwards. -p writes a file of that many MB in STREAM_CHUNK
+ * writes, once as is and once with promotion set to move it out of the
+ * pool at a quarter of the way, reports both write rates and how long
+ * the move took past the last write, and reads the promoted file back.
+ * -b creates that many files in one directory with fs_create, then with
+ * STACKFS_IOC_CREATE_BATCH ioctls packed by libstackfs, the way untar
+ * and sharding tools would through sfsctl.
+ * -l lists a directory of that many files with attributes, first the
+ * way ls -l does, fs_readdir and an fs_getattr per name, then with
+ * STACKFS_IOC_BULKSTAT calls, and pages through it LIST_PAGE entries per
+ * fs_readdir call, timing the first and the last page. It also times
+ * STACKFS_BULK_RANK calls that seek to the first and to the last full
+ * buffer by rank, the way sharded listers split a directory.
+ * -x removes a tree of that many files, RMTREE_FANOUT per directory,
+ * the way rm -rf does, with a readdir per directory and an unlink per
+ * file, then an equal tree with fs_rmtree, timing the call and how long
+ * the reclaim thread took to free the files behind it.
+ * -g builds a tree of that many files of up to 4 KB, DU_FANOUT per
+ * directory, and sums it up the way du -s does, readdir and a getattr
+ * per name all the way down, then with the user.stackfs.rbytes xattr of
+ * the top directory, DU_CALLS times.
+ * -e creates, chmods, renames and unlinks that many files, first alone,
+ * then with a standby attached: a process forked at start, before any
+ * thread, that replays them from a UNIX socket on the same backend. It reports both
+ * rates, the cost replication adds to each op in microseconds, and the
+ * standby's lag by its acks, the last and the largest, and how long it
+ * took to catch up after the last op.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "../fs/fs.h"
+#include "../fs/evict.h"
+#include "../fs/file.h"
+#include "../fs/pcache.h"
+#include "../fs/uring.h"
+#include "../fs/promote.h"
+#include "../fs/ioctl.h"
+#include "../fs/reclaim.h"
+#include "../fs/aggr.h"
+#include "../fs/replica.h"
+#include "../client/stackfs.h"
+
+static int nr_files = 1000;
+static int nr_rounds = 20;
+static int nr_dirs = 0;
+static unsigned long mem_budget = 0;
+static int nr_threads = 0;
+static unsigned long stream_mb = 0;
+static unsigned long append_mb = 0;
+static int nr_small = 0;
+static int uring_depth = 0;
+static unsigned long direct_mb = 0;
+static unsigned long promote_mb = 0;
+static int nr_batch = 0;
+static int nr_list = 0;
+static int nr_rmtree = 0;
+static int nr_du = 0;
+static int nr_repl = 0;
+
+#define STREAM_CHUNK (128 << 10)    // the largest FUSE write
+#define APPEND_CHUNK 4096    // a FUSE write without big_writes
+#define APPEND_WB (1 << 20)
+#define SMALL_SIZE (100 << 10)    // a training image
+#define SMALL_PASSES 5
+#define URING_FILE (256 << 20)
+#define URING_OPS 200000
+#define URING_IO 4096
+#define LIST_PAGE 128    // about what one 4 KB FUSE readdir reply holds
+#define RANK_CALLS 100
+#define RMTREE_FANOUT 1000
+#define DU_FANOUT 100
+#define DU_CALLS 1000
+#define REPL_OPS 4    // create, chmod, rename, unlink
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// the pool layout map_tree expects: <access>/pre_alloc/0/<0..127>
+static int prepare_access(const char *access)
+{
+	char path[PATH_LEN];
+	int j;
+	mkdir(access, 0755);
+	snprintf(path, PATH_LEN, "%s/%s", access, ALLOCATED_PATH);
+	mkdir(path, 0755);
+	snprintf(path, PATH_LEN, "%s/%s/0", access, ALLOCATED_PATH);
+	mkdir(path, 0755);
+	for (j = 0; j < 128; j++) {
+		snprintf(path, PATH_LEN, "%s/%s/0/%d", access, ALLOCATED_PATH, j);
+		if (mkdir(path, 0755) != 0 && errno != EEXIST)
+			return ERROR;
+	}
+	return SUCCESS;
+}
+
+static void report(const char *name, uint64_t ns, long ops)
+{
+	printf("%-10s %10ld ops %10.0f ns/op %12.0f ops/s\n", name, ops,
+			(double) ns / ops, ops * 1e9 / ns);
+}
+
+static void report_bw(const char *name, uint64_t ns, uint64_t bytes)
+{
+	printf("%-10s %10lu MB %10.0f MB/s\n", name, (unsigned long) (bytes >> 20),
+			bytes * 1e9 / ns / (1 << 20));
+}
+
+// /tree/d.<i / 256>/e.<i>
+static void dir_path(char *path, int i)
+{
+	if (i < 0)
+		snprintf(path, PATH_LEN, "/tree/d.%d", -i - 1);
+	else
+		snprintf(path, PATH_LEN, "/tree/d.%d/e.%d", i / 256, i);
+}
+
+static void bench_lookup(void)
+{
+	char path[PATH_LEN];
+	struct stat st;
+	uint64_t start, t_mkdir, t_lookup;
+	long i, j, ops = 0;
+	start = now_ns();
+	fs_mkdir("/tree", 0755);
+	for (i = 0; i < (nr_dirs + 255) / 256; i++) {
+		dir_path(path, -i - 1);
+		fs_mkdir(path, 0755);
+	}
+	for (i = 0; i < nr_dirs; i++) {
+		dir_path(path, i);
+		fs_mkdir(path, 0755);
+	}
+	t_mkdir = now_ns() - start;
+
+	start = now_ns();
+	for (j = 0; j < nr_rounds; j++) {
+		// stride by a large prime so consecutive lookups share no cache lines
+		for (i = 0; i < nr_dirs; i++) {
+			dir_path(path, (int) ((i * 2654435761UL) % nr_dirs));
+			fs_getattr(path, &st);
+			ops++;
+		}
+	}
+	t_lookup = now_ns() - start;
+	report("mkdir", t_mkdir, nr_dirs);
+	report("lookup", t_lookup, ops);
+}
+
+struct bench_thread {
+	pthread_t tid;
+	int id;
+	int nr_threads;
+	pthread_barrier_t *barrier;
+};
+
+// main and the workers meet at the barrier between phases, main times them
+static void *bench_worker(void *arg)
+{
+	struct bench_thread *t = (struct bench_thread *) arg;
+	char path[PATH_LEN];
+	struct stat st;
+	int files = nr_files / t->nr_threads;
+	int i, r;
+	for (r = 0; r < nr_rounds; r++) {
+		pthread_barrier_wait(t->barrier);
+		for (i = 0; i < files; i++) {
+			snprintf(path, PATH_LEN, "/mt.%d/t.%d/file.%d", t->nr_threads, t->id, i);
+			fs_create(path, 0644, NULL);
+		}
+		pthread_barrier_wait(t->barrier);
+		for (i = 0; i < files; i++) {
+			snprintf(path, PATH_LEN, "/mt.%d/t.%d/file.%d", t->nr_threads, t->id, i);
+			fs_getattr(path, &st);
+		}
+		pthread_barrier_wait(t->barrier);
+		// every thread on the same file, the attributes are read and never written
+		snprintf(path, PATH_LEN, "/mt.%d/hot", t->nr_threads);
+		for (i = 0; i < files; i++)
+			fs_getattr(path, &st);
+		pthread_barrier_wait(t->barrier);
+		for (i = 0; i < files; i++) {
+			snprintf(path, PATH_LEN, "/mt.%d/t.%d/file.%d", t->nr_threads, t->id, i);
+			fs_unlink(path);
+		}
+	}
+	return NULL;
+}
+
+static void bench_scaling(int threads)
+{
+	struct bench_thread *t = (struct bench_thread *) calloc(threads, sizeof(struct bench_thread));
+	pthread_barrier_t barrier;
+	char path[PATH_LEN], name[16];
+	uint64_t start, t_create = 0, t_stat = 0, t_hot = 0;
+	long ops = (long) (nr_files / threads) * threads * nr_rounds;
+	int i, r;
+
+	snprintf(path, PATH_LEN, "/mt.%d", threads);
+	fs_mkdir(path, 0755);
+	for (i = 0; i < threads; i++) {
+		snprintf(path, PATH_LEN, "/mt.%d/t.%d", threads, i);
+		fs_mkdir(path, 0755);
+	}
+	snprintf(path, PATH_LEN, "/mt.%d/hot", threads);
+	fs_create(path, 0644, NULL);
+	pthread_barrier_init(&barrier, NULL, threads + 1);
+	for (i = 0; i < threads; i++) {
+		t[i].id = i;
+		t[i].nr_threads = threads;
+		t[i].barrier = &barrier;
+		pthread_create(&t[i].tid, NULL, bench_worker, &t[i]);
+	}
+	for (r = 0; r < nr_rounds; r++) {
+		start = now_ns();
+		pthread_barrier_wait(&barrier);    // go create
+		pthread_barrier_wait(&barrier);    // creates done, go stat
+		t_create += now_ns() - start;
+		start = now_ns();
+		pthread_barrier_wait(&barrier);    // stats done, go stat the hot file
+		t_stat += now_ns() - start;
+		start = now_ns();
+		pthread_barrier_wait(&barrier);    // done, go unlink
+		t_hot += now_ns() - start;
+	}
+	for (i = 0; i < threads; i++)
+		pthread_join(t[i].tid, NULL);
+	pthread_barrier_destroy(&barrier);
+	snprintf(name, sizeof(name), "create.%d", threads);
+	report(name, t_create, ops);
+	snprintf(name, sizeof(name), "stat.%d", threads);
+	report(name, t_stat, ops);
+	snprintf(name, sizeof(name), "stat_hot.%d", threads);
+	report(name, t_hot, ops);
+	free(t);
+}
+
+// a chunk of payload waits in the pipe, as a write request in /dev/fuse would
+static void stream_fill(int fd, char *buf)
+{
+	size_t done = 0;
+	ssize_t ret = 0;
+	while (done < STREAM_CHUNK && (ret = write(fd, buf + done, STREAM_CHUNK - done)) > 0)
+		done += ret;
+}
+
+static void stream_drain(int fd, char *buf)
+{
+	size_t done = 0;
+	ssize_t ret = 0;
+	while (done < STREAM_CHUNK && (ret = read(fd, buf + done, STREAM_CHUNK - done)) > 0)
+		done += ret;
+}
+
+static void bench_stream(void)
+{
+	struct fuse_file_info fi;
+	struct fuse_bufvec src, dst;
+	struct fuse_bufvec *bufv = NULL;
+	char *buf = (char *) malloc(STREAM_CHUNK);
+	char *scratch = (char *) malloc(STREAM_CHUNK);
+	uint64_t bytes = (uint64_t) stream_mb << 20;
+	uint64_t start, t_wcopy = 0, t_wsplice = 0, t_rcopy = 0, t_rsplice = 0;
+	off_t off;
+	int p[2];
+
+	if (buf == NULL || scratch == NULL || pipe(p) != 0)
+		return;
+	fcntl(p[0], F_SETPIPE_SZ, STREAM_CHUNK);
+	memset(buf, 'x', STREAM_CHUNK);
+	memset(&fi, 0, sizeof(fi));
+	if (fs_create("/stream", 0644, &fi) != SUCCESS)
+		goto out;
+	for (off = 0; off < bytes; off += STREAM_CHUNK) {
+		stream_fill(p[1], buf);
+		start = now_ns();
+		stream_drain(p[0], scratch);
+		fs_write("/stream", scratch, STREAM_CHUNK, off, &fi);
+		t_wcopy += now_ns() - start;
+	}
+	for (off = 0; off < bytes; off += STREAM_CHUNK) {
+		stream_fill(p[1], buf);
+		start = now_ns();
+		src = FUSE_BUFVEC_INIT(STREAM_CHUNK);
+		src.buf[0].flags = FUSE_BUF_IS_FD;
+		src.buf[0].fd = p[0];
+		fs_write_buf("/stream", &src, off, &fi);
+		t_wsplice += now_ns() - start;
+	}
+	for (off = 0; off < bytes; off += STREAM_CHUNK) {
+		start = now_ns();
+		fs_read("/stream", scratch, STREAM_CHUNK, off, &fi);
+		stream_fill(p[1], scratch);
+		t_rcopy += now_ns() - start;
+		stream_drain(p[0], scratch);
+	}
+	for (off = 0; off < bytes; off += STREAM_CHUNK) {
+		start = now_ns();
+		if (fs_read_buf("/stream", &bufv, STREAM_CHUNK, off, &fi) == 0) {
+			dst = FUSE_BUFVEC_INIT(STREAM_CHUNK);
+			dst.buf[0].flags = FUSE_BUF_IS_FD;
+			dst.buf[0].fd = p[1];
+			fuse_buf_copy(&dst, bufv, FUSE_BUF_SPLICE_MOVE);
+			free(bufv->buf[0].mem);
+			free(bufv);
+		}
+		t_rsplice += now_ns() - start;
+		stream_drain(p[0], scratch);
+	}
+	report_bw("write", t_wcopy, bytes);
+	report_bw("write_buf", t_wsplice, bytes);
+	report_bw("read", t_rcopy, bytes);
+	report_bw("read_buf", t_rsplice, bytes);
+	fs_release("/stream", &fi);
+	fs_unlink("/stream");
+out:
+	close(p[0]);
+	close(p[1]);
+	free(buf);
+	free(scratch);
+}
+
+static uint64_t append_run(const char *path, uint32_t wb_size)
+{
+	struct fuse_file_info fi;
+	char buf[APPEND_CHUNK];
+	uint64_t bytes = (uint64_t) append_mb << 20;
+	uint64_t start;
+	off_t off;
+
+	memset(buf, 'a', APPEND_CHUNK);
+	memset(&fi, 0, sizeof(fi));
+	file_wb_init(wb_size, 0);    // handles opened from here on
+	if (fs_create(path, 0644, &fi) != SUCCESS)
+		return 0;
+	start = now_ns();
+	for (off = 0; off < bytes; off += APPEND_CHUNK)
+		fs_write(path, buf, APPEND_CHUNK, off, &fi);
+	fs_release(path, &fi);
+	start = now_ns() - start;
+	fs_unlink(path);
+	return start;
+}
+
+static void bench_append(void)
+{
+	uint64_t bytes = (uint64_t) append_mb << 20;
+	report_bw("append", append_run("/append", 0), bytes);
+	report_bw("append.wb", append_run("/append.wb", APPEND_WB), bytes);
+	file_wb_init(0, 0);
+}
+
+static uint64_t small_run(char *buf)
+{
+	struct fuse_file_info fi;
+	char path[PATH_LEN];
+	uint64_t start = 0;
+	off_t off;
+	int pass, i;
+
+	for (pass = 0; pass <= SMALL_PASSES; pass++) {
+		if (pass == 1)
+			start = now_ns();    // the first pass fills the cache
+		for (i = 0; i < nr_small; i++) {
+			snprintf(path, PATH_LEN, "/small.%d", i);
+			memset(&fi, 0, sizeof(fi));
+			if (fs_open(path, &fi) != SUCCESS)
+				continue;
+			for (off = 0; off < SMALL_SIZE; off += STREAM_CHUNK)
+				fs_read(path, buf, STREAM_CHUNK, off, &fi);
+			fs_release(path, &fi);
+		}
+	}
+	return now_ns() - start;
+}
+
+static void bench_small(void)
+{
+	struct fuse_file_info fi;
+	char path[PATH_LEN];
+	char *buf = (char *) malloc(STREAM_CHUNK);
+	uint64_t bytes = (uint64_t) nr_small * SMALL_SIZE * SMALL_PASSES;
+	int i;
+
+	if (buf == NULL)
+		return;
+	memset(buf, 's', STREAM_CHUNK);
+	for (i = 0; i < nr_small; i++) {
+		snprintf(path, PATH_LEN, "/small.%d", i);
+		memset(&fi, 0, sizeof(fi));
+		if (fs_create(path, 0644, &fi) != SUCCESS)
+			continue;
+		fs_write(path, buf, SMALL_SIZE, 0, &fi);
+		fs_release(path, &fi);
+	}
+	report_bw("small", small_run(buf), bytes);
+	pcache_init((uint64_t) nr_small * (SMALL_SIZE + PCACHE_PAGE), 0);
+	report_bw("small.pc", small_run(buf), bytes);
+	for (i = 0; i < nr_small; i++) {
+		snprintf(path, PATH_LEN, "/small.%d", i);
+		fs_unlink(path);
+	}
+	pcache_destroy();
+	free(buf);
+}
+
+// MB of fd's file in the kernel page cache
+static unsigned long cached_mb(int fd, uint64_t bytes)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	size_t pages = (bytes + page - 1) / page;
+	unsigned char *vec = (unsigned char *) malloc(pages);
+	unsigned long resident = 0;
+	size_t i;
+	void *map = mmap(NULL, bytes, PROT_READ, MAP_SHARED, fd, 0);
+	if (map != MAP_FAILED && vec != NULL && mincore(map, bytes, vec) == 0) {
+		for (i = 0; i < pages; i++)
+			resident += vec[i] & 1;
+	}
+	if (map != MAP_FAILED)
+		munmap(map, bytes);
+	free(vec);
+	return resident * page >> 20;
+}
+
+static void bench_direct_one(const char *path, int flags, char *buf)
+{
+	struct fuse_file_info fi;
+	struct fs_file *file = NULL;
+	uint64_t bytes = (uint64_t) direct_mb << 20;
+	uint64_t start, t_write, t_read;
+	char name[32];
+	off_t off;
+
+	memset(&fi, 0, sizeof(fi));
+	fi.flags = O_RDWR | flags;
+	if (fs_create(path, 0644, &fi) != SUCCESS)
+		return;
+	file = (struct fs_file *) fi.fh;
+	start = now_ns();
+	for (off = 0; off < bytes; off += STREAM_CHUNK)
+		fs_write(path, buf, STREAM_CHUNK, off, &fi);
+	fs_fsync(path, 0, &fi);
+	t_write = now_ns() - start;
+	start = now_ns();
+	for (off = 0; off < bytes; off += STREAM_CHUNK)
+		fs_read(path, buf, STREAM_CHUNK, off, &fi);
+	t_read = now_ns() - start;
+	snprintf(name, sizeof(name), "ckpt.w%s", file->dfd >= 0 ? ".dio" : "");
+	report_bw(name, t_write, bytes);
+	snprintf(name, sizeof(name), "ckpt.r%s", file->dfd >= 0 ? ".dio" : "");
+	report_bw(name, t_read, bytes);
+	printf("%-10s %10lu MB cached by the kernel\n", "", cached_mb(file->dentry->fid, bytes));
+	fs_release(path, &fi);
+	fs_unlink(path);
+}
+
+// malloc'd like a libfuse request buffer, so not block aligned
+static void bench_direct(void)
+{
+	char *buf = (char *) malloc(STREAM_CHUNK + 16);
+	if (buf == NULL)
+		return;
+	memset(buf, 'c', STREAM_CHUNK + 16);
+	bench_direct_one("/ckpt", 0, buf + 16);
+	bench_direct_one("/ckpt.dio", O_DIRECT, buf + 16);
+	free(buf);
+}
+
+static void promote_fill(char *buf, off_t off)
+{
+	memset(buf, (int) ((off / STREAM_CHUNK) & 0xff), STREAM_CHUNK);
+}
+
+// 1 when the file read back as written
+static int bench_promote_one(const char *path, int promote)
+{
+	struct fuse_file_info fi;
+	struct dentry *dentry = NULL;
+	uint64_t bytes = (uint64_t) promote_mb << 20;
+	uint64_t start, t_write, t_move = 0;
+	char *buf = (char *) malloc(STREAM_CHUNK);
+	char *back = (char *) malloc(STREAM_CHUNK);
+	int ok = 0;
+	off_t off;
+
+	memset(&fi, 0, sizeof(fi));
+	fi.flags = O_RDWR;
+	if (buf == NULL || back == NULL || fs_create(path, 0644, &fi) != SUCCESS)
+		goto out;
+	dentry = ((struct fs_file *) fi.fh)->dentry;
+	start = now_ns();
+	for (off = 0; off < bytes; off += STREAM_CHUNK) {
+		promote_fill(buf, off);
+		fs_write(path, buf, STREAM_CHUNK, off, &fi);
+	}
+	t_write = now_ns() - start;
+	if (promote) {
+		start = now_ns();
+		while (!get_dentry_flag(dentry, D_promoted) && now_ns() - start < 60 * 1000000000ULL)
+			usleep(1000);
+		t_move = now_ns() - start;
+	}
+	ok = promote ? get_dentry_flag(dentry, D_promoted) : 1;
+	for (off = 0; ok && off < bytes; off += STREAM_CHUNK) {
+		promote_fill(buf, off);
+		ok = fs_read(path, back, STREAM_CHUNK, off, &fi) == STREAM_CHUNK && memcmp(buf, back, STREAM_CHUNK) == 0;
+	}
+	report_bw(promote ? "write.move" : "write", t_write, bytes);
+	if (promote)
+		printf("%-10s %10.1f ms after the last write, read back %s\n", "promoted", t_move / 1e6, ok ? "ok" : "BAD");
+	fs_release(path, &fi);
+	fs_unlink(path);
+out:
+	free(buf);
+	free(back);
+	return ok;
+}
+
+static void bench_promote(void)
+{
+	char stats[1024];
+	bench_promote_one("/big", 0);
+	if (promote_init(((uint64_t) promote_mb << 20) / 4) != SUCCESS)
+		return;
+	bench_promote_one("/big.move", 1);
+	promote_stats(stats, sizeof(stats));
+	printf("%s", stats);
+	promote_destroy();
+}
+
+static void batch_unlink(const char *dir)
+{
+	char path[PATH_LEN];
+	int i;
+	for (i = 0; i < nr_batch; i++) {
+		snprintf(path, PATH_LEN, "%s/f.%d", dir, i);
+		fs_unlink(path);
+	}
+}
+
+static void batch_single(const char *dir)
+{
+	char path[PATH_LEN];
+	int i;
+	for (i = 0; i < nr_batch; i++) {
+		snprintf(path, PATH_LEN, "%s/f.%d", dir, i);
+		fs_create(path, 0644, NULL);
+	}
+}
+
+static void bench_batch(void)
+{
+	struct stackfs_create_batch *batch = (struct stackfs_create_batch *) malloc(sizeof(*batch));
+	struct fuse_file_info fi;
+	char name[PATH_LEN];
+	uint32_t used = 0;
+	uint64_t start, t_single, t_batch;
+	long made = 0;
+	int i;
+	if (batch == NULL)
+		return;
+	memset(batch, 0, sizeof(*batch));
+	fs_mkdir("/batch", 0755);
+	// both runs take their files from a pool grown beforehand
+	batch_single("/batch");
+	batch_unlink("/batch");
+	start = now_ns();
+	batch_single("/batch");
+	t_single = now_ns() - start;
+	batch_unlink("/batch");
+	memset(&fi, 0, sizeof(fi));
+	fs_opendir("/batch", &fi);
+	start = now_ns();
+	for (i = 0; i <= nr_batch; i++) {
+		snprintf(name, PATH_LEN, "f.%d", i);
+		if (i < nr_batch && stackfs_batch_add(batch, &used, name, 0644) == 0)
+			continue;
+		if (batch->nr > 0 && fs_ioctl(NULL, STACKFS_IOC_CREATE_BATCH, NULL, &fi, FUSE_IOCTL_DIR, batch) == SUCCESS)
+			made += batch->done;
+		batch->nr = 0;
+		used = 0;
+		if (i < nr_batch)
+			stackfs_batch_add(batch, &used, name, 0644);
+	}
+	t_batch = now_ns() - start;
+	fs_releasedir(NULL, &fi);
+	batch_unlink("/batch");
+	report("create", t_single, nr_batch);
+	report("create.batch", t_batch, nr_batch);
+	if (made != nr_batch)
+		printf("create.batch made %ld of %d\n", made, nr_batch);
+	free(batch);
+}
+
+struct list_names {
+	char **names;
+	int nr;
+};
+
+struct list_page {
+	int nr;
+	off_t last;
+};
+
+static int page_filler(void *buf, const char *name, const struct stat *st, off_t off)
+{
+	struct list_page *page = (struct list_page *) buf;
+	if (page->nr == LIST_PAGE)
+		return 1;
+	page->nr++;
+	page->last = off;
+	return 0;
+}
+
+// ns of the first and of the last page
+static void list_pages(struct fuse_file_info *fi, uint64_t *first, uint64_t *last)
+{
+	struct list_page page;
+	uint64_t start;
+	off_t off = 0;
+	int pages = 0;
+	do {
+		page.nr = 0;
+		start = now_ns();
+		fs_readdir("/list", &page, page_filler, off, fi);
+		if (page.nr == 0)
+			break;
+		*last = now_ns() - start;
+		if (pages++ == 0)
+			*first = *last;
+		off = page.last;
+	} while (page.nr == LIST_PAGE);
+}
+
+// ns per bulkstat call starting at rank, and how many records each returned
+static uint64_t list_rank(struct fuse_file_info *fi, struct stackfs_bulkstat *bulk, uint32_t rank, uint32_t *nr)
+{
+	uint64_t start = now_ns();
+	int i;
+	for (i = 0; i < RANK_CALLS; i++) {
+		memset(bulk, 0, offsetof(struct stackfs_bulkstat, cookie));
+		bulk->flags = STACKFS_BULK_RANK;
+		bulk->rank = rank;
+		if (fs_ioctl(NULL, STACKFS_IOC_BULKSTAT, NULL, fi, FUSE_IOCTL_DIR, bulk) != SUCCESS)
+			break;
+	}
+	*nr = bulk->nr;
+	return (now_ns() - start) / RANK_CALLS;
+}
+
+static int list_filler(void *buf, const char *name, const struct stat *st, off_t off)
+{
+	struct list_names *list = (struct list_names *) buf;
+	if (list->nr < nr_list && strcmp(name, ".") != 0 && strcmp(name, "..") != 0)
+		list->names[list->nr++] = strdup(name);
+	return 0;
+}
+
+static void bench_list(void)
+{
+	struct stackfs_bulkstat *bulk = (struct stackfs_bulkstat *) malloc(sizeof(*bulk));
+	const struct stackfs_stat_rec *rec = NULL;
+	struct list_names list;
+	struct fuse_file_info fi;
+	char path[PATH_LEN];
+	struct stat st;
+	uint64_t start, t_stat, t_bulk, t_first = 0, t_last = 0, t_rfirst = 0, t_rlast = 0;
+	uint32_t per_call = 0;
+	long n = 0;
+	int i;
+	list.names = (char **) calloc(nr_list, sizeof(char *));
+	list.nr = 0;
+	if (bulk == NULL || list.names == NULL)
+		goto out;
+	fs_mkdir("/list", 0755);
+	for (i = 0; i < nr_list; i++) {
+		snprintf(path, PATH_LEN, "/list/f.%d", i);
+		fs_create(path, 0644, NULL);
+	}
+	memset(&fi, 0, sizeof(fi));
+	fs_opendir("/list", &fi);
+	start = now_ns();
+	fs_readdir("/list", &list, list_filler, 0, &fi);
+	for (i = 0; i < list.nr; i++) {
+		snprintf(path, PATH_LEN, "/list/%s", list.names[i]);
+		fs_getattr(path, &st);
+	}
+	t_stat = now_ns() - start;
+	memset(bulk, 0, sizeof(*bulk));
+	start = now_ns();
+	while (!(bulk->flags & STACKFS_BULK_EOF)) {
+		if (fs_ioctl(NULL, STACKFS_IOC_BULKSTAT, NULL, &fi, FUSE_IOCTL_DIR, bulk) != SUCCESS)
+			break;
+		for (rec = stackfs_stat_next(bulk, NULL); rec != NULL; rec = stackfs_stat_next(bulk, rec))
+			n++;
+	}
+	t_bulk = now_ns() - start;
+	list_pages(&fi, &t_first, &t_last);
+	// both calls return a full buffer, only the seek differs
+	t_rfirst = list_rank(&fi, bulk, 0, &per_call);
+	if (per_call < bulk->total)
+		t_rlast = list_rank(&fi, bulk, bulk->total - per_call, &per_call);
+	fs_releasedir(NULL, &fi);
+	report("readdir+stat", t_stat, list.nr);
+	report("bulkstat", t_bulk, n);
+	report("page.first", t_first, 1);
+	report("page.last", t_last, 1);
+	report("rank.first", t_rfirst, 1);
+	report("rank.last", t_rlast, 1);
+	for (i = 0; i < nr_list; i++) {
+		snprintf(path, PATH_LEN, "/list/f.%d", i);
+		fs_unlink(path);
+	}
+out:
+	for (i = 0; i < list.nr; i++)
+		free(list.names[i]);
+	free(list.names);
+	free(bulk);
+}
+
+static void rmtree_build(void)
+{
+	char path[PATH_LEN];
+	int i;
+	fs_mkdir("/rmtree", 0755);
+	for (i = 0; i < nr_rmtree; i++) {
+		if (i % RMTREE_FANOUT == 0) {
+			snprintf(path, PATH_LEN, "/rmtree/d.%d", i / RMTREE_FANOUT);
+			fs_mkdir(path, 0755);
+		}
+		snprintf(path, PATH_LEN, "/rmtree/d.%d/f.%d", i / RMTREE_FANOUT, i);
+		fs_create(path, 0644, NULL);
+	}
+}
+
+static int count_filler(void *buf, const char *name, const struct stat *st, off_t off)
+{
+	(*(long *) buf)++;
+	return 0;
+}
+
+static void rmtree_rf(void)
+{
+	struct fuse_file_info fi;
+	char path[PATH_LEN];
+	long names = 0;
+	int dirs = (nr_rmtree + RMTREE_FANOUT - 1) / RMTREE_FANOUT;
+	int d, i;
+	for (d = 0; d < dirs; d++) {
+		snprintf(path, PATH_LEN, "/rmtree/d.%d", d);
+		memset(&fi, 0, sizeof(fi));
+		fs_opendir(path, &fi);
+		fs_readdir(path, &names, count_filler, 0, &fi);
+		fs_releasedir(path, &fi);
+		for (i = d * RMTREE_FANOUT; i < nr_rmtree && i < (d + 1) * RMTREE_FANOUT; i++) {
+			snprintf(path, PATH_LEN, "/rmtree/d.%d/f.%d", d, i);
+			fs_unlink(path);
+		}
+		snprintf(path, PATH_LEN, "/rmtree/d.%d", d);
+		fs_rmdir(path);
+	}
+	fs_rmdir("/rmtree");
+}
+
+static void bench_rmtree(void)
+{
+	uint64_t start, t_rf, t_call, t_freed;
+	// both trees take their files from a pool grown beforehand
+	rmtree_build();
+	rmtree_rf();
+	rmtree_build();
+	start = now_ns();
+	rmtree_rf();
+	t_rf = now_ns() - start;
+	rmtree_build();
+	start = now_ns();
+	if (fs_rmtree("/rmtree") != SUCCESS)
+		printf("rmtree failed\n");
+	t_call = now_ns() - start;
+	while (reclaim_pending() > 0)
+		usleep(100);
+	t_freed = now_ns() - start;
+	report("rm-rf", t_rf, nr_rmtree);
+	report("rmtree", t_call, nr_rmtree);
+	report("rmtree.bg", t_freed, nr_rmtree);
+}
+
+static void du_build(void)
+{
+	struct fuse_file_info fi;
+	char path[PATH_LEN];
+	char buf[4096];
+	int i;
+	memset(buf, 'g', sizeof(buf));
+	fs_mkdir("/du", 0755);
+	for (i = 0; i < nr_du; i++) {
+		if (i % DU_FANOUT == 0) {
+			snprintf(path, PATH_LEN, "/du/d.%d", i / DU_FANOUT);
+			fs_mkdir(path, 0755);
+		}
+		snprintf(path, PATH_LEN, "/du/d.%d/f.%d", i / DU_FANOUT, i);
+		memset(&fi, 0, sizeof(fi));
+		if (fs_create(path, 0644, &fi) != SUCCESS)
+			continue;
+		fs_write(path, buf, 1 + i % sizeof(buf), 0, &fi);
+		fs_release(path, &fi);
+	}
+}
+
+struct du_names {
+	char **names;
+	int nr;
+	int cap;
+};
+
+static int du_filler(void *buf, const char *name, const struct stat *st, off_t off)
+{
+	struct du_names *list = (struct du_names *) buf;
+	if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+		return 0;
+	if (list->nr == list->cap) {
+		list->cap = list->cap > 0 ? list->cap * 2 : 256;
+		list->names = (char **) realloc(list->names, list->cap * sizeof(char *));
+	}
+	list->names[list->nr++] = strdup(name);
+	return 0;
+}
+
+static uint64_t du_walk(const char *dir, long *files)
+{
+	struct fuse_file_info fi;
+	struct du_names list;
+	struct stat st;
+	char path[PATH_LEN];
+	uint64_t bytes = 0;
+	int i;
+	memset(&list, 0, sizeof(list));
+	memset(&fi, 0, sizeof(fi));
+	fs_opendir(dir, &fi);
+	fs_readdir(dir, &list, du_filler, 0, &fi);
+	fs_releasedir(dir, &fi);
+	for (i = 0; i < list.nr; i++) {
+		snprintf(path, PATH_LEN, "%s/%s", dir, list.names[i]);
+		if (fs_getattr(path, &st) == SUCCESS) {
+			if (S_ISDIR(st.st_mode)) {
+				bytes += du_walk(path, files);
+			} else {
+				bytes += st.st_size;
+				(*files)++;
+			}
+		}
+		free(list.names[i]);
+	}
+	free(list.names);
+	return bytes;
+}
+
+static void bench_du(void)
+{
+	char value[32];
+	uint64_t start, t_walk, t_xattr;
+	uint64_t walked = 0;
+	long files = 0;
+	int len = 0;
+	int i;
+	du_build();
+	start = now_ns();
+	walked = du_walk("/du", &files);
+	t_walk = now_ns() - start;
+	start = now_ns();
+	for (i = 0; i < DU_CALLS; i++)
+		len = fs_getxattr("/du", RBYTES_XATTR, value, sizeof(value) - 1);
+	t_xattr = now_ns() - start;
+	value[len > 0 ? len : 0] = '\0';
+	printf("du         %10ld files %10lu bytes walked, %s by xattr\n", files, (unsigned long) walked, value);
+	report("du.walk", t_walk, 1);
+	report("du.xattr", t_xattr, DU_CALLS);
+}
+
+// one pass of the replicated ops over nr_repl files in dir, t[] gets each op's time
+static void repl_pass(const char *dir, uint64_t *t)
+{
+	char path[PATH_LEN], path2[PATH_LEN];
+	uint64_t start;
+	int i;
+	fs_mkdir(dir, 0755);
+	start = now_ns();
+	for (i = 0; i < nr_repl; i++) {
+		snprintf(path, PATH_LEN, "%s/file.%d", dir, i);
+		fs_create(path, 0644, NULL);
+	}
+	t[0] += now_ns() - start;
+	start = now_ns();
+	for (i = 0; i < nr_repl; i++) {
+		snprintf(path, PATH_LEN, "%s/file.%d", dir, i);
+		fs_chmod(path, S_IFREG | 0600);
+	}
+	t[1] += now_ns() - start;
+	start = now_ns();
+	for (i = 0; i < nr_repl; i++) {
+		snprintf(path, PATH_LEN, "%s/file.%d", dir, i);
+		snprintf(path2, PATH_LEN, "%s/moved.%d", dir, i);
+		fs_rename(path, path2);
+	}
+	t[2] += now_ns() - start;
+	start = now_ns();
+	for (i = 0; i < nr_repl; i++) {
+		snprintf(path, PATH_LEN, "%s/moved.%d", dir, i);
+		fs_unlink(path);
+	}
+	t[3] += now_ns() - start;
+	fs_rmdir(dir);
+}
+
+// a number out of replica_stats()
+static uint64_t repl_stat(const char *name)
+{
+	char buf[1024];
+	char *p = NULL;
+	int len = replica_stats(buf, sizeof(buf));
+	buf[len > 0 && len < (int) sizeof(buf) ? len : 0] = '\0';
+	p = strstr(buf, name);
+	return p != NULL ? strtoull(p + strlen(name) + 1, NULL, 10) : 0;
+}
+
+static pid_t standby = -1;
+static char standby_sock[108];
+
+// before fs_init() and any thread, a fork of a threaded process may inherit a held lock
+static void standby_start(const char *dir)
+{
+	int i;
+	snprintf(standby_sock, sizeof(standby_sock), "/tmp/fs_bench.%d.sock", (int) getpid());
+	signal(SIGPIPE, SIG_IGN);    // a standby that dies ends replication, not the bench
+	fflush(stdout);
+	standby = fork();
+	if (standby == 0) {
+		freopen("/dev/null", "w", stdout);
+		fs_init("/bench", (char *) dir);
+		_exit(replica_run_standby(standby_sock) == SUCCESS ? 0 : 1);
+	}
+	// its pool files mapped before ours, both open the same backend files
+	for (i = 0; standby > 0 && i < 1000 && access(standby_sock, F_OK) != 0; i++)
+		usleep(10000);
+}
+
+static void bench_replica(void)
+{
+	static const char *names[REPL_OPS] = { "create", "chmod", "rename", "unlink" };
+	char name[32];
+	uint64_t t_off[REPL_OPS] = { 0 }, t_on[REPL_OPS] = { 0 };
+	uint64_t start, t_drain;
+	long ops = (long) nr_repl * nr_rounds;
+	int i, r;
+	// untimed, the first pass pays for the backend files the later ones reuse
+	repl_pass("/repl", t_on);
+	memset(t_on, 0, sizeof(t_on));
+	for (r = 0; r < nr_rounds; r++)
+		repl_pass("/repl", t_off);
+	if (standby < 0 || replica_init_primary(standby_sock) != SUCCESS) {
+		printf("replica    no standby on %s\n", standby_sock);
+		if (standby > 0)
+			kill(standby, SIGTERM);
+		goto out;
+	}
+	for (r = 0; r < nr_rounds; r++)
+		repl_pass("/repl", t_on);
+	start = now_ns();
+	// a standby that dropped off clears replica.enabled, stop waiting on it then
+	while (repl_stat("replica.enabled") && repl_stat("replica.acked_seq") < repl_stat("replica.logged_seq"))
+		usleep(100);
+	t_drain = now_ns() - start;
+	for (i = 0; i < REPL_OPS; i++) {
+		report(names[i], t_off[i], ops);
+		snprintf(name, sizeof(name), "%s+r", names[i]);
+		report(name, t_on[i], ops);
+		printf("%-10s %10.2f us/op added\n", names[i], ((double) t_on[i] - t_off[i]) / ops / 1000);
+	}
+	printf("repl.lag   %10.0f us last %10.0f us max %10.0f us to catch up\n",
+			(double) repl_stat("replica.lag_us"), (double) repl_stat("replica.max_lag_us"), t_drain / 1e3);
+	replica_destroy();
+out:
+	if (standby > 0)
+		waitpid(standby, NULL, 0);
+}
+
+struct qd_worker {
+	int fd;
+	int ops;
+	unsigned seed;
+};
+
+static void *qd_pread(void *arg)
+{
+	struct qd_worker *w = (struct qd_worker *) arg;
+	char buf[URING_IO];
+	int i;
+	for (i = 0; i < w->ops; i++)
+		pread(w->fd, buf, URING_IO, (off_t) (rand_r(&w->seed) % (URING_FILE / URING_IO)) * URING_IO);
+	return NULL;
+}
+
+static sem_t qd_slots;
+
+static void qd_done(struct uring_req *req, int res)
+{
+	sem_post(&qd_slots);
+}
+
+static void bench_uring(void)
+{
+	struct fuse_file_info fi;
+	struct qd_worker w[256];
+	pthread_t tid[256];
+	struct uring_req *reqs = NULL;
+	char *buf = (char *) malloc(STREAM_CHUNK);
+	char *bufs = NULL;
+	uint64_t start, t_pread, t_uring;
+	unsigned seed = 1;
+	off_t off;
+	int qd, i, fd;
+
+	memset(&fi, 0, sizeof(fi));
+	if (buf == NULL || fs_create("/uring", 0644, &fi) != SUCCESS)
+		goto out;
+	memset(buf, 'u', STREAM_CHUNK);
+	for (off = 0; off < URING_FILE; off += STREAM_CHUNK)
+		fs_write("/uring", buf, STREAM_CHUNK, off, &fi);
+	fd = ((struct fs_file *) fi.fh)->dentry->fid;
+	if (uring_init(uring_depth) != SUCCESS || !uring_active())
+		goto out_file;
+	reqs = (struct uring_req *) calloc(uring_depth, sizeof(struct uring_req));
+	bufs = (char *) malloc((size_t) uring_depth * URING_IO);
+	if (reqs == NULL || bufs == NULL)
+		goto out_file;
+	for (qd = 1; qd <= uring_depth && qd <= 256; qd *= 2) {
+		start = now_ns();
+		for (i = 0; i < qd; i++) {
+			w[i].fd = fd;
+			w[i].ops = URING_OPS / qd;
+			w[i].seed = i + 1;
+			pthread_create(&tid[i], NULL, qd_pread, &w[i]);
+		}
+		for (i = 0; i < qd; i++)
+			pthread_join(tid[i], NULL);
+		t_pread = now_ns() - start;
+
+		sem_init(&qd_slots, 0, qd);
+		start = now_ns();
+		for (i = 0; i < URING_OPS; i++) {
+			sem_wait(&qd_slots);
+			reqs[i % qd].op = URING_READ;
+			reqs[i % qd].fd = fd;
+			reqs[i % qd].buf = bufs + (size_t) (i % qd) * URING_IO;
+			reqs[i % qd].len = URING_IO;
+			reqs[i % qd].buf_index = -1;
+			reqs[i % qd].off = (off_t) (rand_r(&seed) % (URING_FILE / URING_IO)) * URING_IO;
+			reqs[i % qd].done = qd_done;
+			uring_submit(&reqs[i % qd]);
+		}
+		for (i = 0; i < qd; i++)
+			sem_wait(&qd_slots);
+		t_uring = now_ns() - start;
+		sem_destroy(&qd_slots);
+		printf("qd %-7d %10.0f pread ops/s %10.0f uring ops/s\n", qd,
+				(URING_OPS / qd) * qd * 1e9 / t_pread, URING_OPS * 1e9 / t_uring);
+	}
+	uring_destroy();
+out_file:
+	fs_release("/uring", &fi);
+	fs_unlink("/uring");
+out:
+	free(reqs);
+	free(bufs);
+	free(buf);
+}
+
+int main(int argc, char *argv[])
+{
+	int opt, i, r;
+	char path[PATH_LEN];
+	struct stat st;
+	uint64_t start, t_create = 0, t_stat = 0, t_unlink = 0;
+
+	while ((opt = getopt(argc, argv, "n:r:d:m:t:s:a:c:u:o:p:b:l:x:g:e:")) != -1) {
+		switch (opt) {
+		case 'n':
+			nr_files = atoi(optarg);
+			break;
+		case 'r':
+			nr_rounds = atoi(optarg);
+			break;
+		case 'd':
+			nr_dirs = atoi(optarg);
+			break;
+		case 'm':
+			mem_budget = strtoul(optarg, NULL, 10);
+			break;
+		case 't':
+			nr_threads = atoi(optarg);
+			break;
+		case 's':
+			stream_mb = strtoul(optarg, NULL, 10);
+			break;
+		case 'a':
+			append_mb = strtoul(optarg, NULL, 10);
+			break;
+		case 'c':
+			nr_small = atoi(optarg);
+			break;
+		case 'u':
+			uring_depth = atoi(optarg);
+			break;
+		case 'o':
+			direct_mb = strtoul(optarg, NULL, 10);
+			break;
+		case 'p':
+			promote_mb = strtoul(optarg, NULL, 10);
+			break;
+		case 'b':
+			nr_batch = atoi(optarg);
+			break;
+		case 'l':
+			nr_list = atoi(optarg);
+			break;
+		case 'x':
+			nr_rmtree = atoi(optarg);
+			break;
+		case 'g':
+			nr_du = atoi(optarg);
+			break;
+		case 'e':
+			nr_repl = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n files] [-r rounds] [-d dirs] [-m MB] [-t threads] [-s MB] [-a MB] [-c files] [-u depth] [-o MB] [-p MB] [-b files] [-l files] [-x files] [-g files] [-e files] access_dir\n", argv[0]);
+			return 1;
+		}
+	}
+	if (optind >= argc || prepare_access(argv[optind]) != SUCCESS) {
+		fprintf(stderr, "usage: %s [-n files] [-r rounds] [-d dirs] [-m MB] [-t threads] [-s MB] [-a MB] [-c files] [-u depth] [-o MB] [-p MB] [-b files] [-l files] [-x files] [-g files] [-e files] access_dir\n", argv[0]);
+		return 1;
+	}
+
+	if (nr_repl > 0)
+		standby_start(argv[optind]);
+	fs_init("/bench", argv[optind]);
+	evict_init((uint64_t) mem_budget << 20, NULL);
+	fs_mkdir("/bench", 0755);
+	for (r = 0; r < nr_rounds; r++) {
+		start = now_ns();
+		for (i = 0; i < nr_files; i++) {
+			snprintf(path, PATH_LEN, "/bench/file.%d", i);
+			fs_create(path, 0644, NULL);
+		}
+		t_create += now_ns() - start;
+
+		start = now_ns();
+		for (i = 0; i < nr_files; i++) {
+			snprintf(path, PATH_LEN, "/bench/file.%d", i);
+			fs_getattr(path, &st);
+		}
+		t_stat += now_ns() - start;
+
+		start = now_ns();
+		for (i = 0; i < nr_files; i++) {
+			snprintf(path, PATH_LEN, "/bench/file.%d", i);
+			fs_unlink(path);
+		}
+		t_unlink += now_ns() - start;
+	}
+	report("create", t_create, (long) nr_files * nr_rounds);
+	report("stat", t_stat, (long) nr_files * nr_rounds);
+	report("unlink", t_unlink, (long) nr_files * nr_rounds);
+	if (nr_dirs > 0)
+		bench_lookup();
+	for (i = 1; nr_threads > 0; i *= 2) {
+		bench_scaling(i < nr_threads ? i : nr_threads);
+		if (i >= nr_threads)
+			break;
+	}
+	if (stream_mb > 0)
+		bench_stream();
+	if (append_mb > 0)
+		bench_append();
+	if (nr_small > 0)
+		bench_small();
+	if (uring_depth > 0)
+		bench_uring();
+	if (direct_mb > 0)
+		bench_direct();
+	if (promote_mb > 0)
+		bench_promote();
+	if (nr_batch > 0)
+		bench_batch();
+	if (nr_list > 0)
+		bench_list();
+	if (nr_rmtree > 0)
+		bench_rmtree();
+	if (nr_du > 0)
+		bench_du();
+	// last, its standby shares the backend until it goes
+	if (nr_repl > 0)
+		bench_replica();
+	printf("entry      %10lu bytes, dentry %lu + attr %lu\n",
+			(unsigned long) (sizeof(struct dentry) + sizeof(struct dentry_attr)),
+			(unsigned long) sizeof(struct dentry), (unsigned long) sizeof(struct dentry_attr));
+	fs_destroy();
+	return 0;
+}
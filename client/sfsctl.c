@@ -0,0 +1,446 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <dirent.h>
+
+#include "stackfs.h"
+
+/*
+ * Command line front of libstackfs, for scripts and for measuring the
+ * ioctls against the plain syscalls they replace on a mounted stackfs.
+ *
+ *   sfsctl create [-m mode] dir [name ...]    names from stdin if none given
+ *   sfsctl bench-create dir n                 n creat() against n batched creates
+ *   sfsctl ls [-r start count] dir            mode nlink uid gid size mtime name per child
+ *   sfsctl count dir                          number of children
+ *   sfsctl du dir ...                         bytes, files and directories below each dir
+ *   sfsctl rmtree dir ...                     rm -rf, the files are freed in the background
+ *   sfsctl bench-rmtree dir n                 n files deleted one by one against one rmtree
+ *   sfsctl bench-stat dir                     readdir and a stat per child against bulkstat
+ */
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int open_dir(const char *dir)
+{
+	int fd = open(dir, O_RDONLY | O_DIRECTORY);
+	if (fd < 0)
+		fprintf(stderr, "sfsctl: %s: %s\n", dir, strerror(errno));
+	return fd;
+}
+
+// names from stdin, one per line
+static char **read_names(int *nr)
+{
+	char line[PATH_MAX];
+	char **names = NULL;
+	char **tmp = NULL;
+	int cap = 0;
+	size_t len = 0;
+	*nr = 0;
+	while (fgets(line, sizeof(line), stdin) != NULL) {
+		len = strlen(line);
+		if (len > 0 && line[len - 1] == '\n')
+			line[--len] = '\0';
+		if (len == 0)
+			continue;
+		if (*nr == cap) {
+			cap = cap > 0 ? cap * 2 : 1024;
+			tmp = (char **) realloc(names, cap * sizeof(char *));
+			if (tmp == NULL)
+				break;
+			names = tmp;
+		}
+		names[(*nr)++] = strdup(line);
+	}
+	return names;
+}
+
+static int cmd_create(int argc, char **argv)
+{
+	mode_t mode = 0644;
+	char **names = NULL;
+	mode_t *modes = NULL;
+	int *status = NULL;
+	int nr = 0;
+	int fd = -1;
+	int ret = 0;
+	int i;
+	if (argc > 2 && strcmp(argv[1], "-m") == 0) {
+		mode = (mode_t) strtoul(argv[2], NULL, 8);
+		argc -= 2;
+		argv += 2;
+	}
+	if (argc < 2)
+		return 2;
+	fd = open_dir(argv[1]);
+	if (fd < 0)
+		return 1;
+	if (argc > 2) {
+		names = &argv[2];
+		nr = argc - 2;
+	} else {
+		names = read_names(&nr);
+	}
+	status = (int *) calloc(nr > 0 ? nr : 1, sizeof(int));
+	modes = (mode_t *) calloc(nr > 0 ? nr : 1, sizeof(mode_t));
+	if (status == NULL || modes == NULL) {
+		ret = 1;
+		goto out;
+	}
+	for (i = 0; i < nr; i++)
+		modes[i] = mode;
+	ret = stackfs_create_batch(fd, (const char **) names, modes, nr, status);
+	if (ret < 0) {
+		fprintf(stderr, "sfsctl: create in %s: %s\n", argv[1], strerror(-ret));
+		ret = 1;
+		goto out;
+	}
+	for (i = 0; i < nr; i++) {
+		if (status[i] != 0)
+			fprintf(stderr, "sfsctl: %s: %s\n", names[i], strerror(-status[i]));
+	}
+	ret = ret == nr ? 0 : 1;
+out:
+	free(modes);
+	free(status);
+	close(fd);
+	return ret;
+}
+
+static void report(const char *name, uint64_t ns, long n)
+{
+	printf("%-14s %8ld files %10.0f ns/file %10.0f files/s\n", name, n, (double) ns / n, n * 1e9 / ns);
+}
+
+static int cmd_bench_create(int argc, char **argv)
+{
+	char **names = NULL;
+	int *status = NULL;
+	char path[PATH_MAX];
+	uint64_t start = 0;
+	int n = 0;
+	int fd = -1;
+	int dfd = -1;
+	int ret = 1;
+	int i;
+	if (argc < 3)
+		return 2;
+	n = atoi(argv[2]);
+	dfd = open_dir(argv[1]);
+	if (n <= 0 || dfd < 0)
+		goto out;
+	names = (char **) calloc(n, sizeof(char *));
+	status = (int *) calloc(n, sizeof(int));
+	if (names == NULL || status == NULL)
+		goto out;
+	start = now_ns();
+	for (i = 0; i < n; i++) {
+		snprintf(path, sizeof(path), "%s/creat.%d", argv[1], i);
+		fd = creat(path, 0644);
+		if (fd < 0) {
+			fprintf(stderr, "sfsctl: %s: %s\n", path, strerror(errno));
+			goto out;
+		}
+		close(fd);
+	}
+	report("creat", now_ns() - start, n);
+	for (i = 0; i < n; i++) {
+		snprintf(path, sizeof(path), "batch.%d", i);
+		names[i] = strdup(path);
+	}
+	start = now_ns();
+	if (stackfs_create_batch(dfd, (const char **) names, NULL, n, status) != n) {
+		fprintf(stderr, "sfsctl: batch create in %s failed\n", argv[1]);
+		goto out;
+	}
+	report("create_batch", now_ns() - start, n);
+	ret = 0;
+out:
+	for (i = 0; names != NULL && i < n; i++) {
+		snprintf(path, sizeof(path), "%s/creat.%d", argv[1], i);
+		unlink(path);
+		if (names[i] != NULL) {
+			snprintf(path, sizeof(path), "%s/%s", argv[1], names[i]);
+			unlink(path);
+		}
+		free(names[i]);
+	}
+	free(names);
+	free(status);
+	if (dfd >= 0)
+		close(dfd);
+	return ret;
+}
+
+static int print_rec(const struct stackfs_stat_rec *rec, void *arg)
+{
+	printf("%06o %u %u %u %llu %lld %s\n", rec->mode, rec->nlink, rec->uid, rec->gid,
+			(unsigned long long) rec->size, (long long) (rec->mtime_ns / 1000000000LL), rec->name);
+	return 0;
+}
+
+static int cmd_ls(int argc, char **argv)
+{
+	uint32_t start = 0;
+	uint32_t count = 0;
+	int fd = -1;
+	int ret = 0;
+	if (argc > 3 && strcmp(argv[1], "-r") == 0) {
+		start = (uint32_t) strtoul(argv[2], NULL, 10);
+		count = (uint32_t) strtoul(argv[3], NULL, 10);
+		argc -= 3;
+		argv += 3;
+	}
+	if (argc < 2)
+		return 2;
+	fd = open_dir(argv[1]);
+	if (fd < 0)
+		return 1;
+	ret = stackfs_bulkstat_range(fd, start, count, print_rec, NULL);
+	if (ret < 0)
+		fprintf(stderr, "sfsctl: ls %s: %s\n", argv[1], strerror(-ret));
+	close(fd);
+	return ret < 0 ? 1 : 0;
+}
+
+static int cmd_count(int argc, char **argv)
+{
+	long nr = 0;
+	int fd = -1;
+	if (argc < 2)
+		return 2;
+	fd = open_dir(argv[1]);
+	if (fd < 0)
+		return 1;
+	nr = stackfs_nr_children(fd);
+	if (nr < 0)
+		fprintf(stderr, "sfsctl: count %s: %s\n", argv[1], strerror((int) -nr));
+	else
+		printf("%ld\n", nr);
+	close(fd);
+	return nr < 0 ? 1 : 0;
+}
+
+static int cmd_du(int argc, char **argv)
+{
+	struct stackfs_dirstat ds;
+	int ret = 0;
+	int err = 0;
+	int fd = -1;
+	int i;
+	if (argc < 2)
+		return 2;
+	for (i = 1; i < argc; i++) {
+		fd = open_dir(argv[i]);
+		if (fd < 0) {
+			ret = 1;
+			continue;
+		}
+		err = stackfs_dirstat(fd, &ds);
+		if (err < 0) {
+			fprintf(stderr, "sfsctl: du %s: %s\n", argv[i], strerror(-err));
+			ret = 1;
+		} else {
+			printf("%llu\t%llu\t%llu\t%s\n", (unsigned long long) ds.bytes, (unsigned long long) ds.files,
+					(unsigned long long) ds.dirs, argv[i]);
+		}
+		close(fd);
+	}
+	return ret;
+}
+
+static int count_rec(const struct stackfs_stat_rec *rec, void *arg)
+{
+	(*(long *) arg)++;
+	return 0;
+}
+
+static int cmd_bench_stat(int argc, char **argv)
+{
+	struct dirent *de = NULL;
+	struct stat st;
+	DIR *dir = NULL;
+	uint64_t start = 0;
+	long n = 0;
+	long bulk = 0;
+	int fd = -1;
+	int ret = 1;
+	if (argc < 2)
+		return 2;
+	dir = opendir(argv[1]);
+	fd = open_dir(argv[1]);
+	if (dir == NULL || fd < 0)
+		goto out;
+	// what ls -l does
+	start = now_ns();
+	while ((de = readdir(dir)) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+		if (fstatat(dirfd(dir), de->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+			n++;
+	}
+	if (n == 0)
+		goto out;
+	report("readdir+stat", now_ns() - start, n);
+	start = now_ns();
+	if (stackfs_bulkstat(fd, count_rec, &bulk) < 0 || bulk == 0)
+		goto out;
+	report("bulkstat", now_ns() - start, bulk);
+	ret = 0;
+out:
+	if (dir != NULL)
+		closedir(dir);
+	if (fd >= 0)
+		close(fd);
+	return ret;
+}
+
+// dir/name from path, dir opened
+static int open_parent(const char *path, char *name)
+{
+	char dir[PATH_MAX];
+	const char *slash = NULL;
+	size_t len = strlen(path);
+	while (len > 1 && path[len - 1] == '/')
+		len--;
+	if (len >= PATH_MAX)
+		return -1;
+	memcpy(dir, path, len);
+	dir[len] = '\0';
+	slash = strrchr(dir, '/');
+	if (slash == NULL) {
+		strcpy(name, dir);
+		return open_dir(".");
+	}
+	strcpy(name, slash + 1);
+	if (slash == dir)
+		return open_dir("/");
+	dir[slash - dir] = '\0';
+	return open_dir(dir);
+}
+
+static int cmd_rmtree(int argc, char **argv)
+{
+	char name[PATH_MAX];
+	int fd = -1;
+	int ret = 0;
+	int err = 0;
+	int i;
+	if (argc < 2)
+		return 2;
+	for (i = 1; i < argc; i++) {
+		fd = open_parent(argv[i], name);
+		if (fd < 0) {
+			ret = 1;
+			continue;
+		}
+		err = stackfs_rmtree(fd, name);
+		if (err < 0) {
+			fprintf(stderr, "sfsctl: rmtree %s: %s\n", argv[i], strerror(-err));
+			ret = 1;
+		}
+		close(fd);
+	}
+	return ret;
+}
+
+// n files in dir/a and dir/b, a deleted the way rm -rf does, b with one rmtree
+static int cmd_bench_rmtree(int argc, char **argv)
+{
+	char path[PATH_MAX];
+	uint64_t start = 0;
+	int n = 0;
+	int fd = -1;
+	int ret = 1;
+	int i;
+	if (argc < 3)
+		return 2;
+	n = atoi(argv[2]);
+	if (n <= 0)
+		return 2;
+	for (i = 0; i < 2; i++) {
+		snprintf(path, sizeof(path), "%s/%c", argv[1], 'a' + i);
+		if (mkdir(path, 0755) != 0) {
+			fprintf(stderr, "sfsctl: %s: %s\n", path, strerror(errno));
+			return 1;
+		}
+	}
+	for (i = 0; i < 2 * n; i++) {
+		snprintf(path, sizeof(path), "%s/%c/f.%d", argv[1], 'a' + i % 2, i / 2);
+		fd = creat(path, 0644);
+		if (fd < 0) {
+			fprintf(stderr, "sfsctl: %s: %s\n", path, strerror(errno));
+			goto out;
+		}
+		close(fd);
+	}
+	start = now_ns();
+	for (i = 0; i < n; i++) {
+		snprintf(path, sizeof(path), "%s/a/f.%d", argv[1], i);
+		unlink(path);
+	}
+	snprintf(path, sizeof(path), "%s/a", argv[1]);
+	rmdir(path);
+	report("unlink+rmdir", now_ns() - start, n);
+	fd = open_dir(argv[1]);
+	if (fd < 0)
+		goto out;
+	start = now_ns();
+	ret = stackfs_rmtree(fd, "b") == 0 ? 0 : 1;
+	report("rmtree", now_ns() - start, n);
+	close(fd);
+out:
+	return ret;
+}
+
+static void usage()
+{
+	fprintf(stderr, "usage: sfsctl create [-m mode] dir [name ...]\n"
+			"       sfsctl bench-create dir n\n"
+			"       sfsctl ls [-r start count] dir\n"
+			"       sfsctl count dir\n"
+			"       sfsctl du dir ...\n"
+			"       sfsctl rmtree dir ...\n"
+			"       sfsctl bench-rmtree dir n\n"
+			"       sfsctl bench-stat dir\n");
+}
+
+int main(int argc, char **argv)
+{
+	int ret = 2;
+	if (argc < 2) {
+		usage();
+		return 2;
+	}
+	if (strcmp(argv[1], "create") == 0)
+		ret = cmd_create(argc - 1, argv + 1);
+	else if (strcmp(argv[1], "bench-create") == 0)
+		ret = cmd_bench_create(argc - 1, argv + 1);
+	else if (strcmp(argv[1], "ls") == 0)
+		ret = cmd_ls(argc - 1, argv + 1);
+	else if (strcmp(argv[1], "count") == 0)
+		ret = cmd_count(argc - 1, argv + 1);
+	else if (strcmp(argv[1], "du") == 0)
+		ret = cmd_du(argc - 1, argv + 1);
+	else if (strcmp(argv[1], "rmtree") == 0)
+		ret = cmd_rmtree(argc - 1, argv + 1);
+	else if (strcmp(argv[1], "bench-rmtree") == 0)
+		ret = cmd_bench_rmtree(argc - 1, argv + 1);
+	else if (strcmp(argv[1], "bench-stat") == 0)
+		ret = cmd_bench_stat(argc - 1, argv + 1);
+	if (ret == 2)
+		usage();
+	return ret;
+}
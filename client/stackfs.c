@@ -0,0 +1,154 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#include "stackfs.h"
+
+int stackfs_batch_add(struct stackfs_create_batch *batch, uint32_t *used, const char *name, mode_t mode)
+{
+	struct stackfs_name_rec *rec = NULL;
+	size_t len = strlen(name);
+	if (len == 0 || strchr(name, '/') != NULL)
+		return -EINVAL;
+	if (len > NAME_MAX)
+		return -ENAMETOOLONG;
+	if (batch->nr >= STACKFS_BATCH_MAX || *used + stackfs_rec_size(len) > STACKFS_BATCH_DATA)
+		return -ENOSPC;
+	rec = (struct stackfs_name_rec *) &(batch->data[*used]);
+	rec->mode = S_IFREG | (mode & 07777);
+	rec->len = (uint16_t) len;
+	rec->pad = 0;
+	memcpy(rec->name, name, len);
+	*used += stackfs_rec_size(len);
+	batch->nr++;
+	return 0;
+}
+
+int stackfs_create_batch(int dirfd, const char **names, const mode_t *modes, int nr, int *status)
+{
+	struct stackfs_create_batch *batch = NULL;
+	int idx[STACKFS_BATCH_MAX];    // names index of each record
+	uint32_t used = 0;
+	uint32_t j = 0;
+	int made = 0;
+	int i = 0;
+	int ret = 0;
+	batch = (struct stackfs_create_batch *) malloc(sizeof(*batch));
+	if (batch == NULL)
+		return -ENOMEM;
+	while (i < nr) {
+		batch->nr = 0;
+		used = 0;
+		for (; i < nr; i++) {
+			ret = stackfs_batch_add(batch, &used, names[i], modes != NULL ? modes[i] : 0644);
+			if (ret == -ENOSPC)
+				break;
+			if (ret == 0)
+				idx[batch->nr - 1] = i;
+			else
+				status[i] = ret;
+		}
+		if (batch->nr == 0)
+			continue;
+		if (ioctl(dirfd, STACKFS_IOC_CREATE_BATCH, batch) < 0) {
+			ret = -errno;
+			goto out;
+		}
+		made += batch->done;
+		for (j = 0; j < batch->nr; j++)
+			status[idx[j]] = batch->status[j];
+	}
+	ret = made;
+out:
+	free(batch);
+	return ret;
+}
+
+const struct stackfs_stat_rec *stackfs_stat_next(const struct stackfs_bulkstat *bulk, const struct stackfs_stat_rec *rec)
+{
+	uint32_t pos = rec == NULL ? 0 : (uint32_t) ((const char *) rec - bulk->data) + rec->reclen;
+	if (pos >= bulk->used)
+		return NULL;
+	return (const struct stackfs_stat_rec *) &(bulk->data[pos]);
+}
+
+int stackfs_bulkstat(int dirfd, int (*fn)(const struct stackfs_stat_rec *rec, void *arg), void *arg)
+{
+	return stackfs_bulkstat_range(dirfd, 0, 0, fn, arg);
+}
+
+int stackfs_bulkstat_range(int dirfd, uint32_t start, uint32_t count,
+		int (*fn)(const struct stackfs_stat_rec *rec, void *arg), void *arg)
+{
+	struct stackfs_bulkstat *bulk = NULL;
+	const struct stackfs_stat_rec *rec = NULL;
+	uint32_t left = count;
+	int ret = 0;
+	bulk = (struct stackfs_bulkstat *) calloc(1, sizeof(*bulk));
+	if (bulk == NULL)
+		return -ENOMEM;
+	// the first call seeks by rank, the rest resume from the cookie
+	if (start > 0) {
+		bulk->flags = STACKFS_BULK_RANK;
+		bulk->rank = start;
+	}
+	while (ret == 0 && !(bulk->flags & STACKFS_BULK_EOF)) {
+		if (ioctl(dirfd, STACKFS_IOC_BULKSTAT, bulk) < 0) {
+			ret = -errno;
+			break;
+		}
+		for (rec = stackfs_stat_next(bulk, NULL); rec != NULL && ret == 0; rec = stackfs_stat_next(bulk, rec)) {
+			ret = fn(rec, arg);
+			if (count > 0 && --left == 0)
+				goto out;
+		}
+	}
+out:
+	free(bulk);
+	return ret;
+}
+
+int stackfs_rmtree(int dirfd, const char *name)
+{
+	struct stackfs_rmtree rm;
+	size_t len = strlen(name);
+	if (len == 0 || strchr(name, '/') != NULL)
+		return -EINVAL;
+	if (len >= STACKFS_RMTREE_NAME)
+		return -ENAMETOOLONG;
+	memset(&rm, 0, sizeof(rm));
+	rm.len = (uint32_t) len;
+	memcpy(rm.name, name, len);
+	if (ioctl(dirfd, STACKFS_IOC_RMTREE, &rm) < 0)
+		return -errno;
+	return 0;
+}
+
+int stackfs_dirstat(int dirfd, struct stackfs_dirstat *ds)
+{
+	memset(ds, 0, sizeof(*ds));
+	if (ioctl(dirfd, STACKFS_IOC_DIRSTAT, ds) < 0)
+		return -errno;
+	return 0;
+}
+
+long stackfs_nr_children(int dirfd)
+{
+	struct stackfs_bulkstat *bulk = NULL;
+	long ret = 0;
+	bulk = (struct stackfs_bulkstat *) calloc(1, sizeof(*bulk));
+	if (bulk == NULL)
+		return -ENOMEM;
+	// a rank past any directory returns no records, only the total
+	bulk->flags = STACKFS_BULK_RANK;
+	bulk->rank = UINT32_MAX;
+	if (ioctl(dirfd, STACKFS_IOC_BULKSTAT, bulk) < 0)
+		ret = -errno;
+	else
+		ret = bulk->total;
+	free(bulk);
+	return ret;
+}
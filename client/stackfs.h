@@ -0,0 +1,55 @@
+#ifndef STACKFS_H
+#define STACKFS_H
+
+#include <sys/types.h>
+
+#include "../fs/ioctl.h"
+
+/*
+ * Client side of the stackfs ioctls, link libstackfs.a. Calls take an fd
+ * open on the stackfs file or directory they act on and return 0 or a
+ * count on success, -errno on failure.
+ */
+
+// appends one record to a batch zeroed to start, -ENOSPC when it is full
+int stackfs_batch_add(struct stackfs_create_batch *batch, uint32_t *used, const char *name, mode_t mode);
+
+/*
+ * Creates the nr regular files names[i] in the directory open at dirfd,
+ * in as few calls as the records fit. status[i] is 0 or -errno per name,
+ * modes NULL makes them all 0644. Returns how many were made.
+ */
+int stackfs_create_batch(int dirfd, const char **names, const mode_t *modes, int nr, int *status);
+
+// the records one bulkstat call returned, rec NULL for the first, NULL after the last
+const struct stackfs_stat_rec *stackfs_stat_next(const struct stackfs_bulkstat *bulk, const struct stackfs_stat_rec *rec);
+
+/*
+ * Calls fn for every child of the directory open at dirfd, with its name
+ * and attributes, in STACKFS_IOC_BULKSTAT calls of many children each.
+ * A nonzero return from fn stops the walk and is returned.
+ */
+int stackfs_bulkstat(int dirfd, int (*fn)(const struct stackfs_stat_rec *rec, void *arg), void *arg);
+
+/*
+ * As stackfs_bulkstat() for the count children from rank start on, so
+ * listers splitting a directory by rank each seek straight to their own
+ * range. count 0 runs to the end.
+ */
+int stackfs_bulkstat_range(int dirfd, uint32_t start, uint32_t count,
+		int (*fn)(const struct stackfs_stat_rec *rec, void *arg), void *arg);
+
+// children of the directory open at dirfd, without listing them
+long stackfs_nr_children(int dirfd);
+
+/*
+ * Removes the directory name in the one open at dirfd and everything
+ * below it, as rm -rf would, in one call. stackfs frees the files after
+ * it returned.
+ */
+int stackfs_rmtree(int dirfd, const char *name);
+
+// files, directories and bytes below the directory open at dirfd, without a walk
+int stackfs_dirstat(int dirfd, struct stackfs_dirstat *ds);
+
+#endif
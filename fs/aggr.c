@@ -0,0 +1,215 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "fs.h"
+#include "aggr.h"
+
+/*
+ * Recursive totals per directory: files, directories and bytes of the
+ * whole subtree, so du and find -type f | wc -l are one getxattr or
+ * ioctl instead of a walk. Creates, unlinks, mkdir, rmdir, renames and
+ * subtree removal already hold tree_rwlock for write, and add or take
+ * out their exact amounts along the ancestor chain there.
+ *
+ * Size changes come under no tree lock and must not all meet on the
+ * same few root lines, so a write only marks the file D_aggr_queued and
+ * parks it in the queue of its CPU. A fold, by the writer that fills a
+ * queue or by whoever reads totals, takes tree_rwlock for read and adds
+ * size - d_counted of each file up its chain with atomic adds. A file
+ * written a thousand times between folds costs one queue slot and one
+ * chain walk. Unlinked files are skipped, unlink took out d_counted.
+ */
+
+struct aggr_slot {
+	pthread_mutex_t lock;
+	uint32_t nr;
+	struct dentry *files[AGGR_QUEUE];
+} __attribute__((aligned(64)));
+
+struct aggr_stats {
+	uint64_t queued;
+	uint64_t folds;
+	uint64_t folded;
+	uint64_t full;    // folds by a writer whose queue was full
+};
+
+static struct aggr_slot slots[AGGR_SLOTS];
+static struct aggr_stats ast;
+
+extern struct fs_super *fs_sb;
+
+void aggr_init()
+{
+	int i;
+	for (i = 0; i < AGGR_SLOTS; i++) {
+		pthread_mutex_init(&(slots[i].lock), NULL);
+		slots[i].nr = 0;
+	}
+}
+
+// tree_rwlock held, for read the adds only race with each other
+static void aggr_add(struct dentry *dir, int64_t files, int64_t dirs, int64_t bytes)
+{
+	struct d_aggr *aggr = NULL;
+	for (; dir != NULL; dir = dir->attr->parent) {
+		aggr = d_aggr(dir);
+		if (files != 0)
+			__atomic_add_fetch(&(aggr->files), files, __ATOMIC_RELAXED);
+		if (dirs != 0)
+			__atomic_add_fetch(&(aggr->dirs), dirs, __ATOMIC_RELAXED);
+		if (bytes != 0)
+			__atomic_add_fetch(&(aggr->bytes), bytes, __ATOMIC_RELAXED);
+	}
+}
+
+void aggr_account(struct dentry *dentry, int sign)
+{
+	struct d_aggr *aggr = NULL;
+	if (get_dentry_flag(dentry, D_type) != DIR_DENTRY) {
+		aggr_add(dentry->attr->parent, sign, 0, sign * (int64_t) dentry->attr->d_counted);
+		return;
+	}
+	// no fold runs under the write lock, the totals below hold still
+	aggr = d_aggr(dentry);
+	aggr_add(dentry->attr->parent, sign * aggr->files, sign * (aggr->dirs + 1), sign * aggr->bytes);
+}
+
+// slot lock and tree_rwlock held
+static void fold_one(struct dentry *dentry)
+{
+	int64_t delta = 0;
+	__atomic_and_fetch(&(dentry->flags), ~(1U << D_aggr_queued), __ATOMIC_ACQ_REL);
+	// the parent link only changes under the write lock, a recycled file has none
+	if (dentry->attr->parent == NULL || d_dead(dentry))
+		return;
+	d_attr_lock(dentry);
+	delta = (int64_t) (dentry->attr->size - dentry->attr->d_counted);
+	dentry->attr->d_counted = dentry->attr->size;
+	d_attr_unlock(dentry);
+	if (delta != 0)
+		aggr_add(dentry->attr->parent, 0, 0, delta);
+}
+
+static void fold_slot(struct aggr_slot *slot)
+{
+	uint32_t i;
+	for (i = 0; i < slot->nr; i++)
+		fold_one(slot->files[i]);
+	__atomic_add_fetch(&(ast.folds), 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&(ast.folded), slot->nr, __ATOMIC_RELAXED);
+	slot->nr = 0;
+}
+
+static void aggr_queue(struct dentry *dentry, int locked)
+{
+	struct aggr_slot *slot = NULL;
+	int cpu = 0;
+	// already waiting, the fold takes whatever size it finds then
+	if (__atomic_fetch_or(&(dentry->flags), 1U << D_aggr_queued, __ATOMIC_ACQ_REL) & (1U << D_aggr_queued))
+		return;
+	cpu = sched_getcpu();
+	slot = &slots[(cpu < 0 ? 0 : cpu) % AGGR_SLOTS];
+	__atomic_add_fetch(&(ast.queued), 1, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&(slot->lock));
+	if (slot->nr < AGGR_QUEUE) {
+		slot->files[slot->nr++] = dentry;
+		pthread_mutex_unlock(&(slot->lock));
+		return;
+	}
+	pthread_mutex_unlock(&(slot->lock));
+	// full, fold it; tree_rwlock goes first
+	if (!locked)
+		pthread_rwlock_rdlock(&(fs_sb->tree_rwlock));
+	pthread_mutex_lock(&(slot->lock));
+	if (slot->nr == AGGR_QUEUE) {
+		fold_slot(slot);
+		__atomic_add_fetch(&(ast.full), 1, __ATOMIC_RELAXED);
+	}
+	slot->files[slot->nr++] = dentry;
+	pthread_mutex_unlock(&(slot->lock));
+	if (!locked)
+		pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
+}
+
+void aggr_resized(struct dentry *dentry)
+{
+	aggr_queue(dentry, 0);
+}
+
+void aggr_resized_locked(struct dentry *dentry)
+{
+	aggr_queue(dentry, 1);
+}
+
+void aggr_fold_locked()
+{
+	int i;
+	for (i = 0; i < AGGR_SLOTS; i++) {
+		pthread_mutex_lock(&(slots[i].lock));
+		if (slots[i].nr > 0)
+			fold_slot(&slots[i]);
+		pthread_mutex_unlock(&(slots[i].lock));
+	}
+}
+
+void aggr_fold()
+{
+	pthread_rwlock_rdlock(&(fs_sb->tree_rwlock));
+	aggr_fold_locked();
+	pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
+}
+
+// a fold holds the slot lock as long as it looks at a file of the slot
+void aggr_forget(struct dentry *dentry)
+{
+	uint32_t j;
+	int i;
+	for (i = 0; i < AGGR_SLOTS; i++) {
+		pthread_mutex_lock(&(slots[i].lock));
+		for (j = 0; j < slots[i].nr; j++) {
+			if (slots[i].files[j] == dentry)
+				slots[i].files[j--] = slots[i].files[--slots[i].nr];
+		}
+		pthread_mutex_unlock(&(slots[i].lock));
+	}
+}
+
+int aggr_read(struct dentry *dir, struct d_aggr *res)
+{
+	struct d_aggr *aggr = NULL;
+	if (get_dentry_flag(dir, D_type) != DIR_DENTRY)
+		return -ENOTDIR;
+	// snapshots are never counted
+	if (get_dentry_flag(dir, D_snapshot))
+		return -EOPNOTSUPP;
+	aggr = d_aggr(dir);
+	pthread_rwlock_rdlock(&(fs_sb->tree_rwlock));
+	aggr_fold_locked();
+	res->files = __atomic_load_n(&(aggr->files), __ATOMIC_RELAXED);
+	res->dirs = __atomic_load_n(&(aggr->dirs), __ATOMIC_RELAXED);
+	res->bytes = __atomic_load_n(&(aggr->bytes), __ATOMIC_RELAXED);
+	pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
+	return SUCCESS;
+}
+
+int aggr_stats(char *buf, size_t size)
+{
+	uint64_t pending = 0;
+	int i;
+	for (i = 0; i < AGGR_SLOTS; i++) {
+		pthread_mutex_lock(&(slots[i].lock));
+		pending += slots[i].nr;
+		pthread_mutex_unlock(&(slots[i].lock));
+	}
+	return snprintf(buf, size, "aggr.queued %lu\naggr.folds %lu\naggr.folded %lu\naggr.full %lu\naggr.pending %lu\n",
+			(unsigned long) __atomic_load_n(&(ast.queued), __ATOMIC_RELAXED),
+			(unsigned long) __atomic_load_n(&(ast.folds), __ATOMIC_RELAXED),
+			(unsigned long) __atomic_load_n(&(ast.folded), __ATOMIC_RELAXED),
+			(unsigned long) __atomic_load_n(&(ast.full), __ATOMIC_RELAXED),
+			(unsigned long) pending);
+}
@@ -0,0 +1,40 @@
+#ifndef AGGR_H
+#define AGGR_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "fs.h"
+
+#define AGGR_SLOTS 64    // delta queues, one per CPU modulo this
+#define AGGR_QUEUE 256    // files a queue holds before the writer filling it folds it
+
+void aggr_init();
+
+/*
+ * tree_rwlock held for write. Adds a linked dentry and all below it to
+ * the totals of its ancestors, sign 1 right after d_insert(), or takes
+ * it out, sign -1 right before d_remove(). A file counts with d_counted,
+ * set it before it goes in.
+ */
+void aggr_account(struct dentry *dentry, int sign);
+
+// a file's size changed, no lock held; the ancestors see it once folded
+void aggr_resized(struct dentry *dentry);
+// as above, tree_rwlock held
+void aggr_resized_locked(struct dentry *dentry);
+
+// every queued size change into the totals, no lock held
+void aggr_fold();
+// tree_rwlock held
+void aggr_fold_locked();
+// a queued file is about to be freed, no tree_rwlock needed
+void aggr_forget(struct dentry *dentry);
+
+// a directory's totals with everything queued folded in, -ENOTDIR for files,
+// -EOPNOTSUPP in a snapshot
+int aggr_read(struct dentry *dir, struct d_aggr *res);
+
+int aggr_stats(char *buf, size_t size);
+
+#endif
@@ -0,0 +1,302 @@
+#include <string.h>
+
+#include "fs.h"
+#include "pcache.h"
+#include "../tools/rbtree.h"
+#include "../tools/slab.h"
+
+/*
+ * Namespace index. Every directory dentry roots the tree of its children,
+ * ordered by (name hash, name). A lookup step compares hashes held in the
+ * one line dentry header and reads the cold attr block, where the name
+ * lives, only when the hashes match.
+ *
+ * The trees are order statistic trees as well: every node counts the
+ * nodes of its subtree in d_nodes, kept up by the augment hooks of
+ * tools/rbtree.c on insert and erase. A directory's child count is its
+ * tree root's, and the n-th child or a child's rank is one walk down or
+ * up. The counts live in the cold attr block, which a lookup step only
+ * opens on a hash match, so lookups pay nothing for them.
+ */
+
+static struct slab_cache dentry_cache;
+static struct slab_cache attr_cache;
+static struct slab_cache dir_attr_cache;
+static uint64_t nr_dentries = 0;
+static uint64_t nr_dirs = 0;
+
+void d_cache_init()
+{
+	slab_cache_init(&dentry_cache, "dentry", sizeof(struct dentry));
+	slab_cache_init(&attr_cache, "dentry_attr", sizeof(struct dentry_attr));
+	slab_cache_init(&dir_attr_cache, "dentry_dir_attr", sizeof(struct dentry_dir_attr));
+}
+
+static struct dentry *__d_alloc(struct slab_cache *cache)
+{
+	struct dentry *dentry = (struct dentry *) slab_zalloc(&dentry_cache);
+	if (dentry == NULL)
+		return NULL;
+	dentry->attr = (struct dentry_attr *) slab_zalloc(cache);
+	if (dentry->attr == NULL) {
+		slab_free(&dentry_cache, dentry);
+		return NULL;
+	}
+	dentry->d_children = RB_ROOT;
+	__atomic_add_fetch(&nr_dentries, 1, __ATOMIC_RELAXED);
+	return dentry;
+}
+
+struct dentry *d_alloc()
+{
+	return __d_alloc(&attr_cache);
+}
+
+// with the recursive totals, for a dentry that is to be a directory
+struct dentry *d_alloc_dir()
+{
+	struct dentry *dentry = __d_alloc(&dir_attr_cache);
+	if (dentry != NULL)
+		__atomic_add_fetch(&nr_dirs, 1, __ATOMIC_RELAXED);
+	return dentry;
+}
+
+void d_free(struct dentry *dentry)
+{
+	int dir = get_dentry_flag(dentry, D_type) == DIR_DENTRY;
+	// cached pages are keyed by the address
+	if (!dir)
+		pcache_invalidate(dentry, 0, dentry->attr->size);
+	d_put_name(dentry);
+	if (dir) {
+		slab_free(&dir_attr_cache, dentry->attr);
+		__atomic_sub_fetch(&nr_dirs, 1, __ATOMIC_RELAXED);
+	} else {
+		slab_free(&attr_cache, dentry->attr);
+	}
+	slab_free(&dentry_cache, dentry);
+	__atomic_sub_fetch(&nr_dentries, 1, __ATOMIC_RELAXED);
+}
+
+// bytes held by dentries, long names aside
+uint64_t d_bytes()
+{
+	return __atomic_load_n(&nr_dentries, __ATOMIC_RELAXED) * (sizeof(struct dentry) + sizeof(struct dentry_attr))
+			+ __atomic_load_n(&nr_dirs, __ATOMIC_RELAXED) * (sizeof(struct dentry_dir_attr) - sizeof(struct dentry_attr));
+}
+
+// FNV-1a
+static uint32_t d_hash(const char *name)
+{
+	uint32_t hash = 2166136261u;
+	while (*name != '\0') {
+		hash ^= (unsigned char) *name++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static inline int d_cmp(uint32_t hash, const char *name, struct dentry *dentry)
+{
+	if (hash != dentry->hash)
+		return hash < dentry->hash ? -1 : 1;
+	return strcmp(name, d_name(dentry));
+}
+
+static inline uint32_t d_nodes(rb_node_t *node)
+{
+	return node != NULL ? container_of(node, struct dentry, node)->attr->d_nodes : 0;
+}
+
+static void d_nodes_update(rb_node_t *node, void *data)
+{
+	container_of(node, struct dentry, node)->attr->d_nodes = 1 + d_nodes(node->rb_left) + d_nodes(node->rb_right);
+}
+
+void d_put_name(struct dentry *dentry)
+{
+	if (dentry->name_len >= DNAME_INLINE_LEN)
+		slab_free_size(dentry->attr->d_lname, dentry->name_len + 1);
+	dentry->name_len = 0;
+	dentry->attr->d_iname[0] = '\0';
+}
+
+static void d_set_name(struct dentry *dentry, const char *name)
+{
+	int len = strlen(name);
+	d_put_name(dentry);
+	if (len >= DNAME_INLINE_LEN) {
+		dentry->attr->d_lname = (char *) slab_alloc_size(len + 1);
+		memcpy(dentry->attr->d_lname, name, len + 1);
+	} else {
+		memcpy(dentry->attr->d_iname, name, len + 1);
+	}
+	dentry->name_len = len;
+	dentry->hash = d_hash(name);
+}
+
+struct dentry *d_lookup(struct dentry *parent, const char *name)
+{
+	rb_node_t *node = parent->d_children.rb_node;
+	struct dentry *dentry = NULL;
+	uint32_t hash = d_hash(name);
+	int cmp;
+	while (node) {
+		dentry = container_of(node, struct dentry, node);
+		cmp = d_cmp(hash, name, dentry);
+		if (cmp < 0)
+			node = node->rb_left;
+		else if (cmp > 0)
+			node = node->rb_right;
+		else
+			return dentry;
+	}
+	return NULL;
+}
+
+// return 1 if linked, 0 if the name is already taken
+int d_insert(struct dentry *parent, struct dentry *dentry, const char *name)
+{
+	rb_node_t **new_node = &(parent->d_children.rb_node), *rb_parent = NULL;
+	struct dentry *this_dentry = NULL;
+	uint32_t hash = d_hash(name);
+	int cmp;
+	while (*new_node) {
+		this_dentry = container_of(*new_node, struct dentry, node);
+		cmp = d_cmp(hash, name, this_dentry);
+		rb_parent = *new_node;
+		if (cmp < 0)
+			new_node = &((*new_node)->rb_left);
+		else if (cmp > 0)
+			new_node = &((*new_node)->rb_right);
+		else
+			return 0;
+	}
+	dentry->attr->parent = parent;
+	d_set_name(dentry, name);
+	rb_link_node(&(dentry->node), rb_parent, new_node);
+	rb_insert_color(&(dentry->node), &(parent->d_children));
+	rb_augment_insert(&(dentry->node), d_nodes_update, NULL);
+	return 1;
+}
+
+// named under parent but in no d_children, a .snap directory
+void d_attach(struct dentry *parent, struct dentry *dentry, const char *name)
+{
+	dentry->attr->parent = parent;
+	d_set_name(dentry, name);
+}
+
+void d_remove(struct dentry *dentry)
+{
+	rb_node_t *deepest = rb_augment_erase_begin(&(dentry->node));
+	rb_erase(&(dentry->node), &(dentry->attr->parent->d_children));
+	rb_augment_erase_end(deepest, d_nodes_update, NULL);
+	RB_CLEAR_NODE(&(dentry->node));
+	dentry->attr->parent = NULL;
+	d_put_name(dentry);
+}
+
+struct dentry *d_first_child(struct dentry *parent)
+{
+	rb_node_t *node = rb_first(&(parent->d_children));
+	if (node == NULL)
+		return NULL;
+	return container_of(node, struct dentry, node);
+}
+
+struct dentry *d_next_child(struct dentry *dentry)
+{
+	rb_node_t *node = rb_next(&(dentry->node));
+	if (node == NULL)
+		return NULL;
+	return container_of(node, struct dentry, node);
+}
+
+// first child ordered after (hash, name), "" for every child with that hash or later
+struct dentry *d_seek_child(struct dentry *parent, uint32_t hash, const char *name)
+{
+	rb_node_t *node = parent->d_children.rb_node;
+	struct dentry *dentry = NULL;
+	struct dentry *found = NULL;
+	while (node) {
+		dentry = container_of(node, struct dentry, node);
+		if (d_cmp(hash, name, dentry) < 0) {
+			found = dentry;
+			node = node->rb_left;
+		} else {
+			node = node->rb_right;
+		}
+	}
+	return found;
+}
+
+/*
+ * readdir offsets. A child's cookie is its name hash and its rank among
+ * the siblings sharing that hash, so a listing resumed from it lands in
+ * the same place however many other names came and went meanwhile; only
+ * a change within one run of colliding names can shift it. Offsets below
+ * D_COOKIE_BASE are "." and "..".
+ */
+off_t d_cookie(struct dentry *dentry, uint32_t dup)
+{
+	if (dup > D_COOKIE_DUP_MASK)
+		dup = D_COOKIE_DUP_MASK;
+	return D_COOKIE_BASE + (((off_t) dentry->hash << D_COOKIE_DUP_BITS) | dup);
+}
+
+// the child listed after cookie off, its rank in *dup
+struct dentry *d_seek_cookie(struct dentry *parent, off_t off, uint32_t *dup)
+{
+	struct dentry *dentry = NULL;
+	uint32_t hash = 0;
+	uint32_t i = 0;
+	*dup = 0;
+	if (off < D_COOKIE_BASE)
+		return d_first_child(parent);
+	off -= D_COOKIE_BASE;
+	hash = (uint32_t) (off >> D_COOKIE_DUP_BITS);
+	dentry = d_seek_child(parent, hash, "");
+	for (i = 0; dentry != NULL && dentry->hash == hash && i <= (off & D_COOKIE_DUP_MASK); i++)
+		dentry = d_next_child(dentry);
+	if (dentry != NULL && dentry->hash == hash)
+		*dup = i;
+	return dentry;
+}
+
+uint32_t d_nr_children(struct dentry *parent)
+{
+	return d_nodes(parent->d_children.rb_node);
+}
+
+// in the index order from 0, NULL past the last
+struct dentry *d_nth_child(struct dentry *parent, uint32_t n)
+{
+	rb_node_t *node = parent->d_children.rb_node;
+	uint32_t left = 0;
+	while (node) {
+		left = d_nodes(node->rb_left);
+		if (n < left) {
+			node = node->rb_left;
+		} else if (n == left) {
+			return container_of(node, struct dentry, node);
+		} else {
+			n -= left + 1;
+			node = node->rb_right;
+		}
+	}
+	return NULL;
+}
+
+// a linked dentry, d_nth_child(parent, d_child_rank(dentry)) is dentry
+uint32_t d_child_rank(struct dentry *dentry)
+{
+	rb_node_t *node = &(dentry->node);
+	rb_node_t *up = NULL;
+	uint32_t rank = d_nodes(node->rb_left);
+	for (up = rb_parent(node); up != NULL; node = up, up = rb_parent(up)) {
+		if (node == up->rb_right)
+			rank += d_nodes(up->rb_left) + 1;
+	}
+	return rank;
+}
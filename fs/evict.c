@@ -0,0 +1,335 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "fs.h"
+#include "evict.h"
+#include "aggr.h"
+#include "../tools/rbtree.h"
+
+/*
+ * Memory budget for the namespace. When the dentries outgrow the budget,
+ * directories whose children were not looked up since the last pass have
+ * their children written to an append only segment on local disk and
+ * freed; the directory keeps only the segment offset. The next lookup
+ * through it reads them back and punches the record out of the segment.
+ * Passes go children first, so a cold subtree folds up from its leaves.
+ *
+ * Lock order: fs_sb->tree_rwlock, evict.lock, fs_sb->dirty_list_rwlock.
+ */
+
+#define EVICT_SEG_START 8    // offset 0 means "not evicted"
+
+struct evict {
+	int fd;
+	uint64_t seg_end;
+	uint64_t seg_live;    // records not faulted back in yet
+	uint64_t seg_live_bytes;
+	uint64_t passes;
+	uint64_t evicted_dirs;
+	uint64_t evicted_dentries;
+	uint64_t bytes_out;
+	uint64_t faults;
+	uint64_t fault_dentries;
+	uint64_t fault_ns;
+	uint64_t fault_max_ns;
+	uint64_t errors;
+	pthread_mutex_t lock;    // the segment, and faults that only hold the read lock
+};
+
+static struct evict ev = {
+	.fd = -1,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+uint64_t evict_budget = 0;
+
+extern struct fs_super *fs_sb;
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int evict_init(uint64_t budget, const char *dir)
+{
+	char path[PATH_MAX];
+	if (budget == 0)
+		return SUCCESS;
+	snprintf(path, PATH_MAX, "%s/stackfs-evict.XXXXXX", dir ? dir : "/tmp");
+	ev.fd = mkstemp(path);
+	if (ev.fd < 0) {
+		printf("evict, create segment in %s failed, errno = %d\n", dir ? dir : "/tmp", errno);
+		return ERROR;
+	}
+	unlink(path);    // only ever read back by us
+	evict_budget = budget;
+	ev.seg_end = EVICT_SEG_START;
+#ifdef FS_DEBUG
+	printf("evict, budget = %lu bytes, segment = %s\n", (unsigned long) budget, path);
+#endif
+	return SUCCESS;
+}
+
+void evict_destroy()
+{
+	if (ev.fd < 0)
+		return;
+	close(ev.fd);
+	ev.fd = -1;
+	evict_budget = 0;
+}
+
+// ev.lock held, tree_rwlock held for write
+static int evict_dir(struct dentry *dir)
+{
+	struct dentry *dentry = NULL;
+	struct dentry **children = NULL;
+	struct evict_hdr *hdr = NULL;
+	struct evict_rec *rec = NULL;
+	char *buf = NULL;
+	size_t len = sizeof(struct evict_hdr);
+	size_t pos = 0;
+	uint32_t nr = 0, i;
+	int ret = 0;
+
+	// pinned children, a resident subtree below or a size change not folded keep the directory in memory
+	for (dentry = d_first_child(dir); dentry; dentry = d_next_child(dentry)) {
+		if (__atomic_load_n(&(dentry->d_count), __ATOMIC_ACQUIRE) > 0 || !RB_EMPTY_ROOT(&(dentry->d_children))
+				|| get_dentry_flag(dentry, D_aggr_queued))
+			return 0;
+		len += EVICT_REC_LEN(dentry->name_len);
+		nr++;
+	}
+	if (nr == 0)
+		return 0;
+
+	buf = (char *) calloc(1, len);
+	children = (struct dentry **) malloc(nr * sizeof(struct dentry *));
+	if (buf == NULL || children == NULL) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	hdr = (struct evict_hdr *) buf;
+	hdr->magic = EVICT_SEG_MAGIC;
+	hdr->nr = nr;
+	hdr->len = len;
+	pos = sizeof(struct evict_hdr);
+	i = 0;
+	for (dentry = d_first_child(dir); dentry; dentry = d_next_child(dentry)) {
+		rec = (struct evict_rec *) (buf + pos);
+		memset(rec, 0, sizeof(struct evict_rec));
+		rec->inode = dentry->inode;
+		rec->seg = dentry->attr->d_seg;
+		rec->size = dentry->attr->size;
+		rec->atime = dentry->attr->atime;
+		rec->mtime = dentry->attr->mtime;
+		rec->ctime = dentry->attr->ctime;
+		rec->fid = dentry->fid;
+		rec->mode = dentry->attr->mode;
+		rec->uid = dentry->attr->uid;
+		rec->gid = dentry->attr->gid;
+		rec->nlink = dentry->attr->nlink;
+		rec->flags = dentry->flags & ~((1U << D_dirty) | (1U << D_referenced));
+		rec->name_len = dentry->name_len;
+		rec->saved = dentry->attr->d_saved;
+		if (get_dentry_flag(dentry, D_type) == DIR_DENTRY) {
+			rec->aggr = *d_aggr(dentry);
+			rec->epoch = d_snap(dentry)->epoch;
+		}
+		memcpy(buf + pos + sizeof(struct evict_rec), d_name(dentry), dentry->name_len);
+		pos += EVICT_REC_LEN(dentry->name_len);
+		children[i++] = dentry;
+	}
+	if (pwrite(ev.fd, buf, len, ev.seg_end) != len) {
+		printf("evict, write segment failed, errno = %d\n", errno);
+		ev.errors++;
+		ret = -EIO;
+		goto out;
+	}
+
+	// the tree is dropped whole, rb_next must not run over freed nodes
+	pthread_rwlock_wrlock(&(fs_sb->dirty_list_rwlock));
+	for (i = 0; i < nr; i++)
+		remove_dentry_from_dirty_list(children[i]);
+	pthread_rwlock_unlock(&(fs_sb->dirty_list_rwlock));
+	for (i = 0; i < nr; i++)
+		d_free(children[i]);
+	dir->d_children = RB_ROOT;
+	dir->attr->d_seg = ev.seg_end;
+	set_dentry_flag(dir, D_evicted, 1);
+
+	ev.seg_end += len;
+	ev.seg_live++;
+	ev.seg_live_bytes += len;
+	ev.evicted_dirs++;
+	ev.evicted_dentries += nr;
+	ev.bytes_out += len;
+	ret = nr;
+#ifdef FS_DEBUG
+	printf("evict, dir inode = %lu, %d children out at %lu\n", (unsigned long)dir->inode, (int)nr, (unsigned long)dir->attr->d_seg);
+#endif
+out:
+	free(children);
+	free(buf);
+	return ret;
+}
+
+static void evict_walk(struct dentry *dir, uint64_t target)
+{
+	struct dentry *dentry = NULL;
+	for (dentry = d_first_child(dir); dentry && d_bytes() > target; dentry = d_next_child(dentry)) {
+		if (get_dentry_flag(dentry, D_type) == DIR_DENTRY && !RB_EMPTY_ROOT(&(dentry->d_children)))
+			evict_walk(dentry, target);
+	}
+	if (d_bytes() <= target)
+		return;
+	if (get_dentry_flag(dir, D_referenced)) {
+		set_dentry_flag(dir, D_referenced, 0);
+		return;
+	}
+	evict_dir(dir);
+}
+
+void evict_maybe()
+{
+	uint64_t target = 0;
+	int pass;
+	if (likely(evict_budget == 0) || d_bytes() <= evict_budget)
+		return;
+	target = EVICT_LOW_WATERMARK(evict_budget);
+	// files with a size change queued stay, most of them are folded now
+	aggr_fold_locked();
+	pthread_mutex_lock(&(ev.lock));
+	// the first pass may only clear reference bits
+	for (pass = 0; pass < 2 && d_bytes() > target; pass++) {
+		evict_walk(fs_sb->root, target);
+		ev.passes++;
+	}
+	pthread_mutex_unlock(&(ev.lock));
+}
+
+int evict_fault(struct dentry *dir)
+{
+	struct evict_hdr hdr;
+	struct evict_rec *rec = NULL;
+	struct dentry *dentry = NULL;
+	char name[NAME_MAX + 1];
+	char *buf = NULL;
+	size_t pos = 0;
+	uint64_t start = now_ns();
+	uint64_t ns = 0;
+	uint32_t i;
+	int ret = SUCCESS;
+
+	pthread_mutex_lock(&(ev.lock));
+	if (!get_dentry_flag(dir, D_evicted))    // another thread got here first
+		goto out;
+	if (pread(ev.fd, &hdr, sizeof(hdr), dir->attr->d_seg) != sizeof(hdr) || hdr.magic != EVICT_SEG_MAGIC) {
+		printf("evict, bad segment record at %lu for dir inode = %lu\n", (unsigned long)dir->attr->d_seg, (unsigned long)dir->inode);
+		ret = -EIO;
+		goto out;
+	}
+	buf = (char *) malloc(hdr.len);
+	if (buf == NULL) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	if (pread(ev.fd, buf, hdr.len, dir->attr->d_seg) != hdr.len) {
+		ret = -EIO;
+		goto out;
+	}
+	pos = sizeof(struct evict_hdr);
+	for (i = 0; i < hdr.nr; i++) {
+		rec = (struct evict_rec *) (buf + pos);
+		memcpy(name, buf + pos + sizeof(struct evict_rec), rec->name_len);
+		name[rec->name_len] = '\0';
+		pos += EVICT_REC_LEN(rec->name_len);
+		// D_type set is a file
+		dentry = (rec->flags & (1U << D_type)) ? d_alloc() : d_alloc_dir();
+		if (dentry == NULL) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		dentry->inode = rec->inode;
+		dentry->fid = rec->fid;
+		dentry->flags = rec->flags;
+		dentry->attr->d_seg = rec->seg;
+		dentry->attr->size = rec->size;
+		dentry->attr->atime = rec->atime;
+		dentry->attr->mtime = rec->mtime;
+		dentry->attr->ctime = rec->ctime;
+		dentry->attr->mode = rec->mode;
+		dentry->attr->uid = rec->uid;
+		dentry->attr->gid = rec->gid;
+		dentry->attr->nlink = rec->nlink;
+		dentry->attr->d_saved = rec->saved;
+		if (get_dentry_flag(dentry, D_type) == DIR_DENTRY) {
+			*d_aggr(dentry) = rec->aggr;
+			d_snap(dentry)->epoch = rec->epoch;
+		}
+		d_insert(dir, dentry, name);
+		pthread_rwlock_wrlock(&(fs_sb->dirty_list_rwlock));
+		add_dentry_to_dirty_list(dentry);
+		pthread_rwlock_unlock(&(fs_sb->dirty_list_rwlock));
+	}
+	// records are never rewritten in place, give the blocks back
+	fallocate(ev.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, dir->attr->d_seg, hdr.len);
+	dir->attr->d_seg = 0;
+	// readers see the children only once they are all linked
+	__atomic_and_fetch(&(dir->flags), ~(1U << D_evicted), __ATOMIC_RELEASE);
+	set_dentry_flag(dir, D_referenced, 1);
+
+	// nothing left out there, start the segment over
+	ev.seg_live_bytes -= hdr.len;
+	if (--ev.seg_live == 0) {
+		ev.seg_end = EVICT_SEG_START;
+		ftruncate(ev.fd, EVICT_SEG_START);
+	}
+	ns = now_ns() - start;
+	ev.faults++;
+	ev.fault_dentries += hdr.nr;
+	ev.fault_ns += ns;
+	if (ns > ev.fault_max_ns)
+		ev.fault_max_ns = ns;
+#ifdef FS_DEBUG
+	printf("evict, dir inode = %lu, %d children back in %lu ns\n", (unsigned long)dir->inode, (int)hdr.nr, (unsigned long)ns);
+#endif
+out:
+	if (ret != SUCCESS)
+		ev.errors++;
+	pthread_mutex_unlock(&(ev.lock));
+	free(buf);
+	return ret;
+}
+
+int evict_stats(char *buf, size_t size)
+{
+	if (ev.fd < 0)
+		return 0;
+	pthread_mutex_lock(&(ev.lock));
+	int len = snprintf(buf, size,
+			"evict.budget_bytes %lu\nevict.dentry_bytes %lu\nevict.passes %lu\n"
+			"evict.evicted_dirs %lu\nevict.evicted_dentries %lu\nevict.bytes_out %lu\n"
+			"evict.segment_bytes %lu\nevict.segment_end %lu\nevict.segment_records %lu\nevict.faults %lu\n"
+			"evict.fault_dentries %lu\nevict.fault_avg_us %lu\nevict.fault_max_us %lu\n"
+			"evict.errors %lu\n",
+			(unsigned long) evict_budget, (unsigned long) d_bytes(), (unsigned long) ev.passes,
+			(unsigned long) ev.evicted_dirs, (unsigned long) ev.evicted_dentries,
+			(unsigned long) ev.bytes_out, (unsigned long) ev.seg_live_bytes,
+			(unsigned long) ev.seg_end, (unsigned long) ev.seg_live,
+			(unsigned long) ev.faults, (unsigned long) ev.fault_dentries,
+			(unsigned long) (ev.faults ? ev.fault_ns / ev.faults / 1000 : 0),
+			(unsigned long) (ev.fault_max_ns / 1000), (unsigned long) ev.errors);
+	pthread_mutex_unlock(&(ev.lock));
+	return len;
+}
@@ -0,0 +1,80 @@
+#ifndef EVICT_H
+#define EVICT_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "fs.h"
+
+#define EVICT_SEG_MAGIC 0x53544b45
+#define EVICT_LOW_WATERMARK(budget) ((budget) - (budget) / 8)    // evict down to 7/8 of the budget
+
+// one evicted directory in the segment, followed by nr evict_rec
+struct evict_hdr {
+	uint32_t magic;
+	uint32_t nr;
+	uint64_t len;    // whole record, header included
+};
+
+// one child, followed by name_len bytes of name (no '\0') padded to 8
+struct evict_rec {
+	uint64_t inode;
+	uint64_t seg;    // its own evicted children, 0 if none; d_counted of a file
+	uint64_t size;
+	struct timespec atime;
+	struct timespec mtime;
+	struct timespec ctime;
+	uint32_t fid;
+	uint32_t mode;
+	uint32_t uid;
+	uint32_t gid;
+	uint32_t nlink;
+	uint16_t flags;
+	uint16_t name_len;
+	struct d_aggr aggr;    // directories, the totals of their subtree
+	uint32_t saved;    // d_saved
+	uint32_t epoch;    // directories, the newest snapshot taken of them
+};
+
+#define EVICT_REC_LEN(name_len) (sizeof(struct evict_rec) + (((name_len) + 7) & ~7))
+
+// bytes, 0 keeps the whole namespace in memory
+extern uint64_t evict_budget;
+
+int evict_init(uint64_t budget, const char *dir);
+void evict_destroy();
+
+// fs_sb->tree_rwlock held for write
+void evict_maybe();
+// fs_sb->tree_rwlock held for read or write
+int evict_fault(struct dentry *dir);
+// a snapshot directory's children, fs/snap.c
+int snap_fault(struct dentry *dir);
+
+int evict_stats(char *buf, size_t size);
+
+// faults only ever add dentries, lookups trim back to the budget before they start
+static inline int evict_pending()
+{
+	return unlikely(evict_budget != 0) && d_bytes() > evict_budget;
+}
+
+// call before dir->d_children is walked or changed
+static inline int d_ensure(struct dentry *dir)
+{
+	uint32_t flags = __atomic_load_n(&(dir->flags), __ATOMIC_ACQUIRE);
+	if (likely(!(flags & ((1U << D_evicted) | (1U << D_snap_lazy)))))
+		return SUCCESS;
+	if (flags & (1U << D_snap_lazy))
+		return snap_fault(dir);
+	return evict_fault(dir);
+}
+
+// second chance for a directory whose children are in use, only write the line once
+static inline void d_reference(struct dentry *dir)
+{
+	if (!(__atomic_load_n(&(dir->flags), __ATOMIC_RELAXED) & (1U << D_referenced)))
+		set_dentry_flag(dir, D_referenced, 1);
+}
+
+#endif
@@ -0,0 +1,731 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <fnmatch.h>
+
+#include "fs.h"
+#include "file.h"
+#include "pcache.h"
+#include "promote.h"
+#include "../tools/slab.h"
+
+/*
+ * Open file handles. Each open() gets a struct fs_file from its own slab
+ * and keeps it until release. Reads feed a sequential detector; once a
+ * stream has gone FILE_RA_SEQ reads in a row it asks the backend to read
+ * ahead of it, and the window doubles up to FILE_RA_MAX while the stream
+ * keeps going. A seek starts over at FILE_RA_MIN. The backend then has the
+ * next chunk in flight while the current one crosses /dev/fuse.
+ *
+ * With a write behind size set, small writes that follow on from each
+ * other collect in a per handle buffer and reach the backend as one
+ * pwrite. The buffer goes out when it fills, when a write does not
+ * follow on, on flush, fsync and release, when a read on the handle
+ * overlaps it, and from a timer thread once it is older than the flush
+ * interval. The dentry size covers buffered bytes at once. A read on
+ * another handle flushes what it overlaps first, and a truncate all of
+ * it, so the backend never lags a size the file already shows; a flush
+ * from the timer or another handle that fails is reported by the next
+ * flush or fsync.
+ *
+ * A direct handle, for multi GB checkpoints and the like, reads and
+ * writes through an O_DIRECT fd of its own on the pooled backend file,
+ * so the data is not cached again by the kernel under the backend
+ * client; the FUSE side gets direct_io to keep it out of the page cache
+ * above us too. Whole blocks go to that fd, from a bounce buffer when
+ * the request's memory is not aligned. Partial blocks at either end of
+ * a write go through the buffered pooled fd, the kernel writes them back
+ * before a direct read or write of the range. Reads are widened to whole
+ * blocks in a bounce buffer. When the file is promoted to another backend
+ * file, the first request after the swap points dfd at it.
+ */
+
+static struct slab_cache file_cache;
+
+struct file_stats {
+	uint64_t opens;
+	uint64_t closes;
+	uint64_t ra_calls;
+	uint64_t ra_bytes;
+	uint64_t flushes;
+	uint64_t wb_writes;
+	uint64_t wb_bytes;
+	uint64_t wb_timer_flushes;
+	uint64_t direct_opens;
+	uint64_t direct_fallbacks;
+	uint64_t direct_bytes;
+	uint64_t bounce_bytes;
+};
+
+static struct file_stats fst;
+
+// handles with pending writes, oldest first, for the flusher
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t flusher;
+	struct fs_file *head;
+	struct fs_file *tail;
+	uint32_t size;
+	uint64_t interval_ns;
+	int running;
+	int stop;
+} wb = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.interval_ns = FILE_WB_INTERVAL_MS * 1000000ULL,
+};
+
+static struct {
+	uint64_t min_size;
+	char *patterns;
+} direct;
+
+static pthread_mutex_t direct_lock = PTHREAD_MUTEX_INITIALIZER;    // leaf, dfd follows a promotion under it
+
+// every open handle, by inode; a stripe lock comes before any file->lock
+static struct file_stripe {
+	pthread_mutex_t lock;
+	struct fs_file *head;
+	uint32_t pending;    // handles on the list with writes buffered, read without the lock
+} open_files[FILE_OPEN_STRIPES];
+
+static struct file_stripe *file_stripe(struct dentry *dentry)
+{
+	return &(open_files[dentry->inode % FILE_OPEN_STRIPES]);
+}
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void file_cache_init()
+{
+	int i;
+	slab_cache_init(&file_cache, "file", sizeof(struct fs_file));
+	for (i = 0; i < FILE_OPEN_STRIPES; i++)
+		pthread_mutex_init(&(open_files[i].lock), NULL);
+}
+
+int file_direct_init(uint64_t min_size, const char *patterns)
+{
+	free(direct.patterns);
+	direct.patterns = NULL;
+	if (patterns != NULL && patterns[0] != '\0') {
+		direct.patterns = strdup(patterns);
+		if (direct.patterns == NULL)
+			return -ENOMEM;
+	}
+	direct.min_size = min_size;
+#ifdef FS_DEBUG
+	printf("file, direct io from %lu bytes or paths %s\n", (unsigned long) min_size, patterns);
+#endif
+	return SUCCESS;
+}
+
+static int direct_wanted(struct dentry *dentry, int flags)
+{
+	char path[PATH_LEN];
+	char pattern[PATH_LEN];
+	const char *p = NULL;
+	size_t len = 0;
+	uint64_t size = 0;
+	if (flags & O_DIRECT)
+		return 1;
+	if (direct.min_size > 0) {
+		size = d_size(dentry);
+		if (size >= direct.min_size)
+			return 1;
+	}
+	if (direct.patterns == NULL || d_path(dentry, path, PATH_LEN) != SUCCESS)
+		return 0;
+	// without FNM_PATHNAME a * crosses slashes, /ckpt/* takes the whole tree
+	for (p = direct.patterns; *p != '\0'; p += len + (p[len] == ',')) {
+		len = strcspn(p, ",");
+		if (len == 0 || len >= PATH_LEN)
+			continue;
+		memcpy(pattern, p, len);
+		pattern[len] = '\0';
+		if (fnmatch(pattern, path, 0) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+// a backend that refuses O_DIRECT leaves the handle buffered
+static void direct_open(struct fs_file *file)
+{
+	char proc[64];
+	int fd = promote_io_begin(file->dentry);
+	snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+	file->dfd = open(proc, O_RDWR | O_DIRECT);
+	file->dfd_src = fd;
+	promote_io_end(file->dentry, 0, 0);
+	if (file->dfd < 0) {
+		__atomic_add_fetch(&fst.direct_fallbacks, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	file->wb_size = 0;    // the point is not to hold the data anywhere
+	__atomic_add_fetch(&fst.direct_opens, 1, __ATOMIC_RELAXED);
+}
+
+void file_set_info(struct fs_file *file, struct fuse_file_info *fi)
+{
+	if (file->dfd < 0)
+		return;
+	fi->direct_io = 1;
+	fi->keep_cache = 0;
+}
+
+struct fs_file *file_open(struct dentry *dentry, int flags)
+{
+	struct file_stripe *stripe = NULL;
+	struct fs_file *file = (struct fs_file *) slab_zalloc(&file_cache);
+	if (file == NULL)
+		return NULL;
+	file->dentry = dentry;
+	file->flags = flags;
+	file->dfd = -1;
+	file->ra_len = FILE_RA_MIN;
+	file->wb_size = __atomic_load_n(&wb.size, __ATOMIC_RELAXED);
+	if (direct_wanted(dentry, flags))
+		direct_open(file);
+	pthread_mutex_init(&(file->lock), NULL);
+	stripe = file_stripe(dentry);
+	pthread_mutex_lock(&(stripe->lock));
+	file->o_next = stripe->head;
+	if (stripe->head != NULL)
+		stripe->head->o_prev = file;
+	stripe->head = file;
+	pthread_mutex_unlock(&(stripe->lock));
+	__atomic_add_fetch(&fst.opens, 1, __ATOMIC_RELAXED);
+	return file;
+}
+
+// wb.lock held
+static void wb_unqueue(struct fs_file *file)
+{
+	if (file->wb_prev != NULL)
+		file->wb_prev->wb_next = file->wb_next;
+	else
+		wb.head = file->wb_next;
+	if (file->wb_next != NULL)
+		file->wb_next->wb_prev = file->wb_prev;
+	else
+		wb.tail = file->wb_prev;
+	file->wb_prev = file->wb_next = NULL;
+	file->wb_queued = 0;
+	__atomic_sub_fetch(&(file_stripe(file->dentry)->pending), 1, __ATOMIC_RELAXED);
+}
+
+// file->lock held, the first byte is about to be buffered
+static void wb_queue(struct fs_file *file)
+{
+	file->wb_stamp = now_ns();
+	__atomic_add_fetch(&(file_stripe(file->dentry)->pending), 1, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&(wb.lock));
+	file->wb_prev = wb.tail;
+	if (wb.tail != NULL)
+		wb.tail->wb_next = file;
+	else
+		wb.head = file;
+	wb.tail = file;
+	file->wb_queued = 1;
+	pthread_mutex_unlock(&(wb.lock));
+}
+
+// file->lock held, writes the buffer out but leaves the flusher's list alone
+static int wb_write_out(struct fs_file *file)
+{
+	ssize_t ret = 0;
+	uint32_t done = 0;
+	int fd = 0;
+	if (file->wb_len == 0)
+		return SUCCESS;
+	fd = promote_io_begin(file->dentry);
+	while (done < file->wb_len) {
+		ret = pwrite(fd, file->wb_buf + done, file->wb_len - done, file->wb_off + done);
+		if (ret < 0) {
+			ret = -errno;
+			break;
+		}
+		done += ret;
+	}
+	promote_io_end(file->dentry, file->wb_off, done);
+	if (ret < 0) {
+		// nobody is left to retry it, drop the data and report it later
+		pcache_invalidate(file->dentry, file->wb_off, done);
+		file->wb_err = ret;
+		file->wb_len = 0;
+		return ret;
+	}
+	if (file->wb_len > 0) {
+		pcache_invalidate(file->dentry, file->wb_off, file->wb_len);
+		__atomic_add_fetch(&fst.flushes, 1, __ATOMIC_RELAXED);
+	}
+	file->wb_off += file->wb_len;
+	file->wb_len = 0;
+	return SUCCESS;
+}
+
+// file->lock held
+static int __file_flush(struct fs_file *file)
+{
+	int ret = wb_write_out(file);
+	if (file->wb_queued) {
+		pthread_mutex_lock(&(wb.lock));
+		if (file->wb_queued)
+			wb_unqueue(file);
+		pthread_mutex_unlock(&(wb.lock));
+	}
+	return ret;
+}
+
+int file_flush(struct fs_file *file)
+{
+	int ret = 0;
+	pthread_mutex_lock(&(file->lock));
+	ret = __file_flush(file);
+	if (ret == SUCCESS && file->wb_err != 0) {
+		ret = file->wb_err;
+		file->wb_err = 0;
+	}
+	pthread_mutex_unlock(&(file->lock));
+	if (__atomic_exchange_n(&(file->atime_due), 0, __ATOMIC_RELAXED))
+		d_accessed(file->dentry);
+	return ret;
+}
+
+/*
+ * Takes wb.lock before a file->lock, the other way round from writers,
+ * so it only ever trylocks a handle and skips it while it is busy. A
+ * handle it holds cannot be closed under it, file_close() takes the lock.
+ */
+static void *wb_flusher(void *arg)
+{
+	struct fs_file *file = NULL;
+	struct timespec ts;
+	uint64_t now = 0;
+	pthread_mutex_lock(&(wb.lock));
+	while (!wb.stop) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += (wb.interval_ns / 2) / 1000000000ULL;
+		ts.tv_nsec += (wb.interval_ns / 2) % 1000000000ULL;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&(wb.cond), &(wb.lock), &ts);
+		now = now_ns();
+		file = wb.head;
+		while (file != NULL && !wb.stop) {
+			if (now - file->wb_stamp < wb.interval_ns)
+				break;    // oldest first, the rest are younger
+			if (pthread_mutex_trylock(&(file->lock)) != 0) {
+				file = file->wb_next;
+				continue;
+			}
+			wb_unqueue(file);
+			pthread_mutex_unlock(&(wb.lock));
+			if (file->wb_len > 0) {
+				wb_write_out(file);
+				__atomic_add_fetch(&fst.wb_timer_flushes, 1, __ATOMIC_RELAXED);
+			}
+			pthread_mutex_unlock(&(file->lock));
+			pthread_mutex_lock(&(wb.lock));
+			file = wb.head;    // the list moved on while it was unlocked
+		}
+	}
+	pthread_mutex_unlock(&(wb.lock));
+	return NULL;
+}
+
+int file_wb_init(uint32_t size, uint32_t interval_ms)
+{
+	__atomic_store_n(&wb.size, size, __ATOMIC_RELAXED);
+	if (interval_ms > 0)
+		wb.interval_ns = interval_ms * 1000000ULL;
+	if (size == 0 || wb.running)
+		return SUCCESS;
+	wb.stop = 0;
+	if (pthread_create(&(wb.flusher), NULL, wb_flusher, NULL) != 0) {
+		__atomic_store_n(&wb.size, 0, __ATOMIC_RELAXED);    // nothing would flush behind
+		return -EAGAIN;
+	}
+	wb.running = 1;
+#ifdef FS_DEBUG
+	printf("file, write behind %u bytes per handle, flushed after %u ms\n", size, interval_ms);
+#endif
+	return SUCCESS;
+}
+
+void file_wb_destroy()
+{
+	if (!wb.running)
+		return;
+	pthread_mutex_lock(&(wb.lock));
+	wb.stop = 1;
+	pthread_cond_signal(&(wb.cond));
+	pthread_mutex_unlock(&(wb.lock));
+	pthread_join(wb.flusher, NULL);
+	wb.running = 0;
+}
+
+/*
+ * file->lock held. Where size bytes at offset go in the buffer, after
+ * flushing what they do not follow on from, or NULL with *ret 0 when
+ * they are better written through.
+ */
+static char *wb_reserve(struct fs_file *file, size_t size, off_t offset, int *ret)
+{
+	*ret = SUCCESS;
+	if (file->wb_len > 0 && (offset != file->wb_off + (off_t) file->wb_len || file->wb_len + size > file->wb_size)) {
+		*ret = __file_flush(file);
+		if (*ret != SUCCESS)
+			return NULL;
+	}
+	if (size >= file->wb_size)
+		return NULL;
+	if (file->wb_buf == NULL) {
+		file->wb_buf = (char *) malloc(file->wb_size);
+		if (file->wb_buf == NULL)
+			return NULL;
+	}
+	if (file->wb_len == 0) {
+		file->wb_off = offset;
+		if (!file->wb_queued)
+			wb_queue(file);
+	}
+	return file->wb_buf + file->wb_len;
+}
+
+// file->lock held, size bytes went in at the reservation
+static int wb_commit(struct fs_file *file, size_t size)
+{
+	file->wb_len += size;
+	__atomic_add_fetch(&fst.wb_writes, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&fst.wb_bytes, size, __ATOMIC_RELAXED);
+	if (file->wb_len == file->wb_size)
+		return __file_flush(file);
+	return SUCCESS;
+}
+
+int file_write(struct fs_file *file, const char *buf, size_t size, off_t offset)
+{
+	int ret = 0;
+	char *dst = NULL;
+	if (file->wb_size == 0)
+		return 0;
+	pthread_mutex_lock(&(file->lock));
+	dst = wb_reserve(file, size, offset, &ret);
+	if (dst != NULL) {
+		memcpy(dst, buf, size);
+		ret = wb_commit(file, size);
+		if (ret == SUCCESS)
+			ret = size;
+	}
+	pthread_mutex_unlock(&(file->lock));
+	return ret;
+}
+
+int file_write_buf(struct fs_file *file, struct fuse_bufvec *buf, off_t offset)
+{
+	size_t size = 0;
+	ssize_t copied = 0;
+	int ret = 0;
+	char *dst = NULL;
+	struct fuse_bufvec mem = FUSE_BUFVEC_INIT(0);
+	if (file->wb_size == 0)
+		return 0;
+	size = fuse_buf_size(buf);
+	pthread_mutex_lock(&(file->lock));
+	dst = wb_reserve(file, size, offset, &ret);
+	if (dst != NULL) {
+		mem.buf[0].size = size;
+		mem.buf[0].mem = dst;
+		copied = fuse_buf_copy(&mem, buf, 0);
+		if (copied < 0) {
+			ret = copied;
+		} else if (copied > 0) {
+			ret = wb_commit(file, copied);
+			if (ret == SUCCESS)
+				ret = copied;
+		}
+	}
+	pthread_mutex_unlock(&(file->lock));
+	return ret;
+}
+
+void file_close(struct fs_file *file)
+{
+	struct dentry *dentry = file->dentry;
+	struct file_stripe *stripe = file_stripe(dentry);
+	file_flush(file);
+	pthread_mutex_lock(&(stripe->lock));
+	if (file->o_prev != NULL)
+		file->o_prev->o_next = file->o_next;
+	else
+		stripe->head = file->o_next;
+	if (file->o_next != NULL)
+		file->o_next->o_prev = file->o_prev;
+	pthread_mutex_unlock(&(stripe->lock));
+	free(file->wb_buf);
+	if (file->dfd >= 0)
+		close(file->dfd);
+	pthread_mutex_destroy(&(file->lock));
+	slab_free(&file_cache, file);
+	__atomic_add_fetch(&fst.closes, 1, __ATOMIC_RELAXED);
+	d_put(dentry);    // an unlinked file goes back to the pool here
+}
+
+#define DIRECT_MASK ((off_t) FILE_DIRECT_ALIGN - 1)
+#define DIRECT_ALIGNED(x) ((((uintptr_t) (x)) & DIRECT_MASK) == 0)
+
+static char *bounce_alloc(size_t size)
+{
+	void *bounce = NULL;
+	if (size > FILE_DIRECT_BOUNCE)
+		size = FILE_DIRECT_BOUNCE;
+	if (posix_memalign(&bounce, FILE_DIRECT_ALIGN, size) != 0)
+		return NULL;
+	return (char *) bounce;
+}
+
+// where whole blocks go, the O_DIRECT fd on the backend file behind fd or fd itself
+static int direct_fd(struct fs_file *file, int fd)
+{
+	char proc[64];
+	int dfd = 0;
+	if (__atomic_load_n(&(file->dfd_src), __ATOMIC_ACQUIRE) == fd)
+		return file->dfd;
+	// promoted, dup2() keeps the number so nothing else has to follow
+	pthread_mutex_lock(&direct_lock);
+	if (file->dfd_src != fd) {
+		snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+		dfd = open(proc, O_RDWR | O_DIRECT);
+		if (dfd >= 0 && dup2(dfd, file->dfd) >= 0)
+			__atomic_store_n(&(file->dfd_src), fd, __ATOMIC_RELEASE);
+		if (dfd >= 0)
+			close(dfd);
+	}
+	pthread_mutex_unlock(&direct_lock);
+	return __atomic_load_n(&(file->dfd_src), __ATOMIC_ACQUIRE) == fd ? file->dfd : fd;
+}
+
+ssize_t file_read_direct(struct fs_file *file, int fd, char *buf, size_t size, off_t offset)
+{
+	char *bounce = NULL;
+	size_t done = 0;
+	size_t skip = 0;
+	size_t span = 0;
+	size_t n = 0;
+	off_t start = 0;
+	ssize_t ret = 0;
+	int dfd = direct_fd(file, fd);
+	if (DIRECT_ALIGNED(buf) && DIRECT_ALIGNED(offset) && DIRECT_ALIGNED(size)) {
+		ret = pread(dfd, buf, size, offset);
+		if (ret < 0)
+			return -errno;
+		__atomic_add_fetch(&fst.direct_bytes, ret, __ATOMIC_RELAXED);
+		return ret;
+	}
+	bounce = bounce_alloc((size + 2 * FILE_DIRECT_ALIGN) & ~DIRECT_MASK);
+	if (bounce == NULL)
+		return -ENOMEM;
+	while (done < size) {
+		start = (offset + done) & ~DIRECT_MASK;
+		skip = offset + done - start;
+		span = (skip + size - done + DIRECT_MASK) & ~DIRECT_MASK;
+		if (span > FILE_DIRECT_BOUNCE)
+			span = FILE_DIRECT_BOUNCE;
+		ret = pread(dfd, bounce, span, start);
+		if (ret < 0) {
+			ret = -errno;
+			break;
+		}
+		if ((size_t) ret <= skip)
+			break;    // end of file
+		n = ret - skip < size - done ? ret - skip : size - done;
+		memcpy(buf + done, bounce + skip, n);
+		done += n;
+		if ((size_t) ret < span)
+			break;
+	}
+	free(bounce);
+	__atomic_add_fetch(&fst.direct_bytes, done, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&fst.bounce_bytes, done, __ATOMIC_RELAXED);
+	return done > 0 || ret >= 0 ? (ssize_t) done : ret;
+}
+
+static ssize_t pwrite_all(int fd, const char *buf, size_t size, off_t offset)
+{
+	size_t done = 0;
+	ssize_t ret = 0;
+	while (done < size) {
+		ret = pwrite(fd, buf + done, size - done, offset + done);
+		if (ret <= 0)
+			return done > 0 ? (ssize_t) done : (ret < 0 ? -errno : 0);
+		done += ret;
+	}
+	return done;
+}
+
+// whole blocks, offset and size aligned
+static ssize_t direct_write_blocks(int dfd, const char *buf, size_t size, off_t offset)
+{
+	char *bounce = NULL;
+	size_t done = 0;
+	size_t n = 0;
+	ssize_t ret = 0;
+	if (DIRECT_ALIGNED(buf))
+		return pwrite_all(dfd, buf, size, offset);
+	bounce = bounce_alloc(size);
+	if (bounce == NULL)
+		return -ENOMEM;
+	while (done < size) {
+		n = size - done < FILE_DIRECT_BOUNCE ? size - done : FILE_DIRECT_BOUNCE;
+		memcpy(bounce, buf + done, n);
+		ret = pwrite_all(dfd, bounce, n, offset + done);
+		if (ret <= 0)
+			break;
+		done += ret;
+		if ((size_t) ret < n)
+			break;
+	}
+	free(bounce);
+	__atomic_add_fetch(&fst.bounce_bytes, done, __ATOMIC_RELAXED);
+	return done > 0 || ret >= 0 ? (ssize_t) done : ret;
+}
+
+ssize_t file_write_direct(struct fs_file *file, int fd, const char *buf, size_t size, off_t offset)
+{
+	size_t head = (FILE_DIRECT_ALIGN - (offset & DIRECT_MASK)) & DIRECT_MASK;
+	size_t body = 0;
+	size_t done = 0;
+	ssize_t ret = 0;
+	if (head > size)
+		head = size;
+	body = (size - head) & ~DIRECT_MASK;
+	if (head > 0) {
+		ret = pwrite_all(fd, buf, head, offset);
+		if (ret < (ssize_t) head)
+			return ret;
+		done += head;
+	}
+	if (body > 0) {
+		ret = direct_write_blocks(direct_fd(file, fd), buf + done, body, offset + done);
+		if (ret > 0) {
+			__atomic_add_fetch(&fst.direct_bytes, ret, __ATOMIC_RELAXED);
+			done += ret;
+		}
+		if (ret < (ssize_t) body)
+			return done > 0 ? (ssize_t) done : ret;
+	}
+	if (done < size) {
+		ret = pwrite_all(fd, buf + done, size - done, offset + done);
+		if (ret > 0)
+			done += ret;
+		else if (done == 0)
+			return ret;
+	}
+	return done;
+}
+
+// the payload comes out of /dev/fuse into aligned memory first if it is not in memory already
+ssize_t file_write_direct_buf(struct fs_file *file, int fd, struct fuse_bufvec *buf, off_t offset)
+{
+	struct fuse_bufvec mem = FUSE_BUFVEC_INIT(fuse_buf_size(buf));
+	void *data = NULL;
+	ssize_t ret = 0;
+	if (buf->count == 1 && !(buf->buf[0].flags & FUSE_BUF_IS_FD))
+		return file_write_direct(file, fd, (const char *) buf->buf[0].mem, buf->buf[0].size, offset);
+	if (posix_memalign(&data, FILE_DIRECT_ALIGN, mem.buf[0].size) != 0)
+		return -ENOMEM;
+	mem.buf[0].mem = data;
+	ret = fuse_buf_copy(&mem, buf, 0);
+	if (ret > 0)
+		ret = file_write_direct(file, fd, (const char *) data, ret, offset);
+	free(data);
+	return ret;
+}
+
+void file_sync(struct dentry *dentry, struct fs_file *skip, off_t offset, size_t size)
+{
+	struct file_stripe *stripe = file_stripe(dentry);
+	struct fs_file *file = NULL;
+	if (likely(__atomic_load_n(&(stripe->pending), __ATOMIC_RELAXED) == 0))
+		return;
+	pthread_mutex_lock(&(stripe->lock));
+	for (file = stripe->head; file != NULL; file = file->o_next) {
+		if (file->dentry != dentry || file == skip)
+			continue;
+		pthread_mutex_lock(&(file->lock));
+		// a failure stays with the handle, its own next flush reports it
+		if (file->wb_len > 0 && offset < file->wb_off + (off_t) file->wb_len
+				&& (size == 0 || offset + (off_t) size > file->wb_off))
+			__file_flush(file);
+		pthread_mutex_unlock(&(file->lock));
+	}
+	pthread_mutex_unlock(&(stripe->lock));
+}
+
+void file_read_ahead(struct fs_file *file, off_t offset, size_t size)
+{
+	off_t ra_start = 0;
+	uint32_t ra_len = 0;
+	int fd = 0;
+	file_sync(file->dentry, file, offset, size);
+	pthread_mutex_lock(&(file->lock));
+	if (file->wb_len > 0 && offset < file->wb_off + (off_t) file->wb_len && offset + (off_t) size > file->wb_off)
+		__file_flush(file);
+	if (offset != file->next_off) {
+		file->seq_reads = 0;
+		file->ra_len = FILE_RA_MIN;
+		file->ra_end = 0;
+	} else if (++file->seq_reads >= FILE_RA_SEQ && offset + (off_t) size + file->ra_len / 2 > file->ra_end) {
+		// half the window is left, push it on
+		ra_start = file->ra_end > offset + (off_t) size ? file->ra_end : offset + (off_t) size;
+		ra_len = file->ra_len;
+		file->ra_end = ra_start + ra_len;
+		if (file->ra_len < FILE_RA_MAX)
+			file->ra_len *= 2;
+	}
+	file->next_off = offset + size;
+	pthread_mutex_unlock(&(file->lock));
+	if (ra_len == 0)
+		return;
+	fd = promote_io_begin(file->dentry);
+	posix_fadvise(fd, ra_start, ra_len, POSIX_FADV_WILLNEED);
+	promote_io_end(file->dentry, 0, 0);
+	__atomic_add_fetch(&fst.ra_calls, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&fst.ra_bytes, ra_len, __ATOMIC_RELAXED);
+}
+
+int file_stats(char *buf, size_t size)
+{
+	return snprintf(buf, size,
+			"file.opens %lu\nfile.open_now %lu\nfile.readahead_calls %lu\nfile.readahead_bytes %lu\n"
+			"file.flushes %lu\nfile.wb_writes %lu\nfile.wb_bytes %lu\nfile.wb_timer_flushes %lu\n"
+			"file.direct_opens %lu\nfile.direct_fallbacks %lu\nfile.direct_bytes %lu\nfile.bounce_bytes %lu\n",
+			(unsigned long) __atomic_load_n(&fst.opens, __ATOMIC_RELAXED),
+			(unsigned long) (__atomic_load_n(&fst.opens, __ATOMIC_RELAXED) - __atomic_load_n(&fst.closes, __ATOMIC_RELAXED)),
+			(unsigned long) __atomic_load_n(&fst.ra_calls, __ATOMIC_RELAXED),
+			(unsigned long) __atomic_load_n(&fst.ra_bytes, __ATOMIC_RELAXED),
+			(unsigned long) __atomic_load_n(&fst.flushes, __ATOMIC_RELAXED),
+			(unsigned long) __atomic_load_n(&fst.wb_writes, __ATOMIC_RELAXED),
+			(unsigned long) __atomic_load_n(&fst.wb_bytes, __ATOMIC_RELAXED),
+			(unsigned long) __atomic_load_n(&fst.wb_timer_flushes, __ATOMIC_RELAXED),
+			(unsigned long) __atomic_load_n(&fst.direct_opens, __ATOMIC_RELAXED),
+			(unsigned long) __atomic_load_n(&fst.direct_fallbacks, __ATOMIC_RELAXED),
+			(unsigned long) __atomic_load_n(&fst.direct_bytes, __ATOMIC_RELAXED),
+			(unsigned long) __atomic_load_n(&fst.bounce_bytes, __ATOMIC_RELAXED));
+}
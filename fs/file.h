@@ -0,0 +1,90 @@
+#ifndef FILE_H
+#define FILE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <pthread.h>
+
+#include "fs.h"
+
+#define FILE_RA_MIN (128 << 10)    // first readahead window of a sequential stream
+#define FILE_RA_MAX (8 << 20)
+#define FILE_RA_SEQ 2    // sequential reads in a row before readahead starts
+#define FILE_WB_INTERVAL_MS 1000    // pending writes older than this are flushed by the timer
+#define FILE_DIRECT_ALIGN 4096    // O_DIRECT offsets, lengths and buffers, covers the usual block sizes
+#define FILE_DIRECT_BOUNCE (1 << 20)    // largest bounce buffer of one unaligned direct request
+#define FILE_OPEN_STRIPES 256    // open handles hashed by inode, see file_sync()
+
+/*
+ * One per open(), in fileInfo->fh of a regular file. It holds the
+ * dentry pin the open took, so an unlinked file keeps its backend file
+ * until the last close. The rest is per stream state.
+ */
+struct fs_file {
+	struct dentry *dentry;    // pinned, its fid is the backend fd, see promote_io_begin()
+	int flags;    // open flags
+	int dfd;    // O_DIRECT fd on the same backend file, -1 for a buffered handle
+	int dfd_src;    // the backend fd dfd was opened from, a promotion moves the file
+	pthread_mutex_t lock;    // requests on one handle may run concurrently
+	// sequential read detector
+	off_t next_off;    // where the next read of a sequential stream starts
+	uint32_t seq_reads;
+	// backend readahead window, issued up to ra_end
+	uint32_t ra_len;
+	off_t ra_end;
+	// pending writes, contiguous from wb_off, see file_write()
+	char *wb_buf;
+	off_t wb_off;
+	uint32_t wb_len;
+	uint32_t wb_size;    // 0 writes straight through
+	int wb_err;    // a flush behind the writer's back failed, reported by the next flush
+	int wb_queued;    // on the flusher's list, under its lock
+	uint64_t wb_stamp;    // when the first pending byte came in
+	struct fs_file *wb_prev;
+	struct fs_file *wb_next;
+	// on the open list of its stripe, under the stripe's lock
+	struct fs_file *o_prev;
+	struct fs_file *o_next;
+	int atime_due;    // read since the last flush, the atime moves then
+};
+
+void file_cache_init();
+// write behind buffer of size bytes per handle opened from now on, 0 turns it off
+int file_wb_init(uint32_t size, uint32_t interval_ms);
+void file_wb_destroy();
+/*
+ * Handles opened from now on go around the page caches when the file is
+ * at least min_size bytes (0 for any size) or its path matches one of
+ * the comma separated fnmatch patterns, or the caller asked for O_DIRECT.
+ */
+int file_direct_init(uint64_t min_size, const char *patterns);
+// takes over a pin the caller holds on dentry
+struct fs_file *file_open(struct dentry *dentry, int flags);
+// flushes, then drops the pin
+void file_close(struct fs_file *file);
+int file_flush(struct fs_file *file);
+// direct_io and keep_cache for the reply to open or create
+void file_set_info(struct fs_file *file, struct fuse_file_info *fi);
+// reads and writes of a direct handle on the backend fd from promote_io_begin(), partial blocks are bounced
+ssize_t file_read_direct(struct fs_file *file, int fd, char *buf, size_t size, off_t offset);
+ssize_t file_write_direct(struct fs_file *file, int fd, const char *buf, size_t size, off_t offset);
+ssize_t file_write_direct_buf(struct fs_file *file, int fd, struct fuse_bufvec *buf, off_t offset);
+// > 0 the write is buffered, 0 the caller writes it through, < 0 error
+int file_write(struct fs_file *file, const char *buf, size_t size, off_t offset);
+int file_write_buf(struct fs_file *file, struct fuse_bufvec *buf, off_t offset);
+// a read of size at offset is about to be served: pending writes it
+// overlaps go out first, and the backend is kept ahead of the stream
+void file_read_ahead(struct fs_file *file, off_t offset, size_t size);
+// pending writes of dentry's handles but skip that overlap size bytes at offset go out, size 0 for all of them
+void file_sync(struct dentry *dentry, struct fs_file *skip, off_t offset, size_t size);
+
+// a read through file, the next flush or the close moves the atime once for all of them
+static inline void file_accessed(struct fs_file *file)
+{
+	if (__atomic_load_n(&(file->atime_due), __ATOMIC_RELAXED) == 0 && d_atime_due(file->dentry))
+		__atomic_store_n(&(file->atime_due), 1, __ATOMIC_RELAXED);
+}
+
+int file_stats(char *buf, size_t size);
+
+#endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
@@ -7,35 +8,44 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <libgen.h>
+#include <limits.h>
+#include <time.h>
+#include <sched.h>
 
 #include "fs.h"
+#include "replica.h"
+#include "evict.h"
+#include "file.h"
+#include "pcache.h"
+#include "uring.h"
+#include "promote.h"
+#include "reclaim.h"
+#include "aggr.h"
+#include "snap.h"
+#include "ino.h"
 #include "../tools/rbtree.h"
+#include "../tools/slab.h"
 
 struct fs_super *fs_sb = NULL;
+int fs_atime = ATIME_RELATIME;
+static uint64_t atime_updates;
 
-uint32_t generate_unique_id()
-{
-	pthread_mutex_lock(&(fs_sb->dir_id_lock));
-	fs_sb->curr_dir_id++;
-	pthread_mutex_unlock(&(fs_sb->dir_id_lock));
-	return fs_sb->curr_dir_id;
-}
-
+// atomic, lookups under the read lock set D_referenced concurrently
 void set_dentry_flag(struct dentry *dentry, int flag_type, int val)
 {
 	if (val == 0)
 	{
 		// set 0
-		dentry->flags &= ~(1UL << flag_type);
+		__atomic_and_fetch(&(dentry->flags), ~(1U << flag_type), __ATOMIC_RELAXED);
 	} else {
 		// set 1
-		dentry->flags |= 1UL << flag_type;
+		__atomic_or_fetch(&(dentry->flags), 1U << flag_type, __ATOMIC_RELAXED);
 	}
 }
 
 int get_dentry_flag(struct dentry *dentry, int flag_type)
 {
-	if (((dentry->flags >> flag_type) & 1) == 1 )
+	if (((__atomic_load_n(&(dentry->flags), __ATOMIC_RELAXED) >> flag_type) & 1) == 1 )
 	{
 		return 1;
 	} else {
@@ -43,143 +53,264 @@ int get_dentry_flag(struct dentry *dentry, int flag_type)
 	}
 }
 
+// dirty and unused lists share the links embedded in the dentry
+static void list_push_head(struct dentry **head, struct dentry **tail, struct dentry *dentry)
+{
+	dentry->attr->prev = NULL;
+	dentry->attr->next = *head;
+	if (*head == NULL)
+		*tail = dentry;
+	else
+		(*head)->attr->prev = dentry;
+	*head = dentry;
+}
+
+static int list_unlink(struct dentry **head, struct dentry **tail, struct dentry *dentry)
+{
+	if (dentry->attr->prev == NULL && *head != dentry)
+		return ERROR;
+	if (dentry->attr->prev != NULL)
+		dentry->attr->prev->attr->next = dentry->attr->next;
+	else
+		*head = dentry->attr->next;
+	if (dentry->attr->next != NULL)
+		dentry->attr->next->attr->prev = dentry->attr->prev;
+	else
+		*tail = dentry->attr->prev;
+	dentry->attr->prev = NULL;
+	dentry->attr->next = NULL;
+	return SUCCESS;
+}
+
 int add_dentry_to_dirty_list(struct dentry *dentry)
 {
 	set_dentry_flag(dentry, D_dirty, 1);
-	struct dirty_dentry *dirty_dentry = (struct dirty_dentry *) calloc(1, sizeof(struct dirty_dentry));
-	dirty_dentry->dentry = dentry;
-	dirty_dentry->prev = NULL;
-	dirty_dentry->next = NULL;
-
-	if (fs_sb->dirty_dentry_head == NULL) {
-		fs_sb->dirty_dentry_head = dirty_dentry;
-		fs_sb->dirty_dentry_tail = dirty_dentry;
-		return 0;
-	}
-
-	dirty_dentry->next = fs_sb->dirty_dentry_head;
-	fs_sb->dirty_dentry_head->prev = dirty_dentry;
-	fs_sb->dirty_dentry_head = dirty_dentry;
+	list_push_head(&(fs_sb->dirty_dentry_head), &(fs_sb->dirty_dentry_tail), dentry);
 	return 0;
 }
 
 int remove_dentry_from_dirty_list(struct dentry *dentry)
 {
-	struct dirty_dentry * dirty_dentry = fs_sb->dirty_dentry_tail;
-	if (get_dentry_flag(dentry, D_type) == DIR_DENTRY) {
-		while (dirty_dentry != NULL && dirty_dentry->dentry->inode != dentry->inode)
-			dirty_dentry = dirty_dentry->prev;
-	} else if(get_dentry_flag(dentry, D_type) == FILE_DENTRY) {
-		while (dirty_dentry != NULL && dirty_dentry->dentry->fid != dentry->fid)
-			dirty_dentry = dirty_dentry->prev;
-	} else {    // is link
-		while (dirty_dentry != NULL && dirty_dentry->dentry->fid != dentry->fid && dirty_dentry->dentry->inode != dentry->inode)
-			dirty_dentry = dirty_dentry->prev;
-	}
-
-	if (dirty_dentry == NULL) {
+	if (list_unlink(&(fs_sb->dirty_dentry_head), &(fs_sb->dirty_dentry_tail), dentry) == ERROR) {
 		printf("this dentry not in dirty list\n");
 		return 0;
 	}
-	if (dirty_dentry == fs_sb->dirty_dentry_tail) {
-		if (dirty_dentry->prev == NULL) {
-			fs_sb->dirty_dentry_head = NULL;
-			fs_sb->dirty_dentry_tail = NULL;
-			goto out;
-		}
-		fs_sb->dirty_dentry_tail = dirty_dentry->prev;
-		dirty_dentry->prev->next = NULL;
-	} else {
-		dirty_dentry->next->prev = dirty_dentry->prev;
-		if (dirty_dentry->prev != NULL) {
-			dirty_dentry->prev->next = dirty_dentry->next;
-		} else {
-			fs_sb->dirty_dentry_head = dirty_dentry->next;
-		}
-	}
-out:
 	set_dentry_flag(dentry, D_dirty, 0);
-	
-	free(dirty_dentry);
-	dirty_dentry = NULL;
 	return 0;	
 }
 
+// a pool dentry is in no d_children, its node keys it by inode meanwhile
+static void unused_tree_insert(struct dentry *dentry)
+{
+	rb_node_t **new_node = &(fs_sb->unused_tree.rb_node), *rb_parent = NULL;
+	struct dentry *this_dentry = NULL;
+	while (*new_node) {
+		this_dentry = container_of(*new_node, struct dentry, node);
+		rb_parent = *new_node;
+		if (dentry->inode < this_dentry->inode)
+			new_node = &((*new_node)->rb_left);
+		else
+			new_node = &((*new_node)->rb_right);
+	}
+	rb_link_node(&(dentry->node), rb_parent, new_node);
+	rb_insert_color(&(dentry->node), &(fs_sb->unused_tree));
+}
+
+static int unused_unlink(struct dentry *dentry)
+{
+	if (list_unlink(&(fs_sb->unused_dentry_head), &(fs_sb->unused_dentry_tail), dentry) == ERROR)
+		return ERROR;
+	rb_erase(&(dentry->node), &(fs_sb->unused_tree));
+	RB_CLEAR_NODE(&(dentry->node));
+	return SUCCESS;
+}
+
 // front insert
 int add_dentry_to_unused_list(struct dentry *dentry)
 {
 	set_dentry_flag(dentry, D_dirty, 0);
-	struct unused_dentry *unused_dentry = (struct unused_dentry *) calloc(1, sizeof(struct unused_dentry));
-	unused_dentry->dentry = dentry;
-	unused_dentry->prev = NULL;
-	unused_dentry->next = NULL;
-
-	if (fs_sb->unused_dentry_head == NULL) {
-		fs_sb->unused_dentry_head = unused_dentry;
-		fs_sb->unused_dentry_tail = unused_dentry;
-		return 0;
-	}
-
-	unused_dentry->next = fs_sb->unused_dentry_head;
-	fs_sb->unused_dentry_head->prev = unused_dentry;
-	fs_sb->unused_dentry_head = unused_dentry;
+	list_push_head(&(fs_sb->unused_dentry_head), &(fs_sb->unused_dentry_tail), dentry);
+	unused_tree_insert(dentry);
 	return 0;
 }
 
 struct dentry* fetch_dentry_from_unused_list()
 {
-	if (fs_sb->unused_dentry_tail == NULL)    // not enough
+	struct dentry *dentry = fs_sb->unused_dentry_tail;
+	if (dentry == NULL)    // not enough
 		return NULL;
-	struct unused_dentry *fetched_dentry = NULL;
-	fetched_dentry = fs_sb->unused_dentry_tail;
-	fs_sb->unused_dentry_tail = fetched_dentry->prev;
-	if (fetched_dentry->prev == NULL) {    // the last one
-		fs_sb->unused_dentry_head = NULL;
-	} else {
-		fetched_dentry->prev->next = NULL;
-	}
-	fetched_dentry->prev = NULL;
+	unused_unlink(dentry);
+	return dentry;
+}
+
+static struct dentry *unused_find(uint64_t inode)
+{
+	rb_node_t *node = fs_sb->unused_tree.rb_node;
 	struct dentry *dentry = NULL;
-	dentry = fetched_dentry->dentry;
-	free(fetched_dentry);
-	fetched_dentry = NULL;
+	while (node) {
+		dentry = container_of(node, struct dentry, node);
+		if (inode < dentry->inode)
+			node = node->rb_left;
+		else if (inode > dentry->inode)
+			node = node->rb_right;
+		else
+			return dentry;
+	}
+	return NULL;
+}
+
+// replay of a create on the standby must bind the same backend file
+struct dentry* fetch_dentry_from_unused_list_by_inode(uint64_t inode)
+{
+	struct dentry *dentry = unused_find(inode);
+	if (dentry == NULL)
+		return NULL;
+	remove_dentry_from_unused_list(dentry);
 	return dentry;
 }
 
-// only remove from tail
 int remove_dentry_from_unused_list(struct dentry *dentry)
 {
-	struct unused_dentry * unused_dentry = fs_sb->unused_dentry_tail;
-	while (unused_dentry->dentry->fid != dentry->fid && unused_dentry != NULL) {
-		unused_dentry = unused_dentry->prev;
-	}
-	if (unused_dentry == NULL) {
-		printf("this dentry not in dirty list\n");
+	if (unused_unlink(dentry) == ERROR) {
+		printf("this dentry not in unused list\n");
 		return 0;
 	}
-	if (unused_dentry == fs_sb->unused_dentry_tail) {
-		if (unused_dentry->prev == NULL) {
-			fs_sb->unused_dentry_head = NULL;
-			fs_sb->unused_dentry_tail = NULL;
-			goto out;
-		}
-		fs_sb->unused_dentry_tail = unused_dentry->prev;
-		unused_dentry->prev->next = NULL;
-	} else {
-		unused_dentry->next->prev = unused_dentry->prev;
-		if (unused_dentry->prev != NULL) {
-			unused_dentry->prev->next = unused_dentry->next;
-		} else {
-			fs_sb->unused_dentry_head = unused_dentry->next;
-		}
-	}
-out:
 	set_dentry_flag(dentry, D_dirty, 1);
-	free(unused_dentry);
-	unused_dentry = NULL;
 	return 0;	
 }
 
+static struct attr_stripe *attr_lock(struct dentry *dentry)
+{
+	// dentries are line aligned, the low bits carry nothing
+	return &(fs_sb->attr_locks[((uintptr_t) dentry >> 6) % ATTR_LOCK_STRIPES]);
+}
+
+void d_attr_lock(struct dentry *dentry)
+{
+	struct attr_stripe *stripe = attr_lock(dentry);
+	pthread_mutex_lock(&(stripe->lock));
+	// odd before any field changes
+	__atomic_store_n(&(stripe->seq), stripe->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void d_attr_unlock(struct dentry *dentry)
+{
+	struct attr_stripe *stripe = attr_lock(dentry);
+	__atomic_store_n(&(stripe->seq), stripe->seq + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&(stripe->lock));
+}
+
+uint32_t d_attr_read_begin(struct dentry *dentry)
+{
+	struct attr_stripe *stripe = attr_lock(dentry);
+	uint32_t seq = __atomic_load_n(&(stripe->seq), __ATOMIC_ACQUIRE);
+	// a writer holds the stripe for a few stores, unless it was preempted
+	while (unlikely(seq & 1)) {
+		sched_yield();
+		seq = __atomic_load_n(&(stripe->seq), __ATOMIC_ACQUIRE);
+	}
+	return seq;
+}
+
+int d_attr_read_retry(struct dentry *dentry, uint32_t seq)
+{
+	// the copy is done before the count is looked at again
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&(attr_lock(dentry)->seq), __ATOMIC_RELAXED) != seq;
+}
+
+// a copy a writer may race with, d_attr_read_retry() finds out and it is made again
+__attribute__((no_sanitize_thread))
+uint64_t d_size(struct dentry *dentry)
+{
+	uint64_t size = 0;
+	uint32_t seq = 0;
+	do {
+		seq = d_attr_read_begin(dentry);
+		size = dentry->attr->size;
+	} while (d_attr_read_retry(dentry, seq));
+	return size;
+}
+
+// a pool file nobody reads any more, emptied and back on the unused list
+void d_recycle(struct dentry *dentry)
+{
+	// a promoted file goes, the pool slot parked for it comes back
+	if (get_dentry_flag(dentry, D_promoted) && !promote_release(dentry)) {
+		aggr_forget(dentry);
+		d_free(dentry);
+		return;
+	}
+	// the primary may have bound the file again already, truncated at takeover
+	if (likely(!replica_replaying()))
+		ftruncate(dentry->fid, 0);    // delete the file
+	dentry->attr->size = 0;
+	// a queued size change stays queued, the fold skips the file unlinked
+	__atomic_and_fetch(&(dentry->flags), 1U << D_aggr_queued, __ATOMIC_RELAXED);
+	set_dentry_flag(dentry, D_type, FILE_DENTRY);
+	dentry->attr->nlink = 0;
+	dentry->d_count = 0;
+	clock_gettime(CLOCK_REALTIME, &(dentry->attr->mtime));
+	pthread_rwlock_wrlock(&(fs_sb->unused_list_rwlock));
+	add_dentry_to_unused_list(dentry);    // for file, need recycle
+	pthread_rwlock_unlock(&(fs_sb->unused_list_rwlock));
+}
+
+// a pool file about to be bound, emptied of what it still holds
+static void pool_empty(struct dentry *dentry)
+{
+	ftruncate(dentry->fid, 0);
+	dentry->attr->size = 0;
+}
+
+// the last pin on an unlinked dentry is gone, files go back to the pool
+static void d_release(struct dentry *dentry)
+{
+	if (get_dentry_flag(dentry, D_snapshot)) {
+		if (get_dentry_flag(dentry, D_type) != DIR_DENTRY)
+			pcache_invalidate(dentry, 0, dentry->attr->size);
+		snap_release(dentry);
+		return;
+	}
+	if (get_dentry_flag(dentry, D_type) == DIR_DENTRY || S_ISLNK(dentry->attr->mode)) {
+		d_free(dentry);
+		return;
+	}
+	pcache_invalidate(dentry, 0, dentry->attr->size);
+	// a snapshot still reading the data keeps the pool file
+	if (get_dentry_flag(dentry, D_snap_shared) && snap_unlinked(dentry))
+		return;
+	d_recycle(dentry);
+}
+
+void d_put(struct dentry *dentry)
+{
+	if (__atomic_sub_fetch(&(dentry->d_count), 1, __ATOMIC_ACQ_REL) == D_COUNT_DEAD)
+		d_release(dentry);
+}
+
+// tree_rwlock held for write, right after d_remove(); 1 if nothing pins the
+// dentry and the caller is to d_release() it once the lock is dropped
+int d_kill(struct dentry *dentry)
+{
+	return __atomic_fetch_or(&(dentry->d_count), D_COUNT_DEAD, __ATOMIC_ACQ_REL) == 0;
+}
+
+void lookup_put(struct lookup_res *lkup_res)
+{
+	if (lkup_res->dentry != NULL)
+		d_put(lkup_res->dentry);
+	lkup_res->dentry = NULL;
+}
+
+// forget, drop n pins at once
+void d_put_many(struct dentry *dentry, uint64_t n)
+{
+	if (__atomic_sub_fetch(&(dentry->d_count), (uint32_t) n, __ATOMIC_ACQ_REL) == D_COUNT_DEAD)
+		d_release(dentry);
+}
+
 int charlen(char *str)
 {
 	int len = 0;
@@ -210,90 +341,106 @@ bool is_prefix(const char *prefix, const char *str)
 
 void init_sb(char * mount_point, char * access_point)
 {
-	fs_sb = (struct fs_super *) calloc(1, sizeof(struct fs_super));
+	// the attr stripes are a line each
+	if (posix_memalign((void **) &fs_sb, 64, sizeof(struct fs_super)) != 0) {
+		printf("init_sb, no memory for the super block\n");
+		exit(1);
+	}
+	memset(fs_sb, 0, sizeof(struct fs_super));
+	d_cache_init();
+	aggr_init();
+	file_cache_init();
+	map_init();
 	strcpy(fs_sb->alloc_path, access_point);
 	strcpy(fs_sb->mount_point, mount_point);
 	fs_sb->dirty_dentry_head = NULL;
 	fs_sb->dirty_dentry_tail = NULL;
 	fs_sb->unused_dentry_head = NULL;
 	fs_sb->unused_dentry_tail = NULL;
-	fs_sb->tree = RB_ROOT;
 	fs_sb->link_tree = RB_ROOT;
-	fs_sb->curr_dir_id = 1;
+	fs_sb->unused_tree = RB_ROOT;
 
-	// root should in map first!
+	// root heads the namespace, it is in no d_children
 	struct stat root_buf;
 	stat(access_point, &root_buf);
-	struct dentry *dentry = (struct dentry *) calloc(1, sizeof(struct dentry));
+	struct dentry *dentry = d_alloc_dir();
 	dentry->fid = 0;    // name in lustre
 	//dentry->inode = root_buf.st_ino;
-	//dentry->inode = generate_unique_id();
-	dentry->inode = 1;    // root inode;
+	dentry->inode = INO_ROOT;    // root inode;
 	dentry->flags = 0;
 	set_dentry_flag(dentry, D_type, DIR_DENTRY);
-	dentry->mode = root_buf.st_mode;
-	dentry->ctime = root_buf.st_ctime;
-	dentry->mtime = root_buf.st_mtime;
-	dentry->atime = root_buf.st_atime;
-	dentry->size = root_buf.st_size;
-	dentry->uid = root_buf.st_uid;
-	dentry->gid = root_buf.st_gid;
-	dentry->nlink = root_buf.st_nlink;
+	dentry->attr->mode = root_buf.st_mode;
+	dentry->attr->ctime = root_buf.st_ctim;
+	dentry->attr->mtime = root_buf.st_mtim;
+	dentry->attr->atime = root_buf.st_atim;
+	dentry->attr->size = root_buf.st_size;
+	dentry->attr->uid = root_buf.st_uid;
+	dentry->attr->gid = root_buf.st_gid;
+	dentry->attr->nlink = root_buf.st_nlink;
 	add_dentry_to_dirty_list(dentry);
 
-	// put in map
-	uint64_t addr = (uint64_t) dentry;
-	put(&(fs_sb->tree), "0#/", addr);
+	fs_sb->root = dentry;
 }
 
+// lkup_res->dentry comes back pinned, also on a miss, lookup_put() it when done
 int path_lookup(const char *path, struct lookup_res *lkup_res)
 {
 	int s, len = strlen(path);
 	int last_pos = 0;
-	int cur_inode = 0;
-	uint64_t addr = 0;
-	map_t *map_item = NULL;
 	struct dentry *find_dentry = NULL;
+	struct dentry *last_dentry = NULL;
 	char dentry_name[DENTRY_NAME_SIZE];
-	char search_key[MAP_KEY_LEN];
-	
 
 	s = 0;
 	last_pos = 0;
+	lkup_res->dentry = NULL;
+	if (evict_pending()) {
+		pthread_rwlock_wrlock(&(fs_sb->tree_rwlock));
+		evict_maybe();
+		pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
+	}
 	pthread_rwlock_rdlock(&(fs_sb->tree_rwlock));
 	while (s <= len) {
 		if (s == len || path[s] == '/') {
-			memset(dentry_name, '\0', DENTRY_NAME_SIZE);
-			memset(search_key, '\0', MAP_KEY_LEN);
 			s = s ? s : 1;
-			memcpy(dentry_name, &path[last_pos], s - last_pos);
-			sprintf(search_key, "%d", cur_inode);
-			strcat(search_key, MAP_KEY_DELIMIT);
-			strcat(search_key, dentry_name);
-		#ifdef FS_DEBUG
-			printf("path_lookup, dentry name = %s, search key = %s\n", dentry_name, search_key);
-		#endif
-			map_item = get(&(fs_sb->tree), search_key);
-			if (map_item == NULL) {
+			find_dentry = NULL;
+			if (s - last_pos < DENTRY_NAME_SIZE) {
+				memcpy(dentry_name, &path[last_pos], s - last_pos);
+				dentry_name[s - last_pos] = '\0';
+			#ifdef FS_DEBUG
+				printf("path_lookup, dentry name = %s, parent inode = %lu\n", dentry_name, last_dentry ? (unsigned long)last_dentry->inode : 0);
+			#endif
+				if (last_dentry == NULL) {
+					find_dentry = strcmp(dentry_name, "/") == 0 ? fs_sb->root : NULL;
+				} else {
+					d_reference(last_dentry);
+					if (d_ensure(last_dentry) == SUCCESS)
+						find_dentry = d_lookup(last_dentry, dentry_name);
+					if (find_dentry == NULL && snap_reserved(dentry_name))
+						find_dentry = snap_lookup(last_dentry);
+				}
+			}
+			if (find_dentry == NULL) {
 
 			#ifdef FS_DEBUG
-				printf("path_lookup, not find key = %s item in the map\n", search_key);
+				printf("path_lookup, not find name = %s in the map\n", dentry_name);
 			#endif
 
-				lkup_res->dentry = find_dentry;    // if failed record the last searched dentry
+				lkup_res->dentry = last_dentry;    // if failed record the last searched dentry
 				//lkup_res->p_inode = cur_inode;
 				if (s == len) {
 					lkup_res->error = MISS_FILE;
 				} else {
 					lkup_res->error = MISS_DIR;
 				}
+				if (last_dentry != NULL)
+					d_get(last_dentry);
 				pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
 				return ERROR;
 			}
-			lkup_res->p_inode = cur_inode;
-			addr = map_item->val;
-			find_dentry = (struct dentry *) addr;
-			cur_inode = (int) find_dentry->inode;
+			lkup_res->p_dentry = last_dentry;
+			lkup_res->p_inode = last_dentry ? last_dentry->inode : 0;
+			last_dentry = find_dentry;
 			if (s == 1)
 				last_pos = s;
 			else
@@ -303,10 +450,191 @@ int path_lookup(const char *path, struct lookup_res *lkup_res)
 	}
 	lkup_res->dentry = find_dentry;
 	lkup_res->error = LOOKUP_SUCCESS;
+	d_get(find_dentry);
+	pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
+	return SUCCESS;
+}
+
+// name in p_dentry, the one step of path_lookup(); *res comes back pinned
+int fs_lookup_at(struct dentry *p_dentry, const char *name, struct dentry **res)
+{
+	struct dentry *dentry = NULL;
+	if (get_dentry_flag(p_dentry, D_type) != DIR_DENTRY)
+		return -ENOTDIR;
+	if (strlen(name) >= DENTRY_NAME_SIZE)
+		return -ENAMETOOLONG;
+	if (evict_pending()) {
+		pthread_rwlock_wrlock(&(fs_sb->tree_rwlock));
+		evict_maybe();
+		pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
+	}
+	pthread_rwlock_rdlock(&(fs_sb->tree_rwlock));
+	if (!d_dead(p_dentry)) {
+		d_reference(p_dentry);
+		if (d_ensure(p_dentry) == SUCCESS)
+			dentry = d_lookup(p_dentry, name);
+		if (dentry == NULL && snap_reserved(name))
+			dentry = snap_lookup(p_dentry);
+	}
+	if (dentry != NULL)
+		d_get(dentry);
+	pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
+	if (dentry == NULL)
+		return -ENOENT;
+	*res = dentry;
+	return SUCCESS;
+}
+
+// tree_rwlock held, absolute path of a linked dentry into buf, the inverse of path_lookup()
+int __d_path(struct dentry *dentry, char *buf, int size)
+{
+	struct dentry *p = NULL;
+	int pos = size - 1;
+	buf[pos] = '\0';
+	for (p = dentry; p != fs_sb->root; p = p->attr->parent) {
+		// unlinked, or below a directory fs_rmtree_at() cut off
+		if (d_dead(p))
+			return -ENOENT;
+		if (pos < p->name_len + 1)
+			return -ENAMETOOLONG;
+		pos -= p->name_len;
+		memcpy(&buf[pos], d_name(p), p->name_len);
+		buf[--pos] = '/';
+	}
+	if (pos == size - 1)
+		buf[--pos] = '/';
+	memmove(buf, &buf[pos], size - pos);
+	return SUCCESS;
+}
+
+int d_path(struct dentry *dentry, char *buf, int size)
+{
+	int ret = 0;
+	pthread_rwlock_rdlock(&(fs_sb->tree_rwlock));
+	ret = __d_path(dentry, buf, size);
 	pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
+	return ret;
+}
+
+// tree_rwlock held since the change was made, nothing that touches the same names is logged in between
+void d_log(uint32_t op, struct dentry *dentry, const char *path2, uint32_t mode, uint32_t uid, uint32_t gid,
+		uint64_t ino, int64_t atime, int64_t mtime)
+{
+	char path[PATH_MAX];
+	if (likely(!replica_active()))
+		return;
+	if (__d_path(dentry, path, PATH_MAX) == SUCCESS)
+		replica_log(op, path, path2, mode, uid, gid, ino, atime, mtime);
+}
+
+// the pool file behind fd relative to alloc_path, e.g. "pre_alloc/12"
+int pool_name(int fd, char *buf, int size)
+{
+	char proc[32];
+	char path[PATH_MAX];
+	ssize_t len = 0;
+	size_t plen = strlen(fs_sb->alloc_path);
+	snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+	len = readlink(proc, path, sizeof(path) - 1);
+	if (len <= 0)
+		return ERROR;
+	path[len] = '\0';
+	if (strncmp(path, fs_sb->alloc_path, plen) != 0 || path[plen] != '/' || len - (ssize_t) plen > size)
+		return ERROR;
+	strcpy(buf, &path[plen + 1]);
+	return SUCCESS;
+}
+
+// tree_rwlock held, a create names its pool file, the standby binds that same one
+static void d_log_create(struct dentry *dentry, mode_t mode)
+{
+	char name[PATH_LEN];
+	if (likely(!replica_active()))
+		return;
+	d_log(REPL_CREATE, dentry, pool_name(dentry->fid, name, PATH_LEN) == SUCCESS ? name : NULL,
+			mode, 0, 0, dentry->inode, 0, 0);
+}
+
+// an unused pool dentry for fd, its attributes as the backend file has them
+static struct dentry *pool_dentry(int fd)
+{
+	struct dentry *dentry = NULL;
+	struct stat buf;
+	if (fstat(fd, &buf) != 0)
+		return NULL;
+	dentry = d_alloc();
+	if (unlikely(dentry == NULL))
+		return NULL;
+	uring_note_fd(fd);
+	dentry->fid = (uint32_t) fd;
+	dentry->inode = buf.st_ino;
+	dentry->flags = 0;
+	dentry->attr->mode = buf.st_mode;
+	dentry->attr->ctime = buf.st_ctim;
+	dentry->attr->mtime = buf.st_mtim;
+	dentry->attr->atime = buf.st_atim;
+	dentry->attr->size = buf.st_size;
+	dentry->attr->uid = buf.st_uid;
+	dentry->attr->gid = buf.st_gid;
+	dentry->attr->nlink = buf.st_nlink;
+	return dentry;
+}
+
+/*
+ * unused_list_rwlock held for write. A standby replaying a create takes the
+ * pool file its primary named, which it may never have opened: one the
+ * primary's batch_realloc() made. It never makes pool files of its own
+ * while replaying, the primary would skip them and they would only leak.
+ */
+static int adopt_pool_file(const char *name, uint64_t inode)
+{
+	char path[PATH_MAX];
+	struct dentry *dentry = NULL;
+	const char *flat = NULL;
+	uint32_t nr = 0;
+	int fd = 0;
+	if (unused_find(inode) != NULL)
+		return SUCCESS;
+	if (name == NULL || name[0] == '\0' || strstr(name, "..") != NULL)
+		return -ENFILE;
+	snprintf(path, PATH_MAX, "%s/%s", fs_sb->alloc_path, name);
+	fd = open(path, O_RDWR);
+	if (fd < 0)
+		return -errno;
+	dentry = pool_dentry(fd);
+	if (dentry == NULL || dentry->inode != inode) {
+		if (dentry != NULL)
+			d_free(dentry);
+		close(fd);
+		return dentry != NULL ? -ESTALE : -ENOMEM;
+	}
+	add_dentry_to_unused_list(dentry);
+	// after a takeover batch_realloc() goes on past the primary's names
+	flat = name + strlen(ALLOCATED_PATH);
+	if (strncmp(name, ALLOCATED_PATH, strlen(ALLOCATED_PATH)) == 0 && flat[0] == '/'
+			&& sscanf(flat + 1, "%u", &nr) == 1 && nr > fs_sb->realloc_next)
+		fs_sb->realloc_next = nr;
+#ifdef FS_DEBUG
+	printf("adopt_pool_file, %s inode = %lu fd = %d\n", path, (unsigned long)inode, fd);
+#endif
 	return SUCCESS;
 }
 
+// the pool file a primary named, off the unused list for the caller
+int take_pool_file(const char *name, uint64_t inode, struct dentry **res)
+{
+	int ret = 0;
+	pthread_rwlock_wrlock(&(fs_sb->unused_list_rwlock));
+	ret = adopt_pool_file(name, inode);
+	if (ret == SUCCESS)
+		*res = fetch_dentry_from_unused_list_by_inode(inode);
+	pthread_rwlock_unlock(&(fs_sb->unused_list_rwlock));
+	return ret;
+}
+
+// unused_list_rwlock held for write. Names continue past every earlier batch
+// and O_EXCL skips leftovers, so a pool file that is still bound to a live
+// dentry is never opened a second time.
 void batch_realloc()
 {
 	char create_path[PATH_LEN];
@@ -315,49 +643,38 @@ void batch_realloc()
 	strcat(create_path, "/");
 	strcat(create_path, ALLOCATED_PATH);    // // like /mnt/lustre/pre_alloc
 
-	uint32_t i = 0;
-	char part[8];
+	char part[16];
 	int fd = 0;
-	struct stat buf;
 	struct dentry *dentry = NULL;
-	int max_open_num = PRE_LOC_NUM;
+	int failed = 0;
 
 	int realloc_count = 0;
 	char tmp[PATH_LEN];
-	for (i = 1; i <= max_open_num; i++) {
-		dentry = (struct dentry *) calloc(1, sizeof(struct dentry));
-		memset(part, '\0', 8);
+	while (realloc_count < PRE_LOC_NUM && failed < PRE_LOC_NUM) {
+		memset(part, '\0', sizeof(part));
 		memset(tmp, '\0', PATH_LEN);
 		strcpy(tmp, create_path);
-		sprintf(part, "%d", (int)i);
+		sprintf(part, "%u", ++fs_sb->realloc_next);
 		strcat(tmp, "/");
 		strcat(tmp, part);
-		fd = open(tmp, O_CREAT | O_RDWR);
+		fd = open(tmp, O_CREAT | O_EXCL | O_RDWR, 0644);
 	#ifdef FS_DEBUG
 		printf("batch_realloc..., create_path = %s, open fd = %d\n", tmp, fd);
 	#endif
 		if (unlikely(fd < 0)) {
-			printf("batch_realloc... part = %s not be created, max num increase\n", part);
-			max_open_num++;
+			if (errno != EEXIST) {
+				printf("batch_realloc... part = %s not be created, errno = %d\n", part, errno);
+				failed++;
+			}
 			continue;
-			
+		}
+		dentry = pool_dentry(fd);
+		if (unlikely(dentry == NULL)) {
+			close(fd);
+			unlink(tmp);
+			break;
 		}
 		realloc_count++;
-		stat(tmp, &buf);
-		// hook dentry
-		//dentry->fid = i;    // name in lustre
-		dentry->fid = (uint32_t) fd;
-		dentry->inode = buf.st_ino;
-		dentry->flags = 0;
-		dentry->mode = buf.st_mode;
-		dentry->ctime = buf.st_ctime;
-		dentry->mtime = buf.st_mtime;
-		dentry->atime = buf.st_atime;
-		dentry->size = buf.st_size;
-		dentry->uid = buf.st_uid;
-		dentry->gid = buf.st_gid;
-		dentry->nlink = buf.st_nlink;
-
 		add_dentry_to_unused_list(dentry);
 	}
 #ifdef FS_DEBUG
@@ -401,14 +718,14 @@ int map_tree(char * dir_parent)
 			strcat(tmp_2, "/");
 			strcat(tmp_2, part_2);
 			for (k = 1; k <= EACH_SUBDIR; k++) {
-				dentry = (struct dentry *) calloc(1, sizeof(struct dentry));
+				dentry = d_alloc();
 				memset(tmp_3, '\0', PATH_LEN);
 				strcpy(tmp_3, tmp_2);
 				memset(part_3, '\0', 8);
 				sprintf(part_3, "%d", (int)k);
 				strcat(tmp_3, "/");
 				strcat(tmp_3, part_3);
-				fd = open(tmp_3, O_CREAT | O_RDWR);
+				fd = open(tmp_3, O_CREAT | O_RDWR, 0644);
 			#ifdef FS_DEBUG
 				printf("fs_init, create_path = %s, open fd = %d\n", tmp_3, fd);
 			#endif
@@ -419,17 +736,18 @@ int map_tree(char * dir_parent)
 					
 				}
 				stat(tmp_3, &buf);
+				uring_note_fd(fd);
 				dentry->fid = (uint32_t) fd;
 				dentry->inode = buf.st_ino;
 				dentry->flags = 0;
-				dentry->mode = buf.st_mode;
-				dentry->ctime = buf.st_ctime;
-				dentry->mtime = buf.st_mtime;
-				dentry->atime = buf.st_atime;
-				dentry->size = buf.st_size;
-				dentry->uid = buf.st_uid;
-				dentry->gid = buf.st_gid;
-				dentry->nlink = buf.st_nlink;
+				dentry->attr->mode = buf.st_mode;
+				dentry->attr->ctime = buf.st_ctim;
+				dentry->attr->mtime = buf.st_mtim;
+				dentry->attr->atime = buf.st_atim;
+				dentry->attr->size = buf.st_size;
+				dentry->attr->uid = buf.st_uid;
+				dentry->attr->gid = buf.st_gid;
+				dentry->attr->nlink = buf.st_nlink;
 				add_dentry_to_unused_list(dentry);
 				max_count++;
 				if (max_count > MAX_COUNT_LIMIT)
@@ -442,20 +760,24 @@ int map_tree(char * dir_parent)
 
 void init_lock()
 {
-	pthread_mutex_init(&(fs_sb->dir_id_lock), NULL);
+	int i;
 	pthread_rwlock_init(&(fs_sb->dirty_list_rwlock), NULL);
 	pthread_rwlock_init(&(fs_sb->unused_list_rwlock), NULL);
 	pthread_rwlock_init(&(fs_sb->tree_rwlock), NULL);
 	pthread_rwlock_init(&(fs_sb->link_tree_rwlock), NULL);
+	for (i = 0; i < ATTR_LOCK_STRIPES; i++)
+		pthread_mutex_init(&(fs_sb->attr_locks[i].lock), NULL);
 }
 
 void destroy_lock()
 {
-	pthread_mutex_destroy(&(fs_sb->dir_id_lock));
+	int i;
 	pthread_rwlock_destroy(&(fs_sb->dirty_list_rwlock));
 	pthread_rwlock_destroy(&(fs_sb->unused_list_rwlock));
 	pthread_rwlock_destroy(&(fs_sb->tree_rwlock));
 	pthread_rwlock_destroy(&(fs_sb->link_tree_rwlock));
+	for (i = 0; i < ATTR_LOCK_STRIPES; i++)
+		pthread_mutex_destroy(&(fs_sb->attr_locks[i].lock));
 }
 
 void fs_init(char * mount_point, char * access_point)
@@ -473,6 +795,7 @@ void fs_init(char * mount_point, char * access_point)
 
 	map_tree(create_path);
 	init_lock();
+	ino_init(fs_sb->alloc_path);
 	/*
 	if (access(create_path, F_OK) != 0) {
 		mkdir(create_path, O_CREAT);
@@ -488,7 +811,7 @@ void fs_init(char * mount_point, char * access_point)
 	char tmp[PATH_LEN];
 	
 	for (i = 1; i <= max_open_num; i++) {
-		dentry = (struct dentry *) calloc(1, sizeof(struct dentry));
+		dentry = d_alloc();
 		memset(part, '\0', 8);
 		memset(tmp, '\0', PATH_LEN);
 		strcpy(tmp, create_path);
@@ -512,14 +835,14 @@ void fs_init(char * mount_point, char * access_point)
 		dentry->fid = (uint32_t) fd;
 		dentry->inode = buf.st_ino;
 		dentry->flags = 0;
-		dentry->mode = buf.st_mode;
-		dentry->ctime = buf.st_ctime;
-		dentry->mtime = buf.st_mtime;
-		dentry->atime = buf.st_atime;
-		dentry->size = buf.st_size;
-		dentry->uid = buf.st_uid;
-		dentry->gid = buf.st_gid;
-		dentry->nlink = buf.st_nlink;
+		dentry->attr->mode = buf.st_mode;
+		dentry->attr->ctime = buf.st_ctim;
+		dentry->attr->mtime = buf.st_mtim;
+		dentry->attr->atime = buf.st_atim;
+		dentry->attr->size = buf.st_size;
+		dentry->attr->uid = buf.st_uid;
+		dentry->attr->gid = buf.st_gid;
+		dentry->attr->nlink = buf.st_nlink;
 
 		add_dentry_to_unused_list(dentry);
 
@@ -530,12 +853,16 @@ void fs_init(char * mount_point, char * access_point)
 	*/
 }
 
+static int do_create(const char * path, mode_t mode, struct fuse_file_info * fileInfo, uint64_t pool_inode);
+
 int fs_open(const char *path, struct fuse_file_info *fileInfo)
 {
 	int ret = 0;
 	struct dentry *dentry = NULL;
+	struct fs_file *file = NULL;
+	struct lookup_res lkup_res_buf;
 	struct lookup_res *lkup_res = NULL;
-	lkup_res = (struct lookup_res *) malloc(sizeof(struct lookup_res));
+	lkup_res = &lkup_res_buf;
 	ret = path_lookup(path, lkup_res);
 	if (lkup_res->error == MISS_DIR) {
 		ret = -ENOENT;
@@ -547,174 +874,349 @@ int fs_open(const char *path, struct fuse_file_info *fileInfo)
 			ret = -ENOENT;
 			goto out;
 		}
-		if (get_dentry_flag(dentry, D_type) != DIR_DENTRY) {
-			ret = -ENOTDIR;
-			goto out;
-		}
-		char cur_name[DENTRY_NAME_SIZE];
-		memset(cur_name, '\0', DENTRY_NAME_SIZE);
-		int len = strlen(path);
-		int i = 0;
-		int j = 0;
-		for (i = len - 1; i >= 0; --i) {
-			if (path[i] == '/')
-				break;
-		}
-		int split_pos = 0;
-		split_pos = (i > 0) ? i : 1;
-		if (split_pos == 1)
-			memcpy(cur_name, &path[split_pos], len - split_pos);
-		else
-			memcpy(cur_name, &path[split_pos + 1], len - split_pos - 1);
-
-		uint32_t p_inode = dentry->inode;
-		struct dentry *create_dentry = NULL;
-		pthread_rwlock_wrlock(&(fs_sb->unused_list_rwlock));
-		create_dentry = fetch_dentry_from_unused_list();
-		pthread_rwlock_unlock(&(fs_sb->unused_list_rwlock));
-		if (create_dentry == NULL) {
-			if (REALLOC_ENABLE) {
-			#ifdef FS_DEBUG
-				printf("fs_open(create), begin to batch_realloc ...\n");
-			#endif
-				batch_realloc();
-				create_dentry = fetch_dentry_from_unused_list();
-			} else {
-				ret = -ENFILE;    // not enough, need pre-alloc
-				goto out;
-			}
-		}
-	#ifdef FS_DEBUG
-		printf("fs_open(create), fetch dentry fid = %d, inode = %d\n", (int)create_dentry->fid, (int)create_dentry->inode);
-	#endif
-		pthread_rwlock_wrlock(&(fs_sb->unused_list_rwlock));
-		add_dentry_to_dirty_list(create_dentry);
-		pthread_rwlock_unlock(&(fs_sb->unused_list_rwlock));
-		set_dentry_flag(create_dentry, D_type, FILE_DENTRY);
-		create_dentry->mode = S_IFREG | 0644;
-		// init the new dentry...
-		char create_key[MAP_KEY_LEN];
-		memset(create_key, '\0', MAP_KEY_LEN);
-		sprintf(create_key, "%d", (int)p_inode);
-		strcat(create_key, MAP_KEY_DELIMIT);
-		strcat(create_key, cur_name);
-		//create_key[charlen(create_key)] = '\0';
-		uint64_t addr = (uint64_t) create_dentry;
-		pthread_rwlock_wrlock(&(fs_sb->tree_rwlock));
-		ret = put(&(fs_sb->tree), create_key, addr);
-		pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
-	#ifdef FS_DEBUG
-		if (ret == 1) {
-			printf("fs_open(create), put key = %s, its parent dentry inode = %d in the map!\n", create_key, (int)p_inode);
-		} else {
-			printf("fs_open(create), this key = %s, with parent inode = %d has already in the map\n", create_key, (int)p_inode);
-		}
-	#endif
-		ret = SUCCESS;
-		fileInfo->fh = addr;
+		lookup_put(lkup_res);
+		ret = do_create(path, S_IFREG | 0644, fileInfo, 0);
+		goto out;
+	}
+	ret = snap_open(dentry, fileInfo->flags);
+	if (ret != SUCCESS)
+		goto out;
+	// the handle keeps the lookup's pin, fs_release drops it
+	file = file_open(dentry, fileInfo->flags);
+	if (file == NULL) {
+		ret = -ENOMEM;
 		goto out;
 	}
 	ret = SUCCESS;
-	fileInfo->fh = (uint64_t) dentry;
+	fileInfo->fh = (uint64_t) file;
+	file_set_info(file, fileInfo);
+	lkup_res->dentry = NULL;
 out:
-	free(lkup_res);
-	lkup_res = NULL;
+	lookup_put(lkup_res);
 	return ret;
 }
 
-int fs_create(const char * path, mode_t mode, struct fuse_file_info * fileInfo)
+/*
+ * Namespace operations by parent and name. The parent is pinned by the
+ * caller, a path lookup or a FUSE node id; a new dentry handed back in
+ * *res carries a pin of its own for the caller. The path based fs_* ops
+ * and the low level frontend in fs_ll.c both sit on these.
+ */
+int fs_create_at(struct dentry *p_dentry, const char *name, mode_t mode, uint64_t pool_inode, struct dentry **res)
 {
 	int ret = 0;
-	int len = strlen(path);
-	int split_pos = 0;
-	int i;
-	for (i = len - 1; i >= 0; --i) {
-		if (path[i] == '/')
-			break;
-	}
-	split_pos = (i > 0) ? i : 1;
-	char cur_name[DENTRY_NAME_SIZE];
-	memset(cur_name, '\0', DENTRY_NAME_SIZE);
-	if (split_pos == 1)
-		memcpy(cur_name, &path[split_pos], len - split_pos);
+	struct dentry *create_dentry = NULL;
+	if (get_dentry_flag(p_dentry, D_type) != DIR_DENTRY)
+		return -ENOTDIR;
+	if (strlen(name) >= DENTRY_NAME_SIZE)
+		return -ENAMETOOLONG;
+	if (snap_reserved(name))
+		return -EEXIST;
+	pthread_rwlock_wrlock(&(fs_sb->unused_list_rwlock));
+	if (pool_inode != 0)
+		create_dentry = fetch_dentry_from_unused_list_by_inode(pool_inode);
 	else
-		memcpy(cur_name, &path[split_pos + 1], len - split_pos - 1);
-
-	if (fileInfo != NULL)
-		fileInfo->flags |= O_CREAT;
+		create_dentry = fetch_dentry_from_unused_list();
+	// a replayed create takes the file its primary named, fs_create_pooled() adopted it
+	if (create_dentry == NULL && pool_inode == 0 && REALLOC_ENABLE) {
+	#ifdef FS_DEBUG
+		printf("fs_create, begin to batch_realloc ...\n");
+	#endif
+		batch_realloc();
+		create_dentry = fetch_dentry_from_unused_list();
+	}
+	pthread_rwlock_unlock(&(fs_sb->unused_list_rwlock));
+	if (create_dentry == NULL)
+		return -ENFILE;    // not enough, need pre-alloc
+	// left with data by an earlier run, a replayed create keeps what its primary wrote
+	if (pool_inode == 0 && create_dentry->attr->size != 0)
+		pool_empty(create_dentry);
 #ifdef FS_DEBUG
-	printf("fs_create, will create path = %s, cur_name = %s\n", path, cur_name);
+	printf("fs_create, fetch dentry fid = %d, inode = %lu\n", (int)create_dentry->fid, (unsigned long)create_dentry->inode);
 #endif
-	struct lookup_res *lkup_res = NULL;
-	lkup_res = (struct lookup_res *)malloc(sizeof(struct lookup_res));
-	ret = path_lookup(path, lkup_res);
-	if (ret == SUCCESS) {
-		ret = -EEXIST;
-		goto out;
-	}
-	if (lkup_res->error == MISS_DIR) {
+	set_dentry_flag(create_dentry, D_type, FILE_DENTRY);
+	create_dentry->attr->mode = S_IFREG | (mode & 07777);
+	// init the new dentry...
+	create_dentry->d_count = res != NULL ? 1 : 0;
+	pthread_rwlock_wrlock(&(fs_sb->tree_rwlock));
+	// the parent may have been removed since the lookup, or the name taken
+	if (d_dead(p_dentry) || d_ensure(p_dentry) != SUCCESS)
 		ret = -ENOENT;
-		goto out;
+	else
+		ret = snap_touch(p_dentry);
+	if (ret == SUCCESS && d_insert(p_dentry, create_dentry, name) == 0)
+		ret = -EEXIST;
+	if (ret == SUCCESS) {
+		create_dentry->attr->d_saved = snap_epoch;
+		// a standby's pooled file may come with data already
+		create_dentry->attr->d_counted = create_dentry->attr->size;
+		aggr_account(create_dentry, 1);
+		pthread_rwlock_wrlock(&(fs_sb->dirty_list_rwlock));
+		add_dentry_to_dirty_list(create_dentry);
+		pthread_rwlock_unlock(&(fs_sb->dirty_list_rwlock));
+		d_log_create(create_dentry, mode);
+		evict_maybe();
 	}
-	if (get_dentry_flag(lkup_res->dentry, D_type) != DIR_DENTRY) {
-		ret = -ENOTDIR;
-		goto out;
+	pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
+	if (ret != SUCCESS) {
+		create_dentry->d_count = 0;
+		pthread_rwlock_wrlock(&(fs_sb->unused_list_rwlock));
+		add_dentry_to_unused_list(create_dentry);
+		pthread_rwlock_unlock(&(fs_sb->unused_list_rwlock));
+		return ret;
 	}
-	uint32_t p_inode = lkup_res->dentry->inode;
-	struct dentry *create_dentry = NULL;
+#ifdef FS_DEBUG
+	printf("fs_create, put name = %s, its parent dentry inode = %lu in the map!\n", name, (unsigned long)p_dentry->inode);
+#endif
+	if (res != NULL)
+		*res = create_dentry;
+	return SUCCESS;
+}
+
+/*
+ * fs_create_at() for nr names at once: one pool fetch, one tree_rwlock
+ * section and one dirty list pass for all of them, and the mode bits are
+ * kept. status[i] comes in SUCCESS, or an error that skips name i, and
+ * goes out SUCCESS or -errno; res[i] gets a pinned dentry for every name
+ * made when res is given. Returns how many were made.
+ */
+int fs_create_many_at(struct dentry *p_dentry, const char **names, const mode_t *modes, int nr, int *status, struct dentry **res)
+{
+	struct dentry **dentries = NULL;
+	int made = 0;
+	int ret = SUCCESS;
+	int i;
+	if (get_dentry_flag(p_dentry, D_type) != DIR_DENTRY)
+		return -ENOTDIR;
+	dentries = (struct dentry **) calloc(nr, sizeof(struct dentry *));
+	if (dentries == NULL)
+		return -ENOMEM;
 	pthread_rwlock_wrlock(&(fs_sb->unused_list_rwlock));
-	create_dentry = fetch_dentry_from_unused_list();
-	pthread_rwlock_unlock(&(fs_sb->unused_list_rwlock));
-	if (create_dentry == NULL) {
-		if (REALLOC_ENABLE) {
-		#ifdef FS_DEBUG
-			printf("fs_create, begin to batch_realloc ...\n");
-		#endif
+	for (i = 0; i < nr; i++) {
+		if (status[i] != SUCCESS)
+			continue;
+		if (strlen(names[i]) >= DENTRY_NAME_SIZE) {
+			status[i] = -ENAMETOOLONG;
+			continue;
+		}
+		if (snap_reserved(names[i])) {
+			status[i] = -EEXIST;
+			continue;
+		}
+		dentries[i] = fetch_dentry_from_unused_list();
+		if (dentries[i] == NULL && REALLOC_ENABLE) {
 			batch_realloc();
-			create_dentry = fetch_dentry_from_unused_list();
-		} else {
-			ret = -ENFILE;    // not enough, need pre-alloc
-			goto out;
+			dentries[i] = fetch_dentry_from_unused_list();
+		}
+		if (dentries[i] == NULL) {
+			status[i] = -ENFILE;
+			continue;
 		}
+		if (dentries[i]->attr->size != 0)
+			pool_empty(dentries[i]);
+		set_dentry_flag(dentries[i], D_type, FILE_DENTRY);
+		dentries[i]->attr->mode = S_IFREG | (modes[i] & 07777);
+		dentries[i]->d_count = res != NULL ? 1 : 0;
 	}
-#ifdef FS_DEBUG
-	printf("fs_create, fetch dentry fid = %d, inode = %d\n", (int)create_dentry->fid, (int)create_dentry->inode);
-#endif
-	pthread_rwlock_wrlock(&(fs_sb->unused_list_rwlock));
-	add_dentry_to_dirty_list(create_dentry);
 	pthread_rwlock_unlock(&(fs_sb->unused_list_rwlock));
-	set_dentry_flag(create_dentry, D_type, FILE_DENTRY);
-	create_dentry->mode = S_IFREG | 0644;
-	// init the new dentry...
-	char create_key[MAP_KEY_LEN];
-	memset(create_key, '\0', MAP_KEY_LEN);
-	sprintf(create_key, "%d", (int)p_inode);
-	strcat(create_key, MAP_KEY_DELIMIT);
-	strcat(create_key, cur_name);
-	//create_key[charlen(create_key)] = '\0';
-	uint64_t addr = (uint64_t) create_dentry;
 	pthread_rwlock_wrlock(&(fs_sb->tree_rwlock));
-	ret = put(&(fs_sb->tree), create_key, addr);
+	if (d_dead(p_dentry) || d_ensure(p_dentry) != SUCCESS)
+		ret = -ENOENT;
+	else
+		ret = snap_touch(p_dentry);
+	for (i = 0; i < nr; i++) {
+		if (dentries[i] == NULL)
+			continue;
+		if (ret != SUCCESS)
+			status[i] = ret;
+		else if (d_insert(p_dentry, dentries[i], names[i]) == 0)
+			status[i] = -EEXIST;
+		else
+			made++;
+		if (status[i] == SUCCESS) {
+			dentries[i]->attr->d_saved = snap_epoch;
+			dentries[i]->attr->d_counted = dentries[i]->attr->size;
+			aggr_account(dentries[i], 1);
+			d_log_create(dentries[i], modes[i]);
+		}
+	}
+	if (made > 0) {
+		pthread_rwlock_wrlock(&(fs_sb->dirty_list_rwlock));
+		for (i = 0; i < nr; i++) {
+			if (dentries[i] != NULL && status[i] == SUCCESS)
+				add_dentry_to_dirty_list(dentries[i]);
+		}
+		pthread_rwlock_unlock(&(fs_sb->dirty_list_rwlock));
+		evict_maybe();
+	}
 	pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
+	// names that did not go in hand their pool file back
+	if (made < nr) {
+		pthread_rwlock_wrlock(&(fs_sb->unused_list_rwlock));
+		for (i = 0; i < nr; i++) {
+			if (dentries[i] == NULL || status[i] == SUCCESS)
+				continue;
+			dentries[i]->d_count = 0;
+			add_dentry_to_unused_list(dentries[i]);
+			dentries[i] = NULL;
+		}
+		pthread_rwlock_unlock(&(fs_sb->unused_list_rwlock));
+	}
 #ifdef FS_DEBUG
-	if (ret == 1) {
-		printf("fs_create, put key = %s, its parent dentry inode = %d in the map!\n", create_key, (int)p_inode);
-	} else {
-		printf("fs_create, this key = %s, with parent inode = %d has already in the map\n", create_key, (int)p_inode);
+	printf("fs_create_many, %d of %d names made in parent dentry inode = %lu\n", made, nr, (unsigned long)p_dentry->inode);
+#endif
+	if (res != NULL)
+		memcpy(res, dentries, nr * sizeof(struct dentry *));
+	free(dentries);
+	return made;
+}
+
+int fs_mkdir_at(struct dentry *p_dentry, const char *name, mode_t mode, uint64_t ino, struct dentry **res)
+{
+	int ret = 0;
+	struct dentry *mkdir_dentry = NULL;
+	if (get_dentry_flag(p_dentry, D_type) != DIR_DENTRY)
+		return -ENOTDIR;
+	// a snapshot is taken by its name in .snap
+	if (get_dentry_flag(p_dentry, D_snapshot))
+		return snap_create(p_dentry, name, res);
+	if (strlen(name) >= DENTRY_NAME_SIZE)
+		return -ENAMETOOLONG;
+	if (snap_reserved(name))
+		return -EEXIST;
+	//mkdir_dentry = fetch_dentry_from_unused_list();
+	// for dir, should generate the new dentry
+	mkdir_dentry = d_alloc_dir();
+	if (mkdir_dentry == NULL)
+		return -ENOMEM;
+	// a standby takes the id its primary gave the directory
+	if (ino != 0)
+		ino_adopt(ino);
+	mkdir_dentry->fid = 0;
+	mkdir_dentry->inode = ino != 0 ? ino : ino_alloc();
+	mkdir_dentry->flags = 0;
+	set_dentry_flag(mkdir_dentry, D_type, DIR_DENTRY);
+	mkdir_dentry->attr->mode = S_IFDIR | 0755;
+	clock_gettime(CLOCK_REALTIME, &(mkdir_dentry->attr->ctime));
+	mkdir_dentry->attr->mtime = mkdir_dentry->attr->ctime;
+	mkdir_dentry->attr->atime = mkdir_dentry->attr->ctime;
+	mkdir_dentry->attr->size = 0;
+	mkdir_dentry->attr->uid = getuid();
+	mkdir_dentry->attr->gid = getgid();
+	mkdir_dentry->attr->nlink = 0;
+	mkdir_dentry->d_count = res != NULL ? 1 : 0;
+#ifdef FS_DEBUG
+	printf("fs_mkdir, create new dir dentry id = %lu, name = %s\n", (unsigned long)mkdir_dentry->inode, name);
+#endif
+	pthread_rwlock_wrlock(&(fs_sb->tree_rwlock));
+	// new, it has nothing to save for the snapshots there are
+	mkdir_dentry->attr->d_saved = snap_epoch;
+	if (d_dead(p_dentry) || d_ensure(p_dentry) != SUCCESS)
+		ret = -ENOENT;
+	else
+		ret = snap_touch(p_dentry);
+	if (ret == SUCCESS && d_insert(p_dentry, mkdir_dentry, name) == 0)
+		ret = -EEXIST;
+	if (ret == SUCCESS) {
+		aggr_account(mkdir_dentry, 1);
+		pthread_rwlock_wrlock(&(fs_sb->dirty_list_rwlock));
+		add_dentry_to_dirty_list(mkdir_dentry);
+		pthread_rwlock_unlock(&(fs_sb->dirty_list_rwlock));
+		d_log(REPL_MKDIR, mkdir_dentry, NULL, mode, 0, 0, mkdir_dentry->inode, 0, 0);
+		evict_maybe();
+	}
+	pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
+	if (ret != SUCCESS) {
+		d_free(mkdir_dentry);
+		return ret;
 	}
+#ifdef FS_DEBUG
+	printf("fs_mkdir, put name = %s, its parent dentry inode = %lu in the map!\n", name, (unsigned long)p_dentry->inode);
 #endif
+	if (res != NULL)
+		*res = mkdir_dentry;
+	return SUCCESS;
+}
+
+static int do_create(const char * path, mode_t mode, struct fuse_file_info * fileInfo, uint64_t pool_inode)
+{
+	int ret = 0;
+	struct fs_file *file = NULL;
+	int len = strlen(path);
+	int split_pos = 0;
+	int i;
+	for (i = len - 1; i >= 0; --i) {
+		if (path[i] == '/')
+			break;
+	}
+	split_pos = (i > 0) ? i : 1;
+	char cur_name[DENTRY_NAME_SIZE];
+	memset(cur_name, '\0', DENTRY_NAME_SIZE);
+	if (len - split_pos >= DENTRY_NAME_SIZE)
+		return -ENAMETOOLONG;
+	if (split_pos == 1)
+		memcpy(cur_name, &path[split_pos], len - split_pos);
+	else
+		memcpy(cur_name, &path[split_pos + 1], len - split_pos - 1);
 
-	ret = SUCCESS;
 	if (fileInfo != NULL)
-		fileInfo->fh = addr;
+		fileInfo->flags |= O_CREAT;
+#ifdef FS_DEBUG
+	printf("fs_create, will create path = %s, cur_name = %s\n", path, cur_name);
+#endif
+	struct dentry *create_dentry = NULL;
+	struct lookup_res lkup_res_buf;
+	struct lookup_res *lkup_res = NULL;
+	lkup_res = &lkup_res_buf;
+	ret = path_lookup(path, lkup_res);
+	if (ret == SUCCESS) {
+		ret = -EEXIST;
+		goto out;
+	}
+	if (lkup_res->error == MISS_DIR) {
+		ret = -ENOENT;
+		goto out;
+	}
+	ret = fs_create_at(lkup_res->dentry, cur_name, mode, pool_inode, &create_dentry);
+	if (ret != SUCCESS)
+		goto out;
+	// the handle keeps the new dentry's pin, fs_release drops it
+	if (fileInfo == NULL) {
+		d_put(create_dentry);
+		goto out;
+	}
+	file = file_open(create_dentry, fileInfo->flags);
+	if (file == NULL) {
+		d_put(create_dentry);
+		ret = -ENOMEM;
+		goto out;
+	}
+	fileInfo->fh = (uint64_t) file;
+	file_set_info(file, fileInfo);
 out:
-	free(lkup_res);
-	lkup_res = NULL;
+	lookup_put(lkup_res);
 	return ret;
 }
 
-int fs_mkdir(const char *path, mode_t mode)
+int fs_create(const char * path, mode_t mode, struct fuse_file_info * fileInfo)
 {
+	return do_create(path, mode, fileInfo, 0);
+}
+
+int fs_create_pooled(const char * path, mode_t mode, uint64_t pool_inode, const char *pool_file)
+{
+	int ret = 0;
+	pthread_rwlock_wrlock(&(fs_sb->unused_list_rwlock));
+	ret = adopt_pool_file(pool_file, pool_inode);
+	pthread_rwlock_unlock(&(fs_sb->unused_list_rwlock));
+	if (ret != SUCCESS)
+		return ret;
+	return do_create(path, mode, NULL, pool_inode);
+}
+
+static int do_mkdir(const char *path, mode_t mode, uint64_t ino)
+{
+	struct dentry *mkdir_dentry = NULL;
 	int i;
 	int ret = 0;
 	int len = strlen(path);
@@ -728,6 +1230,8 @@ int fs_mkdir(const char *path, mode_t mode)
 
 	char cur_name[DENTRY_NAME_SIZE];
 	memset(cur_name, '\0', DENTRY_NAME_SIZE);
+	if (len - split_pos >= DENTRY_NAME_SIZE)
+		return -ENAMETOOLONG;
 	if (split_pos == 1)
 		memcpy(cur_name, &path[split_pos], len - split_pos);
 	else
@@ -736,9 +1240,9 @@ int fs_mkdir(const char *path, mode_t mode)
 #ifdef FS_DEBUG
 	printf("fs_mkdir, will mkdir path = %s, cur_name = %s\n", path, cur_name);
 #endif
-	struct dentry *dentry = NULL;
+	struct lookup_res lkup_res_buf;
 	struct lookup_res *lkup_res = NULL;
-	lkup_res = (struct lookup_res *)malloc(sizeof(struct lookup_res));
+	lkup_res = &lkup_res_buf;
 	ret = path_lookup(path, lkup_res);
 	if (ret == SUCCESS) {
 		ret = -EEXIST;
@@ -748,66 +1252,31 @@ int fs_mkdir(const char *path, mode_t mode)
 		ret = -ENOENT;
 		goto out;
 	}
-	dentry = lkup_res->dentry;
-	if (get_dentry_flag(dentry, D_type) != DIR_DENTRY) {
-		ret = -ENOTDIR;
-		goto out;
-	}
-
-	uint32_t p_inode = dentry->inode;
-	struct dentry *mkdir_dentry = NULL;
-	//mkdir_dentry = fetch_dentry_from_unused_list();
-	// for dir, should generate the new dentry
-	mkdir_dentry = (struct dentry *) calloc(1, sizeof(struct dentry));
-	mkdir_dentry->fid = 0;
-	mkdir_dentry->inode = generate_unique_id();
-	mkdir_dentry->flags = 0;
-	set_dentry_flag(mkdir_dentry, D_type, DIR_DENTRY);
-	mkdir_dentry->mode = S_IFDIR | 0755;
-	mkdir_dentry->ctime = time(NULL);
-	mkdir_dentry->mtime = time(NULL);
-	mkdir_dentry->atime = time(NULL);
-	mkdir_dentry->size = 0;
-	mkdir_dentry->uid = getuid();
-	mkdir_dentry->gid = getgid();
-	mkdir_dentry->nlink = 0;
-#ifdef FS_DEBUG
-	printf("fs_mkdir, create new dir dentry id = %d, name = %s\n", (int)mkdir_dentry->inode, cur_name);
-#endif
-	pthread_rwlock_wrlock(&(fs_sb->dirty_list_rwlock));
-	add_dentry_to_dirty_list(mkdir_dentry);	
-	pthread_rwlock_unlock(&(fs_sb->dirty_list_rwlock));
-	// init the new dentry...
-	char mkdir_key[MAP_KEY_LEN];
-	memset(mkdir_key, '\0', MAP_KEY_LEN);
-	sprintf(mkdir_key, "%d", (int)p_inode);
-	strcat(mkdir_key, MAP_KEY_DELIMIT);
-	strcat(mkdir_key, cur_name);
-	uint64_t addr = (uint64_t) mkdir_dentry;
-	pthread_rwlock_wrlock(&(fs_sb->tree_rwlock));
-	ret = put(&(fs_sb->tree), mkdir_key, addr);
-	pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
-#ifdef FS_DEBUG
-	if (ret == 1) {
-		printf("fs_mkdir, put key = %s, its parent dentry inode = %d in the map!\n", mkdir_key, (int)p_inode);
-	} else {
-		printf("fs_mkdir, this key = %s, with parent inode = %d has already in the map\n", mkdir_key, (int)p_inode);
-	}
-#endif
-
-	ret = SUCCESS;
+	ret = fs_mkdir_at(lkup_res->dentry, cur_name, mode, ino, &mkdir_dentry);
+	if (ret == SUCCESS)
+		d_put(mkdir_dentry);
 out:
-	free(lkup_res);
-	lkup_res = NULL;
+	lookup_put(lkup_res);
 	return ret;	
 }
 
+int fs_mkdir(const char *path, mode_t mode)
+{
+	return do_mkdir(path, mode, 0);
+}
+
+int fs_mkdir_ino(const char *path, mode_t mode, uint64_t ino)
+{
+	return do_mkdir(path, mode, ino);
+}
+
 int fs_opendir(const char *path, struct fuse_file_info *fileInfo)
 {
 	int ret = 0;
 	struct dentry *dentry = NULL;
+	struct lookup_res lkup_res_buf;
 	struct lookup_res *lkup_res = NULL;
-	lkup_res = (struct lookup_res *)malloc(sizeof(struct lookup_res));
+	lkup_res = &lkup_res_buf;
 	ret = path_lookup(path, lkup_res);
 	if (ret == ERROR) {
 		ret = -ENOENT;
@@ -818,85 +1287,142 @@ int fs_opendir(const char *path, struct fuse_file_info *fileInfo)
 			ret = -ENOTDIR;
 			goto out;
 		}
+		// the handle keeps the lookup's pin, fs_releasedir drops it
 		fileInfo->fh = (uint64_t) dentry;
+		lkup_res->dentry = NULL;
 	#ifdef FS_DEBUG
 		printf("fs_opendir, open path = %s, dentry addr = %ld\n", path, fileInfo->fh);
 	#endif
 	}
 out:
-	free(lkup_res);
-	lkup_res = NULL;
+	lookup_put(lkup_res);
 	return ret;
 }
 
+/*
+ * One buffer of entries from offset on, with the d_cookie() of each as
+ * its offset, so libfuse comes back for the rest and the tree_rwlock hold
+ * is bounded by a buffer however large the directory.
+ */
 int fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fileInfo)
 {
-	int i = 0;
-	int j = 0;
 	uint64_t addr = fileInfo->fh;
 	struct dentry *p_dentry = NULL;
+	struct dentry *dentry = NULL;
+	struct dentry *prev = NULL;
+	struct stat st;
+	uint32_t dup = 0;
 	p_dentry = (struct dentry *) addr;
 	if (p_dentry == NULL)
 		return ERROR;
+	// a listing reads the directory once, not once per page
+	if (offset == 0)
+		d_accessed(p_dentry);
 
-	if (filler(buf, ".", NULL, 0) < 0) {
-		printf("filler . error in func = %s\n", __FUNCTION__);
-		return ERROR;
-	}
-	if (filler(buf, "..", NULL, 0) < 0) {
-		printf("filler . error in func = %s\n", __FUNCTION__);
-		return ERROR;
-	}
-
-	char matched_name[DENTRY_NAME_SIZE];
-	char pre_key[MAP_PRE_KEY_LEN];
-	memset(matched_name, '\0', DENTRY_NAME_SIZE);
-	memset(pre_key, '\0', MAP_PRE_KEY_LEN);
-	sprintf(pre_key, "%d", (int)p_dentry->inode);
-	strcat(pre_key, MAP_KEY_DELIMIT);
-	int len = charlen(pre_key);
-	//pre_key[len] = '\0';
+	if (offset < 1 && filler(buf, ".", NULL, 1) != 0)
+		return SUCCESS;
+	if (offset < 2 && filler(buf, "..", NULL, 2) != 0)
+		return SUCCESS;
 
 #ifdef FS_DEBUG
-	printf("fs_readdir, readdir path = %s, pre_key = %s\n", path, pre_key);
+	printf("fs_readdir, readdir path = %s, inode = %lu, offset = %ld\n", path, (unsigned long)p_dentry->inode, (long)offset);
 #endif
 
-	map_t *node;
-	char *key = NULL;
-	bool match = true;
 	pthread_rwlock_rdlock(&(fs_sb->tree_rwlock));
-	for (node = map_first(&(fs_sb->tree)); node; node = map_next(&(node->node))) {
-		key = node->key;
-		for (i = 0; i < len; i++) {
-			if (pre_key[i] != key[i]) {
-				match = false;
-				break;
-			}
-		}
-		if (match) {
-			for (i = len, j = 0; i < strlen(key); i++, j++) {
-				matched_name[j] = key[i];
-			}
-			matched_name[j] = '\0';
-			if (filler(buf, matched_name, NULL, 0) < 0) {
-				printf("filler %s error in func = %s\n", matched_name, __FUNCTION__);
-				pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
-				return ERROR;
-			}
-		} else {
-			match = true;
-		}
+	d_reference(p_dentry);
+	if (d_ensure(p_dentry) != SUCCESS) {
+		pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
+		return -EIO;
+	}
+	// attributes go along, the way readdirplus hands them over
+	memset(&st, 0, sizeof(st));
+	for (dentry = d_seek_cookie(p_dentry, offset, &dup); dentry; dentry = d_next_child(dentry)) {
+		if (prev != NULL)
+			dup = dentry->hash == prev->hash ? dup + 1 : 0;
+		prev = dentry;
+		d_stat(dentry, &st);
+		// full, the rest goes in the next call
+		if (filler(buf, d_name(dentry), &st, d_cookie(dentry, dup)) != 0)
+			break;
 	}
 	pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
 	return SUCCESS;
 }
 
+// inside d_attr_read_begin() and d_attr_read_retry(), a torn copy is made again
+__attribute__((no_sanitize_thread))
+static void d_copy_stat(struct dentry *dentry, struct stat *st)
+{
+	if (dentry == fs_sb->root) {
+		st->st_mode = S_IFDIR | 0755;
+	} else {
+		st->st_mode = dentry->attr->mode;
+	}
+	// copy some parements from dentry to st
+	st->st_ino = dentry->inode;
+	st->st_nlink = dentry->attr->nlink;
+	st->st_size = dentry->attr->size;
+	st->st_ctim = dentry->attr->ctime;
+
+	st->st_uid = dentry->attr->uid;
+	st->st_gid = dentry->attr->gid;
+	st->st_atim = dentry->attr->atime;
+	st->st_mtim = dentry->attr->mtime;
+}
+
+void d_stat(struct dentry *dentry, struct stat *st)
+{
+	uint32_t seq = 0;
+	do {
+		seq = d_attr_read_begin(dentry);
+		d_copy_stat(dentry, st);
+	} while (d_attr_read_retry(dentry, seq));
+}
+
+static inline int ts_after(const struct timespec *a, const struct timespec *b)
+{
+	return a->tv_sec > b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec > b->tv_nsec);
+}
+
+__attribute__((no_sanitize_thread))
+int d_atime_due(struct dentry *dentry)
+{
+	struct timespec now;
+	int policy = fs_atime;
+	int due = 0;
+	uint32_t seq = 0;
+	if (policy == ATIME_NOATIME || get_dentry_flag(dentry, D_snapshot))
+		return 0;
+	if (policy == ATIME_STRICT)
+		return 1;
+	// a day is coarse, the coarse clock does
+	clock_gettime(CLOCK_REALTIME_COARSE, &now);
+	do {
+		seq = d_attr_read_begin(dentry);
+		due = !ts_after(&(dentry->attr->atime), &(dentry->attr->mtime))
+			|| !ts_after(&(dentry->attr->atime), &(dentry->attr->ctime))
+			|| now.tv_sec - dentry->attr->atime.tv_sec >= ATIME_RELATIME_SEC;
+	} while (d_attr_read_retry(dentry, seq));
+	return due;
+}
+
+void d_accessed(struct dentry *dentry)
+{
+	if (!d_atime_due(dentry))
+		return;
+	d_attr_lock(dentry);
+	clock_gettime(CLOCK_REALTIME, &(dentry->attr->atime));
+	d_attr_unlock(dentry);
+	__atomic_add_fetch(&atime_updates, 1, __ATOMIC_RELAXED);
+}
+
 int fs_getattr(const char* path, struct stat* st)
 {
 	int ret = 0;
 	struct dentry *dentry = NULL;
+	struct lookup_res lkup_res_buf;
 	struct lookup_res *lkup_res = NULL;
-	lkup_res = (struct lookup_res *)malloc(sizeof(struct lookup_res));
+	lkup_res = &lkup_res_buf;
 	ret = path_lookup(path, lkup_res);
 	if (ret == ERROR) {
 		ret = -ENOENT;
@@ -904,29 +1430,71 @@ int fs_getattr(const char* path, struct stat* st)
 	}
 	dentry = lkup_res->dentry;
 #ifdef FS_DEBUG
-	printf("fs_getattr, getattr path = %s, its inode = %d\n", path, (int)dentry->inode);
+	printf("fs_getattr, getattr path = %s, its inode = %lu\n", path, (unsigned long)dentry->inode);
 #endif
-	if (strcmp(path, "/") == 0) {
-		st->st_mode = S_IFDIR | 0755;
-	} else {
-		st->st_mode = dentry->mode;
-	}
-	// copy some parements from dentry to st
-	st->st_nlink = dentry->nlink;
-	st->st_size = dentry->size;
-	st->st_ctime = dentry->ctime;
-
-	st->st_uid = dentry->uid;
-	st->st_gid = dentry->gid;
-	st->st_atime = dentry->atime;
-	st->st_mtime = dentry->mtime;
-	dentry->atime = time(NULL);
+	d_stat(dentry, st);
 out:
-	free(lkup_res);
-	lkup_res = NULL;
+	lookup_put(lkup_res);
 	return ret;
 }
 
+int fs_rmdir_at(struct dentry *p_dentry, const char *name)
+{
+	struct dentry *rm_dentry = NULL;
+	int ret = 0;
+	int release = 0;
+	if (get_dentry_flag(p_dentry, D_type) != DIR_DENTRY)
+		return -ENOTDIR;
+	if (get_dentry_flag(p_dentry, D_snapshot))
+		return snap_remove(p_dentry, name);
+	// the child is looked up and unlinked in one go, nobody slips in between
+	pthread_rwlock_wrlock(&(fs_sb->tree_rwlock));
+	if (!d_dead(p_dentry) && d_ensure(p_dentry) == SUCCESS)
+		rm_dentry = d_lookup(p_dentry, name);
+	if (rm_dentry == NULL) {
+		ret = -ENOENT;
+		pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
+		return ret;
+	}
+	if (get_dentry_flag(rm_dentry, D_type) != DIR_DENTRY) {
+		ret = -ENOTDIR;
+		pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
+		return ret;
+	}
+
+#ifdef FS_DEBUG
+	printf("fs_rmdir, check dir = %s whether have child, inode = %lu\n", name, (unsigned long)rm_dentry->inode);
+#endif
+	// if you do not check the child, you can rm all the subtree
+	// an evicted directory always had children, its snapshots are in .snap
+	if (!RB_EMPTY_ROOT(&(rm_dentry->d_children)) || get_dentry_flag(rm_dentry, D_evicted) || snap_busy(rm_dentry)) {
+		ret = -ENOTEMPTY;
+		pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
+		return ret;
+	}
+	ret = snap_touch(p_dentry);
+	if (ret != SUCCESS) {
+		pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
+		return ret;
+	}
+#ifdef FS_DEBUG
+	printf("fs_rmdir, will del node and free dir dentry, name = %s\n", name);
+#endif
+	d_log(REPL_RMDIR, rm_dentry, NULL, 0, 0, 0, 0, 0, 0);
+	aggr_account(rm_dentry, -1);
+	d_remove(rm_dentry);
+	pthread_rwlock_wrlock(&(fs_sb->dirty_list_rwlock));
+	remove_dentry_from_dirty_list(rm_dentry);
+	pthread_rwlock_unlock(&(fs_sb->dirty_list_rwlock));
+	snap_drop(rm_dentry);
+	// an open handle keeps it until fs_releasedir
+	release = d_kill(rm_dentry);
+	pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
+	if (release)
+		d_release(rm_dentry);
+	return SUCCESS;
+}
+
 int fs_rmdir(const char *path)
 {
 	int ret = 0;
@@ -938,9 +1506,11 @@ int fs_rmdir(const char *path)
 			break;
 	}
 	split_pos = (i > 0) ? i : 1;
-	char *p_path = (char *)calloc(1, split_pos + 1);
+	char p_path[PATH_MAX];
 	if (i < 0)
 		return -ENOENT;
+	if (split_pos >= PATH_MAX)
+		return -ENAMETOOLONG;
 	int j;
 	for (j = 0; j < split_pos; ++j) {
 		p_path[j] = path[j];
@@ -954,8 +1524,9 @@ int fs_rmdir(const char *path)
 		memcpy(cur_name, &path[split_pos + 1], len - split_pos - 1);
 
 	struct dentry *dentry = NULL;
+	struct lookup_res lkup_res_buf;
 	struct lookup_res *lkup_res = NULL;
-	lkup_res = (struct lookup_res *)malloc(sizeof(struct lookup_res));
+	lkup_res = &lkup_res_buf;
 	ret = path_lookup(p_path, lkup_res);
 	if (ret == ERROR) {
 		ret = -ENOENT;
@@ -967,80 +1538,264 @@ int fs_rmdir(const char *path)
 		goto out;
 	}
 
-	char rm_key[MAP_KEY_LEN];
-	memset(rm_key, '\0', MAP_KEY_LEN);
-	sprintf(rm_key, "%d", (int)dentry->inode);    // parent inode (by generate_unique_id)
-	strcat(rm_key, MAP_KEY_DELIMIT);
-	strcat(rm_key, cur_name);
-	map_t *rm_node;
-	pthread_rwlock_rdlock(&(fs_sb->tree_rwlock));
-	rm_node = get(&(fs_sb->tree), rm_key);
-	pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
-	if (rm_node == NULL) {
+	ret = fs_rmdir_at(dentry, cur_name);
+out:
+	lookup_put(lkup_res);
+	return ret;
+}
+
+/*
+ * Detaches the directory name under p_dentry with everything below it in
+ * one tree_rwlock section, the way fs_rmdir_at() takes out an empty one.
+ * The subtree goes to the reclaim thread, which frees it with d_reclaim().
+ */
+int fs_rmtree_at(struct dentry *p_dentry, const char *name)
+{
+	struct dentry *rm_dentry = NULL;
+	int ret = 0;
+	if (get_dentry_flag(p_dentry, D_type) != DIR_DENTRY)
+		return -ENOTDIR;
+	if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+		return -EINVAL;
+	if (get_dentry_flag(p_dentry, D_snapshot))
+		return snap_remove(p_dentry, name);
+	pthread_rwlock_wrlock(&(fs_sb->tree_rwlock));
+	if (!d_dead(p_dentry) && d_ensure(p_dentry) == SUCCESS)
+		rm_dentry = d_lookup(p_dentry, name);
+	if (rm_dentry == NULL)
 		ret = -ENOENT;
-		goto out;
-	}
-	dentry = (struct dentry *) rm_node->val;
-	if (get_dentry_flag(dentry, D_type) != DIR_DENTRY) {
+	else if (get_dentry_flag(rm_dentry, D_type) != DIR_DENTRY)
 		ret = -ENOTDIR;
-		goto out;
+	else
+		ret = snap_touch(p_dentry);
+	if (ret != SUCCESS) {
+		pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
+		return ret;
 	}
-	
-	char pre_key[MAP_PRE_KEY_LEN];
-	memset(pre_key, '\0', MAP_PRE_KEY_LEN);
-	sprintf(pre_key, "%d", (int)dentry->inode);
-	strcat(pre_key, MAP_KEY_DELIMIT);
-	len = charlen(pre_key);
-
 #ifdef FS_DEBUG
-	printf("fs_rmdir, check dir = %s whether have child, pre key = %s\n", cur_name, pre_key);
+	printf("fs_rmtree, detach dir = %s, inode = %lu\n", name, (unsigned long)rm_dentry->inode);
 #endif
-	map_t *node;
-	char *key = NULL;
-	bool match = true;
-	pthread_rwlock_rdlock(&(fs_sb->tree_rwlock));
-	// if you do not check the child, you can rm all the subtree
-	for (node = map_first(&(fs_sb->tree)); node; node = map_next(&(node->node))) {
-		key = node->key;
-		for (i = 0; i < len; i++) {
-			if (pre_key[i] != key[i]) {
-				match = false;
+	d_log(REPL_RMTREE, rm_dentry, NULL, 0, 0, 0, 0, 0, 0);
+	// the totals go at once, the dentries in the background
+	aggr_account(rm_dentry, -1);
+	d_remove(rm_dentry);
+	pthread_rwlock_wrlock(&(fs_sb->dirty_list_rwlock));
+	remove_dentry_from_dirty_list(rm_dentry);
+	pthread_rwlock_unlock(&(fs_sb->dirty_list_rwlock));
+	snap_drop(rm_dentry);
+	// the job's pin, the root outlives its children whatever handles do
+	d_get(rm_dentry);
+	d_kill(rm_dentry);
+	d_get(p_dentry);
+	pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
+	snap_reap();
+	return reclaim_queue(rm_dentry, p_dentry, name);
+}
+
+/*
+ * Frees up to budget dentries of a subtree fs_rmtree_at() detached,
+ * deepest first, in one tree_rwlock section. The walk starts over from
+ * root every time, so it also finds what handles into the subtree made
+ * meanwhile. Returns how many went, 0 once only root is left.
+ */
+int d_reclaim(struct dentry *root, int budget)
+{
+	struct dentry *dead[RECLAIM_BATCH];
+	struct dentry *dir = root;
+	struct dentry *child = NULL;
+	struct dentry *victim = NULL;
+	char key[MAP_KEY_LEN];
+	map_t *node = NULL;
+	int ret = SUCCESS;
+	int nr = 0;
+	int i;
+	if (budget > RECLAIM_BATCH)
+		budget = RECLAIM_BATCH;
+	pthread_rwlock_wrlock(&(fs_sb->tree_rwlock));
+	while (nr < budget) {
+		// an evicted directory comes back to have its pooled files recycled
+		ret = d_ensure(dir);
+		if (ret != SUCCESS)
+			break;
+		child = d_first_child(dir);
+		if (child == NULL) {
+			if (dir == root)
+				break;
+			victim = dir;
+			dir = dir->attr->parent;
+		} else if (get_dentry_flag(child, D_type) == DIR_DENTRY
+				&& (!RB_EMPTY_ROOT(&(child->d_children)) || get_dentry_flag(child, D_evicted))) {
+			dir = child;
+			continue;
+		} else {
+			victim = child;
+		}
+		// snapshots that see the subtree keep it, the first removal in dir saves its children
+		if (!get_dentry_flag(dir, D_snapshot)) {
+			ret = snap_touch(dir);
+			if (ret != SUCCESS)
 				break;
+		}
+		if (get_dentry_flag(victim, D_type) == DIR_DENTRY)
+			snap_drop(victim);
+		if (S_ISLNK(victim->attr->mode)) {
+			link_key(key, dir, d_name(victim));
+			pthread_rwlock_wrlock(&(fs_sb->link_tree_rwlock));
+			node = get(&(fs_sb->link_tree), key);
+			if (node != NULL) {
+				free((char *) node->val);
+				del(&(fs_sb->link_tree), node);
 			}
+			pthread_rwlock_unlock(&(fs_sb->link_tree_rwlock));
 		}
-		if (match) {
-		#ifdef FS_DEBUG
-			printf("fs_rmdir, find sub dir with key = %s\n", key);
-		#endif
-			ret = -ENOTEMPTY;
-			pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
-			goto out;
+		d_remove(victim);
+		dead[nr++] = victim;
+	}
+	pthread_rwlock_wrlock(&(fs_sb->dirty_list_rwlock));
+	for (i = 0; i < nr; i++)
+		remove_dentry_from_dirty_list(dead[i]);
+	pthread_rwlock_unlock(&(fs_sb->dirty_list_rwlock));
+	// pinned ones go with their last d_put(), as after an unlink
+	for (i = 0; i < nr; i++) {
+		if (!d_kill(dead[i]))
+			dead[i] = NULL;
+	}
+	pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
+	for (i = 0; i < nr; i++) {
+		if (dead[i] != NULL)
+			d_release(dead[i]);
+	}
+	snap_reap();
+	if (ret != SUCCESS)
+		return ret;
+	return nr;
+}
+
+int fs_rmtree(const char *path)
+{
+	char p_path[PATH_MAX];
+	const char *name = strrchr(path, '/');
+	struct lookup_res lkup_res;
+	int ret = 0;
+	if (name == NULL || name[1] == '\0')
+		return -EINVAL;
+	if (name - path >= PATH_MAX)
+		return -ENAMETOOLONG;
+	memcpy(p_path, path, name - path);
+	p_path[name - path > 0 ? name - path : 1] = '\0';
+	if (name == path)
+		p_path[0] = '/';
+	ret = path_lookup(p_path, &lkup_res);
+	if (ret == ERROR)
+		return -ENOENT;
+	ret = fs_rmtree_at(lkup_res.dentry, name + 1);
+	lookup_put(&lkup_res);
+	return ret;
+}
+
+// "<parent inode>#<name>", the link tree key of a symlink
+void link_key(char *key, struct dentry *p_dentry, const char *name)
+{
+	memset(key, '\0', MAP_KEY_LEN);
+	sprintf(key, "%lu", (unsigned long)p_dentry->inode);
+	strcat(key, MAP_KEY_DELIMIT);
+	strncat(key, name, MAP_KEY_LEN - strlen(key) - 1);
+}
+
+// tree_rwlock held for write. Relink dentry as new_name under new_parent,
+// it stays put if the new name is taken.
+static int __d_move(struct dentry *dentry, struct dentry *new_parent, const char *new_name)
+{
+	int ret = 0;
+	struct dentry *p = NULL;
+	char old_key[MAP_KEY_LEN];
+	char new_key[MAP_KEY_LEN];
+	char old_path[PATH_MAX];
+	char new_path[PATH_MAX];
+	map_t *node = NULL;
+	uint64_t val = 0;
+	int logged = 0;
+	// either end may have been removed since the lookups
+	if (d_dead(dentry) || d_dead(new_parent) || dentry == fs_sb->root)
+		return -ENOENT;
+	if (get_dentry_flag(dentry, D_snapshot))
+		return -EROFS;
+	if (snap_reserved(new_name))
+		return -EEXIST;
+	// a directory can not move below itself, nor anything into a removed subtree
+	for (p = new_parent; p != fs_sb->root; p = p->attr->parent) {
+		if (p == dentry)
+			return -EINVAL;
+		if (d_dead(p))
+			return -ENOENT;
+	}
+	if (d_ensure(new_parent) != SUCCESS || d_lookup(new_parent, new_name) != NULL)
+		return -EEXIST;
+	// both directories' snapshots keep the name where it was
+	ret = snap_touch(dentry->attr->parent);
+	if (ret == SUCCESS)
+		ret = snap_touch(new_parent);
+	if (ret != SUCCESS)
+		return ret;
+	if (S_ISLNK(dentry->attr->mode))
+		link_key(old_key, dentry->attr->parent, d_name(dentry));
+	if (replica_active())
+		logged = __d_path(dentry, old_path, PATH_MAX) == SUCCESS;
+	// the subtree's totals move with it
+	aggr_account(dentry, -1);
+	d_remove(dentry);
+	ret = d_insert(new_parent, dentry, new_name);
+	if (ret == 1)
+		aggr_account(dentry, 1);
+	// the target string follows the link to its new key
+	if (ret == 1 && S_ISLNK(dentry->attr->mode)) {
+		link_key(new_key, new_parent, new_name);
+		pthread_rwlock_wrlock(&(fs_sb->link_tree_rwlock));
+		node = get(&(fs_sb->link_tree), old_key);
+		if (node != NULL) {
+			val = node->val;
+			del(&(fs_sb->link_tree), node);
+			put(&(fs_sb->link_tree), new_key, val);
 		}
-		match = true;
+		pthread_rwlock_unlock(&(fs_sb->link_tree_rwlock));
 	}
+	if (ret == 1 && logged && __d_path(dentry, new_path, PATH_MAX) == SUCCESS)
+		replica_log(REPL_RENAME, old_path, new_path, 0, 0, 0, 0, 0, 0);
+	return ret == 1 ? 0 : -EEXIST;
+}
+
+static int d_move(struct dentry *dentry, struct dentry *new_parent, const char *new_name)
+{
+	int ret = 0;
+	pthread_rwlock_wrlock(&(fs_sb->tree_rwlock));
+	ret = __d_move(dentry, new_parent, new_name);
 	pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
+	return ret;
+}
 
-#ifdef FS_DEBUG
-	printf("fs_rmdir, will del node and free dir dentry, key = %s\n", rm_key);
-#endif
+int fs_rename_at(struct dentry *p_dentry, const char *name, struct dentry *new_parent, const char *new_name)
+{
+	int ret = 0;
+	struct dentry *dentry = NULL;
+	if (strlen(new_name) >= DENTRY_NAME_SIZE)
+		return -ENAMETOOLONG;
+	if (get_dentry_flag(new_parent, D_type) != DIR_DENTRY)
+		return -ENOTDIR;
 	pthread_rwlock_wrlock(&(fs_sb->tree_rwlock));
-	del(&(fs_sb->tree), rm_node);
+	if (!d_dead(p_dentry) && d_ensure(p_dentry) == SUCCESS)
+		dentry = d_lookup(p_dentry, name);
+	if (dentry == NULL)
+		ret = -ENOENT;
+	else if (dentry->attr->parent == new_parent && strcmp(name, new_name) == 0)
+		ret = SUCCESS;
+	else
+		ret = __d_move(dentry, new_parent, new_name);
 	pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
-	pthread_rwlock_wrlock(&(fs_sb->dirty_list_rwlock));
-	remove_dentry_from_dirty_list(dentry);
-	pthread_rwlock_unlock(&(fs_sb->dirty_list_rwlock));
-	free(dentry);
-	dentry = NULL;
-	ret = SUCCESS;
-out:
-	free(lkup_res);
-	lkup_res = NULL;
 	return ret;
 }
 
 int movename(struct lookup_res *lkup_res, struct lookup_res *new_lkup_res, const char *path, const char *newpath)
 {
-	int p_inode = lkup_res->p_inode;
 	char cur_name[DENTRY_NAME_SIZE];
 	char new_cur_name[DENTRY_NAME_SIZE];
 	memset(cur_name, '\0', DENTRY_NAME_SIZE);
@@ -1064,41 +1819,13 @@ int movename(struct lookup_res *lkup_res, struct lookup_res *new_lkup_res, const
 		memcpy(new_cur_name, &newpath[1], new_len);
 	else
 		memcpy(new_cur_name, &newpath[j + 1], new_len - j - 1);
-	char old_key[MAP_KEY_LEN];
-	char new_key[MAP_KEY_LEN];
-	memset(old_key, '\0', MAP_KEY_LEN);
-	memset(new_key, '\0', MAP_KEY_LEN);
-	sprintf(old_key, "%d", p_inode);
-	strcat(old_key, MAP_KEY_DELIMIT);
-	strcat(old_key, cur_name);
-
 	struct dentry *dentry = lkup_res->dentry;
 	struct dentry *pdentry = new_lkup_res->dentry;
-	p_inode = pdentry->inode;
-	sprintf(new_key, "%d", p_inode);
-	strcat(new_key, MAP_KEY_DELIMIT);
-	strcat(new_key, cur_name);
-
-	map_t *rm_node;
-	pthread_rwlock_rdlock(&(fs_sb->tree_rwlock));
-	rm_node = get(&(fs_sb->tree), old_key);
-	pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
-	if (rm_node == NULL) {
-		return -1;
-	}
-    pthread_rwlock_wrlock(&(fs_sb->tree_rwlock));
-	del(&(fs_sb->tree), rm_node);
-	pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
-	uint64_t addr = (uint64_t) dentry;
-	pthread_rwlock_wrlock(&(fs_sb->tree_rwlock));
-	put(&(fs_sb->tree), new_key, addr);
-	pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
-	return 0;
+	return d_move(dentry, pdentry, cur_name);
 }
 
 int chgname(struct lookup_res *lkup_res, struct lookup_res *new_lkup_res, const char *path, const char *newpath)
 {
-	int p_inode = lkup_res->p_inode;
 	int i, j;
 	char cur_name[DENTRY_NAME_SIZE];
 	char new_cur_name[DENTRY_NAME_SIZE];
@@ -1122,41 +1849,13 @@ int chgname(struct lookup_res *lkup_res, struct lookup_res *new_lkup_res, const
 		memcpy(new_cur_name, &newpath[1], new_len);
 	else
 		memcpy(new_cur_name, &newpath[j + 1], new_len - j - 1);
-	char old_key[MAP_KEY_LEN];
-	char new_key[MAP_KEY_LEN];
-	memset(old_key, '\0', MAP_KEY_LEN);
-	memset(new_key, '\0', MAP_KEY_LEN);
-	sprintf(old_key, "%d", p_inode);
-	strcat(old_key, MAP_KEY_DELIMIT);
-	strcat(old_key, cur_name);
-
 	struct dentry *dentry = lkup_res->dentry;
 	struct dentry *pdentry = new_lkup_res->dentry;
-	p_inode = pdentry->inode;
-	sprintf(new_key, "%d", p_inode);
-	strcat(new_key, MAP_KEY_DELIMIT);
-	strcat(new_key, new_cur_name);
-
-	map_t *rm_node;
-	pthread_rwlock_rdlock(&(fs_sb->tree_rwlock));
-	rm_node = get(&(fs_sb->tree), old_key);
-	pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
-	if (rm_node == NULL) {
-		return -1;
-	}
-    pthread_rwlock_wrlock(&(fs_sb->tree_rwlock));
-	del(&(fs_sb->tree), rm_node);
-	pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
-	uint64_t addr = (uint64_t) dentry;
-	pthread_rwlock_wrlock(&(fs_sb->tree_rwlock));
-	put(&(fs_sb->tree), new_key, addr);
-	pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
-	return 0;
+	return d_move(dentry, pdentry, new_cur_name);
 }
 
 int changename(struct lookup_res *lkup_res, const char *path, const char *newpath)
 {
-	int p_inode = lkup_res->p_inode;
 	int i, j;
 	char cur_name[DENTRY_NAME_SIZE];
 	char new_cur_name[DENTRY_NAME_SIZE];
@@ -1181,32 +1880,10 @@ int changename(struct lookup_res *lkup_res, const char *path, const char *newpat
 	else
 		memcpy(new_cur_name, &newpath[j + 1], new_len - j - 1);
 
-	char old_key[MAP_KEY_LEN];
-	char new_key[MAP_KEY_LEN];
-	memset(old_key, '\0', MAP_KEY_LEN);
-	memset(new_key, '\0', MAP_KEY_LEN);
-	sprintf(old_key, "%d", p_inode);
-	strcat(old_key, MAP_KEY_DELIMIT);
-	strcat(old_key, cur_name);
-	sprintf(new_key, "%d", p_inode);
-	strcat(new_key, MAP_KEY_DELIMIT);
-	strcat(new_key, new_cur_name);
-	uint64_t addr = (uint64_t) lkup_res->dentry;
-
 #ifdef FS_DEBUG
-	printf("changename, old_key = %s, new_key = %s\n", old_key, new_key);
+	printf("changename, old name = %s, new name = %s\n", cur_name, new_cur_name);
 #endif
-	map_t *rm_node;
-	pthread_rwlock_rdlock(&(fs_sb->tree_rwlock));
-	rm_node = get(&(fs_sb->tree), old_key);
-	pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
-	if (rm_node == NULL)
-		return -1;
-	pthread_rwlock_wrlock(&(fs_sb->tree_rwlock));
-	del(&(fs_sb->tree), rm_node);
-	put(&(fs_sb->tree), new_key, addr);
-	pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
-	return 0;
+	return d_move(lkup_res->dentry, lkup_res->p_dentry, new_cur_name);
 }
 
 // mv /a/a /b  ==> rename /a/a /b/a
@@ -1215,13 +1892,16 @@ int fs_rename(const char *path, const char *newpath)
 	int i, j, ret = 0;
 	int len_path = strlen(path);
 	int len_newpath = strlen(newpath);
+	struct lookup_res lkup_res_buf;
 	struct lookup_res *lkup_res = NULL;
+	struct lookup_res new_lkup_res_buf;
 	struct lookup_res *new_lkup_res = NULL;
 	bool ismove = false;
 	if (strcmp(path, newpath) == 0)
 		return 0;
-	lkup_res = (struct lookup_res *)malloc(sizeof(struct lookup_res));
-	new_lkup_res = (struct lookup_res *)malloc(sizeof(struct lookup_res));
+	lkup_res = &lkup_res_buf;
+	new_lkup_res = &new_lkup_res_buf;
+	new_lkup_res->dentry = NULL;
 	ret = path_lookup(path, lkup_res);
 	if (ret == ERROR) {
 		ret = -ENOENT;
@@ -1284,25 +1964,32 @@ int fs_rename(const char *path, const char *newpath)
 		ret = changename(lkup_res, path, newpath);
 	*/
 out:
-	free(lkup_res);
-	free(new_lkup_res);
-	lkup_res = NULL;
-	new_lkup_res = NULL;
+	lookup_put(lkup_res);
+	lookup_put(new_lkup_res);
 	return ret;
 }
 
 int fs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fileInfo)
 {
 	int ret = 0;
-	uint64_t addr = fileInfo->fh;
-	struct dentry *dentry = NULL;
-	dentry = (struct dentry *) addr;
-	int fd = (int)dentry->fid;
+	struct fs_file *file = (struct fs_file *) fileInfo->fh;
+	struct dentry *dentry = file->dentry;
+	int fd = 0;
 
-	if (unlikely(fd < 0)) {
-		return -EBADF;
+	file_accessed(file);
+	if (file->dfd < 0)
+		file_read_ahead(file, offset, size);
+	else
+		file_sync(dentry, file, offset, size);
+	fd = promote_io_begin(dentry);
+	if (file->dfd >= 0) {
+		ret = file_read_direct(file, fd, buf, size, offset);
+	} else {
+		ret = pcache_read(dentry, fd, buf, size, offset);
+		if (ret == ERROR)
+			ret = pread(fd, buf, size, offset);
 	}
-	ret = pread(fd, buf, size, offset);
+	promote_io_end(dentry, offset, 0);
 #ifdef FS_DEBUG
 	printf("fs_read, read %d data from fd = %d in path = %s\n", ret, fd, path);
 #endif
@@ -1311,68 +1998,421 @@ int fs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_
 	return ret;
 }
 
-int fs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fileInfo)
+// ret bytes landed at offset, the file grows to cover them
+void d_written(struct dentry *dentry, off_t offset, size_t ret)
+{
+	uint64_t size = 0;
+	int grown = 0;
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	d_attr_lock(dentry);
+	if (offset + ret > dentry->attr->size) {
+		dentry->attr->size = offset + ret;
+		grown = 1;
+	}
+	size = dentry->attr->size;
+	// the relatime check in d_atime_due() goes by it
+	dentry->attr->mtime = now;
+	dentry->attr->ctime = now;
+	d_attr_unlock(dentry);
+	if (grown)
+		aggr_resized(dentry);
+	promote_check(dentry, size);
+}
+
+int fs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fileInfo)
+{
+	int ret = 0;
+	struct fs_file *file = (struct fs_file *) fileInfo->fh;
+	struct dentry *dentry = file->dentry;
+	int fd = 0;
+
+	ret = snap_write(dentry, file);
+	if (ret != SUCCESS)
+		return ret;
+	// direct handles never buffer, file_write() passes them through
+	ret = file_write(file, buf, size, offset);
+	if (ret == 0) {
+		fd = promote_io_begin(dentry);
+		if (file->dfd >= 0)
+			ret = file_write_direct(file, fd, buf, size, offset);
+		else
+			ret = pwrite(fd, buf, size, offset);
+		promote_io_end(dentry, offset, ret > 0 ? ret : 0);
+		pcache_invalidate(dentry, offset, size);
+	}
+#ifdef FS_DEBUG
+	printf("fs_write, write %d data from fd = %d in path = %s\n", ret, fd, path);
+#endif
+	if (ret > 0)
+		d_written(dentry, offset, ret);
+	return ret;
+}
+
+/*
+ * The buf variants hand libfuse the pooled fd instead of the data, so it
+ * can splice pages between /dev/fuse and the backend file through a pipe
+ * and the payload never lands in a user space buffer.
+ */
+int fs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fileInfo)
+{
+	struct fs_file *file = (struct fs_file *) fileInfo->fh;
+	struct dentry *dentry = file->dentry;
+	struct fuse_bufvec *src = NULL;
+	char *mem = NULL;
+	ssize_t ret = 0;
+	int fd = 0;
+	src = (struct fuse_bufvec *) malloc(sizeof(struct fuse_bufvec));
+	if (src == NULL)
+		return -ENOMEM;
+	file_accessed(file);
+	// direct handles read into aligned memory, splicing would go through the page cache
+	if (file->dfd >= 0) {
+		if (posix_memalign((void **) &mem, FILE_DIRECT_ALIGN, size) != 0) {
+			free(src);
+			return -ENOMEM;
+		}
+		file_sync(dentry, file, offset, size);
+		fd = promote_io_begin(dentry);
+		ret = file_read_direct(file, fd, mem, size, offset);
+		promote_io_end(dentry, offset, 0);
+		if (ret < 0) {
+			free(mem);
+			free(src);
+			return ret;
+		}
+		*src = FUSE_BUFVEC_INIT(ret);
+		src->buf[0].mem = mem;
+		*bufp = src;
+		return 0;
+	}
+	file_read_ahead(file, offset, size);
+	// a cached small file is copied out of memory, libfuse frees mem with the bufvec
+	if (pcache_holds(dentry, offset) && (mem = (char *) malloc(size)) != NULL) {
+		fd = promote_io_begin(dentry);
+		ret = pcache_read(dentry, fd, mem, size, offset);
+		promote_io_end(dentry, offset, 0);
+		if (ret != ERROR) {
+			*src = FUSE_BUFVEC_INIT(ret);
+			src->buf[0].mem = mem;
+			*bufp = src;
+			return 0;
+		}
+		free(mem);
+	}
+	// a snapshot's file may be copied away under a splice, it is read out now; so is
+	// one that may still be promoted, the high level api tells nothing once it spliced
+	if (get_dentry_flag(dentry, D_snapshot) || (path != NULL && !promote_settled(dentry))) {
+		mem = (char *) malloc(size);
+		if (mem == NULL) {
+			free(src);
+			return -ENOMEM;
+		}
+		fd = promote_io_begin(dentry);
+		ret = pread(fd, mem, size, offset);
+		if (ret < 0)
+			ret = -errno;
+		promote_io_end(dentry, offset, 0);
+		if (ret < 0) {
+			free(mem);
+			free(src);
+			return ret;
+		}
+		*src = FUSE_BUFVEC_INIT(ret);
+		src->buf[0].mem = mem;
+		*bufp = src;
+		return 0;
+	}
+	// libfuse splices after we return, ll_read() puts the count once the reply is out
+	fd = promote_io_begin(dentry);
+	promote_async_get(dentry);
+	promote_io_end(dentry, offset, 0);
+	*src = FUSE_BUFVEC_INIT(size);
+	src->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	src->buf[0].fd = fd;
+	src->buf[0].pos = offset;
+	*bufp = src;
+	return 0;
+}
+
+int fs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fileInfo)
+{
+	struct fs_file *file = (struct fs_file *) fileInfo->fh;
+	struct dentry *dentry = file->dentry;
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(fuse_buf_size(buf));
+	ssize_t ret = 0;
+	int fd = 0;
+	ret = snap_write(dentry, file);
+	if (ret != SUCCESS)
+		return ret;
+	// small appends coalesce in the handle, the rest splice straight through
+	ret = file_write_buf(file, buf, offset);
+	if (ret != 0)
+		goto out;
+	fd = promote_io_begin(dentry);
+	if (file->dfd >= 0) {
+		ret = file_write_direct_buf(file, fd, buf, offset);
+	} else {
+		dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		dst.buf[0].fd = fd;
+		dst.buf[0].pos = offset;
+		ret = fuse_buf_copy(&dst, buf, FUSE_BUF_SPLICE_NONBLOCK);
+	}
+	promote_io_end(dentry, offset, ret > 0 ? ret : 0);
+	pcache_invalidate(dentry, offset, dst.buf[0].size);
+out:
+#ifdef FS_DEBUG
+	printf("fs_write_buf, write %ld data to fd = %d in path = %s\n", (long) ret, fd, path);
+#endif
+	if (ret > 0)
+		d_written(dentry, offset, ret);
+	return ret;
+}
+
+int fs_release(const char *path, struct fuse_file_info *fileInfo)
+{
+	struct fs_file *file = (struct fs_file *) fileInfo->fh;
+	if (file != NULL)
+		file_close(file);
+	fileInfo->fh = 0;
+#ifdef FS_DEBUG
+	printf("fs_release, path = %s has been closed\n", path);
+#endif
+	return 0;
+}
+
+int fs_releasedir(const char * path, struct fuse_file_info * info)
+{
+	struct dentry *dentry = (struct dentry *) info->fh;
+	if (dentry != NULL)
+		d_put(dentry);
+	info->fh = -1;
+	return SUCCESS;
+}
+
+static void set_time(struct timespec *time, const struct timespec *tv, const struct timespec *now)
+{
+	if (tv->tv_nsec == UTIME_OMIT)
+		return;
+	if (tv->tv_nsec == UTIME_NOW)
+		*time = *now;
+	else
+		*time = *tv;
+}
+
+static inline int64_t time_ns(const struct timespec *time)
+{
+	return (int64_t) time->tv_sec * 1000000000LL + time->tv_nsec;
+}
+
+int fs_utimens(const char * path, const struct timespec tv[2])
+{
+	int ret = 0;
+	int64_t atime_ns, mtime_ns;
+	struct timespec now;
+	struct dentry *dentry = NULL;
+	struct lookup_res lkup_res_buf;
+	struct lookup_res *lkup_res = NULL;
+	lkup_res = &lkup_res_buf;
+	ret = path_lookup(path, lkup_res);
+	if (unlikely(ret == ERROR)) {
+		ret = -ENOENT;
+		goto out;
+	}
+	dentry = lkup_res->dentry;
+	ret = snap_setattr(dentry);
+	if (ret != SUCCESS)
+		goto out;
+	clock_gettime(CLOCK_REALTIME, &now);
+	// read held, a rename can not come between the change and its record
+	pthread_rwlock_rdlock(&(fs_sb->tree_rwlock));
+	d_attr_lock(dentry);
+	set_time(&(dentry->attr->atime), &tv[0], &now);
+	set_time(&(dentry->attr->mtime), &tv[1], &now);
+	dentry->attr->ctime = now;
+	atime_ns = time_ns(&(dentry->attr->atime));
+	mtime_ns = time_ns(&(dentry->attr->mtime));
+	d_log(REPL_UTIMENS, dentry, NULL, 0, 0, 0, 0, atime_ns, mtime_ns);
+	d_attr_unlock(dentry);
+	pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
+#ifdef FS_DEBUG
+	printf("fs_utimens, update time dentry inode = %lu\n", (unsigned long)dentry->inode);
+#endif
+out:
+	lookup_put(lkup_res);
+	return ret;
+}
+
+/*
+ * Ops on an open handle act on fileInfo->fh and the pooled fd behind it and
+ * never look at the path, the frontend need not even build one.
+ */
+int d_truncate(struct dentry *dentry, off_t length)
+{
+	uint64_t old_size = 0;
+	int ret = 0;
+	int fd = 0;
+	if (get_dentry_flag(dentry, D_type) == DIR_DENTRY)
+		return -EISDIR;
+	if (S_ISLNK(dentry->attr->mode))
+		return -EINVAL;
+	// bytes other handles still buffer would land after the cut, or a copy would miss them
+	file_sync(dentry, NULL, 0, 0);
+	ret = snap_write(dentry, NULL);
+	if (ret != SUCCESS)
+		return ret;
+	fd = promote_io_begin(dentry);
+	ret = ftruncate(fd, length) == 0 ? SUCCESS : -errno;
+	d_attr_lock(dentry);
+	old_size = dentry->attr->size;
+	if (ret == SUCCESS) {
+		dentry->attr->size = length;
+		clock_gettime(CLOCK_REALTIME, &(dentry->attr->mtime));
+		dentry->attr->ctime = dentry->attr->mtime;
+	}
+	d_attr_unlock(dentry);
+	// a copy being made of the file has to lose the cut or gain the hole
+	if (old_size > (uint64_t) length)
+		promote_io_end(dentry, length, ret == SUCCESS ? old_size - length : 0);
+	else
+		promote_io_end(dentry, old_size, ret == SUCCESS ? length - old_size : 0);
+	if (ret != SUCCESS)
+		return ret;
+	if (old_size != (uint64_t) length)
+		aggr_resized(dentry);
+	promote_check(dentry, length);
+	// the short last page goes too, a read past it would miss the zeroes
+	if (old_size > (uint64_t) length)
+		pcache_invalidate(dentry, length, old_size - length);
+	else
+		pcache_invalidate(dentry, old_size, length - old_size);
+	return SUCCESS;
+}
+
+int fs_truncate(const char * path, off_t length)
+{
+	int ret = 0;
+	struct lookup_res lkup_res_buf;
+	struct lookup_res *lkup_res = NULL;
+	lkup_res = &lkup_res_buf;
+	ret = path_lookup(path, lkup_res);
+	if (ret == ERROR) {
+		ret = -ENOENT;
+		goto out;
+	}
+	ret = d_truncate(lkup_res->dentry, length);
+out:
+	lookup_put(lkup_res);
+	return ret;
+}
+
+int fs_ftruncate(const char * path, off_t length, struct fuse_file_info *fileInfo)
 {
-	int ret = 0;
-	uint64_t addr = fileInfo->fh;
-	struct dentry *dentry = NULL;
-	dentry = (struct dentry *) addr;
-	int fd = (int)dentry->fid;
+	struct fs_file *file = (struct fs_file *) fileInfo->fh;
+	int ret = file_flush(file);
+	if (ret != SUCCESS)
+		return ret;
+	return d_truncate(file->dentry, length);
+}
 
-	if (unlikely(fd < 0)) {
-		return -EBADF;
-	}
-	ret = pwrite(fd, buf, size, offset);
-#ifdef FS_DEBUG
-	printf("fs_write, write %d data from fd = %d in path = %s\n", ret, fd, path);
-#endif
-	if (ret > 0) {
-		dentry->size += ret;
-		//offset += ret;
-	}
-	return ret;
+int fs_fgetattr(const char *path, struct stat *st, struct fuse_file_info *fileInfo)
+{
+	d_stat(((struct fs_file *) fileInfo->fh)->dentry, st);
+	return SUCCESS;
 }
 
-int fs_release(const char *path, struct fuse_file_info *fileInfo)
+// close() of one descriptor, the handle lives on until release
+int fs_flush(const char *path, struct fuse_file_info *fileInfo)
 {
-#ifdef FS_DEBUG
-	printf("fs_release, path = %s has been closed\n", path);
-#endif
-	return 0;
+	return file_flush((struct fs_file *) fileInfo->fh);
 }
 
-int fs_releasedir(const char * path, struct fuse_file_info * info)
+int fs_fsync(const char *path, int datasync, struct fuse_file_info *fileInfo)
 {
-	info->fh = -1;
+	struct fs_file *file = (struct fs_file *) fileInfo->fh;
+	int ret = file_flush(file);
+	int fd = 0;
+	if (ret != SUCCESS)
+		return ret;
+	fd = promote_io_begin(file->dentry);
+	ret = (datasync ? fdatasync(fd) : fsync(fd)) == 0 ? SUCCESS : -errno;
+	promote_io_end(file->dentry, 0, 0);
+	return ret;
+}
+
+int fs_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fileInfo)
+{
+	struct fs_file *file = (struct fs_file *) fileInfo->fh;
+	int ret = snap_write(file->dentry, file);
+	int fd = 0;
+	if (ret == SUCCESS)
+		ret = file_flush(file);
+	if (ret != SUCCESS)
+		return ret;
+	fd = promote_io_begin(file->dentry);
+	ret = fallocate(fd, mode, offset, length) == 0 ? SUCCESS : -errno;
+	promote_io_end(file->dentry, offset, ret == SUCCESS ? length : 0);
+	if (ret != SUCCESS)
+		return ret;
+	pcache_invalidate(file->dentry, offset, length);
+	if (!(mode & FALLOC_FL_KEEP_SIZE))
+		d_written(file->dentry, offset, length);
 	return SUCCESS;
 }
 
-int fs_utimens(const char * path, const struct timespec tv[2])
+int fs_unlink_at(struct dentry *p_dentry, const char *name)
 {
 	int ret = 0;
-	struct dentry *dentry = NULL;
-	struct lookup_res *lkup_res = NULL;
-	lkup_res = (struct lookup_res *)malloc(sizeof(struct lookup_res));
-	ret = path_lookup(path, lkup_res);
-	if (unlikely(ret == ERROR)) {
+	char rm_key[MAP_KEY_LEN];
+	struct dentry *rm_dentry = NULL;
+	map_t *rm_node;
+	int release = 0;
+	if (get_dentry_flag(p_dentry, D_type) != DIR_DENTRY)
+		return -ENOTDIR;
+	link_key(rm_key, p_dentry, name);
+	pthread_rwlock_wrlock(&(fs_sb->tree_rwlock));
+	if (!d_dead(p_dentry) && d_ensure(p_dentry) == SUCCESS)
+		rm_dentry = d_lookup(p_dentry, name);
+	if (rm_dentry == NULL) {
 		ret = -ENOENT;
-		goto out;
+		pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
+		return ret;
 	}
-	dentry = lkup_res->dentry;
-	dentry->atime = tv[0].tv_sec;
-	dentry->mtime = tv[1].tv_sec;
+	if (get_dentry_flag(rm_dentry, D_type) == DIR_DENTRY) {
+		ret = -EISDIR;
+		pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
+		return ret;
+	}
+	ret = snap_touch(p_dentry);
+	if (ret != SUCCESS) {
+		pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
+		return ret;
+	}
+
 #ifdef FS_DEBUG
-	printf("fs_utimens, update time dentry inode = %d\n", (int)dentry->inode);
+	printf("fs_unlink, will del node and add a unused dentry, key = %s\n", rm_key);
 #endif
-out:
-	free(lkup_res);
-	lkup_res = NULL;
-	return ret;
-}
-
-int fs_truncate(const char * path, off_t length)
-{
-	return -ENOSYS;
+	d_log(REPL_UNLINK, rm_dentry, NULL, 0, 0, 0, 0, 0, 0);
+	aggr_account(rm_dentry, -1);
+	d_remove(rm_dentry);
+	pthread_rwlock_wrlock(&(fs_sb->dirty_list_rwlock));
+	remove_dentry_from_dirty_list(rm_dentry);
+	pthread_rwlock_unlock(&(fs_sb->dirty_list_rwlock));
+	if (S_ISLNK(rm_dentry->attr->mode)) {
+		pthread_rwlock_wrlock(&(fs_sb->link_tree_rwlock));
+		rm_node = get(&(fs_sb->link_tree), rm_key);
+		if (rm_node != NULL) {
+			free((char *) rm_node->val);
+			del(&(fs_sb->link_tree), rm_node);
+		}
+		pthread_rwlock_unlock(&(fs_sb->link_tree_rwlock));
+	}
+	// an open file keeps its backend file until fs_release, then it is recycled
+	release = d_kill(rm_dentry);
+	pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
+	if (release)
+		d_release(rm_dentry);
+	return SUCCESS;
 }
 
 int fs_unlink(const char * path)
@@ -1386,9 +2426,11 @@ int fs_unlink(const char * path)
 			break;
 	}
 	split_pos = (i > 0) ? i : 1;
-	char *p_path = (char *)calloc(1, split_pos + 1);
+	char p_path[PATH_MAX];
 	if (i < 0)
 		return -ENOENT;
+	if (split_pos >= PATH_MAX)
+		return -ENAMETOOLONG;
 	int j;
 	for (j = 0; j < split_pos; ++j) {
 		p_path[j] = path[j];
@@ -1402,8 +2444,9 @@ int fs_unlink(const char * path)
 		memcpy(cur_name, &path[split_pos + 1], len - split_pos - 1);
 
 	struct dentry *dentry = NULL;
+	struct lookup_res lkup_res_buf;
 	struct lookup_res *lkup_res = NULL;
-	lkup_res = (struct lookup_res *)malloc(sizeof(struct lookup_res));
+	lkup_res = &lkup_res_buf;
 	ret = path_lookup(p_path, lkup_res);
 	if (ret == ERROR) {
 		ret = -ENOENT;
@@ -1415,60 +2458,9 @@ int fs_unlink(const char * path)
 		goto out;
 	}
 
-	char rm_key[MAP_KEY_LEN];
-	memset(rm_key, '\0', MAP_KEY_LEN);
-	sprintf(rm_key, "%d", (int)dentry->inode);    // parent inode
-	strcat(rm_key, MAP_KEY_DELIMIT);
-	strcat(rm_key, cur_name);
-	map_t *rm_node;
-	pthread_rwlock_rdlock(&(fs_sb->tree_rwlock));
-	rm_node = get(&(fs_sb->tree), rm_key);
-	pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
-	if (rm_node == NULL) {
-		ret = -ENOENT;
-		goto out;
-	}
-	dentry = (struct dentry *) rm_node->val;
-	if (get_dentry_flag(dentry, D_type) == DIR_DENTRY) {
-		ret = -EISDIR;
-		goto out;
-	}
-
-#ifdef FS_DEBUG
-	printf("fs_unlink, will del node and add a unused dentry, key = %s\n", rm_key);
-#endif
-    pthread_rwlock_wrlock(&(fs_sb->tree_rwlock));
-	del(&(fs_sb->tree), rm_node);
-	pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
-	pthread_rwlock_wrlock(&(fs_sb->dirty_list_rwlock));
-	remove_dentry_from_dirty_list(dentry);
-	pthread_rwlock_unlock(&(fs_sb->dirty_list_rwlock));
-	if ((dentry->flags & S_IFLNK) == 1) {
-		pthread_rwlock_rdlock(&(fs_sb->link_tree_rwlock));
-		rm_node = get(&(fs_sb->link_tree), rm_key);
-		pthread_rwlock_unlock(&(fs_sb->link_tree_rwlock));
-		pthread_rwlock_wrlock(&(fs_sb->link_tree_rwlock));
-		del(&(fs_sb->link_tree), rm_node);
-		pthread_rwlock_unlock(&(fs_sb->link_tree_rwlock));
-		free(dentry);
-		dentry = NULL;
-		ret = SUCCESS;
-		goto out;
-	}
-	// change the dentry
-	ftruncate(dentry->fid, 0);    // delete the file
-	dentry->size = 0;
-	dentry->flags = 0;
-	set_dentry_flag(dentry, D_type, FILE_DENTRY);
-	dentry->nlink = 0;
-	dentry->mtime = time(NULL);
-	pthread_rwlock_wrlock(&(fs_sb->unused_list_rwlock));
-	add_dentry_to_unused_list(dentry);    // for file, need recycle
-	pthread_rwlock_unlock(&(fs_sb->unused_list_rwlock));
-	ret = SUCCESS;
+	ret = fs_unlink_at(dentry, cur_name);
 out:
-	free(lkup_res);
-	lkup_res = NULL;
+	lookup_put(lkup_res);
 	return ret;
 }
 
@@ -1476,8 +2468,9 @@ int fs_chmod(const char * path, mode_t mode)
 {
 	int ret = 0;
 	struct dentry *dentry = NULL;
+	struct lookup_res lkup_res_buf;
 	struct lookup_res *lkup_res = NULL;
-	lkup_res = (struct lookup_res *)malloc(sizeof(struct lookup_res));
+	lkup_res = &lkup_res_buf;
 	ret = path_lookup(path, lkup_res);
 	if (ret == ERROR) {
 		ret = -ENOENT;
@@ -1485,14 +2478,21 @@ int fs_chmod(const char * path, mode_t mode)
 	}
 	dentry = lkup_res->dentry;
 #ifdef FS_DEBUG
-	printf("fs_chmod, chmod path = %s, its inode = %d\n", path, (int)dentry->inode);
+	printf("fs_chmod, chmod path = %s, its inode = %lu\n", path, (unsigned long)dentry->inode);
 #endif
-	dentry->mode = mode;
-	dentry->atime = time(NULL);
+	ret = snap_setattr(dentry);
+	if (ret != SUCCESS)
+		goto out;
+	pthread_rwlock_rdlock(&(fs_sb->tree_rwlock));
+	d_attr_lock(dentry);
+	dentry->attr->mode = mode;
+	clock_gettime(CLOCK_REALTIME, &(dentry->attr->ctime));
+	d_log(REPL_CHMOD, dentry, NULL, mode, 0, 0, 0, 0, 0);
+	d_attr_unlock(dentry);
+	pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
 	ret = 0;
 out:
-	free(lkup_res);
-	lkup_res = NULL;
+	lookup_put(lkup_res);
 	return ret;
 }
 
@@ -1500,8 +2500,9 @@ int fs_chown(const char * path, uid_t owner, gid_t group)
 {
 	int ret = 0;
 	struct dentry *dentry = NULL;
+	struct lookup_res lkup_res_buf;
 	struct lookup_res *lkup_res = NULL;
-	lkup_res = (struct lookup_res *)malloc(sizeof(struct lookup_res));
+	lkup_res = &lkup_res_buf;
 	ret = path_lookup(path, lkup_res);
 	if (ret == ERROR) {
 		ret = -ENOENT;
@@ -1509,14 +2510,25 @@ int fs_chown(const char * path, uid_t owner, gid_t group)
 	}
 	dentry = lkup_res->dentry;
 #ifdef FS_DEBUG
-	printf("fs_chown, chown path = %s, its inode = %d\n", path, (int)dentry->inode);
+	printf("fs_chown, chown path = %s, its inode = %lu\n", path, (unsigned long)dentry->inode);
 #endif
-	dentry->uid = owner;
-	dentry->gid = group;
+	ret = snap_setattr(dentry);
+	if (ret != SUCCESS)
+		goto out;
+	pthread_rwlock_rdlock(&(fs_sb->tree_rwlock));
+	d_attr_lock(dentry);
+	// -1 leaves that one as it is, as chown(2) does
+	if (owner != (uid_t) -1)
+		dentry->attr->uid = owner;
+	if (group != (gid_t) -1)
+		dentry->attr->gid = group;
+	clock_gettime(CLOCK_REALTIME, &(dentry->attr->ctime));
+	d_log(REPL_CHOWN, dentry, NULL, 0, owner, group, 0, 0, 0);
+	d_attr_unlock(dentry);
+	pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
 	ret = 0;
 out:
-	free(lkup_res);
-	lkup_res = NULL;
+	lookup_put(lkup_res);
 	return ret;	
 }
 
@@ -1528,18 +2540,105 @@ int fs_access(const char * path, int amode)
 	return 0;
 }
 
-int fs_symlink(const char *oldpath, const char *newpath)
+// link as name in p_dentry, it shares target's backend file and reads back as val
+int fs_symlink_at(struct dentry *p_dentry, const char *name, struct dentry *target, const char *val, uint64_t ino, struct dentry **res)
+{
+	int ret = 0;
+	int len_val = strlen(val);
+	struct dentry *create_dentry = NULL;
+	char create_key[MAP_KEY_LEN];
+	char path[PATH_MAX];
+	char *val_str = NULL;
+	if (get_dentry_flag(p_dentry, D_type) != DIR_DENTRY)
+		return -ENOTDIR;
+	if (strlen(name) >= DENTRY_NAME_SIZE)
+		return -ENAMETOOLONG;
+	if (snap_reserved(name))
+		return -EEXIST;
+	create_dentry = d_alloc();
+	if (create_dentry == NULL)
+		return -ENOMEM;
+	if (ino != 0)
+		ino_adopt(ino);
+	create_dentry->fid = target->fid;
+	// the backend file is the target's, the inode number the link's own
+	create_dentry->inode = ino != 0 ? ino : ino_alloc();
+	create_dentry->flags = 0;
+	create_dentry->d_count = res ? 1 : 0;
+	set_dentry_flag(create_dentry, D_type, FILE_DENTRY);
+	create_dentry->attr->mode = S_IFLNK | 0777;
+	create_dentry->attr->size = len_val;
+	create_dentry->attr->d_counted = len_val;
+	clock_gettime(CLOCK_REALTIME, &(create_dentry->attr->ctime));
+	create_dentry->attr->mtime = create_dentry->attr->ctime;
+	create_dentry->attr->atime = create_dentry->attr->ctime;
+	create_dentry->attr->uid = getuid();
+	create_dentry->attr->gid = getgid();
+	create_dentry->attr->nlink = 1;
+
+	link_key(create_key, p_dentry, name);
+	val_str = (char *) malloc(len_val + 1);
+	if (val_str == NULL) {
+		d_free(create_dentry);
+		return -ENOMEM;
+	}
+	memcpy(val_str, val, len_val + 1);
+
+	// the link target goes in with the name, readlink never sees one without the other
+	pthread_rwlock_wrlock(&(fs_sb->tree_rwlock));
+	if (d_dead(p_dentry) || d_ensure(p_dentry) != SUCCESS)
+		ret = -ENOENT;
+	else
+		ret = snap_touch(p_dentry);
+	if (ret == SUCCESS && d_insert(p_dentry, create_dentry, name) == 0)
+		ret = -EEXIST;
+	if (ret == SUCCESS) {
+		aggr_account(create_dentry, 1);
+		pthread_rwlock_wrlock(&(fs_sb->dirty_list_rwlock));
+		add_dentry_to_dirty_list(create_dentry);
+		pthread_rwlock_unlock(&(fs_sb->dirty_list_rwlock));
+		pthread_rwlock_wrlock(&(fs_sb->link_tree_rwlock));
+		put(&(fs_sb->link_tree), create_key, (uint64_t) val_str);
+		pthread_rwlock_unlock(&(fs_sb->link_tree_rwlock));
+		// the link's own path goes second, replayed as fs_symlink_ino(val, path, ino)
+		if (replica_active() && __d_path(create_dentry, path, PATH_MAX) == SUCCESS)
+			replica_log(REPL_SYMLINK, val, path, 0, 0, 0, create_dentry->inode, 0, 0);
+	}
+	pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
+	if (ret != SUCCESS) {
+		d_free(create_dentry);
+		free(val_str);
+		return ret;
+	}
+	d_attr_lock(target);
+	target->attr->nlink++;
+	target->attr->ctime = create_dentry->attr->ctime;
+	d_attr_unlock(target);
+#ifdef FS_DEBUG
+	printf("fs_symlink, new link file inode = %lu, link val = %s\n", (unsigned long)create_dentry->inode, val_str);
+#endif
+	if (res)
+		*res = create_dentry;
+	return SUCCESS;
+}
+
+static int do_symlink(const char *oldpath, const char *newpath, uint64_t ino)
 {
+	struct dentry *create_dentry = NULL;
 	int ret = 0;
 	int i, j;
 	bool isprefix = true;
 	isprefix = is_prefix(fs_sb->mount_point, oldpath);
 	int len_oldpath = strlen(oldpath);
 	int len_mount = strlen(fs_sb->mount_point);
+	struct lookup_res lkup_res_buf;
 	struct lookup_res *lkup_res = NULL;
+	struct lookup_res old_lkup_res_buf;
 	struct lookup_res *old_lkup_res = NULL;
-	lkup_res = (struct lookup_res *)malloc(sizeof(struct lookup_res));
-	old_lkup_res = (struct lookup_res *)malloc(sizeof(struct lookup_res));
+	char *old_real_path = NULL;
+	lkup_res = &lkup_res_buf;
+	old_lkup_res = &old_lkup_res_buf;
+	old_lkup_res->dentry = NULL;
 	ret = path_lookup(newpath, lkup_res);
 	if (lkup_res->error != MISS_FILE) {
 		ret = -EEXIST;
@@ -1558,7 +2657,7 @@ int fs_symlink(const char *oldpath, const char *newpath)
 		len = len_oldpath - len_mount;
 	else
 		len = len_oldpath;
-	char* old_real_path = (char *)calloc(1, len + 1);
+	old_real_path = (char *)calloc(1, len + 1);
 	if (isprefix) {
 		for (i = len_mount, j = 0; i < len_oldpath; i++, j++) {
 			old_real_path[j] = oldpath[i];
@@ -1590,70 +2689,35 @@ int fs_symlink(const char *oldpath, const char *newpath)
 			break;
 	}
 	split_pos = (i > 0) ? i : 1;
+	if (strlen(newpath) - split_pos >= DENTRY_NAME_SIZE) {
+		ret = -ENAMETOOLONG;
+		goto out;
+	}
 	if (split_pos == 1)
 		memcpy(cur_name, &newpath[split_pos], strlen(newpath) - split_pos);
 	else
 		memcpy(cur_name, &newpath[split_pos + 1], strlen(newpath) - split_pos - 1);
 
-// dentry tree
-	uint32_t p_inode = lkup_res->dentry->inode;
-	struct dentry *create_dentry = NULL;
-	create_dentry = (struct dentry *)calloc(1, sizeof(struct dentry));
-	create_dentry->fid = old_lkup_res->dentry->fid;
-	create_dentry->inode = old_lkup_res->dentry->inode;
-	create_dentry->flags = 0;
-	pthread_rwlock_wrlock(&(fs_sb->dirty_list_rwlock));
-	add_dentry_to_dirty_list(create_dentry);
-	pthread_rwlock_unlock(&(fs_sb->dirty_list_rwlock));
-	set_dentry_flag(create_dentry, D_type, FILE_DENTRY);
-	create_dentry->mode = S_IFLNK | 0777;
-	create_dentry->ctime = time(NULL);
-	create_dentry->mtime = time(NULL);
-	create_dentry->atime = time(NULL);
-	create_dentry->uid = getuid();
-	create_dentry->gid = getgid();
-	old_lkup_res->dentry->nlink++;
-
-	char create_key[MAP_KEY_LEN];
-	memset(create_key, '\0', MAP_KEY_LEN);
-	sprintf(create_key, "%d", (int)p_inode);
-	strcat(create_key, MAP_KEY_DELIMIT);
-	strcat(create_key, cur_name);
-	uint64_t addr = (uint64_t) create_dentry;
-	pthread_rwlock_wrlock(&(fs_sb->tree_rwlock));
-	ret = put(&(fs_sb->tree), create_key, addr);
-	pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
-#ifdef FS_DEBUG
-	if (ret == 1) {
-		printf("fs_create, put key = %s, its parent dentry inode = %d in the map!\n", create_key, (int)p_inode);
-	} else {
-		printf("fs_create, this key = %s, with parent inode = %d has already in the map\n", create_key, (int)p_inode);
-	}
-#endif
-
-// link tree
-	len = strlen(newpath);
-	char *val_str = (char *) malloc(len_mount + len + 1);
-	memset(val_str, '\0', len_mount + len + 1);
-	strcpy(val_str, oldpath);
-	//strcpy(val_str, fs_sb->mount_point);
-	//strcat(val_str, old_real_path);
-	addr = (uint64_t) val_str;
-	pthread_rwlock_wrlock(&(fs_sb->link_tree_rwlock));
-	ret = put(&(fs_sb->link_tree), create_key, addr);
-	pthread_rwlock_unlock(&(fs_sb->link_tree_rwlock));
-	ret = SUCCESS;
-#ifdef FS_DEBUG
-	printf("fs_symlink, new link file inode = %d, link val = %s\n", create_dentry->inode, val_str);
-#endif
+	ret = fs_symlink_at(lkup_res->dentry, cur_name, old_lkup_res->dentry, oldpath, ino, &create_dentry);
+	if (ret == SUCCESS)
+		d_put(create_dentry);
 out:
-	free(lkup_res);
-	free(old_lkup_res);
-	lkup_res = NULL;
-	old_lkup_res = NULL;
+	free(old_real_path);
+	lookup_put(lkup_res);
+	lookup_put(old_lkup_res);
 	return ret;
 }
 
+int fs_symlink(const char *oldpath, const char *newpath)
+{
+	return do_symlink(oldpath, newpath, 0);
+}
+
+int fs_symlink_ino(const char *oldpath, const char *newpath, uint64_t ino)
+{
+	return do_symlink(oldpath, newpath, ino);
+}
+
 int fs_symlink_old(const char * oldpath, const char * newpath)
 {
 	int ret = 0;
@@ -1662,10 +2726,13 @@ int fs_symlink_old(const char * oldpath, const char * newpath)
 	isprefix = is_prefix(fs_sb->mount_point, oldpath);
 	int len_oldpath = strlen(oldpath);
 	int len_mount = strlen(fs_sb->mount_point);
+	struct lookup_res lkup_res_buf;
 	struct lookup_res *lkup_res = NULL;
+	struct lookup_res old_lkup_res_buf;
 	struct lookup_res *old_lkup_res = NULL;
-	lkup_res = (struct lookup_res *)malloc(sizeof(struct lookup_res));
-	old_lkup_res = (struct lookup_res *)malloc(sizeof(struct lookup_res));
+	lkup_res = &lkup_res_buf;
+	old_lkup_res = &old_lkup_res_buf;
+	old_lkup_res->dentry = NULL;
 	ret = path_lookup(newpath, lkup_res);
 	if (lkup_res->error != MISS_FILE) {
 		ret = -EEXIST;
@@ -1711,9 +2778,10 @@ int fs_symlink_old(const char * oldpath, const char * newpath)
 		memcpy(cur_name, &newpath[split_pos], strlen(newpath) - split_pos);
 	else
 		memcpy(cur_name, &newpath[split_pos + 1], strlen(newpath) - split_pos - 1);
-	uint32_t p_inode = lkup_res->dentry->inode;
+	struct dentry *p_dentry = lkup_res->dentry;
+	uint64_t p_inode = p_dentry->inode;
 	struct dentry *create_dentry = NULL;
-	create_dentry = (struct dentry *)calloc(1, sizeof(struct dentry));
+	create_dentry = d_alloc();
 	create_dentry->fid = old_lkup_res->dentry->fid;
 	create_dentry->inode = old_lkup_res->dentry->inode;
 	create_dentry->flags = 0;
@@ -1721,39 +2789,77 @@ int fs_symlink_old(const char * oldpath, const char * newpath)
 	add_dentry_to_dirty_list(create_dentry);
 	pthread_rwlock_unlock(&(fs_sb->dirty_list_rwlock));
 	set_dentry_flag(create_dentry, D_type, FILE_DENTRY);
-	create_dentry->mode = S_IFLNK | 0777;
-	create_dentry->ctime = time(NULL);
-	create_dentry->mtime = time(NULL);
-	create_dentry->atime = time(NULL);
-	create_dentry->uid = getuid();
-	create_dentry->gid = getgid();
-	old_lkup_res->dentry->nlink++;
+	create_dentry->attr->mode = S_IFLNK | 0777;
+	clock_gettime(CLOCK_REALTIME, &(create_dentry->attr->ctime));
+	create_dentry->attr->mtime = create_dentry->attr->ctime;
+	create_dentry->attr->atime = create_dentry->attr->ctime;
+	create_dentry->attr->uid = getuid();
+	create_dentry->attr->gid = getgid();
+	d_attr_lock(old_lkup_res->dentry);
+	old_lkup_res->dentry->attr->nlink++;
+	old_lkup_res->dentry->attr->ctime = create_dentry->attr->ctime;
+	d_attr_unlock(old_lkup_res->dentry);
 #ifdef FS_DEBUG
-	printf("fs_symlink, new link file inode = %d, linked name = %s\n", create_dentry->inode, basename(old_real_path));
+	printf("fs_symlink, new link file inode = %lu, linked name = %s\n", (unsigned long)create_dentry->inode, basename(old_real_path));
 #endif
 
 	char create_key[MAP_KEY_LEN];
 	memset(create_key, '\0', MAP_KEY_LEN);
-	sprintf(create_key, "%d", (int)p_inode);
+	sprintf(create_key, "%lu", (unsigned long)p_inode);
 	strcat(create_key, MAP_KEY_DELIMIT);
 	strcat(create_key, cur_name);
-	uint64_t addr = (uint64_t) create_dentry;
 	pthread_rwlock_wrlock(&(fs_sb->tree_rwlock));
-	ret = put(&(fs_sb->tree), create_key, addr);
+	d_ensure(p_dentry);
+	ret = d_insert(p_dentry, create_dentry, cur_name);
+	if (ret == 1)
+		aggr_account(create_dentry, 1);
 	pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
 #ifdef FS_DEBUG
 	if (ret == 1) {
-		printf("fs_create, put key = %s, its parent dentry inode = %d in the map!\n", create_key, (int)p_inode);
+		printf("fs_create, put key = %s, its parent dentry inode = %lu in the map!\n", create_key, (unsigned long)p_inode);
 	} else {
-		printf("fs_create, this key = %s, with parent inode = %d has already in the map\n", create_key, (int)p_inode);
+		printf("fs_create, this key = %s, with parent inode = %lu has already in the map\n", create_key, (unsigned long)p_inode);
 	}
 #endif
 	ret = SUCCESS;
 out:
-	free(lkup_res);
-	free(old_lkup_res);
-	lkup_res = NULL;
-	old_lkup_res = NULL;
+	lookup_put(lkup_res);
+	lookup_put(old_lkup_res);
+	return ret;
+}
+
+int d_readlink(struct dentry *dentry, char *buf, size_t size)
+{
+	int ret = 0;
+	char find_key[MAP_KEY_LEN];
+	map_t *node;
+	char *val = NULL;
+	if (!S_ISLNK(dentry->attr->mode))
+		return -EINVAL;
+	if (size == 0)
+		return -EINVAL;
+	// the key follows the link through renames, read it where it is now
+	pthread_rwlock_rdlock(&(fs_sb->tree_rwlock));
+	if (d_dead(dentry)) {
+		pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
+		return -ENOENT;
+	}
+	link_key(find_key, dentry->attr->parent, d_name(dentry));
+	// an unlink frees the target string, copy it out under the lock
+	pthread_rwlock_rdlock(&(fs_sb->link_tree_rwlock));
+	node = get(&(fs_sb->link_tree), find_key);
+	if (node == NULL) {
+		ret = -ENOENT;
+	} else {
+		val = (char *) node->val;
+#ifdef FS_DEBUG
+		printf("fs_readlink, find key = %s, val = %s\n", find_key, val);
+#endif
+		strncpy(buf, val, size - 1);
+		buf[size - 1] = '\0';
+	}
+	pthread_rwlock_unlock(&(fs_sb->link_tree_rwlock));
+	pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
 	return ret;
 }
 
@@ -1761,58 +2867,27 @@ int fs_readlink(const char * path, char * buf, size_t size)
 {
 	int ret = 0;
 	struct dentry *dentry = NULL;
+	struct lookup_res lkup_res_buf;
 	struct lookup_res *lkup_res = NULL;
-	lkup_res = (struct lookup_res *) malloc(sizeof(struct lookup_res));
+	lkup_res = &lkup_res_buf;
 	ret = path_lookup(path, lkup_res);
 	if (ret == ERROR) {
 		ret = -ENOENT;
 		goto out;
 	}
 	dentry = lkup_res->dentry;
-	if (!S_ISLNK(dentry->mode)) {
-		ret = EINVAL;
+	if (!S_ISLNK(dentry->attr->mode)) {
+		ret = -EINVAL;
 		goto out;
 	}
 
-	int i, j;
-	char cur_name[DENTRY_NAME_SIZE];
-	memset(cur_name, '\0', DENTRY_NAME_SIZE);
-	int split_pos = 0;
-	for (i = strlen(path) - 1; i >= 0; --i) {
-		if (path[i] == '/')
-			break;
-	}
-	split_pos = (i > 0) ? i : 1;
-	if (split_pos == 1)
-		memcpy(cur_name, &path[split_pos], strlen(path) - split_pos);
-	else
-		memcpy(cur_name, &path[split_pos + 1], strlen(path) - split_pos - 1);
-
-	char find_key[MAP_KEY_LEN];
-	memset(find_key, '\0', MAP_PRE_KEY_LEN);
-	sprintf(find_key, "%d", (int)lkup_res->p_inode);
-	strcat(find_key, MAP_KEY_DELIMIT);
-	strcat(find_key, cur_name);
-
-	map_t *node;
-	pthread_rwlock_rdlock(&(fs_sb->link_tree_rwlock));
-	node = get(&(fs_sb->link_tree), find_key);
-	pthread_rwlock_unlock(&(fs_sb->link_tree_rwlock));
-	uint64_t addr;
-	addr = node->val;
-	char *val = NULL;
-	val = (char *) addr;
-#ifdef FS_DEBUG
-	printf("fs_readlink, find key = %s, val = %s\n", find_key, val);
-#endif
-	strcpy(buf, val);
+	ret = d_readlink(dentry, buf, size);
 	//sprintf(buf, "%d", (int)dentry->inode);
 #ifdef FS_DEBUG
 	printf("fs_readlink, buf = %s\n", buf);
 #endif
 out:
-	free(lkup_res);
-	lkup_res = NULL;
+	lookup_put(lkup_res);
 	return ret;
 }
 
@@ -1820,34 +2895,32 @@ int fs_readlink_old(const char * path, char * buf, size_t size)
 {
 	int ret = 0;
 	struct dentry *dentry = NULL;
+	struct lookup_res lkup_res_buf;
 	struct lookup_res *lkup_res = NULL;
-	lkup_res = (struct lookup_res *) malloc(sizeof(struct lookup_res));
+	lkup_res = &lkup_res_buf;
 	ret = path_lookup(path, lkup_res);
 	if (ret == ERROR) {
 		ret = -ENOENT;
 		goto out;
 	}
 	dentry = lkup_res->dentry;
-	if (!S_ISLNK(dentry->mode)) {
-		ret = EINVAL;
+	if (!S_ISLNK(dentry->attr->mode)) {
+		ret = -EINVAL;
 		goto out;
 	}
 
-	map_t *node;
 	struct dentry *find_dentry = NULL;
-	char *key = NULL;
-	int i, j;
-	pthread_rwlock_rdlock(&(fs_sb->tree_rwlock));
-	for (node = map_first(&(fs_sb->tree)); node; node = map_next(&(node->node))) {
-		find_dentry = (struct dentry *)node->val;
-		if (S_ISLNK(find_dentry->mode))
+	// every named dentry is on the dirty list
+	pthread_rwlock_rdlock(&(fs_sb->dirty_list_rwlock));
+	for (find_dentry = fs_sb->dirty_dentry_head; find_dentry; find_dentry = find_dentry->attr->next) {
+		if (S_ISLNK(find_dentry->attr->mode))
 			continue;
 		if (get_dentry_flag(find_dentry, D_type) == DIR_DENTRY) {
 			if (find_dentry->inode == dentry->inode) {
 			#ifdef FS_DEBUG
-				printf("fs_readlink, find one is dir with inode = %d\n", (int)find_dentry->inode);
+				printf("fs_readlink, find one is dir with inode = %lu\n", (unsigned long)find_dentry->inode);
 			#endif
-				pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
+				pthread_rwlock_unlock(&(fs_sb->dirty_list_rwlock));
 				goto find_one;
 			}
 		} else if(get_dentry_flag(find_dentry, D_type) == FILE_DENTRY) {
@@ -1855,32 +2928,24 @@ int fs_readlink_old(const char * path, char * buf, size_t size)
 			#ifdef FS_DEBUG
 				printf("fs_readlink, find one is file with fid = %d\n", (int) find_dentry->fid);
 			#endif
-				pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
+				pthread_rwlock_unlock(&(fs_sb->dirty_list_rwlock));
 				goto find_one;
 			}
 		}
 	}
-	pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
+	pthread_rwlock_unlock(&(fs_sb->dirty_list_rwlock));
 find_one:
-	key = node->key;
-#ifdef FS_DEBUG
-	printf("fs_readlink, find key = %s\n", key);
-#endif
-	for (i = 0; i < strlen(key); i++) {
-		if (key[i] == '#')
-			break;
-	}
-	for (i = i + 1, j = 0; i < strlen(key); i++, j++) {
-		buf[j] = key[i];
+	if (find_dentry == NULL) {
+		ret = -ENOENT;
+		goto out;
 	}
-	buf[j] = '\0';
+	strcpy(buf, d_name(find_dentry));
 	//sprintf(buf, "%d", (int)dentry->inode);
 #ifdef FS_DEBUG
-	printf("fs_readlink, buf = %s, dentry inode = %d\n", buf, (int)dentry->inode);
+	printf("fs_readlink, buf = %s, dentry inode = %lu\n", buf, (unsigned long)dentry->inode);
 #endif
 out:
-	free(lkup_res);
-	lkup_res = NULL;
+	lookup_put(lkup_res);
 	return ret;
 }
 
@@ -1889,31 +2954,157 @@ int fs_statfs(const char *path, struct statvfs *statv)
 	return statvfs(fs_sb->alloc_path, statv);
 }
 
+// pick up sizes of files written behind our back, e.g. by a primary before takeover
+void refresh_file_dentries()
+{
+	struct stat buf;
+	struct dentry *dentry = NULL;
+	uint64_t old_size = 0;
+	// the tree lock first, a full delta queue is folded under it
+	pthread_rwlock_rdlock(&(fs_sb->tree_rwlock));
+	pthread_rwlock_rdlock(&(fs_sb->dirty_list_rwlock));
+	for (dentry = fs_sb->dirty_dentry_head; dentry != NULL; dentry = dentry->attr->next) {
+		if (get_dentry_flag(dentry, D_type) != FILE_DENTRY || S_ISLNK(dentry->attr->mode))
+			continue;
+		if (fstat(dentry->fid, &buf) == 0) {
+			d_attr_lock(dentry);
+			old_size = dentry->attr->size;
+			dentry->attr->size = buf.st_size;
+			dentry->attr->mtime = buf.st_mtim;
+			d_attr_unlock(dentry);
+			if (old_size != (uint64_t) buf.st_size)
+				aggr_resized_locked(dentry);
+		}
+	}
+	pthread_rwlock_unlock(&(fs_sb->dirty_list_rwlock));
+	pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
+}
+
+// at takeover, pool files a standby recycled during replay still hold data
+void truncate_unused_files()
+{
+	struct stat buf;
+	struct dentry *dentry = NULL;
+	int count = 0;
+	pthread_rwlock_rdlock(&(fs_sb->unused_list_rwlock));
+	for (dentry = fs_sb->unused_dentry_head; dentry != NULL; dentry = dentry->attr->next) {
+		if (fstat(dentry->fid, &buf) != 0 || buf.st_size == 0)
+			continue;
+		if (ftruncate(dentry->fid, 0) == 0)
+			count++;
+	}
+	pthread_rwlock_unlock(&(fs_sb->unused_list_rwlock));
+#ifdef FS_DEBUG
+	printf("truncate_unused_files, %d pool files emptied\n", count);
+#endif
+}
+
+// len after an emitter wrote n into buf, held at the last byte once buf runs out
+static int stats_add(int len, int n, size_t size)
+{
+	if (n < 0)
+		return len;
+	if ((size_t) len + n >= size)
+		return size > 0 ? size - 1 : 0;
+	return len + n;
+}
+
+int fs_stats(char *buf, size_t size)
+{
+	int len = 0;
+	len = stats_add(len, replica_stats(buf + len, size - len), size);
+	len = stats_add(len, evict_stats(buf + len, size - len), size);
+	len = stats_add(len, file_stats(buf + len, size - len), size);
+	len = stats_add(len, pcache_stats(buf + len, size - len), size);
+	len = stats_add(len, uring_stats(buf + len, size - len), size);
+	len = stats_add(len, promote_stats(buf + len, size - len), size);
+	len = stats_add(len, reclaim_stats(buf + len, size - len), size);
+	len = stats_add(len, aggr_stats(buf + len, size - len), size);
+	len = stats_add(len, snap_stats(buf + len, size - len), size);
+	len = stats_add(len, ino_stats(buf + len, size - len), size);
+	len = stats_add(len, snprintf(buf + len, size - len, "attr.atime %s\nattr.atime_updates %lu\n",
+			fs_atime == ATIME_STRICT ? "strict" : fs_atime == ATIME_NOATIME ? "noatime" : "relatime",
+			(unsigned long) __atomic_load_n(&atime_updates, __ATOMIC_RELAXED)), size);
+	len = stats_add(len, slab_stats(buf + len, size - len), size);
+	return len;
+}
+
+// the stats on any dentry, dentry NULL too, the totals on a directory
+int d_getxattr(struct dentry *dentry, const char *name, char *value, size_t size)
+{
+	char buf[STATS_BUF_SIZE];
+	struct d_aggr aggr;
+	int len = 0;
+	int ret = 0;
+	if (strcmp(name, STATS_XATTR) == 0) {
+		len = fs_stats(buf, STATS_BUF_SIZE);
+		if (len >= STATS_BUF_SIZE)
+			len = STATS_BUF_SIZE - 1;
+	} else if (dentry != NULL && (strcmp(name, RFILES_XATTR) == 0 || strcmp(name, RDIRS_XATTR) == 0
+				|| strcmp(name, RBYTES_XATTR) == 0)) {
+		ret = aggr_read(dentry, &aggr);
+		if (ret != SUCCESS)
+			return ret == -ENOTDIR || ret == -EOPNOTSUPP ? -ENODATA : ret;
+		if (strcmp(name, RFILES_XATTR) == 0)
+			len = snprintf(buf, STATS_BUF_SIZE, "%ld", (long) aggr.files);
+		else if (strcmp(name, RDIRS_XATTR) == 0)
+			len = snprintf(buf, STATS_BUF_SIZE, "%ld", (long) aggr.dirs);
+		else
+			len = snprintf(buf, STATS_BUF_SIZE, "%ld", (long) aggr.bytes);
+	} else {
+		return -ENODATA;
+	}
+	if (size == 0)
+		return len;
+	if (size < len)
+		return -ERANGE;
+	memcpy(value, buf, len);
+	return len;
+}
+
+int fs_getxattr(const char *path, const char *name, char *value, size_t size)
+{
+	struct lookup_res lkup_res;
+	int ret = 0;
+	if (path == NULL || strcmp(name, STATS_XATTR) == 0)
+		return d_getxattr(NULL, name, value, size);
+	ret = path_lookup(path, &lkup_res);
+	if (ret == ERROR)
+		ret = -ENOENT;
+	else
+		ret = d_getxattr(lkup_res.dentry, name, value, size);
+	lookup_put(&lkup_res);
+	return ret;
+}
+
 int fs_destroy()
 {
 	int file_count = 0;
-	struct unused_dentry *unused = fs_sb->unused_dentry_tail;
-	struct unused_dentry *p = NULL;
-	struct dirty_dentry *dirty = fs_sb->dirty_dentry_tail;
-	struct dirty_dentry *q = NULL;
+	char stats[STATS_BUF_SIZE];
+	replica_destroy();
+	reclaim_destroy();
+	promote_destroy();
+	file_wb_destroy();
+	uring_destroy();
+	if (fs_stats(stats, STATS_BUF_SIZE) > 0)
+		printf("%s", stats);
+	evict_destroy();
+	pcache_destroy();
+	ino_destroy();
+	struct dentry *unused = fs_sb->unused_dentry_tail;
+	struct dentry *dirty = fs_sb->dirty_dentry_tail;
 	while (unused != NULL) {
 		file_count++;
-		close(unused->dentry->fid);
-		p = unused;
-		unused = p->prev;
-		free(p);
-		p = NULL;
+		close(unused->fid);
+		unused = unused->attr->prev;
 	}
 
 	while (dirty != NULL) {
-		if (get_dentry_flag(dirty->dentry, D_type) == FILE_DENTRY) {
+		if (get_dentry_flag(dirty, D_type) == FILE_DENTRY) {
 			file_count++;
-			close(dirty->dentry->fid);
+			close(dirty->fid);
 		}
-		q = dirty;
-		dirty = q->prev;
-		free(q);
-		q = NULL;
+		dirty = dirty->attr->prev;
 	}
 	destroy_lock();
 	printf("fs_destroy, file count = %d have been closed\n", file_count);
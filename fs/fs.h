@@ -22,8 +22,8 @@
 
 // map config
 #define MAP_KEY_DELIMIT "#"
-#define MAP_KEY_LEN 128
-#define MAP_PRE_KEY_LEN 10    // inode +'#'
+#define MAP_PRE_KEY_LEN 21    // inode +'#', 64 bit inode numbers
+#define MAP_KEY_LEN (MAP_PRE_KEY_LEN + DENTRY_NAME_SIZE)
 
 
 #define ERROR -1
@@ -35,81 +35,291 @@
 
 #define REALLOC_ENABLE true
 
-// for DEBUG
+// statistics, read with getfattr -n user.stackfs.stats
+#define STATS_XATTR "user.stackfs.stats"
+#define STATS_BUF_SIZE 4096
+
+// recursive totals of a directory, see fs/aggr.c
+#define RFILES_XATTR "user.stackfs.rfiles"
+#define RDIRS_XATTR "user.stackfs.rdirs"
+#define RBYTES_XATTR "user.stackfs.rbytes"
+
+// read-only snapshots of a directory, mkdir dir/.snap/<name>; see fs/snap.c
+#define SNAP_DIR ".snap"
+
+// for DEBUG, build with -DFS_NODEBUG to silence
+#ifndef FS_NODEBUG
 #define FS_DEBUG
+#endif
 
 #define likely(x)    __builtin_expect(!!(x), 1)
 #define unlikely(x)  __builtin_expect(!!(x), 0)
 
 
+// readdir offsets, see d_cookie()
+#define D_COOKIE_BASE 3
+#define D_COOKIE_DUP_BITS 20
+#define D_COOKIE_DUP_MASK ((1 << D_COOKIE_DUP_BITS) - 1)
+
+#define DNAME_INLINE_LEN 16    // keeps struct dentry_attr at two cache lines, with d_nodes
+
+/*
+ * A dentry is split in two. The hot header below is one cache line and is
+ * all a path walk reads: the walk descends the parent's d_children by name
+ * hash and only opens the cold dentry_attr to confirm the name on a hash
+ * match. Everything getattr wants lives in the attr block, which comes
+ * from its own slab so the headers of a large namespace pack densely.
+ */
+struct dentry_attr;
+struct snap_data;
+struct snap_version;
+
 struct dentry {
+	struct rb_node node;    // link in the parent's d_children, or in unused_tree while pooled
+	root_t d_children;    // of struct dentry, by (hash, name)
+	uint64_t inode;
+	struct dentry_attr *attr;
+	uint32_t hash;    // of the name
 	uint32_t fid;    // name in lustre
-	uint32_t inode;
-	uint32_t flags;
+	uint16_t flags;
+	uint16_t name_len;
+	uint32_t d_count;    // pins: open handles and lookups in flight, see d_get()
+};
+
+#define D_COUNT_DEAD (1U << 31)    // in d_count, unlinked, the last d_put() releases it
+
+struct dentry_attr {
+	struct dentry *parent;
+	struct dentry *prev;    // dirty or unused list
+	struct dentry *next;
+	uint64_t size;
+	struct timespec atime;
+	struct timespec mtime;
+	struct timespec ctime;
 	uint32_t mode;
-	uint32_t ctime;
-	uint32_t mtime;
-	uint32_t atime;
-	uint32_t size;
 	uint32_t uid;
 	uint32_t gid;
 	uint32_t nlink;
+	union {
+		uint64_t d_seg;    // directories, segment offset of the evicted children, fs/evict.c
+		uint64_t d_counted;    // files, the size the ancestors' totals hold, fs/aggr.c
+		struct snap_data *d_sdata;    // files in a snapshot, the data they read, fs/snap.c
+	};
+	uint32_t d_nodes;    // in the parent's d_children subtree rooted here, see d_nth_child()
+	uint32_t d_saved;    // snapshot epoch the children, or a file's data, are saved for
+	union {
+		char d_iname[DNAME_INLINE_LEN];
+		char *d_lname;
+	};
+};
+
+// a directory's subtree, itself aside; what is in it counts once in every ancestor
+struct d_aggr {
+	int64_t files;    // anything but directories
+	int64_t dirs;
+	int64_t bytes;
 };
 
-struct dirty_dentry {
-	struct dentry *dentry;
-	struct dirty_dentry *prev;
-	struct dirty_dentry *next;
+// a directory's part in snapshots, fs/snap.c
+struct d_snap {
+	struct snap_version *versions;    // children as they were before changes, newest first
+	struct dentry *link;    // a live directory's .snap; in a snapshot, the live directory shown
+	uint32_t epoch;    // newest snapshot taken of it or of a directory it was in; in a snapshot, its own
 };
 
-struct unused_dentry {
-	struct dentry *dentry;
-	struct unused_dentry *prev;
-	struct unused_dentry *next;
+// directories get the totals behind their attr block, from a slab of their own
+struct dentry_dir_attr {
+	struct dentry_attr attr;
+	struct d_aggr aggr;
+	struct d_snap snap;
 };
 
+static inline struct d_aggr *d_aggr(struct dentry *dir)
+{
+	return &(((struct dentry_dir_attr *) dir->attr)->aggr);
+}
+
+static inline struct d_snap *d_snap(struct dentry *dir)
+{
+	return &(((struct dentry_dir_attr *) dir->attr)->snap);
+}
+
+static inline const char *d_name(const struct dentry *dentry)
+{
+	return dentry->name_len < DNAME_INLINE_LEN ? dentry->attr->d_iname : dentry->attr->d_lname;
+}
+
+#define ATTR_LOCK_STRIPES 256
+
+// an attr lock and the sequence count of the dentries hashed to it
+struct attr_stripe {
+	pthread_mutex_t lock;
+	uint32_t seq;    // odd while a writer is in, readers never write it
+} __attribute__((aligned(64)));
+
+// atime policy, fs_atime
+enum {
+	ATIME_RELATIME,    // moved when at or before the mtime or ctime, or a day old
+	ATIME_STRICT,    // moved by every read
+	ATIME_NOATIME,
+};
+#define ATIME_RELATIME_SEC (24 * 3600)
+
+extern int fs_atime;
+
+/*
+ * Lock order, outermost first:
+ *
+ *   tree_rwlock -> snap lock -> evict lock -> dirty_list_rwlock
+ *               -> unused_list_rwlock -> link_tree_rwlock -> aggr slot locks
+ *               -> attr_locks[]
+ *
+ * tree_rwlock covers every d_children and the parent links; a dentry is
+ * only linked or unlinked under it for write. A dentry found under it stays
+ * valid after the unlock as long as it is pinned (d_count), path_lookup()
+ * hands its result back pinned. The cold attr fields of a linked dentry are
+ * written under its attr lock, which also moves the stripe's sequence
+ * count. Readers take no lock and write nothing: they copy between
+ * d_attr_read_begin() and d_attr_read_retry() and go again if a writer
+ * came in. The lock in fs/ino.c and the slab locks are leaves.
+ *
+ * The replica log lock is a leaf as well. A change goes into the log under
+ * the locks it was made under, tree_rwlock at least, so the standby gets
+ * two changes to the same names in the order they happened here.
+ */
 struct fs_super {
 	char alloc_path[PATH_LEN];
 	char mount_point[PATH_LEN];
 	
-	struct dirty_dentry *dirty_dentry_head;
-	struct dirty_dentry *dirty_dentry_tail;
-	struct unused_dentry *unused_dentry_head;
-	struct unused_dentry *unused_dentry_tail;
-	root_t tree;
-	root_t link_tree;
-	uint32_t curr_dir_id;
-	pthread_mutex_t dir_id_lock;
+	struct dentry *dirty_dentry_head;
+	struct dentry *dirty_dentry_tail;
+	struct dentry *unused_dentry_head;
+	struct dentry *unused_dentry_tail;
+	struct dentry *root;
+	root_t link_tree;    // of map_t, symlink target strings
+	root_t unused_tree;    // the unused list again by inode, through dentry->node, under unused_list_rwlock
 	pthread_rwlock_t dirty_list_rwlock;
 	pthread_rwlock_t unused_list_rwlock;
-	pthread_rwlock_t tree_rwlock;
+	pthread_rwlock_t tree_rwlock;    // every d_children
 	pthread_rwlock_t link_tree_rwlock;
+	uint32_t realloc_next;    // next pool file name batch_realloc() may take, under unused_list_rwlock
+	struct attr_stripe attr_locks[ATTR_LOCK_STRIPES];
 };
 
 enum dentryflags {
 	D_type,    // file/dir
 	D_small_file,    // 1 is small file, 0 is normal file
 	D_dirty,
+	D_evicted,    // children are in the eviction segment
+	D_referenced,    // children looked up since the last eviction pass
+	D_promoting,    // queued for fs/promote.c, or tried and failed
+	D_promoted,    // fid is a promoted file, the pool slot is parked
+	D_aggr_queued,    // size change not folded into the ancestors yet
+	D_snapshot,    // in a snapshot or a .snap directory, read-only
+	D_snap_lazy,    // a snapshot directory whose children are not made yet
+	D_snap_shared,    // a live file whose data a snapshot may still read
 };
 
 struct lookup_res {
-	struct dentry *dentry;
-	int p_inode;
+	struct dentry *dentry;    // pinned
+	struct dentry *p_dentry;    // not pinned, only good under tree_rwlock
+	uint64_t p_inode;
 	int error;
 };
 
 
-uint32_t generate_unique_id();
+// namespace index, fs/dentry.c
+void d_cache_init();
+struct dentry *d_alloc();
+struct dentry *d_alloc_dir();
+void d_free(struct dentry *dentry);
+void d_attach(struct dentry *parent, struct dentry *dentry, const char *name);
+uint64_t d_bytes();
+struct dentry *d_lookup(struct dentry *parent, const char *name);
+int d_insert(struct dentry *parent, struct dentry *dentry, const char *name);
+void d_remove(struct dentry *dentry);
+struct dentry *d_first_child(struct dentry *parent);
+struct dentry *d_next_child(struct dentry *dentry);
+struct dentry *d_seek_child(struct dentry *parent, uint32_t hash, const char *name);
+uint32_t d_nr_children(struct dentry *parent);
+struct dentry *d_nth_child(struct dentry *parent, uint32_t n);
+uint32_t d_child_rank(struct dentry *dentry);
+off_t d_cookie(struct dentry *dentry, uint32_t dup);
+struct dentry *d_seek_cookie(struct dentry *parent, off_t off, uint32_t *dup);
+void d_put_name(struct dentry *dentry);
+
+// pin a dentry found under tree_rwlock so it outlives the unlock
+static inline void d_get(struct dentry *dentry)
+{
+	__atomic_add_fetch(&(dentry->d_count), 1, __ATOMIC_RELAXED);
+}
+
+// unlinked, stable under tree_rwlock
+static inline int d_dead(struct dentry *dentry)
+{
+	return (__atomic_load_n(&(dentry->d_count), __ATOMIC_RELAXED) & D_COUNT_DEAD) != 0;
+}
+
+void d_put(struct dentry *dentry);
+void d_put_many(struct dentry *dentry, uint64_t n);
+// tree_rwlock held for write, right after d_remove(); 1 if the caller is to release it
+int d_kill(struct dentry *dentry);
+void d_attr_lock(struct dentry *dentry);
+void d_attr_unlock(struct dentry *dentry);
+uint32_t d_attr_read_begin(struct dentry *dentry);
+// 1 if a writer came in since d_attr_read_begin() returned seq, the copy is thrown away
+int d_attr_read_retry(struct dentry *dentry, uint32_t seq);
+uint64_t d_size(struct dentry *dentry);
+void lookup_put(struct lookup_res *lkup_res);
+
 void set_dentry_flag(struct dentry *dentry, int flag_type, int val);
 int get_dentry_flag(struct dentry *dentry, int flag_type);
 int add_dentry_to_dirty_list(struct dentry *dentry);
 int remove_dentry_from_dirty_list(struct dentry *dentry);
 int add_dentry_to_unused_list(struct dentry *dentry);
 int remove_dentry_from_unused_list(struct dentry *dentry);
+struct dentry *fetch_dentry_from_unused_list();
+void d_recycle(struct dentry *dentry);
+void link_key(char *key, struct dentry *p_dentry, const char *name);
 int charlen(char *str);
 void init_sb(char * mount_point, char * access_point);
 int path_lookup(const char *path, struct lookup_res *lkup_res);
+int __d_path(struct dentry *dentry, char *buf, int size);
+int d_path(struct dentry *dentry, char *buf, int size);
+// tree_rwlock held, a replica_log() record for the change just made to dentry
+void d_log(uint32_t op, struct dentry *dentry, const char *path2, uint32_t mode, uint32_t uid, uint32_t gid,
+		uint64_t ino, int64_t atime, int64_t mtime);
+// pinned or found under tree_rwlock, a getattr reads and never moves the atime
+void d_stat(struct dentry *dentry, struct stat *st);
+// no lock held, 1 if a read of dentry now is to move its atime
+int d_atime_due(struct dentry *dentry);
+// no lock held, a read of dentry, its atime is moved if the policy says so
+void d_accessed(struct dentry *dentry);
+int d_readlink(struct dentry *dentry, char *buf, size_t size);
+int d_truncate(struct dentry *dentry, off_t length);
+void d_written(struct dentry *dentry, off_t offset, size_t ret);
+int d_reclaim(struct dentry *root, int budget);
 void batch_realloc();
+// the pool file behind fd relative to the access point, e.g. "pre_alloc/12"
+int pool_name(int fd, char *buf, int size);
+// replay, the pool file a primary named by pool_name() and its inode, off the unused list
+int take_pool_file(const char *name, uint64_t inode, struct dentry **res);
+void refresh_file_dentries();
+void truncate_unused_files();
+int fs_stats(char *buf, size_t size);
+int d_getxattr(struct dentry *dentry, const char *name, char *value, size_t size);
+
+// by parent dentry and name, the cores of the path ops below and of fs_ll.c
+int fs_lookup_at(struct dentry *p_dentry, const char *name, struct dentry **res);
+int fs_create_at(struct dentry *p_dentry, const char *name, mode_t mode, uint64_t pool_inode, struct dentry **res);
+int fs_create_many_at(struct dentry *p_dentry, const char **names, const mode_t *modes, int nr, int *status, struct dentry **res);
+// ino 0 makes up a new inode number, a standby replays the primary's
+int fs_mkdir_at(struct dentry *p_dentry, const char *name, mode_t mode, uint64_t ino, struct dentry **res);
+int fs_symlink_at(struct dentry *p_dentry, const char *name, struct dentry *target, const char *val, uint64_t ino, struct dentry **res);
+int fs_unlink_at(struct dentry *p_dentry, const char *name);
+int fs_rmdir_at(struct dentry *p_dentry, const char *name);
+int fs_rmtree_at(struct dentry *p_dentry, const char *name);
+int fs_rename_at(struct dentry *p_dentry, const char *name, struct dentry *new_parent, const char *new_name);
 
 // operation interface api
 void fs_init(char * mount_point, char * access_point);
@@ -118,8 +328,12 @@ int fs_open(const char *path, struct fuse_file_info *fileInfo);
 
 int fs_create(const char * path, mode_t mode, struct fuse_file_info * info);
 
+int fs_create_pooled(const char * path, mode_t mode, uint64_t pool_inode, const char *pool_file);
+
 int fs_mkdir(const char *path, mode_t mode);
 
+int fs_mkdir_ino(const char *path, mode_t mode, uint64_t ino);
+
 int fs_opendir(const char *path, struct fuse_file_info *fileInfo);
 
 int fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fileInfo);
@@ -128,12 +342,18 @@ int fs_getattr(const char* path, struct stat* st);
 
 int fs_rmdir(const char *path);
 
+int fs_rmtree(const char *path);
+
 int fs_rename(const char *path, const char *newpath);
 
 int fs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fileInfo);
 
 int fs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fileInfo);
 
+int fs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fileInfo);
+
+int fs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fileInfo);
+
 int fs_release(const char *path, struct fuse_file_info *fileInfo);
 
 int fs_releasedir(const char * path, struct fuse_file_info * info);
@@ -142,6 +362,16 @@ int fs_utimens(const char * path, const struct timespec tv[2]);
 
 int fs_truncate(const char * path, off_t length);
 
+int fs_ftruncate(const char * path, off_t length, struct fuse_file_info *fileInfo);
+
+int fs_fgetattr(const char *path, struct stat *st, struct fuse_file_info *fileInfo);
+
+int fs_flush(const char *path, struct fuse_file_info *fileInfo);
+
+int fs_fsync(const char *path, int datasync, struct fuse_file_info *fileInfo);
+
+int fs_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fileInfo);
+
 int fs_unlink(const char * path);
 
 int fs_chmod(const char * path, mode_t mode);
@@ -152,10 +382,18 @@ int fs_access(const char * path, int amode);
 
 int fs_symlink(const char * oldpath, const char * newpath);
 
+int fs_symlink_ino(const char * oldpath, const char * newpath, uint64_t ino);
+
 int fs_readlink(const char * path, char * buf, size_t size);
 
 int fs_statfs(const char *path, struct statvfs *statv);
 
+int fs_getxattr(const char *path, const char *name, char *value, size_t size);
+
+// fs/ioctl.c, data is the in and out buffer of _IOC_SIZE(cmd) bytes
+int d_ioctl(struct dentry *dentry, unsigned int cmd, void *data);
+int fs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fileInfo, unsigned int flags, void *data);
+
 int fs_destroy();
 
 #endif
\ No newline at end of file
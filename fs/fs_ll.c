@@ -0,0 +1,739 @@
+#define FUSE_USE_VERSION 30
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <fuse_lowlevel.h>
+
+#include "fs.h"
+#include "fs_ll.h"
+#include "replica.h"
+#include "evict.h"
+#include "file.h"
+#include "pcache.h"
+#include "uring.h"
+#include "promote.h"
+#include "reclaim.h"
+#include "snap.h"
+
+/*
+ * Low level frontend. The kernel names every inode by the node id we hand
+ * out in an entry reply, and that id is the struct dentry pointer itself,
+ * so no request walks a path. Each entry reply takes a pin on the dentry
+ * (the kernel's nlookup), forget drops them again; an unlinked dentry is
+ * released by the last of these pins or of its open handles, the same
+ * d_count the path frontend uses. FUSE_ROOT_ID is fs_sb->root and never
+ * pinned. Paths are only built for the replica log, and only when a
+ * standby is attached.
+ */
+
+extern struct fs_super *fs_sb;
+
+// libfuse's own defaults until the command line says otherwise
+struct fs_cache_conf fs_cache = {
+	.entry_timeout = 1.0,
+	.attr_timeout = 1.0,
+	.negative_timeout = 0.0,
+};
+
+/*
+ * Nothing but stackfs changes its namespace or its files, so the kernel may
+ * keep what it has seen for as long as it is told: page cache across opens,
+ * dentries and attributes for the timeouts above, and with writeback the
+ * kernel also owns mtime and size of files it has dirty pages for.
+ */
+void fs_cache_conn(struct fuse_conn_info *conn)
+{
+	if (conn->capable & FUSE_CAP_ASYNC_READ)
+		conn->want |= FUSE_CAP_ASYNC_READ;
+	// payload moves by splice between /dev/fuse and the pooled files, see fs_read_buf()
+	conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+	if (fs_cache.max_write > 0) {
+		if (conn->capable & FUSE_CAP_BIG_WRITES)
+			conn->want |= FUSE_CAP_BIG_WRITES;
+		conn->max_write = fs_cache.max_write;
+	}
+	if (fs_cache.max_readahead > 0)
+		conn->max_readahead = fs_cache.max_readahead;
+	if (fs_cache.writeback) {
+#ifdef FUSE_CAP_WRITEBACK_CACHE
+		if (conn->capable & FUSE_CAP_WRITEBACK_CACHE)
+			conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+		else
+			printf("fs_cache_conn, kernel can not do writeback caching\n");
+#else
+		printf("fs_cache_conn, libfuse has no writeback caching\n");
+#endif
+	}
+	// after the daemon forked, the flusher thread has to live in the child
+	if (file_wb_init(fs_cache.write_behind, fs_cache.write_behind_ms) != SUCCESS)
+		printf("fs_cache_conn, no write behind flusher, writing through\n");
+	if (promote_init(fs_cache.promote_size) != SUCCESS)
+		printf("fs_cache_conn, no promotion thread, large files stay in the pool\n");
+#ifdef FS_DEBUG
+	printf("fs_cache_conn, want = 0x%x, max_write = %u, max_readahead = %u\n", conn->want, conn->max_write, conn->max_readahead);
+#endif
+}
+
+static inline struct dentry *ll_dentry(fuse_ino_t ino)
+{
+	return ino == FUSE_ROOT_ID ? fs_sb->root : (struct dentry *) (uintptr_t) ino;
+}
+
+static inline fuse_ino_t ll_ino(struct dentry *dentry)
+{
+	return dentry == fs_sb->root ? FUSE_ROOT_ID : (fuse_ino_t) (uintptr_t) dentry;
+}
+
+static struct fuse_chan *ll_chan;
+
+// from the reclaim thread, never inside a request, the kernel takes the directory lock for it
+static void ll_inval_entry(struct dentry *parent, const char *name)
+{
+	fuse_lowlevel_notify_inval_entry(ll_chan, ll_ino(parent), name, strlen(name));
+}
+
+void fs_ll_chan(struct fuse_chan *ch)
+{
+	ll_chan = ch;
+	reclaim_notify = ll_inval_entry;
+}
+
+// the kernel holds a pin on dentry, it is handed over with the reply
+static void ll_reply_entry(fuse_req_t req, struct dentry *dentry)
+{
+	struct fuse_entry_param e;
+	memset(&e, 0, sizeof(e));
+	e.ino = ll_ino(dentry);
+	e.attr_timeout = fs_cache.attr_timeout;
+	e.entry_timeout = fs_cache.entry_timeout;
+	d_stat(dentry, &e.attr);
+	if (fuse_reply_entry(req, &e) != 0)
+		d_put(dentry);    // interrupted, the kernel never saw it
+}
+
+static void ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+	fs_cache_conn(conn);
+	// only this frontend can reply after the handler returned, see ll_read_async()
+	uring_init(fs_cache.uring_depth);
+}
+
+static void ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	struct dentry *dentry = NULL;
+	struct fuse_entry_param e;
+	int ret = fs_lookup_at(ll_dentry(parent), name, &dentry);
+	// node id 0 lets the kernel cache the miss
+	if (ret == -ENOENT && fs_cache.negative_timeout > 0) {
+		memset(&e, 0, sizeof(e));
+		e.entry_timeout = fs_cache.negative_timeout;
+		fuse_reply_entry(req, &e);
+		return;
+	}
+	if (ret != SUCCESS) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	ll_reply_entry(req, dentry);
+}
+
+static void ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+	if (ino != FUSE_ROOT_ID)
+		d_put_many(ll_dentry(ino), nlookup);
+	fuse_reply_none(req);
+}
+
+static void ll_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets)
+{
+	size_t i;
+	for (i = 0; i < count; i++) {
+		if (forgets[i].ino != FUSE_ROOT_ID)
+			d_put_many(ll_dentry(forgets[i].ino), forgets[i].nlookup);
+	}
+	fuse_reply_none(req);
+}
+
+static void ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	struct stat st;
+	memset(&st, 0, sizeof(st));
+	d_stat(ll_dentry(ino), &st);
+	fuse_reply_attr(req, &st, fs_cache.attr_timeout);
+}
+
+static void ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi)
+{
+	struct dentry *dentry = ll_dentry(ino);
+	struct stat st;
+	struct timespec now;
+	int64_t atime_ns, mtime_ns;
+	int ret = snap_setattr(dentry);
+	if (ret != SUCCESS) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	if (to_set & FUSE_SET_ATTR_SIZE) {
+		if (fi != NULL)
+			ret = fs_ftruncate(NULL, attr->st_size, fi);
+		else
+			ret = d_truncate(dentry, attr->st_size);
+		if (ret != SUCCESS) {
+			fuse_reply_err(req, -ret);
+			return;
+		}
+	}
+	clock_gettime(CLOCK_REALTIME, &now);
+	// the records go in under the locks, as in fs_chmod()
+	pthread_rwlock_rdlock(&(fs_sb->tree_rwlock));
+	d_attr_lock(dentry);
+	if (to_set & FUSE_SET_ATTR_MODE)
+		dentry->attr->mode = attr->st_mode;
+	if (to_set & FUSE_SET_ATTR_UID)
+		dentry->attr->uid = attr->st_uid;
+	if (to_set & FUSE_SET_ATTR_GID)
+		dentry->attr->gid = attr->st_gid;
+	if (to_set & FUSE_SET_ATTR_ATIME_NOW)
+		dentry->attr->atime = now;
+	else if (to_set & FUSE_SET_ATTR_ATIME)
+		dentry->attr->atime = attr->st_atim;
+	if (to_set & FUSE_SET_ATTR_MTIME_NOW)
+		dentry->attr->mtime = now;
+	else if (to_set & FUSE_SET_ATTR_MTIME)
+		dentry->attr->mtime = attr->st_mtim;
+	dentry->attr->ctime = now;
+	atime_ns = (int64_t) dentry->attr->atime.tv_sec * 1000000000LL + dentry->attr->atime.tv_nsec;
+	mtime_ns = (int64_t) dentry->attr->mtime.tv_sec * 1000000000LL + dentry->attr->mtime.tv_nsec;
+	if (to_set & FUSE_SET_ATTR_MODE)
+		d_log(REPL_CHMOD, dentry, NULL, attr->st_mode, 0, 0, 0, 0, 0);
+	if (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))
+		d_log(REPL_CHOWN, dentry, NULL, 0, (to_set & FUSE_SET_ATTR_UID) ? attr->st_uid : (uid_t) -1,
+				(to_set & FUSE_SET_ATTR_GID) ? attr->st_gid : (gid_t) -1, 0, 0, 0);
+	if (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME | FUSE_SET_ATTR_ATIME_NOW | FUSE_SET_ATTR_MTIME_NOW))
+		d_log(REPL_UTIMENS, dentry, NULL, 0, 0, 0, 0, atime_ns, mtime_ns);
+	d_attr_unlock(dentry);
+	pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
+	memset(&st, 0, sizeof(st));
+	d_stat(dentry, &st);
+	fuse_reply_attr(req, &st, fs_cache.attr_timeout);
+}
+
+static void ll_readlink(fuse_req_t req, fuse_ino_t ino)
+{
+	char buf[PATH_MAX];
+	int ret = d_readlink(ll_dentry(ino), buf, PATH_MAX);
+	if (ret != SUCCESS)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_readlink(req, buf);
+}
+
+// new regular file, pinned once for the kernel and once for fi if given
+static int ll_create_file(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct dentry **res)
+{
+	return fs_create_at(ll_dentry(parent), name, mode, 0, res);
+}
+
+static void ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev)
+{
+	struct dentry *dentry = NULL;
+	int ret = 0;
+	// only regular files have a backend, like fs_create
+	if (!S_ISREG(mode)) {
+		fuse_reply_err(req, ENOSYS);
+		return;
+	}
+	ret = ll_create_file(req, parent, name, mode, &dentry);
+	if (ret != SUCCESS) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	ll_reply_entry(req, dentry);
+}
+
+static void ll_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi)
+{
+	struct dentry *dentry = NULL;
+	struct fs_file *file = NULL;
+	struct fuse_entry_param e;
+	int ret = ll_create_file(req, parent, name, mode, &dentry);
+	if (ret != SUCCESS) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	// one pin for the entry, one for the handle
+	d_get(dentry);
+	file = file_open(dentry, fi->flags);
+	if (file == NULL) {
+		d_put(dentry);
+		d_put(dentry);
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	fi->fh = (uint64_t) file;
+	fi->keep_cache = fs_cache.keep_cache;
+	file_set_info(file, fi);
+	memset(&e, 0, sizeof(e));
+	e.ino = ll_ino(dentry);
+	e.attr_timeout = fs_cache.attr_timeout;
+	e.entry_timeout = fs_cache.entry_timeout;
+	d_stat(dentry, &e.attr);
+	if (fuse_reply_create(req, &e, fi) != 0) {
+		file_close(file);
+		d_put(dentry);
+	}
+}
+
+static void ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+	struct dentry *p_dentry = ll_dentry(parent);
+	struct dentry *dentry = NULL;
+	int ret = fs_mkdir_at(p_dentry, name, mode, 0, &dentry);
+	if (ret != SUCCESS) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	ll_reply_entry(req, dentry);
+}
+
+static void ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	int ret = fs_unlink_at(ll_dentry(parent), name);
+	fuse_reply_err(req, -ret);
+}
+
+static void ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	int ret = fs_rmdir_at(ll_dentry(parent), name);
+	fuse_reply_err(req, -ret);
+}
+
+static void ll_symlink(fuse_req_t req, const char *link, fuse_ino_t parent, const char *name)
+{
+	struct dentry *p_dentry = ll_dentry(parent);
+	struct dentry *dentry = NULL;
+	struct lookup_res lkup_res_buf;
+	struct lookup_res *lkup_res = &lkup_res_buf;
+	int len_mount = strlen(fs_sb->mount_point);
+	int ret = 0;
+	lkup_res->dentry = NULL;
+	// the link shares its target's backend file, so the target has to be ours
+	if (strncmp(link, fs_sb->mount_point, len_mount) != 0 || link[len_mount] != '/') {
+		ret = -ENOSYS;    // not support relative path
+		goto out;
+	}
+	if (path_lookup(&link[len_mount], lkup_res) == ERROR) {
+		ret = -ENOENT;
+		goto out;
+	}
+	ret = fs_symlink_at(p_dentry, name, lkup_res->dentry, link, 0, &dentry);
+out:
+	lookup_put(lkup_res);
+	if (ret != SUCCESS)
+		fuse_reply_err(req, -ret);
+	else
+		ll_reply_entry(req, dentry);
+}
+
+static void ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname)
+{
+	int ret = fs_rename_at(ll_dentry(parent), name, ll_dentry(newparent), newname);
+	fuse_reply_err(req, -ret);
+}
+
+static void ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	struct dentry *dentry = ll_dentry(ino);
+	struct fs_file *file = NULL;
+	if (get_dentry_flag(dentry, D_type) == DIR_DENTRY) {
+		fuse_reply_err(req, EISDIR);
+		return;
+	}
+	if (snap_open(dentry, fi->flags) != SUCCESS) {
+		fuse_reply_err(req, EROFS);
+		return;
+	}
+	// the handle pins the dentry apart from the kernel's lookups
+	d_get(dentry);
+	file = file_open(dentry, fi->flags);
+	if (file == NULL) {
+		d_put(dentry);
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	fi->fh = (uint64_t) file;
+	fi->keep_cache = fs_cache.keep_cache;
+	file_set_info(file, fi);
+	if (fuse_reply_open(req, fi) != 0)
+		file_close(file);
+}
+
+/*
+ * With the io_uring engine on, reads and writes go to the ring and the
+ * worker goes back for the next request; the reaper replies once the
+ * backend is done. The dentry stays pinned until then, the handle may
+ * not be needed by the time it completes.
+ */
+struct ll_io {
+	struct uring_req io;
+	fuse_req_t req;
+	struct dentry *dentry;
+};
+
+static struct ll_io *ll_io_alloc(fuse_req_t req, struct fs_file *file, int op, size_t size, off_t off)
+{
+	struct ll_io *lio = (struct ll_io *) malloc(sizeof(struct ll_io));
+	if (lio == NULL)
+		return NULL;
+	lio->io.buf = size <= URING_BUF_SIZE ? uring_buf_get(&(lio->io.buf_index)) : NULL;
+	if (lio->io.buf == NULL) {
+		lio->io.buf_index = -1;
+		lio->io.buf = (char *) malloc(size);
+		if (lio->io.buf == NULL) {
+			free(lio);
+			return NULL;
+		}
+	}
+	lio->io.op = op;
+	lio->io.len = size;
+	lio->io.off = off;
+	lio->req = req;
+	lio->dentry = file->dentry;
+	d_get(lio->dentry);
+	return lio;
+}
+
+static void ll_io_free(struct ll_io *lio)
+{
+	if (lio->io.buf_index >= 0)
+		uring_buf_put(lio->io.buf_index);
+	else
+		free(lio->io.buf);
+	d_put(lio->dentry);
+	free(lio);
+}
+
+static void ll_read_done(struct uring_req *io, int res)
+{
+	struct ll_io *lio = (struct ll_io *) io;
+	if (res < 0)
+		fuse_reply_err(lio->req, -res);
+	else
+		fuse_reply_buf(lio->req, io->buf, res);
+	promote_async_put(lio->dentry, io->off, 0);
+	ll_io_free(lio);
+}
+
+static void ll_write_done(struct uring_req *io, int res)
+{
+	struct ll_io *lio = (struct ll_io *) io;
+	if (res < 0) {
+		fuse_reply_err(lio->req, -res);
+	} else {
+		d_written(lio->dentry, io->off, res);
+		pcache_invalidate(lio->dentry, io->off, res);
+		fuse_reply_write(lio->req, res);
+	}
+	promote_async_put(lio->dentry, io->off, res > 0 ? res : 0);
+	ll_io_free(lio);
+}
+
+// 1 when the read is answered, now or from the reaper
+static int ll_read_async(fuse_req_t req, size_t size, off_t off, struct fuse_file_info *fi)
+{
+	struct fs_file *file = (struct fs_file *) fi->fh;
+	struct ll_io *lio = NULL;
+	ssize_t ret = 0;
+	// direct handles need aligned requests, they keep to the bounce path;
+	// a snapshot's file may be copied away before the read lands
+	if (!uring_active() || file->dfd >= 0 || get_dentry_flag(file->dentry, D_snapshot))
+		return 0;
+	lio = ll_io_alloc(req, file, URING_READ, size, off);
+	if (lio == NULL)
+		return 0;
+	file_accessed(file);
+	file_read_ahead(file, off, size);
+	// counted until it lands, a promotion waits for it before the old fd goes
+	lio->io.fd = promote_io_begin(file->dentry);
+	ret = pcache_read(file->dentry, lio->io.fd, lio->io.buf, size, off);
+	if (ret == ERROR) {
+		lio->io.done = ll_read_done;
+		promote_async_get(file->dentry);
+		if (uring_submit(&(lio->io)) == SUCCESS) {
+			promote_io_end(file->dentry, off, 0);
+			return 1;
+		}
+		promote_async_put(file->dentry, off, 0);
+		ret = pread(lio->io.fd, lio->io.buf, size, off);
+		if (ret < 0)
+			ret = -errno;
+	}
+	promote_io_end(file->dentry, off, 0);
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_buf(req, lio->io.buf, ret);
+	ll_io_free(lio);
+	return 1;
+}
+
+// the payload is copied out of the request first, the ring needs it to stay put
+static int ll_write_async(fuse_req_t req, struct fuse_bufvec *bufv, off_t off, struct fuse_file_info *fi)
+{
+	struct fs_file *file = (struct fs_file *) fi->fh;
+	struct fuse_bufvec mem = FUSE_BUFVEC_INIT(fuse_buf_size(bufv));
+	struct ll_io *lio = NULL;
+	ssize_t ret = 0;
+	// coalesced writes stay with the handle, see file_write(); an error goes
+	// back from the sync path
+	if (!uring_active() || file->wb_size != 0 || file->dfd >= 0)
+		return 0;
+	if (snap_write(file->dentry, file) != SUCCESS)
+		return 0;
+	lio = ll_io_alloc(req, file, URING_WRITE, mem.buf[0].size, off);
+	if (lio == NULL)
+		return 0;
+	mem.buf[0].mem = lio->io.buf;
+	ret = fuse_buf_copy(&mem, bufv, 0);
+	if (ret <= 0) {
+		if (ret < 0)
+			fuse_reply_err(req, -ret);
+		else
+			fuse_reply_write(req, 0);
+		ll_io_free(lio);
+		return 1;
+	}
+	lio->io.len = ret;
+	lio->io.done = ll_write_done;
+	// counted until it lands, a promotion waits for it before the swap
+	lio->io.fd = promote_io_begin(file->dentry);
+	promote_async_get(file->dentry);
+	if (uring_submit(&(lio->io)) != SUCCESS) {
+		ret = pwrite(lio->io.fd, lio->io.buf, ret, off);
+		ll_write_done(&(lio->io), ret < 0 ? -errno : ret);
+	}
+	promote_io_end(file->dentry, off, 0);
+	return 1;
+}
+
+// the reply is spliced straight from the pooled fd where the kernel allows
+static void ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+{
+	struct fuse_bufvec *bufv = NULL;
+	int ret = 0;
+	if (ll_read_async(req, size, off, fi))
+		return;
+	ret = fs_read_buf(NULL, &bufv, size, off, fi);
+	if (ret < 0) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+	if (bufv->buf[0].flags & FUSE_BUF_IS_FD)
+		promote_async_put(((struct fs_file *) fi->fh)->dentry, off, 0);
+	free(bufv->buf[0].mem);    // a page cache hit
+	free(bufv);
+}
+
+static void ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t off, struct fuse_file_info *fi)
+{
+	int ret = 0;
+	if (ll_write_async(req, bufv, off, fi))
+		return;
+	ret = fs_write_buf(NULL, bufv, off, fi);
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_write(req, ret);
+}
+
+static void ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	fuse_reply_err(req, -fs_flush(NULL, fi));
+}
+
+static void ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
+{
+	fuse_reply_err(req, -fs_fsync(NULL, datasync, fi));
+}
+
+static void ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length, struct fuse_file_info *fi)
+{
+	fuse_reply_err(req, -fs_fallocate(NULL, mode, offset, length, fi));
+}
+
+static void ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	fs_release(NULL, fi);
+	fuse_reply_err(req, 0);
+}
+
+static void ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	struct dentry *dentry = ll_dentry(ino);
+	if (get_dentry_flag(dentry, D_type) != DIR_DENTRY) {
+		fuse_reply_err(req, ENOTDIR);
+		return;
+	}
+	d_get(dentry);
+	fi->fh = (uint64_t) dentry;
+	if (fuse_reply_open(req, fi) != 0)
+		d_put(dentry);
+}
+
+// fills buf from offset off on, "." and ".." are 0 and 1, children go by d_cookie()
+static size_t ll_fill_dir(fuse_req_t req, struct dentry *p_dentry, char *buf, size_t size, off_t off)
+{
+	struct dentry *dentry = NULL;
+	struct dentry *prev = NULL;
+	struct stat st;
+	size_t pos = 0, len = 0;
+	uint32_t dup = 0;
+	memset(&st, 0, sizeof(st));
+	for (; off < 2; off++) {
+		st.st_ino = off == 0 || p_dentry->attr->parent == NULL ? p_dentry->inode : p_dentry->attr->parent->inode;
+		st.st_mode = S_IFDIR;
+		len = fuse_add_direntry(req, buf + pos, size - pos, off == 0 ? "." : "..", &st, off + 1);
+		if (len > size - pos)
+			return pos;
+		pos += len;
+	}
+	for (dentry = d_seek_cookie(p_dentry, off, &dup); dentry; dentry = d_next_child(dentry)) {
+		if (prev != NULL)
+			dup = dentry->hash == prev->hash ? dup + 1 : 0;
+		prev = dentry;
+		st.st_ino = dentry->inode;
+		st.st_mode = dentry->attr->mode & S_IFMT;
+		len = fuse_add_direntry(req, buf + pos, size - pos, d_name(dentry), &st, d_cookie(dentry, dup));
+		if (len > size - pos)
+			break;
+		pos += len;
+	}
+	return pos;
+}
+
+static void ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+{
+	struct dentry *p_dentry = (struct dentry *) fi->fh;
+	char *buf = (char *) malloc(size);
+	size_t pos = 0;
+	if (buf == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	if (off == 0)
+		d_accessed(p_dentry);
+	pthread_rwlock_rdlock(&(fs_sb->tree_rwlock));
+	d_reference(p_dentry);
+	if (d_ensure(p_dentry) != SUCCESS) {
+		pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
+		free(buf);
+		fuse_reply_err(req, EIO);
+		return;
+	}
+	pos = ll_fill_dir(req, p_dentry, buf, size, off);
+	pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
+	fuse_reply_buf(req, buf, pos);
+	free(buf);
+}
+
+static void ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	fs_releasedir(NULL, fi);
+	fuse_reply_err(req, 0);
+}
+
+static void ll_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+	struct statvfs statv;
+	if (fs_statfs(NULL, &statv) != 0)
+		fuse_reply_err(req, errno);
+	else
+		fuse_reply_statfs(req, &statv);
+}
+
+static void ll_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size)
+{
+	char *value = NULL;
+	int ret = 0;
+	if (size > 0) {
+		value = (char *) malloc(size);
+		if (value == NULL) {
+			fuse_reply_err(req, ENOMEM);
+			return;
+		}
+	}
+	ret = d_getxattr(ll_dentry(ino), name, value, size);
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else if (size == 0)
+		fuse_reply_xattr(req, ret);
+	else
+		fuse_reply_buf(req, value, ret);
+	free(value);
+}
+
+// restricted ioctls only, the argument comes in and goes back in one buffer
+static void ll_ioctl(fuse_req_t req, fuse_ino_t ino, int cmd, void *arg, struct fuse_file_info *fi, unsigned flags, const void *in_buf, size_t in_bufsz, size_t out_bufsz)
+{
+	size_t size = _IOC_SIZE((unsigned int) cmd);
+	char *data = NULL;
+	int ret = 0;
+	if (flags & FUSE_IOCTL_COMPAT) {
+		fuse_reply_err(req, ENOSYS);
+		return;
+	}
+	if (in_bufsz > size || out_bufsz > size) {
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+	data = (char *) calloc(1, size > 0 ? size : 1);
+	if (data == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	memcpy(data, in_buf, in_bufsz);
+	ret = d_ioctl(ll_dentry(ino), (unsigned int) cmd, data);
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_ioctl(req, ret, data, out_bufsz);
+	free(data);
+}
+
+struct fuse_lowlevel_ops fs_ll_ops =
+{
+	.init = ll_init,
+	.lookup = ll_lookup,
+	.forget = ll_forget,
+	.forget_multi = ll_forget_multi,
+	.getattr = ll_getattr,
+	.setattr = ll_setattr,
+	.readlink = ll_readlink,
+	.mknod = ll_mknod,
+	.mkdir = ll_mkdir,
+	.unlink = ll_unlink,
+	.rmdir = ll_rmdir,
+	.symlink = ll_symlink,
+	.rename = ll_rename,
+	.open = ll_open,
+	.read = ll_read,
+	.write_buf = ll_write_buf,
+	.flush = ll_flush,
+	.fsync = ll_fsync,
+	.fallocate = ll_fallocate,
+	.release = ll_release,
+	.opendir = ll_opendir,
+	.readdir = ll_readdir,
+	.releasedir = ll_releasedir,
+	.statfs = ll_statfs,
+	.getxattr = ll_getxattr,
+	.create = ll_create,
+	.ioctl = ll_ioctl,
+};
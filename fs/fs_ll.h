@@ -0,0 +1,35 @@
+#ifndef FS_LL_H
+#define FS_LL_H
+
+#define FUSE_USE_VERSION 30
+#include <stdint.h>
+#include <fuse_lowlevel.h>
+
+// kernel side caching, filled in from the command line before mounting
+struct fs_cache_conf {
+	double entry_timeout;    // seconds
+	double attr_timeout;
+	double negative_timeout;
+	unsigned max_write;    // bytes, 0 keeps the default
+	unsigned max_readahead;
+	unsigned max_read;
+	int keep_cache;    // page cache survives close and reopen
+	int writeback;
+	// ours, small writes coalesce per handle, see file_write()
+	unsigned write_behind;    // bytes, 0 writes straight through
+	unsigned write_behind_ms;    // 0 keeps FILE_WB_INTERVAL_MS
+	unsigned uring_depth;    // backend requests in flight on io_uring, 0 stays on pread/pwrite
+	uint64_t promote_size;    // bytes, larger files move off the pool, see fs/promote.c
+};
+
+extern struct fs_cache_conf fs_cache;
+
+// the init hook of both frontends
+void fs_cache_conn(struct fuse_conn_info *conn);
+
+// inode based frontend, node ids are struct dentry pointers
+extern struct fuse_lowlevel_ops fs_ll_ops;
+// the mounted channel, for telling the kernel about subtrees fs_rmtree_at() removed
+void fs_ll_chan(struct fuse_chan *ch);
+
+#endif
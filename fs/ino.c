@@ -0,0 +1,198 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <pthread.h>
+
+#include "fs.h"
+#include "ino.h"
+
+/*
+ * Inode numbers of what has no backend file: directories, symlinks and
+ * snapshot entries. Files report the st_ino of their pooled backend file,
+ * so these all have INO_SYNTH set and the two never meet.
+ *
+ * A thread takes INO_LEASE ids at a time from the shared counter with
+ * one atomic add and hands them out with no lock at all. The counter
+ * never passes the high-water mark in INO_FILE: the lease that would
+ * moves the mark INO_MARK_STEP ahead and syncs it first, once per
+ * thousand leases. A restart goes on from the mark, so an id the kernel
+ * or an NFS client may still hold is never given to something else.
+ *
+ * A standby shares the access point and the file with its primary. The
+ * mark is written under flock() to the slot holding the lower of two,
+ * never below what is there, so a torn write or the other process
+ * only ever costs ids, never hands one out twice.
+ */
+
+#define INO_MAGIC 0x73666e6f69646d6bULL
+
+struct ino_slot {
+	uint64_t magic;
+	uint64_t mark;
+	uint64_t sum;
+};
+
+struct ino_stats {
+	uint64_t leases;
+	uint64_t marks;    // mark writes
+	uint64_t adopted;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	int fd;
+	uint64_t next;    // the counter, INO_SYNTH off
+	uint64_t mark;    // persisted, next never passes it
+} in = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.fd = -1,
+	.next = INO_ROOT + 1,
+	.mark = UINT64_MAX,    // no file, nothing to keep
+};
+
+static struct ino_stats ist;
+
+__thread struct ino_lease ino_lease;
+
+static inline uint64_t slot_sum(struct ino_slot *slot)
+{
+	return slot->magic ^ (slot->mark * 31);
+}
+
+// flock() held, the higher valid mark on disk, 0 for none; *low is the slot to write
+static uint64_t mark_read(int *low)
+{
+	struct ino_slot slots[2];
+	uint64_t mark[2] = {0, 0};
+	int i;
+	memset(slots, 0, sizeof(slots));
+	if (pread(in.fd, slots, sizeof(slots), 0) < 0)
+		memset(slots, 0, sizeof(slots));
+	for (i = 0; i < 2; i++) {
+		if (slots[i].magic == INO_MAGIC && slots[i].sum == slot_sum(&slots[i]))
+			mark[i] = slots[i].mark;
+	}
+	*low = mark[0] <= mark[1] ? 0 : 1;
+	return mark[1 - *low];
+}
+
+// in.lock held, the mark on disk at least mark, what it is now
+static uint64_t mark_write(uint64_t mark)
+{
+	struct ino_slot slot;
+	uint64_t disk = 0;
+	int low = 0;
+	if (in.fd < 0)
+		return mark;
+	if (flock(in.fd, LOCK_EX) != 0)
+		return mark;
+	disk = mark_read(&low);
+	if (disk >= mark) {
+		flock(in.fd, LOCK_UN);
+		return disk;
+	}
+	slot.magic = INO_MAGIC;
+	slot.mark = mark;
+	slot.sum = slot_sum(&slot);
+	if (pwrite(in.fd, &slot, sizeof(slot), low * sizeof(slot)) != sizeof(slot) || fdatasync(in.fd) != 0)
+		// ids stay unique for this run, only a restart could hand them out again
+		printf("ino, mark %lu not persisted, errno = %d\n", (unsigned long) mark, errno);
+	else
+		__atomic_add_fetch(&(ist.marks), 1, __ATOMIC_RELAXED);
+	flock(in.fd, LOCK_UN);
+	return mark;
+}
+
+// the counter may go up to need, blocks until the mark past it is on disk
+static void mark_ahead(uint64_t need)
+{
+	pthread_mutex_lock(&(in.lock));
+	if (need > in.mark)
+		__atomic_store_n(&(in.mark), mark_write((need / INO_MARK_STEP + 1) * INO_MARK_STEP), __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&(in.lock));
+}
+
+int ino_init(const char *dir)
+{
+	char path[PATH_MAX];
+	snprintf(path, PATH_MAX, "%s/%s", dir, INO_FILE);
+	in.fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (in.fd < 0) {
+		printf("ino, open %s failed, errno = %d, ids start over on restart\n", path, errno);
+		return ERROR;
+	}
+	ino_resume();
+#ifdef FS_DEBUG
+	printf("ino, %s, ids from %lu up to %lu\n", path, (unsigned long) in.next, (unsigned long) in.mark);
+#endif
+	return SUCCESS;
+}
+
+void ino_resume()
+{
+	uint64_t disk = 0;
+	int low = 0;
+	if (in.fd < 0)
+		return;
+	pthread_mutex_lock(&(in.lock));
+	if (flock(in.fd, LOCK_SH) == 0) {
+		disk = mark_read(&low);
+		flock(in.fd, LOCK_UN);
+	}
+	// everything below the mark may have been handed out before
+	if (disk > in.next)
+		__atomic_store_n(&(in.next), disk, __ATOMIC_RELAXED);
+	__atomic_store_n(&(in.mark), in.next, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&(in.lock));
+	// the thread's lease may be from before
+	ino_lease.next = ino_lease.end;
+	mark_ahead(__atomic_load_n(&(in.next), __ATOMIC_RELAXED) + 1);
+}
+
+void ino_destroy()
+{
+	if (in.fd < 0)
+		return;
+	close(in.fd);
+	in.fd = -1;
+}
+
+uint64_t ino_refill()
+{
+	uint64_t start = __atomic_fetch_add(&(in.next), INO_LEASE, __ATOMIC_RELAXED);
+	if (start + INO_LEASE > __atomic_load_n(&(in.mark), __ATOMIC_ACQUIRE))
+		mark_ahead(start + INO_LEASE);
+	__atomic_add_fetch(&(ist.leases), 1, __ATOMIC_RELAXED);
+	ino_lease.next = INO_SYNTH | start;
+	ino_lease.end = ino_lease.next + INO_LEASE;
+	return ino_lease.next++;
+}
+
+void ino_adopt(uint64_t ino)
+{
+	uint64_t next = 0;
+	if (!(ino & INO_SYNTH))
+		return;
+	ino &= ~INO_SYNTH;
+	next = __atomic_load_n(&(in.next), __ATOMIC_RELAXED);
+	while (next <= ino && !__atomic_compare_exchange_n(&(in.next), &next, ino + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+	// what is left of ours may lie below it
+	ino_lease.next = ino_lease.end;
+	__atomic_add_fetch(&(ist.adopted), 1, __ATOMIC_RELAXED);
+}
+
+int ino_stats(char *buf, size_t size)
+{
+	return snprintf(buf, size, "ino.next %lu\nino.mark %lu\nino.leases %lu\nino.marks %lu\nino.adopted %lu\n",
+			(unsigned long) __atomic_load_n(&(in.next), __ATOMIC_RELAXED),
+			(unsigned long) __atomic_load_n(&(in.mark), __ATOMIC_RELAXED),
+			(unsigned long) __atomic_load_n(&(ist.leases), __ATOMIC_RELAXED),
+			(unsigned long) __atomic_load_n(&(ist.marks), __ATOMIC_RELAXED),
+			(unsigned long) __atomic_load_n(&(ist.adopted), __ATOMIC_RELAXED));
+}
@@ -0,0 +1,47 @@
+#ifndef INO_H
+#define INO_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "fs.h"
+
+#define INO_ROOT 1    // FUSE's root id, no backend file system hands it to a regular file
+#define INO_SYNTH (1ULL << 63)    // set in every id made up here, never in a backend st_ino
+#define INO_LEASE 1024    // ids a thread takes at once
+#define INO_MARK_STEP (1ULL << 20)    // ids the persisted mark moves ahead by
+#define INO_FILE "stackfs.ino"    // in the access point
+
+struct ino_lease {
+	uint64_t next;
+	uint64_t end;
+};
+
+extern __thread struct ino_lease ino_lease;
+
+// the high-water mark in dir, made on first use
+int ino_init(const char *dir);
+// ids go on past the mark on disk, a standby taking over calls it
+void ino_resume();
+void ino_destroy();
+
+// a lease is used up, the next one from the shared counter
+uint64_t ino_refill();
+
+/*
+ * An id for a directory, symlink or snapshot entry, one no earlier run
+ * handed out either. Files take the st_ino of their backend file.
+ */
+static inline uint64_t ino_alloc()
+{
+	if (unlikely(ino_lease.next == ino_lease.end))
+		return ino_refill();
+	return ino_lease.next++;
+}
+
+// a standby replaying an id its primary handed out, its own ones go past it
+void ino_adopt(uint64_t ino);
+
+int ino_stats(char *buf, size_t size);
+
+#endif
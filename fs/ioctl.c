@@ -0,0 +1,205 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "fs.h"
+#include "file.h"
+#include "evict.h"
+#include "ioctl.h"
+#include "aggr.h"
+
+/*
+ * ioctls, the calls of client/stackfs.c that do the work of many FUSE
+ * requests in one. The argument structs are in ioctl.h. Both frontends
+ * hand d_ioctl() the dentry the ioctl was issued on and the argument
+ * buffer, which goes back to the caller as it is left here.
+ */
+
+extern struct fs_super *fs_sb;
+
+// the records of a batch, checked against the data area
+static int unpack_names(struct stackfs_create_batch *batch, const char **names, mode_t *modes, int *status)
+{
+	struct stackfs_name_rec *rec = NULL;
+	uint32_t pos = 0;
+	uint32_t i;
+	for (i = 0; i < batch->nr; i++) {
+		rec = (struct stackfs_name_rec *) &(batch->data[pos]);
+		if (pos + sizeof(*rec) > STACKFS_BATCH_DATA || pos + stackfs_rec_size(rec->len) > STACKFS_BATCH_DATA)
+			return -EINVAL;
+		pos += stackfs_rec_size(rec->len);
+		// names go to the core NUL terminated, the record's own bytes are copied
+		names[i] = strndup(rec->name, rec->len);
+		modes[i] = rec->mode;
+		if (names[i] == NULL)
+			return -ENOMEM;
+		if (rec->len == 0 || memchr(rec->name, '/', rec->len) != NULL || memchr(rec->name, '\0', rec->len) != NULL
+				|| strcmp(names[i], ".") == 0 || strcmp(names[i], "..") == 0)
+			status[i] = -EINVAL;
+		else if (!S_ISREG(rec->mode) && (rec->mode & S_IFMT) != 0)
+			status[i] = -EINVAL;
+	}
+	return SUCCESS;
+}
+
+static int ioc_create_batch(struct dentry *dentry, struct stackfs_create_batch *batch)
+{
+	const char *names[STACKFS_BATCH_MAX];
+	mode_t modes[STACKFS_BATCH_MAX];
+	int status[STACKFS_BATCH_MAX];
+	struct dentry *res[STACKFS_BATCH_MAX];
+	int ret = 0;
+	uint32_t i;
+	batch->done = 0;
+	if (batch->nr > STACKFS_BATCH_MAX)
+		return -EINVAL;
+	if (batch->nr == 0)
+		return SUCCESS;
+	memset(names, 0, sizeof(names));
+	memset(status, 0, sizeof(status));
+	ret = unpack_names(batch, names, modes, status);
+	if (ret != SUCCESS)
+		goto out;
+	ret = fs_create_many_at(dentry, names, modes, batch->nr, status, res);
+	if (ret < 0)
+		goto out;
+	batch->done = ret;
+	for (i = 0; i < batch->nr; i++) {
+		batch->status[i] = status[i];
+		if (status[i] == SUCCESS)
+			d_put(res[i]);
+	}
+	ret = SUCCESS;
+out:
+	for (i = 0; i < batch->nr && i < STACKFS_BATCH_MAX; i++)
+		free((char *) names[i]);
+	return ret;
+}
+
+static inline int64_t ts_ns(const struct timespec *ts)
+{
+	return (int64_t) ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+// one tree_rwlock read section per call, from the cookie on until data is full
+static int ioc_bulkstat(struct dentry *dentry, struct stackfs_bulkstat *bulk)
+{
+	struct stackfs_stat_rec *rec = NULL;
+	struct dentry *child = NULL;
+	struct stat st;
+	char cookie[STACKFS_BULK_NAME];
+	uint32_t size = 0;
+	if (get_dentry_flag(dentry, D_type) != DIR_DENTRY)
+		return -ENOTDIR;
+	if (bulk->cookie_len >= STACKFS_BULK_NAME)
+		return -EINVAL;
+	memcpy(cookie, bulk->cookie, bulk->cookie_len);
+	cookie[bulk->cookie_len] = '\0';
+	bulk->nr = 0;
+	bulk->used = 0;
+	memset(&st, 0, sizeof(st));
+	pthread_rwlock_rdlock(&(fs_sb->tree_rwlock));
+	d_reference(dentry);
+	if (d_ensure(dentry) != SUCCESS) {
+		pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
+		return -EIO;
+	}
+	if (bulk->flags & STACKFS_BULK_RANK)
+		child = d_nth_child(dentry, bulk->rank);
+	else if (bulk->cookie_len == 0)
+		child = d_first_child(dentry);
+	else
+		child = d_seek_child(dentry, bulk->cookie_hash, cookie);
+	bulk->flags = 0;
+	bulk->total = d_nr_children(dentry);
+	bulk->rank = child != NULL ? d_child_rank(child) : bulk->total;
+	for (; child; child = d_next_child(child)) {
+		size = stackfs_stat_size(child->name_len);
+		if (bulk->used + size > STACKFS_BULK_DATA)
+			break;
+		rec = (struct stackfs_stat_rec *) &(bulk->data[bulk->used]);
+		d_stat(child, &st);
+		memset(rec, 0, size);
+		rec->reclen = size;
+		rec->len = child->name_len;
+		rec->mode = st.st_mode;
+		rec->ino = st.st_ino;
+		rec->size = st.st_size;
+		rec->nlink = st.st_nlink;
+		rec->uid = st.st_uid;
+		rec->gid = st.st_gid;
+		rec->atime_ns = ts_ns(&st.st_atim);
+		rec->mtime_ns = ts_ns(&st.st_mtim);
+		rec->ctime_ns = ts_ns(&st.st_ctim);
+		memcpy(rec->name, d_name(child), child->name_len);
+		bulk->used += size;
+		bulk->nr++;
+		bulk->cookie_hash = child->hash;
+		bulk->cookie_len = child->name_len;
+		memcpy(bulk->cookie, d_name(child), child->name_len);
+	}
+	if (child == NULL)
+		bulk->flags |= STACKFS_BULK_EOF;
+	pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
+	return SUCCESS;
+}
+
+static int ioc_rmtree(struct dentry *dentry, struct stackfs_rmtree *rm)
+{
+	char name[STACKFS_RMTREE_NAME];
+	if (rm->flags != 0 || rm->len == 0 || rm->len >= STACKFS_RMTREE_NAME)
+		return -EINVAL;
+	if (memchr(rm->name, '/', rm->len) != NULL || memchr(rm->name, '\0', rm->len) != NULL)
+		return -EINVAL;
+	memcpy(name, rm->name, rm->len);
+	name[rm->len] = '\0';
+	return fs_rmtree_at(dentry, name);
+}
+
+static int ioc_dirstat(struct dentry *dentry, struct stackfs_dirstat *ds)
+{
+	struct d_aggr aggr;
+	int ret = aggr_read(dentry, &aggr);
+	if (ret != SUCCESS)
+		return ret;
+	ds->files = aggr.files;
+	ds->dirs = aggr.dirs;
+	ds->bytes = aggr.bytes;
+	return SUCCESS;
+}
+
+// a pinned dentry, data is _IOC_SIZE(cmd) bytes
+int d_ioctl(struct dentry *dentry, unsigned int cmd, void *data)
+{
+#ifdef FS_DEBUG
+	printf("d_ioctl, cmd = %x on dentry inode = %lu\n", cmd, (unsigned long)dentry->inode);
+#endif
+	switch (cmd) {
+	case STACKFS_IOC_CREATE_BATCH:
+		return ioc_create_batch(dentry, (struct stackfs_create_batch *) data);
+	case STACKFS_IOC_BULKSTAT:
+		return ioc_bulkstat(dentry, (struct stackfs_bulkstat *) data);
+	case STACKFS_IOC_RMTREE:
+		return ioc_rmtree(dentry, (struct stackfs_rmtree *) data);
+	case STACKFS_IOC_DIRSTAT:
+		return ioc_dirstat(dentry, (struct stackfs_dirstat *) data);
+	default:
+		return -ENOTTY;
+	}
+}
+
+int fs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fileInfo, unsigned int flags, void *data)
+{
+	struct dentry *dentry = NULL;
+	if (flags & FUSE_IOCTL_COMPAT)
+		return -ENOSYS;
+	// a directory handle is the dentry itself, see fs_opendir()
+	if (flags & FUSE_IOCTL_DIR)
+		dentry = (struct dentry *) fileInfo->fh;
+	else
+		dentry = ((struct fs_file *) fileInfo->fh)->dentry;
+	return d_ioctl(dentry, (unsigned int) cmd, data);
+}
@@ -0,0 +1,124 @@
+#ifndef IOCTL_H
+#define IOCTL_H
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+/*
+ * ioctls on stackfs files and directories, shared with client/stackfs.c,
+ * so nothing here may pull in fuse or the fs core. FUSE only passes
+ * restricted ioctls, the kernel copies _IOC_SIZE(cmd) bytes each way, so
+ * every argument is one fixed size struct below 16 KB and the client
+ * repeats a call until all its records went through.
+ */
+
+#define STACKFS_IOC_MAGIC 'S'
+
+#define STACKFS_BATCH_MAX 256    // records per call
+#define STACKFS_BATCH_DATA 15344    // keeps the struct below _IOC_SIZE's 14 bits
+#define STACKFS_REC_ALIGN 4
+
+// one name in stackfs_create_batch.data, the next starts STACKFS_REC_ALIGN aligned
+struct stackfs_name_rec {
+	uint32_t mode;
+	uint16_t len;    // of name, no NUL
+	uint16_t pad;
+	char name[];
+};
+
+// regular files in the directory the ioctl is issued on, bound to pooled backend files
+struct stackfs_create_batch {
+	uint32_t nr;    // in, records in data
+	uint32_t done;    // out, files made
+	int32_t status[STACKFS_BATCH_MAX];    // out, 0 or -errno per record
+	char data[STACKFS_BATCH_DATA];    // in
+};
+
+#define STACKFS_IOC_CREATE_BATCH _IOWR(STACKFS_IOC_MAGIC, 1, struct stackfs_create_batch)
+
+#define STACKFS_BULK_DATA 16096
+#define STACKFS_BULK_NAME 256
+#define STACKFS_BULK_EOF 1
+#define STACKFS_BULK_RANK 2
+
+// one child in stackfs_bulkstat.data, the next starts reclen bytes on
+struct stackfs_stat_rec {
+	uint16_t reclen;
+	uint16_t len;    // of name, NUL terminated after it
+	uint32_t mode;
+	uint64_t ino;
+	uint64_t size;
+	uint32_t nlink;
+	uint32_t uid;
+	uint32_t gid;
+	uint32_t pad;
+	int64_t atime_ns;
+	int64_t mtime_ns;
+	int64_t ctime_ns;
+	char name[];
+};
+
+/*
+ * Names and attributes of the children of the directory the ioctl is
+ * issued on, as many as fit in data per call. The cookie is the last
+ * child returned, in the directory's own order, so a listing resumed
+ * after inserts or deletes neither repeats nor skips a child that was
+ * there all along. Zero the struct to start, call again as it comes
+ * back until flags has STACKFS_BULK_EOF. With STACKFS_BULK_RANK set the
+ * call starts at the child of that rank instead, found in O(log n), so
+ * a huge directory splits into ranges for parallel listers.
+ */
+struct stackfs_bulkstat {
+	uint32_t cookie_hash;    // in and out
+	uint16_t cookie_len;    // in and out, 0 starts at the first child
+	uint16_t flags;    // STACKFS_BULK_RANK in, STACKFS_BULK_EOF out
+	uint32_t nr;    // out, records in data
+	uint32_t used;    // out, bytes of data
+	uint32_t rank;    // in with STACKFS_BULK_RANK; out, of the first record
+	uint32_t total;    // out, children of the directory
+	char cookie[STACKFS_BULK_NAME];    // in and out
+	char data[STACKFS_BULK_DATA];    // out
+};
+
+#define STACKFS_IOC_BULKSTAT _IOWR(STACKFS_IOC_MAGIC, 2, struct stackfs_bulkstat)
+
+#define STACKFS_RMTREE_NAME 256
+
+/*
+ * Removes the directory name in the one the ioctl is issued on, with all
+ * below it. It is gone from the namespace when the call returns, its
+ * files are recycled in the background.
+ */
+struct stackfs_rmtree {
+	uint32_t len;    // of name, no NUL
+	uint32_t flags;    // none yet, 0
+	char name[STACKFS_RMTREE_NAME];
+};
+
+#define STACKFS_IOC_RMTREE _IOW(STACKFS_IOC_MAGIC, 3, struct stackfs_rmtree)
+
+/*
+ * What is below the directory the ioctl is issued on, at any depth,
+ * kept up as the tree changes so the call costs the same for a subtree
+ * of ten files or ten million.
+ */
+struct stackfs_dirstat {
+	uint64_t files;    // anything but directories, symlinks too
+	uint64_t dirs;
+	uint64_t bytes;    // file sizes
+};
+
+#define STACKFS_IOC_DIRSTAT _IOR(STACKFS_IOC_MAGIC, 4, struct stackfs_dirstat)
+
+static inline uint32_t stackfs_stat_size(uint32_t len)
+{
+	return (sizeof(struct stackfs_stat_rec) + len + 1 + 7) & ~(uint32_t) 7;
+}
+
+static inline uint32_t stackfs_rec_size(uint32_t len)
+{
+	uint32_t size = sizeof(struct stackfs_name_rec) + len;
+	return (size + STACKFS_REC_ALIGN - 1) & ~(uint32_t) (STACKFS_REC_ALIGN - 1);
+}
+
+#endif
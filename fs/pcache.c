@@ -0,0 +1,334 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "fs.h"
+#include "pcache.h"
+
+/*
+ * Page cache for small files, read many times over (training sets of
+ * small images). Pages of PCACHE_PAGE bytes are keyed by dentry and page
+ * index. The first read of a file no larger than max_file fetches all of
+ * it with one pread and caches every page, later reads are served from
+ * memory. Larger files are left to the backend and the readahead in
+ * fs/file.c.
+ *
+ * The frames are a fixed array, reclaimed with CLOCK: a hit sets the
+ * reference bit, the hand clears it and takes the first frame found
+ * clear. Readers pin a frame while copying out of it, so the map and the
+ * hand are the only things under pc.lock.
+ *
+ * Anything that changes the backend file invalidates the pages it covers
+ * afterwards, and bumps the sequence of the dentry's stripe. A fill only
+ * goes in when the sequence it sampled before its pread is unchanged, so
+ * data read before a write can not land in the cache after it. Dentries
+ * invalidate their whole range before they are recycled or freed, since
+ * the key is their address.
+ */
+
+struct pc_page {
+	struct dentry *dentry;    // NULL when free
+	uint32_t index;
+	uint32_t len;    // valid bytes, short only on the last page of a file
+	uint32_t pins;    // readers copying out, taken under pc.lock
+	uint32_t ref;    // CLOCK reference bit
+	int32_t next;    // hash chain
+};
+
+static struct {
+	pthread_mutex_t lock;
+	struct pc_page *pages;
+	char *data;
+	int32_t *buckets;
+	uint32_t nr_pages;
+	uint32_t bucket_mask;
+	uint32_t hand;
+	uint32_t used;
+	uint64_t seq[PCACHE_SEQ_STRIPES];
+} pc = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+struct pcache_stats {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t skips;
+	uint64_t fill_bytes;
+	uint64_t evictions;
+	uint64_t invalidations;
+};
+
+static struct pcache_stats pst;
+
+uint64_t pcache_max_file = 0;
+
+static inline uint32_t pc_stripe(struct dentry *dentry)
+{
+	return ((uintptr_t) dentry >> 6) % PCACHE_SEQ_STRIPES;
+}
+
+static inline int32_t *pc_bucket(struct dentry *dentry, uint32_t index)
+{
+	uint64_t key = ((uintptr_t) dentry >> 6) * 0x9E3779B97F4A7C15ULL + index;
+	return &(pc.buckets[(key ^ (key >> 32)) & pc.bucket_mask]);
+}
+
+// pc.lock held, the slot pointing at the page or at the chain's end
+static int32_t *pc_find(struct dentry *dentry, uint32_t index)
+{
+	int32_t *link = pc_bucket(dentry, index);
+	while (*link >= 0) {
+		struct pc_page *page = &(pc.pages[*link]);
+		if (page->dentry == dentry && page->index == index)
+			break;
+		link = &(page->next);
+	}
+	return link;
+}
+
+// pc.lock held, the frame is free once its readers are done with it
+static void pc_unhash(int32_t *link)
+{
+	struct pc_page *page = &(pc.pages[*link]);
+	*link = page->next;
+	page->next = -1;
+	page->dentry = NULL;
+	pc.used--;
+}
+
+// pc.lock held
+static int32_t pc_victim()
+{
+	uint32_t scanned = 0;
+	int32_t i = 0;
+	struct pc_page *page = NULL;
+	for (scanned = 0; scanned < 2 * pc.nr_pages; scanned++) {
+		i = pc.hand;
+		page = &(pc.pages[i]);
+		pc.hand = (pc.hand + 1) % pc.nr_pages;
+		if (__atomic_load_n(&(page->pins), __ATOMIC_ACQUIRE) != 0)
+			continue;
+		if (page->dentry == NULL)
+			return i;
+		if (page->ref) {
+			page->ref = 0;
+			continue;
+		}
+		pc_unhash(pc_find(page->dentry, page->index));
+		pst.evictions++;
+		return i;
+	}
+	return -1;    // everything pinned
+}
+
+// pc.lock held
+static void pc_insert(struct dentry *dentry, uint32_t index, const char *src, uint32_t len)
+{
+	int32_t *link = pc_find(dentry, index);
+	int32_t i = *link;
+	struct pc_page *page = NULL;
+	if (i >= 0 && __atomic_load_n(&(pc.pages[i].pins), __ATOMIC_ACQUIRE) != 0)
+		pc_unhash(link);    // a reader is still copying the stale copy out
+	else if (i >= 0)
+		goto fill;
+	i = pc_victim();
+	if (i < 0)
+		return;
+	link = pc_find(dentry, index);    // the victim may have shared the chain
+	page = &(pc.pages[i]);
+	page->dentry = dentry;
+	page->index = index;
+	page->next = -1;
+	*link = i;
+	pc.used++;
+fill:
+	page = &(pc.pages[i]);
+	memcpy(pc.data + (size_t) i * PCACHE_PAGE, src, len);
+	page->len = len;
+	page->ref = 1;
+}
+
+int pcache_init(uint64_t budget, uint64_t max_file)
+{
+	uint32_t nr_buckets = 1;
+	if (budget < PCACHE_PAGE)
+		return SUCCESS;
+	pc.nr_pages = budget / PCACHE_PAGE;
+	while (nr_buckets < 2 * pc.nr_pages)
+		nr_buckets <<= 1;
+	pc.pages = (struct pc_page *) calloc(pc.nr_pages, sizeof(struct pc_page));
+	pc.data = (char *) malloc((size_t) pc.nr_pages * PCACHE_PAGE);
+	pc.buckets = (int32_t *) malloc(nr_buckets * sizeof(int32_t));
+	if (pc.pages == NULL || pc.data == NULL || pc.buckets == NULL) {
+		printf("pcache, no memory for %lu bytes of pages\n", (unsigned long) budget);
+		pcache_destroy();
+		return ERROR;
+	}
+	memset(pc.buckets, 0xff, nr_buckets * sizeof(int32_t));
+	pc.bucket_mask = nr_buckets - 1;
+	pcache_max_file = max_file > 0 ? max_file : PCACHE_MAX_FILE;
+#ifdef FS_DEBUG
+	printf("pcache, %u pages of %d bytes, files up to %lu bytes\n", pc.nr_pages, PCACHE_PAGE, (unsigned long) pcache_max_file);
+#endif
+	return SUCCESS;
+}
+
+void pcache_destroy()
+{
+	pcache_max_file = 0;
+	free(pc.pages);
+	free(pc.data);
+	free(pc.buckets);
+	pc.pages = NULL;
+	pc.data = NULL;
+	pc.buckets = NULL;
+}
+
+// first access, or a page went away: read the whole file and cache it
+static ssize_t pc_fill(struct dentry *dentry, int fd, char *buf, size_t size, off_t offset, uint64_t fsize)
+{
+	char *tmp = NULL;
+	uint64_t seq = 0;
+	uint64_t got = 0;
+	uint32_t index = 0;
+	ssize_t ret = 0;
+	// an unlinked file is on its way back to the pool
+	if (__atomic_load_n(&(dentry->d_count), __ATOMIC_ACQUIRE) & D_COUNT_DEAD)
+		return ERROR;
+	tmp = (char *) malloc(fsize);
+	if (tmp == NULL)
+		return ERROR;
+	pthread_mutex_lock(&(pc.lock));
+	seq = pc.seq[pc_stripe(dentry)];
+	pthread_mutex_unlock(&(pc.lock));
+	while (got < fsize) {
+		ret = pread(fd, tmp + got, fsize - got, got);
+		if (ret <= 0)
+			break;
+		got += ret;
+	}
+	if (got == 0) {
+		free(tmp);
+		return ERROR;
+	}
+	pthread_mutex_lock(&(pc.lock));
+	if (seq == pc.seq[pc_stripe(dentry)]) {
+		for (index = 0; (uint64_t) index * PCACHE_PAGE < got; index++)
+			pc_insert(dentry, index, tmp + (size_t) index * PCACHE_PAGE,
+					got - (uint64_t) index * PCACHE_PAGE < PCACHE_PAGE ? got - (uint64_t) index * PCACHE_PAGE : PCACHE_PAGE);
+	}
+	pthread_mutex_unlock(&(pc.lock));
+	__atomic_add_fetch(&pst.fill_bytes, got, __ATOMIC_RELAXED);
+	ret = 0;
+	if ((uint64_t) offset < got) {
+		ret = got - offset < size ? got - offset : size;
+		memcpy(buf, tmp + offset, ret);
+	}
+	free(tmp);
+	return ret;
+}
+
+// the file size when a read at offset is the cache's, or 0
+static uint64_t pc_size(struct dentry *dentry, off_t offset)
+{
+	uint64_t fsize = 0;
+	if (pcache_max_file == 0)
+		return 0;
+	fsize = d_size(dentry);
+	if (fsize == 0 || fsize > pcache_max_file || (uint64_t) offset >= fsize) {
+		__atomic_add_fetch(&pst.skips, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+	return fsize;
+}
+
+int pcache_holds(struct dentry *dentry, off_t offset)
+{
+	return pc_size(dentry, offset) != 0;
+}
+
+ssize_t pcache_read(struct dentry *dentry, int fd, char *buf, size_t size, off_t offset)
+{
+	uint64_t fsize = 0;
+	uint64_t end = 0;
+	uint64_t pos = 0;
+	uint32_t index = 0;
+	uint32_t in = 0;
+	uint32_t n = 0;
+	int32_t i = 0;
+	struct pc_page *page = NULL;
+	fsize = pc_size(dentry, offset);
+	if (fsize == 0)
+		return ERROR;
+	end = offset + size < fsize ? offset + size : fsize;
+	for (pos = offset; pos < end; pos += n) {
+		index = pos / PCACHE_PAGE;
+		in = pos % PCACHE_PAGE;
+		pthread_mutex_lock(&(pc.lock));
+		i = *pc_find(dentry, index);
+		page = i >= 0 ? &(pc.pages[i]) : NULL;
+		// a short last page is stale once the file grew past it
+		if (page == NULL || (page->len < PCACHE_PAGE && (uint64_t) index * PCACHE_PAGE + page->len < fsize)) {
+			pthread_mutex_unlock(&(pc.lock));
+			__atomic_add_fetch(&pst.misses, 1, __ATOMIC_RELAXED);
+			return pc_fill(dentry, fd, buf, size, offset, fsize);
+		}
+		__atomic_add_fetch(&(page->pins), 1, __ATOMIC_ACQ_REL);
+		page->ref = 1;
+		pthread_mutex_unlock(&(pc.lock));
+		n = page->len - in;
+		if (n > end - pos)
+			n = end - pos;
+		memcpy(buf + (pos - offset), pc.data + (size_t) i * PCACHE_PAGE + in, n);
+		__atomic_sub_fetch(&(page->pins), 1, __ATOMIC_ACQ_REL);
+	}
+	__atomic_add_fetch(&pst.hits, 1, __ATOMIC_RELAXED);
+	return end - offset;
+}
+
+void pcache_invalidate(struct dentry *dentry, off_t offset, uint64_t len)
+{
+	uint64_t end = 0;
+	uint32_t index = 0;
+	int32_t *link = NULL;
+	if (pcache_max_file == 0 || len == 0 || (uint64_t) offset >= pcache_max_file)
+		return;
+	// pages only ever exist below max_file
+	end = len < pcache_max_file - offset ? offset + len : pcache_max_file;
+	pthread_mutex_lock(&(pc.lock));
+	pc.seq[pc_stripe(dentry)]++;
+	for (index = offset / PCACHE_PAGE; (uint64_t) index * PCACHE_PAGE < end; index++) {
+		link = pc_find(dentry, index);
+		if (*link < 0)
+			continue;
+		pc_unhash(link);
+		pst.invalidations++;
+	}
+	pthread_mutex_unlock(&(pc.lock));
+}
+
+int pcache_stats(char *buf, size_t size)
+{
+	uint64_t hits = __atomic_load_n(&pst.hits, __ATOMIC_RELAXED);
+	uint64_t misses = __atomic_load_n(&pst.misses, __ATOMIC_RELAXED);
+	uint32_t used = 0;
+	uint64_t evictions = 0;
+	uint64_t invalidations = 0;
+	pthread_mutex_lock(&(pc.lock));
+	used = pc.used;
+	evictions = pst.evictions;
+	invalidations = pst.invalidations;
+	pthread_mutex_unlock(&(pc.lock));
+	return snprintf(buf, size,
+			"pcache.pages %u\npcache.pages_used %u\npcache.hits %lu\npcache.misses %lu\n"
+			"pcache.hit_permille %lu\npcache.skips %lu\npcache.fill_bytes %lu\n"
+			"pcache.evictions %lu\npcache.invalidations %lu\n",
+			pc.nr_pages, used, (unsigned long) hits, (unsigned long) misses,
+			(unsigned long) (hits + misses ? hits * 1000 / (hits + misses) : 0),
+			(unsigned long) __atomic_load_n(&pst.skips, __ATOMIC_RELAXED),
+			(unsigned long) __atomic_load_n(&pst.fill_bytes, __ATOMIC_RELAXED),
+			(unsigned long) evictions, (unsigned long) invalidations);
+}
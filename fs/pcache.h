@@ -0,0 +1,29 @@
+#ifndef PCACHE_H
+#define PCACHE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "fs.h"
+
+#define PCACHE_PAGE (16 << 10)
+#define PCACHE_MAX_FILE (1 << 20)    // files up to this size are cached, read whole on first access
+#define PCACHE_SEQ_STRIPES 64
+
+// files up to this size are cached, 0 when the cache is off
+extern uint64_t pcache_max_file;
+
+// budget in bytes, 0 leaves every read to the backend
+int pcache_init(uint64_t budget, uint64_t max_file);
+void pcache_destroy();
+
+// 0 when a read at offset goes to the backend anyway, to skip setting up for one
+int pcache_holds(struct dentry *dentry, off_t offset);
+// ERROR when the read is to go to the backend
+ssize_t pcache_read(struct dentry *dentry, int fd, char *buf, size_t size, off_t offset);
+// the backend changed under [offset, offset + len), call after the change
+void pcache_invalidate(struct dentry *dentry, off_t offset, uint64_t len);
+
+int pcache_stats(char *buf, size_t size);
+
+#endif
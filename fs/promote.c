@@ -0,0 +1,578 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "fs.h"
+#include "promote.h"
+#include "replica.h"
+#include "snap.h"
+#include "../tools/map.h"
+
+/*
+ * Promotion of large files out of the pool. Every file starts on a
+ * pre_alloc slot with the layout the pool was made with, one stripe
+ * as a rule. Once a write or truncate takes a file past the threshold it
+ * is queued for the promotion thread, which copies it to a new backend
+ * file under PROMOTE_PATH, a directory given a wide default layout
+ * (lfs setstripe -c -1), and swaps dentry->fid over to the copy.
+ *
+ * Requests keep going while it copies. Every backend read or write of a
+ * file goes through promote_io_begin()/end(), a read lock on one of
+ * PROMOTE_IO_STRIPES rwlocks, and writes to the file on the move mark
+ * the PROMOTE_CHUNK chunks they touched dirty. The thread copies the
+ * whole file, recopies dirty chunks until few are left, and only holds
+ * the stripe for write to copy the last of them and swap the fd. Writes
+ * on io_uring and reads still in flight past promote_io_end(), on the
+ * ring or spliced by libfuse, are counted per stripe and drained first,
+ * so nothing reads the old fd once the swap is done.
+ *
+ * The old slot carries the inode number the file is known by, so it is
+ * parked rather than handed out again. Its data is dropped at the swap
+ * and the slot goes back to the pool with the dentry once the promoted
+ * file is unlinked.
+ */
+
+struct promote_job {
+	struct dentry *dentry;    // pinned
+	struct promote_job *next;
+};
+
+struct promote_stats {
+	uint64_t queued;
+	uint64_t promoted;
+	uint64_t failed;
+	uint64_t bytes;
+	uint64_t recopied;
+	uint64_t final;
+	uint64_t last_ms;
+};
+
+static struct {
+	uint64_t min_size;
+	int running;
+	int stop;
+	pthread_t thread;
+	pthread_rwlock_t io_locks[PROMOTE_IO_STRIPES];
+	uint32_t async[PROMOTE_IO_STRIPES];    // requests in flight past promote_io_end() per stripe
+	// the file on the move and its dirty chunks, under dirty_lock
+	pthread_mutex_t dirty_lock;
+	struct dentry *cur;
+	uint8_t *dirty;
+	uint64_t nr_chunks;    // bits in dirty
+	uint64_t nr_dirty;
+	int dirty_lost;    // no memory to track a write, the move is off
+	// queue and parked slots by inode, under lock
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct promote_job *head;
+	struct promote_job *tail;
+	root_t parked;    // of map_t, inode -> fd of the old slot
+	uint64_t nr_parked;
+} pm = {
+	.dirty_lock = PTHREAD_MUTEX_INITIALIZER,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.parked = RB_ROOT,
+};
+
+static struct promote_stats pst;
+
+extern struct fs_super *fs_sb;
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned io_stripe(struct dentry *dentry)
+{
+	return ((uintptr_t) dentry >> 6) % PROMOTE_IO_STRIPES;
+}
+
+int promote_io_begin(struct dentry *dentry)
+{
+	if (get_dentry_flag(dentry, D_snapshot))
+		return snap_io_begin(dentry);
+	if (!pm.running)
+		return (int) dentry->fid;
+	pthread_rwlock_rdlock(&(pm.io_locks[io_stripe(dentry)]));
+	return (int) dentry->fid;
+}
+
+// dirty_lock held, the bitmap covers nr chunks
+static int dirty_grow(uint64_t nr)
+{
+	uint64_t bytes = (nr + 7) / 8;
+	uint64_t old = (pm.nr_chunks + 7) / 8;
+	uint8_t *dirty = NULL;
+	if (bytes < 2 * old)
+		bytes = 2 * old;
+	dirty = (uint8_t *) realloc(pm.dirty, bytes);
+	if (dirty == NULL)
+		return -ENOMEM;
+	memset(dirty + old, 0, bytes - old);
+	pm.dirty = dirty;
+	pm.nr_chunks = bytes * 8;
+	return SUCCESS;
+}
+
+static void mark_dirty(struct dentry *dentry, off_t offset, uint64_t len)
+{
+	uint64_t first = offset / PROMOTE_CHUNK;
+	uint64_t last = (offset + len - 1) / PROMOTE_CHUNK;
+	uint64_t i;
+	if (len == 0 || __atomic_load_n(&pm.cur, __ATOMIC_ACQUIRE) != dentry)
+		return;
+	pthread_mutex_lock(&(pm.dirty_lock));
+	if (pm.cur != dentry)
+		goto out;
+	if (last >= pm.nr_chunks && dirty_grow(last + 1) != SUCCESS) {
+		pm.dirty_lost = 1;
+		goto out;
+	}
+	for (i = first; i <= last; i++) {
+		if (pm.dirty[i / 8] & (1 << (i % 8)))
+			continue;
+		pm.dirty[i / 8] |= 1 << (i % 8);
+		pm.nr_dirty++;
+	}
+out:
+	pthread_mutex_unlock(&(pm.dirty_lock));
+}
+
+void promote_io_end(struct dentry *dentry, off_t offset, uint64_t written)
+{
+	if (get_dentry_flag(dentry, D_snapshot)) {
+		snap_io_end(dentry);
+		return;
+	}
+	if (!pm.running)
+		return;
+	mark_dirty(dentry, offset, written);
+	pthread_rwlock_unlock(&(pm.io_locks[io_stripe(dentry)]));
+}
+
+int promote_settled(struct dentry *dentry)
+{
+	return !pm.running || get_dentry_flag(dentry, D_promoted);
+}
+
+void promote_async_get(struct dentry *dentry)
+{
+	if (pm.running)
+		__atomic_add_fetch(&(pm.async[io_stripe(dentry)]), 1, __ATOMIC_ACQ_REL);
+}
+
+void promote_async_put(struct dentry *dentry, off_t offset, uint64_t written)
+{
+	if (!pm.running)
+		return;
+	mark_dirty(dentry, offset, written);
+	__atomic_sub_fetch(&(pm.async[io_stripe(dentry)]), 1, __ATOMIC_ACQ_REL);
+}
+
+void promote_check(struct dentry *dentry, uint64_t size)
+{
+	struct promote_job *job = NULL;
+	if (!pm.running || size < pm.min_size)
+		return;
+	// the first writer past the threshold queues it, a failed move is not retried;
+	// a snapshot reading the pool file keeps it there
+	if (__atomic_load_n(&(dentry->flags), __ATOMIC_RELAXED) & ((1U << D_promoted) | (1U << D_promoting) | (1U << D_snap_shared)))
+		return;
+	if (__atomic_fetch_or(&(dentry->flags), 1U << D_promoting, __ATOMIC_ACQ_REL) & (1U << D_promoting))
+		return;
+	job = (struct promote_job *) malloc(sizeof(struct promote_job));
+	if (job == NULL) {
+		set_dentry_flag(dentry, D_promoting, 0);
+		return;
+	}
+	d_get(dentry);
+	job->dentry = dentry;
+	job->next = NULL;
+	pthread_mutex_lock(&(pm.lock));
+	if (pm.tail != NULL)
+		pm.tail->next = job;
+	else
+		pm.head = job;
+	pm.tail = job;
+	pst.queued++;
+	pthread_cond_signal(&(pm.cond));
+	pthread_mutex_unlock(&(pm.lock));
+}
+
+// pread/pwrite for backends that cannot copy_file_range between the two
+static int copy_rw(int in, int out, off_t off, uint64_t len)
+{
+	char *buf = (char *) malloc(PROMOTE_CHUNK);
+	ssize_t got = 0;
+	ssize_t put = 0;
+	ssize_t done = 0;
+	int ret = SUCCESS;
+	if (buf == NULL)
+		return -ENOMEM;
+	while (len > 0) {
+		got = pread(in, buf, len < PROMOTE_CHUNK ? len : PROMOTE_CHUNK, off);
+		if (got < 0)
+			ret = -errno;
+		if (got <= 0)
+			break;
+		for (done = 0; done < got; done += put) {
+			put = pwrite(out, buf + done, got - done, off + done);
+			if (put < 0) {
+				ret = -errno;
+				break;
+			}
+		}
+		if (ret != SUCCESS)
+			break;
+		off += got;
+		len -= got;
+		__atomic_add_fetch(&pst.bytes, got, __ATOMIC_RELAXED);
+	}
+	free(buf);
+	return ret;
+}
+
+// up to len bytes at off, short at the end of the file
+static int copy_range(int in, int out, off_t off, uint64_t len)
+{
+	loff_t in_off = off;
+	loff_t out_off = off;
+	ssize_t ret = 0;
+	while (len > 0) {
+		if (__atomic_load_n(&pm.stop, __ATOMIC_RELAXED))
+			return -EINTR;
+		ret = copy_file_range(in, &in_off, out, &out_off, len < PROMOTE_STEP ? len : PROMOTE_STEP, 0);
+		if (ret < 0 && (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EINVAL))
+			return copy_rw(in, out, in_off, len);
+		if (ret < 0)
+			return -errno;
+		if (ret == 0)
+			break;    // the final truncate settles the size
+		len -= ret;
+		__atomic_add_fetch(&pst.bytes, ret, __ATOMIC_RELAXED);
+	}
+	return SUCCESS;
+}
+
+// the next dirty chunk from i on, cleared, or -1
+static int64_t dirty_next(uint64_t i)
+{
+	int64_t found = -1;
+	pthread_mutex_lock(&(pm.dirty_lock));
+	for (; i < pm.nr_chunks && pm.nr_dirty > 0; i++) {
+		if (pm.dirty[i / 8] & (1 << (i % 8))) {
+			pm.dirty[i / 8] &= ~(1 << (i % 8));
+			pm.nr_dirty--;
+			found = i;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&(pm.dirty_lock));
+	return found;
+}
+
+static int copy_dirty(int in, int out, uint64_t *count)
+{
+	int64_t i = 0;
+	int ret = SUCCESS;
+	while (ret == SUCCESS && (i = dirty_next(i)) >= 0) {
+		ret = copy_range(in, out, i * (off_t) PROMOTE_CHUNK, PROMOTE_CHUNK);
+		(*count)++;
+		i++;
+	}
+	return ret;
+}
+
+static uint64_t nr_dirty()
+{
+	uint64_t nr = 0;
+	pthread_mutex_lock(&(pm.dirty_lock));
+	nr = pm.dirty_lost ? UINT64_MAX : pm.nr_dirty;
+	pthread_mutex_unlock(&(pm.dirty_lock));
+	return nr;
+}
+
+// io lock of the stripe held for write
+static void set_cur(struct dentry *dentry)
+{
+	pthread_mutex_lock(&(pm.dirty_lock));
+	if (pm.dirty != NULL)
+		memset(pm.dirty, 0, (pm.nr_chunks + 7) / 8);
+	pm.nr_dirty = 0;
+	pm.dirty_lost = 0;
+	__atomic_store_n(&pm.cur, dentry, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&(pm.dirty_lock));
+}
+
+// lock held
+static void park(uint64_t inode, int fd)
+{
+	char key[32];
+	snprintf(key, sizeof(key), "%lu", (unsigned long) inode);
+	if (put(&(pm.parked), key, (uint64_t) fd))
+		pm.nr_parked++;
+}
+
+static int promote_one(struct dentry *dentry)
+{
+	pthread_rwlock_t *io = &(pm.io_locks[io_stripe(dentry)]);
+	uint32_t *async = &(pm.async[io_stripe(dentry)]);
+	char name[PATH_LEN];
+	char path[PATH_MAX];
+	uint64_t start = now_ns();
+	uint64_t recopied = 0;
+	uint64_t final = 0;
+	struct stat st;
+	int old = 0;
+	int fd = 0;
+	int pass = 0;
+	int ret = SUCCESS;
+
+	if (d_dead(dentry))
+		return SUCCESS;
+	snprintf(name, sizeof(name), "%s/%lu.%lu", PROMOTE_PATH, (unsigned long) dentry->inode, (unsigned long) start);
+	snprintf(path, sizeof(path), "%s/%s", fs_sb->alloc_path, name);
+	fd = open(path, O_CREAT | O_EXCL | O_RDWR, 0644);
+	if (fd < 0)
+		return -errno;
+	// from here on writes to the file mark what they touch
+	pthread_rwlock_wrlock(io);
+	old = (int) dentry->fid;
+	set_cur(dentry);
+	if (fstat(old, &st) != 0)
+		ret = -errno;
+	pthread_rwlock_unlock(io);
+	if (ret == SUCCESS)
+		ret = copy_range(old, fd, 0, st.st_size);
+	for (pass = 0; ret == SUCCESS && pass < PROMOTE_PASSES && nr_dirty() > PROMOTE_FINAL_CHUNKS; pass++)
+		ret = copy_dirty(old, fd, &recopied);
+	// most of it is on disk before writers have to wait
+	if (ret == SUCCESS && fdatasync(fd) != 0)
+		ret = -errno;
+	pthread_rwlock_wrlock(io);
+	while (__atomic_load_n(async, __ATOMIC_ACQUIRE) > 0)
+		usleep(50);
+	if (ret == SUCCESS && nr_dirty() == UINT64_MAX)
+		ret = -ENOMEM;
+	if (ret == SUCCESS)
+		ret = copy_dirty(old, fd, &final);
+	if (ret == SUCCESS && (fstat(old, &st) != 0 || ftruncate(fd, st.st_size) != 0))
+		ret = -errno;
+	// a snapshot took the old fid meanwhile, see snap.c
+	if (ret == SUCCESS && get_dentry_flag(dentry, D_snap_shared))
+		ret = -EBUSY;
+	if (ret == SUCCESS) {
+		dentry->fid = (uint32_t) fd;
+		set_dentry_flag(dentry, D_promoted, 1);
+		set_dentry_flag(dentry, D_promoting, 0);
+	}
+	set_cur(NULL);
+	pthread_rwlock_unlock(io);
+	if (ret != SUCCESS) {
+		close(fd);
+		unlink(path);
+		return ret;
+	}
+
+	// drained above and every request from here on gets the new fd
+	ftruncate(old, 0);
+	pthread_mutex_lock(&(pm.lock));
+	park(dentry->inode, old);
+	pst.promoted++;
+	pst.recopied += recopied;
+	pst.final += final;
+	pst.last_ms = (now_ns() - start) / 1000000;
+	pthread_mutex_unlock(&(pm.lock));
+	// after a rename or unlink that is logged before it, never one logged after
+	pthread_rwlock_rdlock(&(fs_sb->tree_rwlock));
+	d_log(REPL_PROMOTE, dentry, name, 0, 0, 0, dentry->inode, 0, 0);
+	pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
+#ifdef FS_DEBUG
+	printf("promote, inode %lu moved to %s, %lu dirty chunks recopied, %lu at the swap\n",
+			(unsigned long) dentry->inode, name, (unsigned long) recopied, (unsigned long) final);
+#endif
+	return SUCCESS;
+}
+
+static void *promote_thread(void *arg)
+{
+	struct promote_job *job = NULL;
+	int ret = 0;
+	pthread_mutex_lock(&(pm.lock));
+	while (!pm.stop) {
+		job = pm.head;
+		if (job == NULL) {
+			pthread_cond_wait(&(pm.cond), &(pm.lock));
+			continue;
+		}
+		pm.head = job->next;
+		if (pm.head == NULL)
+			pm.tail = NULL;
+		pthread_mutex_unlock(&(pm.lock));
+		ret = promote_one(job->dentry);
+		if (ret != SUCCESS) {
+			__atomic_add_fetch(&pst.failed, 1, __ATOMIC_RELAXED);
+			printf("promote, inode %lu stays on its slot, error %d\n", (unsigned long) job->dentry->inode, ret);
+		}
+		d_put(job->dentry);
+		free(job);
+		pthread_mutex_lock(&(pm.lock));
+	}
+	pthread_mutex_unlock(&(pm.lock));
+	return NULL;
+}
+
+int promote_init(uint64_t min_size)
+{
+	pthread_rwlockattr_t attr;
+	char dir[PATH_MAX];
+	int i;
+	if (min_size == 0 || pm.running)
+		return SUCCESS;
+	snprintf(dir, sizeof(dir), "%s/%s", fs_sb->alloc_path, PROMOTE_PATH);
+	if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+		printf("promote_init, can not make %s, errno = %d\n", dir, errno);
+		return -errno;
+	}
+	// a stream of readers must not hold the swap off
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	for (i = 0; i < PROMOTE_IO_STRIPES; i++)
+		pthread_rwlock_init(&(pm.io_locks[i]), &attr);
+	pthread_rwlockattr_destroy(&attr);
+	pm.min_size = min_size;
+	pm.stop = 0;
+	pm.running = 1;
+	if (pthread_create(&(pm.thread), NULL, promote_thread, NULL) != 0) {
+		pm.running = 0;
+		return -EAGAIN;
+	}
+#ifdef FS_DEBUG
+	printf("promote, files past %lu bytes move to %s\n", (unsigned long) min_size, dir);
+#endif
+	return SUCCESS;
+}
+
+void promote_destroy()
+{
+	struct promote_job *job = NULL;
+	if (!pm.running)
+		return;
+	pthread_mutex_lock(&(pm.lock));
+	__atomic_store_n(&pm.stop, 1, __ATOMIC_RELAXED);
+	pthread_cond_signal(&(pm.cond));
+	pthread_mutex_unlock(&(pm.lock));
+	pthread_join(pm.thread, NULL);
+	pthread_mutex_lock(&(pm.lock));
+	while ((job = pm.head) != NULL) {
+		pm.head = job->next;
+		set_dentry_flag(job->dentry, D_promoting, 0);
+		d_put(job->dentry);
+		free(job);
+	}
+	pm.tail = NULL;
+	pthread_mutex_unlock(&(pm.lock));
+	pm.running = 0;
+	free(pm.dirty);
+	pm.dirty = NULL;
+	pm.nr_chunks = 0;
+}
+
+int promote_release(struct dentry *dentry)
+{
+	char proc[64];
+	char path[PATH_MAX];
+	char key[32];
+	map_t *node = NULL;
+	ssize_t len = 0;
+	int fd = -1;
+	// a standby that replayed the move may find the file gone already,
+	// and before takeover it is the primary's to unlink
+	snprintf(proc, sizeof(proc), "/proc/self/fd/%u", dentry->fid);
+	len = replica_replaying() ? 0 : readlink(proc, path, sizeof(path) - 1);
+	if (len > 0) {
+		path[len] = '\0';
+		unlink(path);
+	}
+	close(dentry->fid);
+	set_dentry_flag(dentry, D_promoted, 0);
+	snprintf(key, sizeof(key), "%lu", (unsigned long) dentry->inode);
+	pthread_mutex_lock(&(pm.lock));
+	node = get(&(pm.parked), key);
+	if (node != NULL) {
+		fd = (int) node->val;
+		del(&(pm.parked), node);
+		pm.nr_parked--;
+	}
+	pthread_mutex_unlock(&(pm.lock));
+	if (fd < 0)
+		return 0;
+	dentry->fid = (uint32_t) fd;
+	return 1;
+}
+
+int promote_adopt(const char *path, const char *name)
+{
+	struct lookup_res lkup_res;
+	char full[PATH_MAX];
+	int old = 0;
+	int fd = 0;
+	int ret = path_lookup(path, &lkup_res);
+	if (ret != SUCCESS) {
+		lookup_put(&lkup_res);
+		return -ENOENT;
+	}
+	snprintf(full, sizeof(full), "%s/%s", fs_sb->alloc_path, name);
+	fd = open(full, O_RDWR);
+	if (fd < 0) {
+		ret = -errno;
+		goto out;
+	}
+	if (get_dentry_flag(lkup_res.dentry, D_promoted)) {
+		close(fd);
+		goto out;
+	}
+	if (pm.running)
+		pthread_rwlock_wrlock(&(pm.io_locks[io_stripe(lkup_res.dentry)]));
+	old = (int) lkup_res.dentry->fid;
+	lkup_res.dentry->fid = (uint32_t) fd;
+	set_dentry_flag(lkup_res.dentry, D_promoted, 1);
+	if (pm.running)
+		pthread_rwlock_unlock(&(pm.io_locks[io_stripe(lkup_res.dentry)]));
+	// the primary drops the old data, the slot only waits for the unlink
+	pthread_mutex_lock(&(pm.lock));
+	park(lkup_res.dentry->inode, old);
+	pthread_mutex_unlock(&(pm.lock));
+out:
+	lookup_put(&lkup_res);
+	return ret;
+}
+
+int promote_stats(char *buf, size_t size)
+{
+	int len = 0;
+	pthread_mutex_lock(&(pm.lock));
+	len = snprintf(buf, size,
+			"promote.queued %lu\npromote.promoted %lu\npromote.failed %lu\npromote.bytes %lu\n"
+			"promote.recopied_chunks %lu\npromote.final_chunks %lu\npromote.last_ms %lu\npromote.parked %lu\n",
+			(unsigned long) pst.queued, (unsigned long) pst.promoted,
+			(unsigned long) __atomic_load_n(&pst.failed, __ATOMIC_RELAXED),
+			(unsigned long) __atomic_load_n(&pst.bytes, __ATOMIC_RELAXED),
+			(unsigned long) pst.recopied, (unsigned long) pst.final,
+			(unsigned long) pst.last_ms, (unsigned long) pm.nr_parked);
+	pthread_mutex_unlock(&(pm.lock));
+	return len;
+}
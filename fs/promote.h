@@ -0,0 +1,44 @@
+#ifndef PROMOTE_H
+#define PROMOTE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "fs.h"
+
+#define PROMOTE_PATH "promoted"    // under the access path, give it a wide default layout
+#define PROMOTE_CHUNK (1 << 20)    // copy and dirty tracking unit
+#define PROMOTE_STEP (64 << 20)    // bulk copy between checks for shutdown
+#define PROMOTE_IO_STRIPES 64
+#define PROMOTE_PASSES 8    // dirty recopies before the last one with writers held off
+#define PROMOTE_FINAL_CHUNKS 16    // dirty chunks few enough for the last copy
+
+// files past min_size bytes move off the pool, 0 leaves every file on its slot
+int promote_init(uint64_t min_size);
+void promote_destroy();
+
+// a write or truncate left dentry size bytes long
+void promote_check(struct dentry *dentry, uint64_t size);
+
+/*
+ * The backend fd behind dentry for one request, it stays put until
+ * promote_io_end(). Pass what the request wrote, so a file on the move
+ * gets it copied again. Never nest them on one thread.
+ */
+int promote_io_begin(struct dentry *dentry);
+void promote_io_end(struct dentry *dentry, off_t offset, uint64_t written);
+// a request that uses the fd past promote_io_end(), a write or read on
+// io_uring or a spliced reply, got between begin and end and put once done
+void promote_async_get(struct dentry *dentry);
+void promote_async_put(struct dentry *dentry, off_t offset, uint64_t written);
+// 1 when the fd behind dentry can not change any more
+int promote_settled(struct dentry *dentry);
+
+// d_release() of a promoted file, 1 when its parked pool slot took over
+int promote_release(struct dentry *dentry);
+// standby replay of a promotion on the primary, the copy is already there
+int promote_adopt(const char *path, const char *name);
+
+int promote_stats(char *buf, size_t size);
+
+#endif
@@ -0,0 +1,191 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "fs.h"
+#include "reclaim.h"
+
+/*
+ * Background teardown of removed subtrees. fs_rmtree_at() unhooks a
+ * directory from its parent in one tree_rwlock section, however much is
+ * below it, and queues it here. The reclaim thread, started with the
+ * first job, empties it bottom up with d_reclaim(), RECLAIM_BATCH
+ * dentries per write lock so requests on the live tree never wait long,
+ * and the pooled files go back to the unused list outside the lock, as
+ * after fs_unlink_at().
+ *
+ * Nothing finds the subtree by path any more. Open handles and kernel
+ * lookups into it keep their dentries as after an unlink, and a file
+ * made through a handle on a directory that is not freed yet goes with
+ * the rest of the subtree.
+ */
+
+struct reclaim_job {
+	struct dentry *root;    // pinned
+	struct dentry *parent;    // pinned
+	char name[NAME_MAX + 1];
+	struct reclaim_job *next;
+};
+
+struct reclaim_stats {
+	uint64_t queued;
+	uint64_t done;
+	uint64_t failed;
+	uint64_t dentries;
+	uint64_t last_ms;
+};
+
+static struct {
+	int running;
+	int stop;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct reclaim_job *head;
+	struct reclaim_job *tail;
+	uint64_t pending;    // queued or being freed
+} rc = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static struct reclaim_stats rst;
+
+void (*reclaim_notify)(struct dentry *parent, const char *name) = NULL;
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void reclaim_one(struct reclaim_job *job)
+{
+	uint64_t start = now_ns();
+	uint64_t nr = 0;
+	int ret = 0;
+	// the kernel drops its cached dentries of the subtree and forgets them
+	if (reclaim_notify != NULL)
+		reclaim_notify(job->parent, job->name);
+	d_put(job->parent);
+	while ((ret = d_reclaim(job->root, RECLAIM_BATCH)) > 0)
+		nr += ret;
+	pthread_mutex_lock(&(rc.lock));
+	rst.dentries += nr;
+	if (ret == SUCCESS) {
+		rst.done++;
+		rst.last_ms = (now_ns() - start) / 1000000;
+	} else {
+		rst.failed++;
+	}
+	rc.pending--;
+	pthread_mutex_unlock(&(rc.lock));
+	if (ret != SUCCESS) {
+		// whatever is left stays pinned in memory rather than freed under a child
+		printf("reclaim, subtree %s kept after %lu dentries, error %d\n", job->name, (unsigned long) nr, ret);
+		return;
+	}
+#ifdef FS_DEBUG
+	printf("reclaim, subtree %s gone, %lu dentries\n", job->name, (unsigned long) nr);
+#endif
+	d_put(job->root);
+}
+
+static void *reclaim_thread(void *arg)
+{
+	struct reclaim_job *job = NULL;
+	pthread_mutex_lock(&(rc.lock));
+	// the queue is drained before a stop is honored
+	while (!rc.stop || rc.head != NULL) {
+		job = rc.head;
+		if (job == NULL) {
+			pthread_cond_wait(&(rc.cond), &(rc.lock));
+			continue;
+		}
+		rc.head = job->next;
+		if (rc.head == NULL)
+			rc.tail = NULL;
+		pthread_mutex_unlock(&(rc.lock));
+		reclaim_one(job);
+		free(job);
+		pthread_mutex_lock(&(rc.lock));
+	}
+	pthread_mutex_unlock(&(rc.lock));
+	return NULL;
+}
+
+int reclaim_queue(struct dentry *root, struct dentry *parent, const char *name)
+{
+	struct reclaim_job inline_job;
+	struct reclaim_job *job = (struct reclaim_job *) malloc(sizeof(*job));
+	if (job == NULL)
+		job = &inline_job;
+	job->root = root;
+	job->parent = parent;
+	strncpy(job->name, name, NAME_MAX);
+	job->name[NAME_MAX] = '\0';
+	job->next = NULL;
+	pthread_mutex_lock(&(rc.lock));
+	rst.queued++;
+	rc.pending++;
+	// started here rather than at init, so it lives in the daemon after the fork
+	if (!rc.running && !rc.stop) {
+		if (pthread_create(&(rc.thread), NULL, reclaim_thread, NULL) == 0)
+			rc.running = 1;
+		else
+			printf("reclaim, no thread, freeing subtrees in the request\n");
+	}
+	if (!rc.running || job == &inline_job) {
+		pthread_mutex_unlock(&(rc.lock));
+		reclaim_one(job);
+		if (job != &inline_job)
+			free(job);
+		return SUCCESS;
+	}
+	if (rc.tail != NULL)
+		rc.tail->next = job;
+	else
+		rc.head = job;
+	rc.tail = job;
+	pthread_cond_signal(&(rc.cond));
+	pthread_mutex_unlock(&(rc.lock));
+	return SUCCESS;
+}
+
+void reclaim_destroy()
+{
+	pthread_mutex_lock(&(rc.lock));
+	rc.stop = 1;
+	pthread_cond_signal(&(rc.cond));
+	pthread_mutex_unlock(&(rc.lock));
+	if (rc.running)
+		pthread_join(rc.thread, NULL);
+	rc.running = 0;
+}
+
+uint64_t reclaim_pending()
+{
+	uint64_t pending = 0;
+	pthread_mutex_lock(&(rc.lock));
+	pending = rc.pending;
+	pthread_mutex_unlock(&(rc.lock));
+	return pending;
+}
+
+int reclaim_stats(char *buf, size_t size)
+{
+	int len = 0;
+	pthread_mutex_lock(&(rc.lock));
+	len = snprintf(buf, size,
+			"reclaim.queued %lu\nreclaim.done %lu\nreclaim.failed %lu\nreclaim.pending %lu\n"
+			"reclaim.dentries %lu\nreclaim.last_ms %lu\n",
+			(unsigned long) rst.queued, (unsigned long) rst.done, (unsigned long) rst.failed,
+			(unsigned long) rc.pending, (unsigned long) rst.dentries, (unsigned long) rst.last_ms);
+	pthread_mutex_unlock(&(rc.lock));
+	return len;
+}
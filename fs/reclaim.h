@@ -0,0 +1,27 @@
+#ifndef RECLAIM_H
+#define RECLAIM_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "fs.h"
+
+#define RECLAIM_BATCH 1024    // dentries freed per tree_rwlock section
+
+/*
+ * A subtree fs_rmtree_at() cut off, its root pinned by the caller and
+ * parent pinned too so the kernel can be told name is gone. Both pins
+ * go with the job.
+ */
+int reclaim_queue(struct dentry *root, struct dentry *parent, const char *name);
+// frees every queued subtree before it returns
+void reclaim_destroy();
+// subtrees queued and not freed yet
+uint64_t reclaim_pending();
+
+// set by the low level frontend, called from the reclaim thread only
+extern void (*reclaim_notify)(struct dentry *parent, const char *name);
+
+int reclaim_stats(char *buf, size_t size);
+
+#endif
@@ -0,0 +1,393 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+
+#include "fs.h"
+#include "replica.h"
+#include "promote.h"
+#include "snap.h"
+#include "ino.h"
+
+#define REPL_RECV_SIZE (1 << 20)
+
+struct replica {
+	int fd;
+	int enabled;
+	int stop;
+	int standby;
+	int running;    // sender started, by the first record, see replica_log()
+	int acking;
+	int replaying;    // a standby before takeover, the backend files are the primary's
+	char *buf[2];    // double buffer: loggers fill one while the sender drains the other
+	size_t used;
+	int cur;
+	uint64_t seq;
+	uint64_t sent_seq;
+	uint64_t acked_seq;
+	uint64_t applied;
+	uint64_t batches;
+	uint64_t bytes;
+	uint64_t lag_ns;
+	uint64_t max_lag_ns;
+	pthread_mutex_t lock;
+	pthread_cond_t data_cond;
+	pthread_cond_t space_cond;
+	pthread_t sender;
+	pthread_t acker;
+};
+
+static struct replica repl = {
+	.fd = -1,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.data_cond = PTHREAD_COND_INITIALIZER,
+	.space_cond = PTHREAD_COND_INITIALIZER,
+};
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t ret;
+	while (len > 0) {
+		ret = write(fd, buf, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return ERROR;
+		}
+		buf += ret;
+		len -= ret;
+	}
+	return SUCCESS;
+}
+
+static void *sender_thread(void *arg)
+{
+	char *out = NULL;
+	size_t len = 0;
+	uint64_t seq = 0;
+	while (1) {
+		pthread_mutex_lock(&(repl.lock));
+		while (repl.used == 0 && !repl.stop)
+			pthread_cond_wait(&(repl.data_cond), &(repl.lock));
+		if (repl.used == 0 && repl.stop) {
+			pthread_mutex_unlock(&(repl.lock));
+			break;
+		}
+		out = repl.buf[repl.cur];
+		len = repl.used;
+		seq = repl.seq;
+		repl.cur ^= 1;
+		repl.used = 0;
+		pthread_cond_broadcast(&(repl.space_cond));
+		pthread_mutex_unlock(&(repl.lock));
+
+		if (write_all(repl.fd, out, len) == ERROR) {
+			printf("replica, send to standby failed, errno = %d, replication disabled\n", errno);
+			pthread_mutex_lock(&(repl.lock));
+			repl.enabled = 0;
+			pthread_cond_broadcast(&(repl.space_cond));
+			pthread_mutex_unlock(&(repl.lock));
+			break;
+		}
+		__atomic_store_n(&(repl.sent_seq), seq, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&(repl.batches), 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&(repl.bytes), len, __ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+static void *acker_thread(void *arg)
+{
+	struct repl_ack ack;
+	size_t have = 0;
+	ssize_t ret;
+	uint64_t lag;
+	while (1) {
+		ret = read(repl.fd, (char *) &ack + have, sizeof(ack) - have);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+		have += ret;
+		if (have < sizeof(ack))
+			continue;
+		have = 0;
+		lag = now_ns() - ack.stamp;
+		__atomic_store_n(&(repl.acked_seq), ack.seq, __ATOMIC_RELAXED);
+		__atomic_store_n(&(repl.lag_ns), lag, __ATOMIC_RELAXED);
+		if (lag > repl.max_lag_ns)
+			__atomic_store_n(&(repl.max_lag_ns), lag, __ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+int replica_init_primary(const char *sock_path)
+{
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, sock_path, sizeof(addr.sun_path) - 1);
+
+	repl.fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (repl.fd < 0)
+		return ERROR;
+	if (connect(repl.fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		printf("replica, connect standby = %s failed, errno = %d\n", sock_path, errno);
+		close(repl.fd);
+		repl.fd = -1;
+		return ERROR;
+	}
+	repl.buf[0] = (char *) malloc(REPL_BATCH_SIZE);
+	repl.buf[1] = (char *) malloc(REPL_BATCH_SIZE);
+	if (repl.buf[0] == NULL || repl.buf[1] == NULL) {
+		free(repl.buf[0]);
+		free(repl.buf[1]);
+		close(repl.fd);
+		repl.fd = -1;
+		return ERROR;
+	}
+	repl.enabled = 1;
+#ifdef FS_DEBUG
+	printf("replica, streaming mutations to standby = %s\n", sock_path);
+#endif
+	return SUCCESS;
+}
+
+// repl.lock held, a sender that never starts would leave loggers waiting for space
+static void start_threads()
+{
+	if (pthread_create(&(repl.sender), NULL, sender_thread, NULL) != 0) {
+		printf("replica, no sender thread, replication disabled\n");
+		repl.enabled = 0;
+		pthread_cond_broadcast(&(repl.space_cond));
+		return;
+	}
+	repl.running = 1;
+	// without it only the lag goes unmeasured
+	if (pthread_create(&(repl.acker), NULL, acker_thread, NULL) == 0)
+		repl.acking = 1;
+}
+
+void replica_log(uint32_t op, const char *path, const char *path2,
+		uint32_t mode, uint32_t uid, uint32_t gid, uint64_t ino,
+		int64_t atime, int64_t mtime)
+{
+	if (likely(!repl.enabled))
+		return;
+
+	struct repl_rec rec;
+	size_t len = strlen(path);
+	size_t len2 = path2 ? strlen(path2) : 0;
+	size_t rec_len = sizeof(rec) + len + len2;
+	memset(&rec, 0, sizeof(rec));
+	rec.op = op;
+	rec.mode = mode;
+	rec.uid = uid;
+	rec.gid = gid;
+	rec.ino = ino;
+	rec.atime = atime;
+	rec.mtime = mtime;
+	rec.len = (uint16_t) len;
+	rec.len2 = (uint16_t) len2;
+	rec.stamp = now_ns();
+
+	pthread_mutex_lock(&(repl.lock));
+	// started here rather than at init, so they live in the daemon after the fork
+	if (unlikely(!repl.running) && repl.enabled)
+		start_threads();
+	while (repl.enabled && repl.used + rec_len > REPL_BATCH_SIZE)
+		pthread_cond_wait(&(repl.space_cond), &(repl.lock));
+	if (!repl.enabled) {
+		pthread_mutex_unlock(&(repl.lock));
+		return;
+	}
+	rec.seq = ++repl.seq;
+	char *p = repl.buf[repl.cur] + repl.used;
+	memcpy(p, &rec, sizeof(rec));
+	memcpy(p + sizeof(rec), path, len);
+	if (len2 > 0)
+		memcpy(p + sizeof(rec) + len, path2, len2);
+	repl.used += rec_len;
+	pthread_cond_signal(&(repl.data_cond));
+	pthread_mutex_unlock(&(repl.lock));
+}
+
+int replica_active()
+{
+	return repl.enabled;
+}
+
+int replica_replaying()
+{
+	return __atomic_load_n(&(repl.replaying), __ATOMIC_ACQUIRE);
+}
+
+void replica_destroy()
+{
+	if (repl.fd < 0)
+		return;
+	pthread_mutex_lock(&(repl.lock));
+	repl.stop = 1;
+	pthread_cond_signal(&(repl.data_cond));
+	pthread_mutex_unlock(&(repl.lock));
+	if (repl.running)
+		pthread_join(repl.sender, NULL);
+	shutdown(repl.fd, SHUT_RDWR);
+	if (repl.acking)
+		pthread_join(repl.acker, NULL);
+	repl.running = repl.acking = 0;
+	close(repl.fd);
+	repl.fd = -1;
+	repl.enabled = 0;
+	free(repl.buf[0]);
+	free(repl.buf[1]);
+}
+
+static int apply_rec(struct repl_rec *rec, char *path, char *path2)
+{
+	struct timespec tv[2];
+	switch (rec->op) {
+	case REPL_CREATE:
+		return fs_create_pooled(path, rec->mode, rec->ino, path2);
+	case REPL_MKDIR:
+		return fs_mkdir_ino(path, rec->mode, rec->ino);
+	case REPL_UNLINK:
+		return fs_unlink(path);
+	case REPL_RMDIR:
+		return fs_rmdir(path);
+	case REPL_RMTREE:
+		return fs_rmtree(path);
+	case REPL_RENAME:
+		return fs_rename(path, path2);
+	case REPL_CHMOD:
+		return fs_chmod(path, rec->mode);
+	case REPL_CHOWN:
+		return fs_chown(path, rec->uid, rec->gid);
+	case REPL_UTIMENS:
+		tv[0].tv_sec = rec->atime / 1000000000LL;
+		tv[0].tv_nsec = rec->atime % 1000000000LL;
+		tv[1].tv_sec = rec->mtime / 1000000000LL;
+		tv[1].tv_nsec = rec->mtime % 1000000000LL;
+		return fs_utimens(path, tv);
+	case REPL_SYMLINK:
+		return fs_symlink_ino(path, path2, rec->ino);
+	case REPL_PROMOTE:
+		return promote_adopt(path, path2);
+	case REPL_SNAP_WRITE:
+		return snap_replay_write(path);
+	case REPL_SNAP_COPY:
+		return snap_replay_copy(path, rec->ino, path2);
+	}
+	return -EINVAL;
+}
+
+int replica_run_standby(const char *sock_path)
+{
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, sock_path, sizeof(addr.sun_path) - 1);
+
+	int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (lfd < 0)
+		return ERROR;
+	unlink(sock_path);
+	if (bind(lfd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(lfd, 1) < 0) {
+		printf("replica, standby listen on %s failed, errno = %d\n", sock_path, errno);
+		close(lfd);
+		return ERROR;
+	}
+	printf("replica, standby waiting for primary on %s\n", sock_path);
+	int fd = accept(lfd, NULL, NULL);
+	close(lfd);
+	unlink(sock_path);
+	if (fd < 0)
+		return ERROR;
+	repl.standby = 1;
+	__atomic_store_n(&(repl.replaying), 1, __ATOMIC_RELEASE);
+
+	char *buf = (char *) malloc(REPL_RECV_SIZE);
+	char path[(1 << 16) + 1];
+	char path2[(1 << 16) + 1];
+	size_t have = 0;
+	size_t pos = 0;
+	ssize_t ret;
+	struct repl_rec rec;
+	struct repl_ack ack;
+	int err;
+	while (1) {
+		ret = read(fd, buf + have, REPL_RECV_SIZE - have);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+		have += ret;
+		pos = 0;
+		ack.seq = 0;
+		// apply every complete record of this batch, then ack once
+		while (have - pos >= sizeof(rec)) {
+			memcpy(&rec, buf + pos, sizeof(rec));
+			if (have - pos < sizeof(rec) + rec.len + rec.len2)
+				break;
+			memcpy(path, buf + pos + sizeof(rec), rec.len);
+			path[rec.len] = '\0';
+			memcpy(path2, buf + pos + sizeof(rec) + rec.len, rec.len2);
+			path2[rec.len2] = '\0';
+			pos += sizeof(rec) + rec.len + rec.len2;
+			err = apply_rec(&rec, path, path2);
+			if (err < 0)
+				printf("replica, apply op = %d path = %s failed, ret = %d\n", (int)rec.op, path, err);
+			repl.applied++;
+			repl.acked_seq = rec.seq;
+			ack.seq = rec.seq;
+			ack.stamp = rec.stamp;
+		}
+		memmove(buf, buf + pos, have - pos);
+		have -= pos;
+		if (ack.seq != 0)
+			write_all(fd, (char *) &ack, sizeof(ack));
+	}
+	close(fd);
+	free(buf);
+	__atomic_store_n(&(repl.replaying), 0, __ATOMIC_RELEASE);
+	// data written by the primary went straight to the backend, pick up the sizes
+	refresh_file_dentries();
+	// and empty the pool files it recycled, which replay left alone
+	truncate_unused_files();
+	// and the inode numbers it handed out
+	ino_resume();
+	printf("replica, primary gone after %lu applied ops, taking over\n", (unsigned long) repl.applied);
+	return SUCCESS;
+}
+
+int replica_stats(char *buf, size_t size)
+{
+	if (repl.standby)
+		return snprintf(buf, size, "replica.applied %lu\nreplica.applied_seq %lu\n",
+				(unsigned long) repl.applied, (unsigned long) repl.acked_seq);
+	if (repl.fd < 0)
+		return 0;
+	uint64_t seq = __atomic_load_n(&(repl.seq), __ATOMIC_RELAXED);
+	uint64_t acked = __atomic_load_n(&(repl.acked_seq), __ATOMIC_RELAXED);
+	return snprintf(buf, size,
+			"replica.enabled %d\nreplica.logged_seq %lu\nreplica.sent_seq %lu\n"
+			"replica.acked_seq %lu\nreplica.lag_ops %lu\nreplica.lag_us %lu\n"
+			"replica.max_lag_us %lu\nreplica.batches %lu\nreplica.bytes %lu\n",
+			repl.enabled, (unsigned long) seq, (unsigned long) repl.sent_seq,
+			(unsigned long) acked, (unsigned long) (seq - acked),
+			(unsigned long) (repl.lag_ns / 1000), (unsigned long) (repl.max_lag_ns / 1000),
+			(unsigned long) repl.batches, (unsigned long) repl.bytes);
+}
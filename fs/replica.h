@@ -0,0 +1,61 @@
+#ifndef REPLICA_H
+#define REPLICA_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// mutation log op code
+#define REPL_CREATE 1    // path2 names its pool file under the access point
+#define REPL_MKDIR 2
+#define REPL_UNLINK 3
+#define REPL_RMDIR 4
+#define REPL_RENAME 5
+#define REPL_CHMOD 6
+#define REPL_CHOWN 7
+#define REPL_UTIMENS 8
+#define REPL_SYMLINK 9
+#define REPL_PROMOTE 10    // path moved to the backend file path2, see fs/promote.c
+#define REPL_RMTREE 11    // path and all below it, see fs_rmtree_at()
+#define REPL_SNAP_WRITE 12    // first write of path since a snapshot saw it, see __snap_write()
+#define REPL_SNAP_COPY 13    // snapshot data of the file numbered path2 copied to the pool file path
+
+#define REPL_BATCH_SIZE (4 << 20)    // bytes pending before a logger has to wait
+
+// on-wire record, followed by path and path2 (no '\0')
+struct repl_rec {
+	uint64_t seq;
+	uint64_t stamp;    // CLOCK_MONOTONIC ns when logged, echoed back in the ack
+	uint64_t ino;    // backend inode of the pool file for create and snapshot copy, the inode number for mkdir and symlink
+	int64_t atime;    // ns since the epoch
+	int64_t mtime;
+	uint32_t op;
+	uint32_t mode;
+	uint32_t uid;
+	uint32_t gid;
+	uint16_t len;
+	uint16_t len2;
+	uint32_t pad;
+};
+
+struct repl_ack {
+	uint64_t seq;
+	uint64_t stamp;
+};
+
+// primary side, connects at once; the sender starts with the first record, after any daemon fork
+int replica_init_primary(const char *sock_path);
+void replica_log(uint32_t op, const char *path, const char *path2,
+		uint32_t mode, uint32_t uid, uint32_t gid, uint64_t ino,
+		int64_t atime, int64_t mtime);
+void replica_destroy();
+// a primary with a standby attached, worth building paths for
+int replica_active();
+
+// standby side, returns when the primary goes away
+int replica_run_standby(const char *sock_path);
+// a standby still replaying, it must not truncate or unlink backend files
+int replica_replaying();
+
+int replica_stats(char *buf, size_t size);
+
+#endif
@@ -0,0 +1,1066 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "fs.h"
+#include "file.h"
+#include "evict.h"
+#include "promote.h"
+#include "reclaim.h"
+#include "replica.h"
+#include "snap.h"
+#include "ino.h"
+#include "../tools/map.h"
+
+/*
+ * Read-only snapshots of a directory: mkdir dir/.snap/name takes one,
+ * rmdir dir/.snap/name drops it. Taking one costs the same for any
+ * subtree, it bumps snap_epoch and stamps dir with it; nothing is copied
+ * until the tree changes.
+ *
+ * The newest snapshot that sees a directory is the largest epoch on its
+ * way up, d_saved the epoch it last saved its children for. The first
+ * change to its children after a newer snapshot, a create, unlink,
+ * rename or attribute change, saves them first as one snap_version:
+ * names and attributes, the child directories pinned and the files'
+ * data shared. A version serves the snapshots with lo < epoch <= hi; a
+ * snapshot directory with no version of its epoch shows what is live,
+ * since nothing changed there since.
+ *
+ * File data is shared by backend file, one snap_data each. The first
+ * write or truncate after a snapshot copies the file to a pool file of
+ * the snapshot's own and the live file goes on in place, so a file
+ * nobody changes costs nothing and one that changes is copied once per
+ * snapshot at most. A shared file unlinked hands its pool file over
+ * instead. Data a write handle still buffers goes in as it lands.
+ *
+ * A standby replays the snapshots and what a write saves for them, then
+ * binds the pool file its primary copied to; it never copies itself.
+ *
+ * Snapshot dentries are made on first lookup, one directory at a time,
+ * and go with the same reclaim as fs_rmtree_at() once the snapshot is
+ * dropped. They count in no recursive totals.
+ */
+
+struct snap_data {
+	pthread_rwlock_t lock;    // fd stays put while read, see snap_io_begin()
+	int fd;    // the live file's until a write copies it away
+	uint32_t fid;    // key in sn.data while bound
+	uint32_t refs;    // snapshot files and saved entries reading it
+	int bound;    // still the live file's data
+	int copying;    // a write is copying it away
+	struct dentry *owner;    // the pool file fd belongs to once no live file has it
+	uint64_t ino;    // the live file's while fd is its data, key in sn.live
+};
+
+// a child as a version saved it
+struct snap_entry {
+	char *name;
+	mode_t mode;
+	uid_t uid;
+	gid_t gid;
+	uint32_t nlink;
+	uint64_t size;
+	struct timespec atime;
+	struct timespec mtime;
+	struct timespec ctime;
+	union {
+		struct dentry *dir;    // pinned
+		struct snap_data *data;
+		char *link;    // symlink target
+	};
+};
+
+struct snap_version {
+	uint32_t lo;    // serves the snapshots lo < epoch <= hi
+	uint32_t hi;
+	uint32_t nr;
+	struct dentry *dir;    // pinned while it has versions
+	struct snap_entry *entries;
+	struct snap_version *next;    // of dir, older
+	struct snap_version *all;    // every version, for gc()
+};
+
+struct snapshot {
+	uint32_t epoch;
+	struct dentry *root;
+	struct dentry *snapdir;    // pinned once dropped, for the reclaim
+	char name[DENTRY_NAME_SIZE];
+	struct snapshot *next;    // in sn.list, then in sn.reap
+};
+
+struct snap_stats {
+	uint64_t taken;
+	uint64_t dropped;
+	uint64_t saves;    // versions made
+	uint64_t saved;    // entries in them
+	uint64_t copies;    // files a write copied away
+	uint64_t copied;    // bytes of them
+	uint64_t handed;    // pool files an unlink handed over
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;    // a copy is done
+	uint32_t nr;    // snapshots alive
+	uint32_t nr_versions;
+	uint32_t nr_data;
+	struct snapshot *list;
+	struct snapshot *reap;    // dropped, for snap_reap()
+	struct snap_version *versions;
+	root_t data;    // of map_t, "<fid>" to the snap_data bound to it
+	root_t live;    // of map_t, "<ino>" to the snap_data reading that live file, for copy records
+} sn = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static struct snap_stats sst;
+
+uint32_t snap_epoch = 0;
+
+extern struct fs_super *fs_sb;
+
+// sn.lock held
+static int snap_live(uint32_t epoch)
+{
+	struct snapshot *snap = NULL;
+	for (snap = sn.list; snap != NULL; snap = snap->next) {
+		if (snap->epoch == epoch)
+			return 1;
+	}
+	return 0;
+}
+
+// sn.lock held, a snapshot alive in (lo, hi]
+static int snap_within(uint32_t lo, uint32_t hi)
+{
+	struct snapshot *snap = NULL;
+	for (snap = sn.list; snap != NULL; snap = snap->next) {
+		if (snap->epoch > lo && snap->epoch <= hi)
+			return 1;
+	}
+	return 0;
+}
+
+// tree_rwlock and sn.lock held, the newest snapshot that sees dir
+static uint32_t dir_cover(struct dentry *dir)
+{
+	uint32_t epoch = 0;
+	for (; dir != NULL; dir = dir->attr->parent) {
+		if (d_snap(dir)->epoch > epoch)
+			epoch = d_snap(dir)->epoch;
+	}
+	return epoch;
+}
+
+static void data_key(char *key, uint32_t fid)
+{
+	snprintf(key, MAP_KEY_LEN, "%u", fid);
+}
+
+// sn.lock held, the snap_data bound to a live file's backend file
+static struct snap_data *data_find(uint32_t fid)
+{
+	char key[MAP_KEY_LEN];
+	map_t *node = NULL;
+	data_key(key, fid);
+	node = get(&(sn.data), key);
+	return node != NULL ? (struct snap_data *) node->val : NULL;
+}
+
+static void live_key(char *key, uint64_t ino)
+{
+	snprintf(key, MAP_KEY_LEN, "%lu", (unsigned long) ino);
+}
+
+// sn.lock held, sd reads the live file numbered ino; one a standby kept past its primary's recycle is replaced
+static void live_add(struct snap_data *sd, uint64_t ino)
+{
+	char key[MAP_KEY_LEN];
+	map_t *node = NULL;
+	sd->ino = ino;
+	live_key(key, ino);
+	node = get(&(sn.live), key);
+	if (node != NULL)
+		node->val = (uint64_t) sd;
+	else
+		put(&(sn.live), key, (uint64_t) sd);
+}
+
+// sn.lock held, sd reads a copy of its own now
+static void live_forget(struct snap_data *sd)
+{
+	char key[MAP_KEY_LEN];
+	map_t *node = NULL;
+	if (sd->ino == 0)
+		return;
+	live_key(key, sd->ino);
+	node = get(&(sn.live), key);
+	if (node != NULL && node->val == (uint64_t) sd)
+		del(&(sn.live), node);
+	sd->ino = 0;
+}
+
+// sn.lock held, the live file and sd part
+static void data_unbind(struct snap_data *sd)
+{
+	char key[MAP_KEY_LEN];
+	map_t *node = NULL;
+	if (!sd->bound)
+		return;
+	data_key(key, sd->fid);
+	node = get(&(sn.data), key);
+	if (node != NULL)
+		del(&(sn.data), node);
+	sd->bound = 0;
+}
+
+// sn.lock held, one more reader of a live file's data
+static struct snap_data *data_share(struct dentry *file)
+{
+	struct snap_data *sd = NULL;
+	char key[MAP_KEY_LEN];
+	int fd = 0;
+	// a promotion about to swap the fid waits, then sees D_snap_shared and backs off
+	fd = promote_io_begin(file);
+	sd = data_find((uint32_t) fd);
+	if (sd == NULL) {
+		sd = (struct snap_data *) calloc(1, sizeof(struct snap_data));
+		if (sd != NULL) {
+			pthread_rwlock_init(&(sd->lock), NULL);
+			sd->fd = fd;
+			sd->fid = (uint32_t) fd;
+			sd->bound = 1;
+			data_key(key, sd->fid);
+			put(&(sn.data), key, (uint64_t) sd);
+			live_add(sd, file->inode);
+			sn.nr_data++;
+		}
+	}
+	if (sd != NULL) {
+		sd->refs++;
+		set_dentry_flag(file, D_snap_shared, 1);
+	}
+	promote_io_end(file, 0, 0);
+	return sd;
+}
+
+// sn.lock held
+static void data_put(struct snap_data *sd)
+{
+	if (--sd->refs > 0)
+		return;
+	live_forget(sd);
+	data_unbind(sd);
+	if (sd->owner != NULL)
+		d_recycle(sd->owner);
+	pthread_rwlock_destroy(&(sd->lock));
+	free(sd);
+	sn.nr_data--;
+}
+
+// sn.lock held
+static void entry_free(struct snap_entry *e)
+{
+	if (S_ISDIR(e->mode)) {
+		if (e->dir != NULL)
+			d_put(e->dir);
+	} else if (S_ISLNK(e->mode)) {
+		free(e->link);
+	} else if (e->data != NULL) {
+		data_put(e->data);
+	}
+	free(e->name);
+}
+
+// tree_rwlock and sn.lock held, child of dir as it is now; cover goes down to a directory
+static int entry_save(struct snap_entry *e, struct dentry *dir, struct dentry *child, uint32_t cover)
+{
+	char key[MAP_KEY_LEN];
+	map_t *node = NULL;
+	memset(e, 0, sizeof(struct snap_entry));
+	e->name = strdup(d_name(child));
+	if (e->name == NULL)
+		return -ENOMEM;
+	d_attr_lock(child);
+	e->mode = child->attr->mode;
+	e->uid = child->attr->uid;
+	e->gid = child->attr->gid;
+	e->nlink = child->attr->nlink;
+	e->size = child->attr->size;
+	e->atime = child->attr->atime;
+	e->mtime = child->attr->mtime;
+	e->ctime = child->attr->ctime;
+	d_attr_unlock(child);
+	if (get_dentry_flag(child, D_type) == DIR_DENTRY) {
+		e->mode = S_IFDIR | (e->mode & 07777);
+		d_get(child);
+		e->dir = child;
+		// it may move out from under what the snapshot saw, it has to save on its own
+		if (d_snap(child)->epoch < cover)
+			d_snap(child)->epoch = cover;
+		return SUCCESS;
+	}
+	if (S_ISLNK(e->mode)) {
+		link_key(key, dir, d_name(child));
+		pthread_rwlock_rdlock(&(fs_sb->link_tree_rwlock));
+		node = get(&(fs_sb->link_tree), key);
+		e->link = strdup(node != NULL ? (char *) node->val : "");
+		pthread_rwlock_unlock(&(fs_sb->link_tree_rwlock));
+		return e->link != NULL ? SUCCESS : -ENOMEM;
+	}
+	e->data = data_share(child);
+	return e->data != NULL ? SUCCESS : -ENOMEM;
+}
+
+// sn.lock held
+static void version_free(struct snap_version *v)
+{
+	uint32_t i;
+	if (v == NULL)
+		return;
+	for (i = 0; i < v->nr; i++)
+		entry_free(&(v->entries[i]));
+	free(v->entries);
+	free(v);
+}
+
+// tree_rwlock and sn.lock held, dir's children saved for the snapshots since d_saved
+static int freeze(struct dentry *dir, uint32_t cover)
+{
+	struct snap_version *v = NULL;
+	struct dentry *child = NULL;
+	uint32_t nr = 0;
+	int ret = SUCCESS;
+	// every snapshot since was dropped, nobody is left to save for
+	if (!snap_within(dir->attr->d_saved, snap_epoch))
+		goto out;
+	ret = d_ensure(dir);
+	if (ret != SUCCESS)
+		return ret;
+	nr = d_nr_children(dir);
+	v = (struct snap_version *) calloc(1, sizeof(struct snap_version));
+	if (v == NULL)
+		return -ENOMEM;
+	v->entries = (struct snap_entry *) calloc(nr > 0 ? nr : 1, sizeof(struct snap_entry));
+	if (v->entries == NULL) {
+		free(v);
+		return -ENOMEM;
+	}
+	for (child = d_first_child(dir); child != NULL && ret == SUCCESS; child = d_next_child(child))
+		ret = entry_save(&(v->entries[v->nr++]), dir, child, cover);
+	if (ret != SUCCESS) {
+		version_free(v);
+		return ret;
+	}
+	v->lo = dir->attr->d_saved;
+	v->hi = snap_epoch;
+	v->dir = dir;
+	if (d_snap(dir)->versions == NULL)
+		d_get(dir);
+	v->next = d_snap(dir)->versions;
+	d_snap(dir)->versions = v;
+	v->all = sn.versions;
+	sn.versions = v;
+	sn.nr_versions++;
+	sst.saves++;
+	sst.saved += v->nr;
+#ifdef FS_DEBUG
+	printf("snap, dir inode = %lu saved %u children for epochs (%u, %u]\n", (unsigned long)dir->inode, v->nr, v->lo, v->hi);
+#endif
+out:
+	__atomic_store_n(&(dir->attr->d_saved), snap_epoch, __ATOMIC_RELEASE);
+	return SUCCESS;
+}
+
+// tree_rwlock and sn.lock held
+static int touch_locked(struct dentry *dir)
+{
+	uint32_t cover = 0;
+	if (get_dentry_flag(dir, D_snapshot))
+		return -EROFS;
+	if (sn.nr == 0)
+		return SUCCESS;
+	cover = dir_cover(dir);
+	if (cover <= dir->attr->d_saved)
+		return SUCCESS;
+	return freeze(dir, cover);
+}
+
+int snap_touch(struct dentry *dir)
+{
+	int ret = 0;
+	if (get_dentry_flag(dir, D_snapshot))
+		return -EROFS;
+	// taken and dropped under the write lock, so this holds still under ours
+	if (likely(__atomic_load_n(&(sn.nr), __ATOMIC_RELAXED) == 0))
+		return SUCCESS;
+	pthread_mutex_lock(&(sn.lock));
+	ret = touch_locked(dir);
+	pthread_mutex_unlock(&(sn.lock));
+	return ret;
+}
+
+int snap_setattr(struct dentry *dentry)
+{
+	int ret = SUCCESS;
+	if (get_dentry_flag(dentry, D_snapshot))
+		return -EROFS;
+	if (likely(__atomic_load_n(&(sn.nr), __ATOMIC_RELAXED) == 0))
+		return SUCCESS;
+	// the attributes are saved with the parent's children
+	pthread_rwlock_rdlock(&(fs_sb->tree_rwlock));
+	if (dentry->attr->parent != NULL && !d_dead(dentry))
+		ret = snap_touch(dentry->attr->parent);
+	pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
+	return ret;
+}
+
+static int copy_rw(int in, int out, off_t off, uint64_t len)
+{
+	char *buf = (char *) malloc(PROMOTE_CHUNK);
+	ssize_t got = 0;
+	ssize_t put = 0;
+	ssize_t done = 0;
+	int ret = SUCCESS;
+	if (buf == NULL)
+		return -ENOMEM;
+	while (len > 0 && ret == SUCCESS) {
+		got = pread(in, buf, len < PROMOTE_CHUNK ? len : PROMOTE_CHUNK, off);
+		if (got < 0)
+			ret = -errno;
+		if (got <= 0)
+			break;
+		for (done = 0; done < got && ret == SUCCESS; done += put) {
+			put = pwrite(out, buf + done, got - done, off + done);
+			if (put < 0)
+				ret = -errno;
+		}
+		off += got;
+		len -= got;
+	}
+	free(buf);
+	return ret;
+}
+
+static int copy_data(int in, int out, uint64_t len)
+{
+	loff_t in_off = 0;
+	loff_t out_off = 0;
+	ssize_t ret = 0;
+	while (len > 0) {
+		ret = copy_file_range(in, &in_off, out, &out_off, len < SNAP_COPY_STEP ? len : SNAP_COPY_STEP, 0);
+		if (ret < 0 && (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EINVAL))
+			return copy_rw(in, out, in_off, len);
+		if (ret < 0)
+			return -errno;
+		if (ret == 0)
+			break;    // the truncate after settles the size
+		len -= ret;
+	}
+	return SUCCESS;
+}
+
+// no lock held, sd's data to a pool file of its own, the live file keeps its fd
+static int copy_away(struct snap_data *sd, struct fs_file *file)
+{
+	struct dentry *copy = NULL;
+	struct stat st;
+	int ret = SUCCESS;
+	// what the handle held back was written before, it belongs in the copy
+	if (file != NULL) {
+		ret = file_flush(file);
+		if (ret != SUCCESS)
+			return ret;
+	}
+	pthread_rwlock_wrlock(&(fs_sb->unused_list_rwlock));
+	copy = fetch_dentry_from_unused_list();
+	if (copy == NULL && REALLOC_ENABLE) {
+		batch_realloc();
+		copy = fetch_dentry_from_unused_list();
+	}
+	pthread_rwlock_unlock(&(fs_sb->unused_list_rwlock));
+	if (copy == NULL)
+		return -ENFILE;
+	if (fstat(sd->fd, &st) != 0)
+		ret = -errno;
+	if (ret == SUCCESS)
+		ret = copy_data(sd->fd, (int) copy->fid, st.st_size);
+	if (ret == SUCCESS && ftruncate(copy->fid, st.st_size) != 0)
+		ret = -errno;
+	if (ret != SUCCESS) {
+		d_recycle(copy);
+		return ret;
+	}
+	pthread_rwlock_wrlock(&(sd->lock));
+	sd->fd = (int) copy->fid;
+	sd->owner = copy;
+	pthread_rwlock_unlock(&(sd->lock));
+	__atomic_add_fetch(&(sst.copies), 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&(sst.copied), st.st_size, __ATOMIC_RELAXED);
+#ifdef FS_DEBUG
+	printf("snap, fid = %u copied away to fid = %u, %lu bytes\n", sd->fid, copy->fid, (unsigned long) st.st_size);
+#endif
+	return SUCCESS;
+}
+
+// sn.lock held, after the drop of every snapshot that read sd and before the recycle of its live file
+static void log_copy(struct snap_data *sd)
+{
+	char name[PATH_LEN];
+	char key[MAP_KEY_LEN];
+	if (likely(!replica_active()))
+		return;
+	if (pool_name(sd->fd, name, PATH_LEN) != SUCCESS)
+		return;
+	live_key(key, sd->ino);
+	replica_log(REPL_SNAP_COPY, name, key, 0, 0, 0, sd->owner->inode, 0, 0);
+}
+
+// sn.lock held, dropped while copying; the snapshots stop reading dentry's backend file
+static int data_unshare(struct dentry *dentry, struct fs_file *file)
+{
+	struct snap_data *sd = NULL;
+	int ret = SUCCESS;
+	while (get_dentry_flag(dentry, D_snap_shared)) {
+		sd = data_find(dentry->fid);
+		if (sd == NULL) {
+			set_dentry_flag(dentry, D_snap_shared, 0);
+			break;
+		}
+		// another writer of the file is at it
+		if (sd->copying) {
+			pthread_cond_wait(&(sn.cond), &(sn.lock));
+			continue;
+		}
+		sd->copying = 1;
+		sd->refs++;
+		pthread_mutex_unlock(&(sn.lock));
+		ret = copy_away(sd, file);
+		pthread_mutex_lock(&(sn.lock));
+		sd->copying = 0;
+		if (ret == SUCCESS) {
+			log_copy(sd);
+			live_forget(sd);
+			data_unbind(sd);
+		}
+		pthread_cond_broadcast(&(sn.cond));
+		data_put(sd);
+		if (ret != SUCCESS)
+			break;
+	}
+	return ret;
+}
+
+int __snap_write(struct dentry *dentry, struct fs_file *file)
+{
+	uint32_t epoch = 0;
+	int ret = SUCCESS;
+	if (get_dentry_flag(dentry, D_snapshot))
+		return -EROFS;
+	pthread_rwlock_rdlock(&(fs_sb->tree_rwlock));
+	pthread_mutex_lock(&(sn.lock));
+	epoch = snap_epoch;
+	// the parent's children hold the size and times this changes
+	if (dentry->attr->parent != NULL && !d_dead(dentry)) {
+		ret = touch_locked(dentry->attr->parent);
+		if (ret == SUCCESS)
+			d_log(REPL_SNAP_WRITE, dentry, NULL, 0, 0, 0, 0, 0, 0);
+	}
+	pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
+	if (ret == SUCCESS)
+		ret = data_unshare(dentry, file);
+	if (ret == SUCCESS)
+		__atomic_store_n(&(dentry->attr->d_saved), epoch, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&(sn.lock));
+	return ret;
+}
+
+int snap_unlinked(struct dentry *dentry)
+{
+	struct snap_data *sd = NULL;
+	int ret = 0;
+	pthread_mutex_lock(&(sn.lock));
+	// a promoted file's fd is closed with it, the snapshots need a copy;
+	// a standby keeps it open until the copy its primary made comes in
+	if (get_dentry_flag(dentry, D_promoted) && !replica_replaying()) {
+		if (data_unshare(dentry, NULL) != SUCCESS)
+			printf("snap, copy of unlinked fid = %u failed, its snapshots read it until it goes\n", dentry->fid);
+		pthread_mutex_unlock(&(sn.lock));
+		return 0;
+	}
+	sd = data_find(dentry->fid);
+	if (sd != NULL) {
+		data_unbind(sd);
+		sd->owner = dentry;
+		sst.handed++;
+		ret = 1;
+	}
+	pthread_mutex_unlock(&(sn.lock));
+	return ret;
+}
+
+int snap_replay_write(const char *path)
+{
+	struct lookup_res lkup_res;
+	struct dentry *dentry = NULL;
+	int ret = path_lookup(path, &lkup_res);
+	if (ret != SUCCESS) {
+		lookup_put(&lkup_res);
+		return -ENOENT;
+	}
+	dentry = lkup_res.dentry;
+	pthread_rwlock_rdlock(&(fs_sb->tree_rwlock));
+	pthread_mutex_lock(&(sn.lock));
+	if (dentry->attr->parent != NULL && !d_dead(dentry))
+		ret = touch_locked(dentry->attr->parent);
+	pthread_mutex_unlock(&(sn.lock));
+	pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
+	lookup_put(&lkup_res);
+	return ret;
+}
+
+int snap_replay_copy(const char *pool_file, uint64_t pool_inode, const char *key)
+{
+	struct dentry *copy = NULL;
+	struct dentry *old = NULL;
+	struct snap_data *sd = NULL;
+	map_t *node = NULL;
+	int ret = take_pool_file(pool_file, pool_inode, &copy);
+	if (ret != SUCCESS)
+		return ret;
+	if (copy == NULL)
+		return -ENFILE;
+	pthread_mutex_lock(&(sn.lock));
+	node = get(&(sn.live), (char *) key);
+	if (node == NULL) {
+		pthread_mutex_unlock(&(sn.lock));
+		d_recycle(copy);
+		return -ENOENT;
+	}
+	sd = (struct snap_data *) node->val;
+	live_forget(sd);
+	data_unbind(sd);
+	pthread_rwlock_wrlock(&(sd->lock));
+	// an unlink replayed first handed the live pool file over, its primary recycled it
+	old = sd->owner;
+	sd->fd = (int) copy->fid;
+	sd->owner = copy;
+	pthread_rwlock_unlock(&(sd->lock));
+	if (old != NULL)
+		d_recycle(old);
+	sst.copies++;
+	pthread_mutex_unlock(&(sn.lock));
+	return SUCCESS;
+}
+
+int snap_io_begin(struct dentry *dentry)
+{
+	struct snap_data *sd = dentry->attr->d_sdata;
+	pthread_rwlock_rdlock(&(sd->lock));
+	return sd->fd;
+}
+
+void snap_io_end(struct dentry *dentry)
+{
+	pthread_rwlock_unlock(&(dentry->attr->d_sdata->lock));
+}
+
+// tree_rwlock and sn.lock held, e as a snapshot dentry in dir; take hands it e's references
+static int view_new(struct dentry *dir, struct snap_entry *e, uint32_t epoch, int take, struct dentry **res)
+{
+	struct dentry *view = NULL;
+	char key[MAP_KEY_LEN];
+	char *link = NULL;
+	int is_dir = S_ISDIR(e->mode);
+	view = is_dir ? d_alloc_dir() : d_alloc();
+	if (view == NULL)
+		return -ENOMEM;
+	if (S_ISLNK(e->mode)) {
+		link = take ? e->link : strdup(e->link);
+		if (link == NULL) {
+			d_free(view);
+			return -ENOMEM;
+		}
+	}
+	view->inode = ino_alloc();
+	view->fid = 0;
+	view->flags = 1U << D_snapshot;
+	set_dentry_flag(view, D_type, is_dir ? DIR_DENTRY : FILE_DENTRY);
+	view->attr->mode = e->mode;
+	view->attr->uid = e->uid;
+	view->attr->gid = e->gid;
+	view->attr->nlink = e->nlink;
+	view->attr->size = e->size;
+	view->attr->atime = e->atime;
+	view->attr->mtime = e->mtime;
+	view->attr->ctime = e->ctime;
+	// never equal to snap_epoch, writes all go to __snap_write() and fail
+	view->attr->d_saved = UINT32_MAX;
+	if (d_insert(dir, view, e->name) == 0) {
+		if (!take)
+			free(link);
+		d_free(view);
+		return -EEXIST;
+	}
+	if (is_dir) {
+		d_snap(view)->link = e->dir;
+		d_snap(view)->epoch = epoch;
+		if (!take)
+			d_get(e->dir);
+		set_dentry_flag(view, D_snap_lazy, 1);
+	} else if (link != NULL) {
+		link_key(key, dir, e->name);
+		pthread_rwlock_wrlock(&(fs_sb->link_tree_rwlock));
+		put(&(fs_sb->link_tree), key, (uint64_t) link);
+		pthread_rwlock_unlock(&(fs_sb->link_tree_rwlock));
+	} else {
+		view->attr->d_sdata = e->data;
+		if (!take)
+			e->data->refs++;
+	}
+	if (take)
+		e->dir = NULL;
+	if (res != NULL)
+		*res = view;
+	return SUCCESS;
+}
+
+// sn.lock held, a snapshot dentry nothing finds any more
+static void view_free(struct dentry *view)
+{
+	struct dentry *link = NULL;
+	if (get_dentry_flag(view, D_type) == DIR_DENTRY) {
+		link = d_snap(view)->link;
+		d_snap(view)->link = NULL;
+	} else if (!S_ISLNK(view->attr->mode) && view->attr->d_sdata != NULL) {
+		data_put(view->attr->d_sdata);
+		view->attr->d_sdata = NULL;
+	}
+	// a live directory, or the one a .snap belongs to; it goes without locks
+	if (link != NULL)
+		d_put(link);
+	d_free(view);
+}
+
+// tree_rwlock and sn.lock held, a fault that failed half way takes back what it made
+static void view_clear(struct dentry *dir)
+{
+	struct dentry *child = NULL;
+	char key[MAP_KEY_LEN];
+	map_t *node = NULL;
+	while ((child = d_first_child(dir)) != NULL) {
+		if (S_ISLNK(child->attr->mode)) {
+			link_key(key, dir, d_name(child));
+			pthread_rwlock_wrlock(&(fs_sb->link_tree_rwlock));
+			node = get(&(fs_sb->link_tree), key);
+			if (node != NULL) {
+				free((char *) node->val);
+				del(&(fs_sb->link_tree), node);
+			}
+			pthread_rwlock_unlock(&(fs_sb->link_tree_rwlock));
+		}
+		d_remove(child);
+		view_free(child);
+	}
+}
+
+int snap_fault(struct dentry *dir)
+{
+	struct snap_version *v = NULL;
+	struct dentry *src = NULL;
+	struct dentry *child = NULL;
+	struct snap_entry e;
+	uint32_t epoch = 0;
+	uint32_t i;
+	int ret = SUCCESS;
+	pthread_mutex_lock(&(sn.lock));
+	if (!get_dentry_flag(dir, D_snap_lazy))    // another thread got here first
+		goto out;
+	src = d_snap(dir)->link;
+	epoch = d_snap(dir)->epoch;
+	// a dropped snapshot shows nothing, its reclaim only needs the way out
+	if (snap_live(epoch)) {
+		for (v = d_snap(src)->versions; v != NULL; v = v->next) {
+			if (v->lo < epoch && epoch <= v->hi)
+				break;
+		}
+		if (v != NULL) {
+			for (i = 0; i < v->nr && ret == SUCCESS; i++)
+				ret = view_new(dir, &(v->entries[i]), epoch, 0, NULL);
+		} else {
+			ret = d_ensure(src);
+			for (child = d_first_child(src); child != NULL && ret == SUCCESS; child = d_next_child(child)) {
+				ret = entry_save(&e, src, child, 0);
+				if (ret == SUCCESS)
+					ret = view_new(dir, &e, epoch, 1, NULL);
+				entry_free(&e);
+			}
+		}
+	}
+	if (ret != SUCCESS) {
+		view_clear(dir);
+		goto out;
+	}
+	// the children hold what they need of src now
+	d_snap(dir)->link = NULL;
+	d_put(src);
+	// readers see the children only once they are all linked
+	__atomic_and_fetch(&(dir->flags), ~(1U << D_snap_lazy), __ATOMIC_RELEASE);
+#ifdef FS_DEBUG
+	printf("snap, dir inode = %lu of epoch %u filled %s\n", (unsigned long)dir->inode, epoch, v != NULL ? "from a saved version" : "from the live tree");
+#endif
+out:
+	pthread_mutex_unlock(&(sn.lock));
+	return ret;
+}
+
+struct dentry *snap_lookup(struct dentry *dir)
+{
+	struct dentry *snapdir = NULL;
+	if (get_dentry_flag(dir, D_type) != DIR_DENTRY || get_dentry_flag(dir, D_snapshot) || d_dead(dir))
+		return NULL;
+	snapdir = __atomic_load_n(&(d_snap(dir)->link), __ATOMIC_ACQUIRE);
+	if (snapdir != NULL)
+		return snapdir;
+	pthread_mutex_lock(&(sn.lock));
+	snapdir = d_snap(dir)->link;
+	if (snapdir != NULL)
+		goto out;
+	snapdir = d_alloc_dir();
+	if (snapdir == NULL)
+		goto out;
+	snapdir->inode = ino_alloc();
+	snapdir->fid = 0;
+	snapdir->flags = 1U << D_snapshot;
+	set_dentry_flag(snapdir, D_type, DIR_DENTRY);
+	snapdir->attr->mode = S_IFDIR | 0555;
+	snapdir->attr->uid = dir->attr->uid;
+	snapdir->attr->gid = dir->attr->gid;
+	snapdir->attr->nlink = 2;
+	clock_gettime(CLOCK_REALTIME, &(snapdir->attr->ctime));
+	snapdir->attr->mtime = snapdir->attr->ctime;
+	snapdir->attr->atime = snapdir->attr->ctime;
+	snapdir->attr->d_saved = UINT32_MAX;
+	// named under dir but none of its children, epoch 0 tells it from a snapshot
+	d_attach(dir, snapdir, SNAP_DIR);
+	d_get(dir);
+	d_snap(snapdir)->link = dir;
+	__atomic_store_n(&(d_snap(dir)->link), snapdir, __ATOMIC_RELEASE);
+out:
+	pthread_mutex_unlock(&(sn.lock));
+	return snapdir;
+}
+
+int snap_create(struct dentry *snapdir, const char *name, struct dentry **res)
+{
+	struct snapshot *snap = NULL;
+	struct dentry *dir = NULL;
+	struct dentry *root = NULL;
+	struct snap_entry e;
+	uint32_t epoch = 0;
+	int ret = SUCCESS;
+	// a directory in a snapshot
+	if (d_snap(snapdir)->epoch != 0)
+		return -EROFS;
+	if (strlen(name) >= DENTRY_NAME_SIZE)
+		return -ENAMETOOLONG;
+	if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+		return -EINVAL;
+	snap = (struct snapshot *) calloc(1, sizeof(struct snapshot));
+	if (snap == NULL)
+		return -ENOMEM;
+	pthread_rwlock_wrlock(&(fs_sb->tree_rwlock));
+	pthread_mutex_lock(&(sn.lock));
+	dir = d_snap(snapdir)->link;
+	if (d_dead(snapdir) || dir == NULL || d_dead(dir))
+		ret = -ENOENT;
+	else if (d_lookup(snapdir, name) != NULL)
+		ret = -EEXIST;
+	if (ret != SUCCESS)
+		goto out;
+	memset(&e, 0, sizeof(e));
+	e.name = (char *) name;
+	d_attr_lock(dir);
+	e.mode = S_IFDIR | (dir->attr->mode & 07777);
+	e.uid = dir->attr->uid;
+	e.gid = dir->attr->gid;
+	e.nlink = dir->attr->nlink;
+	e.atime = dir->attr->atime;
+	e.mtime = dir->attr->mtime;
+	e.ctime = dir->attr->ctime;
+	d_attr_unlock(dir);
+	e.dir = dir;
+	epoch = snap_epoch + 1;
+	ret = view_new(snapdir, &e, epoch, 0, &root);
+	if (ret != SUCCESS)
+		goto out;
+	d_snap(dir)->epoch = epoch;
+	__atomic_store_n(&snap_epoch, epoch, __ATOMIC_RELEASE);
+	snap->epoch = epoch;
+	snap->root = root;
+	strcpy(snap->name, name);
+	snap->next = sn.list;
+	sn.list = snap;
+	__atomic_store_n(&(sn.nr), sn.nr + 1, __ATOMIC_RELAXED);
+	sst.taken++;
+	// replayed as a mkdir in .snap, which comes back here
+	d_log(REPL_MKDIR, root, NULL, e.mode & 07777, 0, 0, root->inode, 0, 0);
+	if (res != NULL) {
+		d_get(root);
+		*res = root;
+	}
+#ifdef FS_DEBUG
+	printf("snap, %s of dir inode = %lu taken at epoch %u\n", name, (unsigned long)dir->inode, epoch);
+#endif
+out:
+	pthread_mutex_unlock(&(sn.lock));
+	pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
+	if (ret != SUCCESS)
+		free(snap);
+	return ret;
+}
+
+// sn.lock held, versions no snapshot left falls in go
+static void gc()
+{
+	struct snap_version **p = &(sn.versions);
+	struct snap_version **q = NULL;
+	struct snap_version *v = NULL;
+	struct dentry *dir = NULL;
+	while ((v = *p) != NULL) {
+		if (snap_within(v->lo, v->hi)) {
+			p = &(v->all);
+			continue;
+		}
+		*p = v->all;
+		dir = v->dir;
+		for (q = &(d_snap(dir)->versions); *q != v; q = &((*q)->next))
+			;
+		*q = v->next;
+		version_free(v);
+		sn.nr_versions--;
+		if (d_snap(dir)->versions == NULL)
+			d_put(dir);
+	}
+}
+
+// tree_rwlock for write and sn.lock held, root out of snapdir and onto sn.reap
+static void snapshot_drop(struct dentry *snapdir, struct dentry *root)
+{
+	struct snapshot **p = NULL;
+	struct snapshot *snap = NULL;
+	for (p = &(sn.list); (*p)->root != root; p = &((*p)->next))
+		;
+	snap = *p;
+	*p = snap->next;
+	__atomic_store_n(&(sn.nr), sn.nr - 1, __ATOMIC_RELAXED);
+	d_remove(root);
+	// the reclaim job's pins, as in fs_rmtree_at()
+	d_get(root);
+	d_kill(root);
+	d_get(snapdir);
+	snap->snapdir = snapdir;
+	snap->next = sn.reap;
+	__atomic_store_n(&(sn.reap), snap, __ATOMIC_RELAXED);
+	sst.dropped++;
+#ifdef FS_DEBUG
+	printf("snap, %s of epoch %u dropped\n", snap->name, snap->epoch);
+#endif
+}
+
+int snap_remove(struct dentry *snapdir, const char *name)
+{
+	struct dentry *root = NULL;
+	if (d_snap(snapdir)->epoch != 0)
+		return -EROFS;
+	pthread_rwlock_wrlock(&(fs_sb->tree_rwlock));
+	pthread_mutex_lock(&(sn.lock));
+	if (!d_dead(snapdir))
+		root = d_lookup(snapdir, name);
+	if (root != NULL) {
+		d_log(REPL_RMDIR, root, NULL, 0, 0, 0, 0, 0, 0);
+		snapshot_drop(snapdir, root);
+		gc();
+	}
+	pthread_mutex_unlock(&(sn.lock));
+	pthread_rwlock_unlock(&(fs_sb->tree_rwlock));
+	if (root == NULL)
+		return -ENOENT;
+	snap_reap();
+	return SUCCESS;
+}
+
+int snap_busy(struct dentry *dir)
+{
+	struct dentry *snapdir = NULL;
+	if (get_dentry_flag(dir, D_snapshot))
+		return 0;
+	snapdir = d_snap(dir)->link;
+	return snapdir != NULL && d_first_child(snapdir) != NULL;
+}
+
+void snap_drop(struct dentry *dir)
+{
+	struct dentry *snapdir = NULL;
+	struct dentry *root = NULL;
+	if (get_dentry_flag(dir, D_snapshot) || d_snap(dir)->link == NULL)
+		return;
+	pthread_mutex_lock(&(sn.lock));
+	snapdir = d_snap(dir)->link;
+	while ((root = d_first_child(snapdir)) != NULL)
+		snapshot_drop(snapdir, root);
+	gc();
+	d_snap(dir)->link = NULL;
+	// its pin on dir goes with it, dir is not killed yet
+	if (d_kill(snapdir))
+		view_free(snapdir);
+	pthread_mutex_unlock(&(sn.lock));
+}
+
+void snap_reap()
+{
+	struct snapshot *snap = NULL;
+	struct snapshot *next = NULL;
+	if (likely(__atomic_load_n(&(sn.reap), __ATOMIC_RELAXED) == NULL))
+		return;
+	pthread_mutex_lock(&(sn.lock));
+	snap = sn.reap;
+	__atomic_store_n(&(sn.reap), NULL, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&(sn.lock));
+	for (; snap != NULL; snap = next) {
+		next = snap->next;
+		reclaim_queue(snap->root, snap->snapdir, snap->name);
+		free(snap);
+	}
+}
+
+void snap_release(struct dentry *dentry)
+{
+	pthread_mutex_lock(&(sn.lock));
+	view_free(dentry);
+	pthread_mutex_unlock(&(sn.lock));
+}
+
+int snap_stats(char *buf, size_t size)
+{
+	int len = 0;
+	pthread_mutex_lock(&(sn.lock));
+	len = snprintf(buf, size, "snap.snapshots %u\nsnap.epoch %u\nsnap.taken %lu\nsnap.dropped %lu\nsnap.versions %u\n"
+			"snap.saves %lu\nsnap.saved %lu\nsnap.shared %u\nsnap.copies %lu\nsnap.copied_bytes %lu\nsnap.handed %lu\n",
+			sn.nr, snap_epoch, (unsigned long) sst.taken, (unsigned long) sst.dropped, sn.nr_versions,
+			(unsigned long) sst.saves, (unsigned long) sst.saved, sn.nr_data,
+			(unsigned long) __atomic_load_n(&(sst.copies), __ATOMIC_RELAXED),
+			(unsigned long) __atomic_load_n(&(sst.copied), __ATOMIC_RELAXED), (unsigned long) sst.handed);
+	pthread_mutex_unlock(&(sn.lock));
+	return len;
+}
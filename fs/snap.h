@@ -0,0 +1,84 @@
+#ifndef SNAP_H
+#define SNAP_H
+
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/types.h>
+
+#include "fs.h"
+#include "file.h"
+
+#define SNAP_COPY_STEP (64 << 20)    // bytes per copy_file_range() of a file a write unshares
+
+// the newest snapshot, 0 before the first; only grows
+extern uint32_t snap_epoch;
+
+/*
+ * tree_rwlock held. SNAP_DIR in dir, looked up after d_lookup() missed:
+ * the .snap directory, made on first use. NULL in a snapshot.
+ */
+struct dentry *snap_lookup(struct dentry *dir);
+// mkdir and rmdir in a .snap directory, -EROFS anywhere else in a snapshot
+int snap_create(struct dentry *snapdir, const char *name, struct dentry **res);
+int snap_remove(struct dentry *snapdir, const char *name);
+
+/*
+ * tree_rwlock held. dir's children, or the attributes of one, are about
+ * to change; the snapshots that see dir keep its children as they are
+ * now. -EROFS in a snapshot.
+ */
+int snap_touch(struct dentry *dir);
+// no lock held, dentry's attributes are about to change
+int snap_setattr(struct dentry *dentry);
+int __snap_write(struct dentry *dentry, struct fs_file *file);
+// tree_rwlock held, dir has snapshots
+int snap_busy(struct dentry *dir);
+// tree_rwlock held for write, dir goes for good and its snapshots with it
+void snap_drop(struct dentry *dir);
+// no lock held, hands what snap_drop() cut off to the reclaim thread
+void snap_reap();
+
+// d_ensure() of a snapshot directory whose children are not made yet
+int snap_fault(struct dentry *dir);
+// d_release() of a dentry in a snapshot or a .snap directory
+void snap_release(struct dentry *dentry);
+// d_release() of a live file a snapshot shares, 1 if the snapshot took its pool file
+int snap_unlinked(struct dentry *dentry);
+// replay of a primary's first write of an epoch to path, saved for the snapshots as it did
+int snap_replay_write(const char *path);
+// replay of a copy away, the snapshot data of the live file numbered key goes to the pool file named
+int snap_replay_copy(const char *pool_file, uint64_t pool_inode, const char *key);
+// promote_io_begin() and promote_io_end() of a file in a snapshot
+int snap_io_begin(struct dentry *dentry);
+void snap_io_end(struct dentry *dentry);
+
+int snap_stats(char *buf, size_t size);
+
+/*
+ * No lock held, a file's data or size is about to change through file,
+ * NULL for none. Free unless a snapshot was taken since the file's last
+ * change, then the first write of the epoch saves what snapshots see.
+ */
+static inline int snap_write(struct dentry *dentry, struct fs_file *file)
+{
+	if (likely(__atomic_load_n(&(dentry->attr->d_saved), __ATOMIC_ACQUIRE) == __atomic_load_n(&snap_epoch, __ATOMIC_RELAXED)))
+		return SUCCESS;
+	return __snap_write(dentry, file);
+}
+
+// a handle on a file in a snapshot reads only
+static inline int snap_open(struct dentry *dentry, int flags)
+{
+	if (get_dentry_flag(dentry, D_snapshot) && ((flags & O_ACCMODE) != O_RDONLY || (flags & O_TRUNC)))
+		return -EROFS;
+	return SUCCESS;
+}
+
+// names no live entry may take, lookups resolve them to the .snap directory
+static inline int snap_reserved(const char *name)
+{
+	return name[0] == '.' && strcmp(name, SNAP_DIR) == 0;
+}
+
+#endif
@@ -0,0 +1,458 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+
+#include "fs.h"
+#include "uring.h"
+
+/*
+ * Backend I/O engine on io_uring, spoken through the raw syscalls so
+ * there is no liburing to build against. Requests go into one shared
+ * ring: a submitter fills an SQE under ring.lock and enters it, a reaper
+ * thread waits for completions and handles every CQE that is there in
+ * one batch, calling each request's done() on its own thread. A FUSE
+ * worker that hands a read to the ring is free for the next request, so
+ * the backend sees up to depth requests at once however many workers
+ * there are.
+ *
+ * Pooled fds are registered as fixed files, at their own fd number in a
+ * sparse table, so the kernel skips the fd lookup and reference on each
+ * request. They stay open until unmount, which is what makes that safe:
+ * no other fd is ever registered. A pool of depth URING_BUF_SIZE buffers
+ * is registered too, for reads and writes whose payload stackfs owns.
+ *
+ * Without <linux/io_uring.h>, or when io_uring_setup fails (old kernel,
+ * seccomp), uring_active() is 0 and callers keep to pread/pwrite.
+ */
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#endif
+
+struct uring_stats {
+	uint64_t submitted;
+	uint64_t completed;
+	uint64_t batches;
+	uint64_t fixed_files;
+	uint64_t fixed_bufs;
+	uint64_t buf_misses;
+	uint32_t inflight_max;
+};
+
+static struct uring_stats ust;
+
+// pooled fds, noted before the ring exists and registered when it starts
+static uint64_t pool_fds[URING_MAX_FILES / 64];
+static uint64_t fixed_fds[URING_MAX_FILES / 64];
+
+#ifdef HAVE_IO_URING
+
+static struct {
+	int fd;
+	int active;
+	int stop;
+	unsigned depth;
+	unsigned inflight;
+	int nr_files;    // fixed file table, no fd is ever past RLIMIT_NOFILE
+	pthread_mutex_t lock;    // the SQ tail and inflight
+	pthread_cond_t space_cond;
+	pthread_t reaper;
+	// submission queue
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	// completion queue
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr;
+	size_t sq_len;
+	void *cq_ptr;
+	size_t cq_len;
+	size_t sqes_len;
+	// registered buffers
+	char *bufs;
+	int bufs_fixed;
+	int *buf_free;
+	int nr_buf_free;
+	pthread_mutex_t buf_lock;
+} ring = {
+	.fd = -1,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.space_cond = PTHREAD_COND_INITIALIZER,
+	.buf_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static int sys_setup(unsigned entries, struct io_uring_params *p)
+{
+	return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return (int) syscall(__NR_io_uring_enter, ring.fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_register(unsigned opcode, void *arg, unsigned nr_args)
+{
+	return (int) syscall(__NR_io_uring_register, ring.fd, opcode, arg, nr_args);
+}
+
+static inline int fd_bit(uint64_t *map, int fd)
+{
+	return (__atomic_load_n(&map[fd / 64], __ATOMIC_ACQUIRE) >> (fd % 64)) & 1;
+}
+
+static inline void fd_set_bit(uint64_t *map, int fd)
+{
+	__atomic_or_fetch(&map[fd / 64], 1ULL << (fd % 64), __ATOMIC_ACQ_REL);
+}
+
+static void register_files()
+{
+	struct rlimit rl;
+	int *table = NULL;
+	int fd = 0;
+	ring.nr_files = URING_MAX_FILES;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < URING_MAX_FILES)
+		ring.nr_files = rl.rlim_cur;
+	table = (int *) malloc(ring.nr_files * sizeof(int));
+	if (table == NULL)
+		return;
+	for (fd = 0; fd < ring.nr_files; fd++)
+		table[fd] = fd_bit(pool_fds, fd) ? fd : -1;
+	if (sys_register(IORING_REGISTER_FILES, table, ring.nr_files) == 0) {
+		for (fd = 0; fd < ring.nr_files; fd++)
+			if (table[fd] >= 0)
+				fd_set_bit(fixed_fds, fd);
+	} else {
+		printf("uring, no fixed files, errno = %d\n", errno);
+	}
+	free(table);
+}
+
+static void register_buffers()
+{
+	struct iovec *iov = NULL;
+	unsigned i = 0;
+	ring.buf_free = (int *) malloc(ring.depth * sizeof(int));
+	if (ring.buf_free == NULL || posix_memalign((void **) &ring.bufs, 4096, (size_t) ring.depth * URING_BUF_SIZE) != 0) {
+		free(ring.buf_free);
+		ring.buf_free = NULL;
+		ring.bufs = NULL;
+		return;
+	}
+	for (i = 0; i < ring.depth; i++)
+		ring.buf_free[ring.nr_buf_free++] = i;
+	iov = (struct iovec *) malloc(ring.depth * sizeof(struct iovec));
+	if (iov == NULL)
+		return;
+	for (i = 0; i < ring.depth; i++) {
+		iov[i].iov_base = ring.bufs + (size_t) i * URING_BUF_SIZE;
+		iov[i].iov_len = URING_BUF_SIZE;
+	}
+	// plain memory still does if the kernel will not pin it
+	ring.bufs_fixed = sys_register(IORING_REGISTER_BUFFERS, iov, ring.depth) == 0;
+	free(iov);
+}
+
+static void *reaper_thread(void *arg)
+{
+	struct io_uring_cqe *cqe = NULL;
+	struct uring_req *req = NULL;
+	unsigned head = 0;
+	unsigned tail = 0;
+	unsigned n = 0;
+	int stop = 0;
+	while (!stop) {
+		if (sys_enter(0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR && errno != EAGAIN) {
+			printf("uring, reaper enter failed, errno = %d\n", errno);
+			usleep(1000);
+		}
+		head = *ring.cq_head;    // the only consumer
+		tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+		n = tail - head;
+		if (n == 0)
+			continue;
+		// the CQ has room for depth more, so the slots can go before the
+		// callbacks run; the lock also orders them after their submitters
+		pthread_mutex_lock(&(ring.lock));
+		ring.inflight -= n;
+		pthread_cond_broadcast(&(ring.space_cond));
+		pthread_mutex_unlock(&(ring.lock));
+		for (; head != tail; head++) {
+			cqe = &(ring.cqes[head & *ring.cq_mask]);
+			req = (struct uring_req *) (uintptr_t) cqe->user_data;
+			if (req == NULL)
+				stop = 1;    // the nop uring_destroy() sent
+			else
+				req->done(req, cqe->res);
+		}
+		__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+		__atomic_add_fetch(&ust.completed, n, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&ust.batches, 1, __ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+// req NULL is the reaper's stop nop
+static int ring_push(struct uring_req *req)
+{
+	struct io_uring_sqe *sqe = NULL;
+	unsigned tail = 0;
+	unsigned idx = 0;
+	pthread_mutex_lock(&(ring.lock));
+	while (ring.inflight >= ring.depth)
+		pthread_cond_wait(&(ring.space_cond), &(ring.lock));
+	tail = *ring.sq_tail;
+	idx = tail & *ring.sq_mask;
+	sqe = &(ring.sqes[idx]);
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = (uint64_t) (uintptr_t) req;
+	if (req == NULL) {
+		sqe->opcode = IORING_OP_NOP;
+	} else {
+		sqe->fd = req->fd;
+		sqe->addr = (uint64_t) (uintptr_t) req->buf;
+		sqe->len = req->len;
+		sqe->off = req->off;
+		if (req->buf_index >= 0 && ring.bufs_fixed) {
+			sqe->opcode = req->op == URING_READ ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+			sqe->buf_index = req->buf_index;
+			ust.fixed_bufs++;
+		} else {
+			sqe->opcode = req->op == URING_READ ? IORING_OP_READ : IORING_OP_WRITE;
+		}
+		if (req->fd < URING_MAX_FILES && fd_bit(fixed_fds, req->fd)) {
+			sqe->flags |= IOSQE_FIXED_FILE;    // the table slot is the fd number
+			ust.fixed_files++;
+		}
+	}
+	ring.sq_array[idx] = idx;
+	__atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+	if (++ring.inflight > ust.inflight_max)
+		ust.inflight_max = ring.inflight;
+	ust.submitted++;
+	pthread_mutex_unlock(&(ring.lock));
+	// whoever enters first takes every SQE published so far, the rest find none
+	while (sys_enter(1, 0, 0) < 0 && (errno == EINTR || errno == EAGAIN || errno == EBUSY))
+		;
+	return SUCCESS;
+}
+
+int uring_init(unsigned depth)
+{
+	struct io_uring_params p;
+	if (depth == 0 || ring.active)
+		return SUCCESS;
+	memset(&p, 0, sizeof(p));
+	ring.fd = sys_setup(depth, &p);
+	if (ring.fd < 0) {
+		printf("uring, io_uring_setup failed, errno = %d, staying on pread/pwrite\n", errno);
+		return ERROR;
+	}
+	ring.depth = p.sq_entries;    // rounded up to a power of 2, the CQ is twice that
+	ring.sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring.cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring.cq_len > ring.sq_len)
+			ring.sq_len = ring.cq_len;
+		ring.cq_len = 0;
+	}
+	ring.sq_ptr = mmap(NULL, ring.sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+	if (ring.sq_ptr == MAP_FAILED)
+		goto out_close;
+	ring.cq_ptr = ring.sq_ptr;
+	if (ring.cq_len > 0) {
+		ring.cq_ptr = mmap(NULL, ring.cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+		if (ring.cq_ptr == MAP_FAILED)
+			goto out_sq;
+	}
+	ring.sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring.sqes = (struct io_uring_sqe *) mmap(NULL, ring.sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+	if (ring.sqes == MAP_FAILED)
+		goto out_cq;
+	ring.sq_tail = (unsigned *) ((char *) ring.sq_ptr + p.sq_off.tail);
+	ring.sq_mask = (unsigned *) ((char *) ring.sq_ptr + p.sq_off.ring_mask);
+	ring.sq_array = (unsigned *) ((char *) ring.sq_ptr + p.sq_off.array);
+	ring.cq_head = (unsigned *) ((char *) ring.cq_ptr + p.cq_off.head);
+	ring.cq_tail = (unsigned *) ((char *) ring.cq_ptr + p.cq_off.tail);
+	ring.cq_mask = (unsigned *) ((char *) ring.cq_ptr + p.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *) ((char *) ring.cq_ptr + p.cq_off.cqes);
+	register_files();
+	register_buffers();
+	ring.stop = 0;
+	if (pthread_create(&(ring.reaper), NULL, reaper_thread, NULL) != 0)
+		goto out_sqes;
+	ring.active = 1;
+#ifdef FS_DEBUG
+	printf("uring, depth %u, fixed buffers %d\n", ring.depth, ring.bufs_fixed);
+#endif
+	return SUCCESS;
+
+out_sqes:
+	munmap(ring.sqes, ring.sqes_len);
+out_cq:
+	if (ring.cq_len > 0)
+		munmap(ring.cq_ptr, ring.cq_len);
+out_sq:
+	munmap(ring.sq_ptr, ring.sq_len);
+out_close:
+	printf("uring, ring setup failed, errno = %d, staying on pread/pwrite\n", errno);
+	close(ring.fd);
+	ring.fd = -1;
+	return ERROR;
+}
+
+void uring_destroy()
+{
+	if (!ring.active)
+		return;
+	ring_push(NULL);
+	pthread_join(ring.reaper, NULL);
+	ring.active = 0;
+	munmap(ring.sqes, ring.sqes_len);
+	if (ring.cq_len > 0)
+		munmap(ring.cq_ptr, ring.cq_len);
+	munmap(ring.sq_ptr, ring.sq_len);
+	close(ring.fd);    // drops the fixed files and buffers with it
+	ring.fd = -1;
+	free(ring.bufs);
+	free(ring.buf_free);
+	ring.bufs = NULL;
+	ring.buf_free = NULL;
+	ring.nr_buf_free = 0;
+	memset(fixed_fds, 0, sizeof(fixed_fds));
+}
+
+int uring_active()
+{
+	return ring.active;
+}
+
+void uring_note_fd(int fd)
+{
+	struct io_uring_files_update up;
+	if (fd < 0 || fd >= URING_MAX_FILES)
+		return;
+	fd_set_bit(pool_fds, fd);
+	if (!ring.active || fd >= ring.nr_files)
+		return;
+	memset(&up, 0, sizeof(up));
+	up.offset = fd;
+	up.fds = (uint64_t) (uintptr_t) &fd;
+	if (sys_register(IORING_REGISTER_FILES_UPDATE, &up, 1) == 1)
+		fd_set_bit(fixed_fds, fd);
+}
+
+int uring_submit(struct uring_req *req)
+{
+	if (!ring.active)
+		return ERROR;
+	return ring_push(req);
+}
+
+char *uring_buf_get(int *index)
+{
+	int i = -1;
+	pthread_mutex_lock(&(ring.buf_lock));
+	if (ring.nr_buf_free > 0)
+		i = ring.buf_free[--ring.nr_buf_free];
+	pthread_mutex_unlock(&(ring.buf_lock));
+	*index = i;
+	if (i < 0) {
+		__atomic_add_fetch(&ust.buf_misses, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+	return ring.bufs + (size_t) i * URING_BUF_SIZE;
+}
+
+void uring_buf_put(int index)
+{
+	if (index < 0)
+		return;
+	pthread_mutex_lock(&(ring.buf_lock));
+	ring.buf_free[ring.nr_buf_free++] = index;
+	pthread_mutex_unlock(&(ring.buf_lock));
+}
+
+#else
+
+int uring_init(unsigned depth)
+{
+	if (depth > 0)
+		printf("uring, built without io_uring, staying on pread/pwrite\n");
+	return depth > 0 ? ERROR : SUCCESS;
+}
+
+void uring_destroy()
+{
+}
+
+int uring_active()
+{
+	return 0;
+}
+
+void uring_note_fd(int fd)
+{
+}
+
+int uring_submit(struct uring_req *req)
+{
+	return ERROR;
+}
+
+char *uring_buf_get(int *index)
+{
+	*index = -1;
+	return NULL;
+}
+
+void uring_buf_put(int index)
+{
+}
+
+#endif
+
+int uring_stats(char *buf, size_t size)
+{
+	uint64_t submitted = 0;
+	uint64_t fixed_files = 0;
+	uint64_t fixed_bufs = 0;
+	uint32_t inflight_max = 0;
+#ifdef HAVE_IO_URING
+	// bumped under ring.lock
+	pthread_mutex_lock(&(ring.lock));
+#endif
+	submitted = ust.submitted;
+	fixed_files = ust.fixed_files;
+	fixed_bufs = ust.fixed_bufs;
+	inflight_max = ust.inflight_max;
+#ifdef HAVE_IO_URING
+	pthread_mutex_unlock(&(ring.lock));
+#endif
+	return snprintf(buf, size,
+			"uring.active %d\nuring.submitted %lu\nuring.completed %lu\nuring.reap_batches %lu\n"
+			"uring.inflight_max %u\nuring.fixed_files %lu\nuring.fixed_bufs %lu\nuring.buf_misses %lu\n",
+			uring_active(), (unsigned long) submitted,
+			(unsigned long) __atomic_load_n(&ust.completed, __ATOMIC_RELAXED),
+			(unsigned long) __atomic_load_n(&ust.batches, __ATOMIC_RELAXED),
+			inflight_max, (unsigned long) fixed_files, (unsigned long) fixed_bufs,
+			(unsigned long) __atomic_load_n(&ust.buf_misses, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,45 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "fs.h"
+
+#define URING_DEPTH 64
+#define URING_MAX_FILES (1 << 16)    // pooled fds below this are registered with the ring
+#define URING_BUF_SIZE (128 << 10)    // registered buffers, the largest FUSE request
+
+#define URING_READ 0
+#define URING_WRITE 1
+
+// one backend read or write in flight, owned by the submitter until done
+struct uring_req {
+	int op;
+	int fd;
+	char *buf;
+	uint32_t len;
+	int buf_index;    // the registered buffer buf is, -1 if none
+	off_t off;
+	// on the reaper thread, res as pread/pwrite would return it or -errno
+	void (*done)(struct uring_req *req, int res);
+};
+
+// depth 0, or a kernel without io_uring, leaves every caller on pread/pwrite
+int uring_init(unsigned depth);
+void uring_destroy();
+int uring_active();
+
+// a pooled fd, registered as a fixed file now or when the ring starts
+void uring_note_fd(int fd);
+
+// blocks while depth requests are in flight
+int uring_submit(struct uring_req *req);
+
+// NULL when they are all out, the caller brings its own memory
+char *uring_buf_get(int *index);
+void uring_buf_put(int index);
+
+int uring_stats(char *buf, size_t size);
+
+#endif
@@ -1,19 +1,37 @@
 #define FUSE_USE_VERSION 30
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <malloc.h>
 
 #include "fs/fs.h"
+#include "fs/replica.h"
+#include "fs/evict.h"
+#include "fs/fs_ll.h"
+#include "fs/pcache.h"
+#include "fs/file.h"
 
 
+void *fuse_init(struct fuse_conn_info *conn)
+{
+	fs_cache_conn(conn);
+	return NULL;
+}
+
 int fuse_open(const char *path, struct fuse_file_info *fileInfo)
 {
+	fileInfo->keep_cache = fs_cache.keep_cache;
 	return fs_open(path, fileInfo);
 }
 
 int fuse_create(const char * path, mode_t mode, struct fuse_file_info * info)
 {
+	info->keep_cache = fs_cache.keep_cache;
     return fs_create(path, mode, info);
 }
 
@@ -57,6 +75,16 @@ int fuse_write(const char *path, const char *buf, size_t size, off_t offset, str
 	return fs_write(path, buf, size, offset, fileInfo);
 }
 
+int fuse_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fileInfo)
+{
+	return fs_read_buf(path, bufp, size, offset, fileInfo);
+}
+
+int fuse_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fileInfo)
+{
+	return fs_write_buf(path, buf, offset, fileInfo);
+}
+
 int fuse_release(const char *path, struct fuse_file_info *fileInfo)
 {
     return fs_release(path, fileInfo);
@@ -77,6 +105,31 @@ int fuse_truncate(const char * path, off_t offset)
 	return fs_truncate(path, offset);
 }
 
+int fuse_ftruncate(const char * path, off_t offset, struct fuse_file_info *fileInfo)
+{
+	return fs_ftruncate(path, offset, fileInfo);
+}
+
+int fuse_fgetattr(const char *path, struct stat *st, struct fuse_file_info *fileInfo)
+{
+	return fs_fgetattr(path, st, fileInfo);
+}
+
+int fuse_flush(const char *path, struct fuse_file_info *fileInfo)
+{
+	return fs_flush(path, fileInfo);
+}
+
+int fuse_fsync(const char *path, int datasync, struct fuse_file_info *fileInfo)
+{
+	return fs_fsync(path, datasync, fileInfo);
+}
+
+int fuse_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fileInfo)
+{
+	return fs_fallocate(path, mode, offset, length, fileInfo);
+}
+
 int fuse_unlink(const char * path)
 {
 	return fs_unlink(path);
@@ -112,8 +165,19 @@ int fuse_statfs(const char *path, struct statvfs *statv)
 	return fs_statfs(path, statv);
 }
 
+int fuse_getxattr(const char *path, const char *name, char *value, size_t size)
+{
+	return fs_getxattr(path, name, value, size);
+}
+
+int fuse_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fileInfo, unsigned int flags, void *data)
+{
+	return fs_ioctl(path, cmd, arg, fileInfo, flags, data);
+}
+
 static struct fuse_operations fuse_ops =
 {
+    .init = fuse_init,
     .open = fuse_open,
     .mkdir = fuse_mkdir,
     .opendir = fuse_opendir,
@@ -124,10 +188,17 @@ static struct fuse_operations fuse_ops =
     .create = fuse_create,
     .read = fuse_read,
     .write = fuse_write,
+    .read_buf = fuse_read_buf,
+    .write_buf = fuse_write_buf,
     .release = fuse_release,
     .releasedir = fuse_releasedir,
     .utimens = fuse_utimens,
     .truncate = fuse_truncate,
+    .ftruncate = fuse_ftruncate,
+    .fgetattr = fuse_fgetattr,
+    .flush = fuse_flush,
+    .fsync = fuse_fsync,
+    .fallocate = fuse_fallocate,
     .unlink = fuse_unlink,
     .chmod = fuse_chmod,
     .chown = fuse_chown,
@@ -135,12 +206,179 @@ static struct fuse_operations fuse_ops =
     .symlink = fuse_symlink,
     .readlink = fuse_readlink,
     .statfs = fuse_statfs,
+    .getxattr = fuse_getxattr,
+    .ioctl = fuse_ioctl,
+    // ops on a handle only use fh, libfuse need not look up a path for them
+    .flag_nullpath_ok = 1,
+    .flag_nopath = 1,
+    .flag_utime_omit_ok = 1,
 };
 
+/*
+ * Fixed pool of FUSE workers. Each one pulls requests off the channel and
+ * runs them to completion; the fs_* core is safe to enter from any number
+ * of them (see the lock order in fs/fs.h). The first worker to see the
+ * session end wakes main, which cancels the rest, as fuse_loop_mt does.
+ */
+struct worker_pool {
+	struct fuse_session *se;
+	struct fuse_chan *ch;
+	sem_t finished;
+};
+
+static void *fuse_worker(void *arg)
+{
+	struct worker_pool *pool = (struct worker_pool *) arg;
+	size_t bufsize = fuse_chan_bufsize(pool->ch);
+	char *mem = (char *) malloc(bufsize);
+	struct fuse_buf fbuf;
+	struct fuse_chan *ch = NULL;
+	int res = 0;
+	if (mem == NULL) {
+		fprintf(stderr, "fuse worker: out of memory\n");
+		goto out;
+	}
+	// a worker cancelled in receive still frees its buffer
+	pthread_cleanup_push(free, mem);
+	while (!fuse_session_exited(pool->se)) {
+		memset(&fbuf, 0, sizeof(fbuf));
+		fbuf.mem = mem;
+		fbuf.size = bufsize;
+		ch = pool->ch;
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		res = fuse_session_receive_buf(pool->se, &fbuf, &ch);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		if (res == -EINTR)
+			continue;
+		if (res <= 0) {
+			if (res < 0)
+				fuse_session_exit(pool->se);
+			break;
+		}
+		fuse_session_process_buf(pool->se, &fbuf, ch);
+	}
+	pthread_cleanup_pop(1);
+out:
+	sem_post(&(pool->finished));
+	return NULL;
+}
+
+static int serve_workers(struct fuse_session *se, int nr_threads)
+{
+	struct worker_pool pool;
+	pthread_t *threads = NULL;
+	int started = 0;
+	int i;
+
+	pool.se = se;
+	pool.ch = fuse_session_next_chan(se, NULL);
+	sem_init(&(pool.finished), 0, 0);
+	threads = (pthread_t *) calloc(nr_threads, sizeof(pthread_t));
+	for (i = 0; threads != NULL && i < nr_threads; i++) {
+		if (pthread_create(&threads[i], NULL, fuse_worker, &pool) != 0) {
+			fprintf(stderr, "fuse workers: only %d of %d started\n", i, nr_threads);
+			break;
+		}
+		started++;
+	}
+	if (started > 0) {
+		printf("serving with %d fuse workers\n", started);
+		while (sem_wait(&(pool.finished)) != 0 && errno == EINTR)
+			;
+		for (i = 0; i < started; i++)
+			pthread_cancel(threads[i]);
+		for (i = 0; i < started; i++)
+			pthread_join(threads[i], NULL);
+	}
+	free(threads);
+	sem_destroy(&(pool.finished));
+	return started > 0 ? 0 : 1;
+}
+
+static int fuse_run_workers(int argc, char *argv[], int nr_threads)
+{
+	struct fuse *fuse = NULL;
+	char *mountpoint = NULL;
+	int multithreaded = 0;
+	int ret = 0;
+
+	fuse = fuse_setup(argc, argv, &fuse_ops, sizeof(fuse_ops), &mountpoint, &multithreaded, NULL);
+	if (fuse == NULL)
+		return 1;
+	if (!multithreaded)
+		nr_threads = 1;    // -s
+	ret = serve_workers(fuse_get_session(fuse), nr_threads);
+	fuse_teardown(fuse, mountpoint);
+	return ret;
+}
+
+// the inode based frontend of fs/fs_ll.c, same mount options and workers
+static int fuse_run_lowlevel(int argc, char *argv[], int nr_threads)
+{
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct fuse_session *se = NULL;
+	struct fuse_chan *ch = NULL;
+	char *mountpoint = NULL;
+	int multithreaded = 0;
+	int foreground = 0;
+	int ret = 1;
+
+	if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) == -1)
+		goto out;
+	ch = fuse_mount(mountpoint, &args);
+	if (ch == NULL)
+		goto out;
+	se = fuse_lowlevel_new(&args, &fs_ll_ops, sizeof(fs_ll_ops), NULL);
+	if (se == NULL)
+		goto unmount;
+	if (fuse_set_signal_handlers(se) == -1)
+		goto destroy;
+	fuse_session_add_chan(se, ch);
+	fs_ll_chan(ch);
+	if (fuse_daemonize(foreground) == -1)
+		goto remove;
+	if (!multithreaded)
+		ret = fuse_session_loop(se);    // -s
+	else if (nr_threads > 0)
+		ret = serve_workers(se, nr_threads);
+	else
+		ret = fuse_session_loop_mt(se);
+remove:
+	fuse_remove_signal_handlers(se);
+	fuse_session_remove_chan(ch);
+destroy:
+	fuse_session_destroy(se);
+unmount:
+	fuse_unmount(mountpoint, ch);
+out:
+	free(mountpoint);
+	fuse_opt_free_args(&args);
+	return ret;
+}
+
 static void usage(void)
 {
     printf(
     "usage:./stackfs /mnt/mountpoint /mnt/access -d\n"
+    "    --replicate=SOCK    stream namespace mutations to a standby listening on SOCK\n"
+    "    --standby=SOCK      replay mutations from a primary, mount when it goes away\n"
+    "    --mem-budget=MB     evict cold directories to disk past MB of dentries\n"
+    "    --evict-dir=DIR     local directory for the eviction segment (/tmp)\n"
+    "    --threads=N         serve with N fuse worker threads, default lets libfuse spawn them\n"
+    "    --lowlevel          serve the inode based low level api instead of paths\n"
+    "    --cache=SEC         kernel keeps dentries and attributes SEC seconds, file pages across opens\n"
+    "    --negative-timeout=SEC  kernel keeps lookup misses SEC seconds\n"
+    "    --writeback         kernel caches writes and sends them back in large batches\n"
+    "    --max-write=KB --max-read=KB --max-readahead=KB  request sizes, big writes past 4KB\n"
+    "    --write-behind=KB   coalesce small contiguous writes per open file up to KB\n"
+    "    --write-behind-ms=MS  flush coalesced writes older than MS (1000)\n"
+    "    --page-cache=MB     keep up to MB of small files in memory, read whole on first access\n"
+    "    --page-cache-file=KB  largest file the page cache takes (1024)\n"
+    "    --uring=DEPTH       with --lowlevel, hand reads and writes to io_uring, DEPTH in flight\n"
+    "    --direct-io=MB      open files of at least MB with O_DIRECT on the backend, no page caching\n"
+    "    --direct-io-path=PATTERN[,PATTERN]  the same for paths matching any pattern, /ckpt/* for a tree\n"
+    "    --promote=GB        move files past GB out of the pool to wide striped files under access/promoted\n"
+    "    --atime=POLICY      relatime (default), strict or noatime; getattr never moves the atime\n"
     );
 }
 
@@ -159,10 +397,85 @@ int main(int argc, char * argv[])
 	int fuse_argc = 0;
 	//char * fuse_argv[argc];
 	char * fuse_argv[20];
+	char * replicate_sock = NULL;
+	char * standby_sock = NULL;
+	char * evict_dir = NULL;
+	unsigned long mem_budget = 0;
+	unsigned long pcache_mb = 0;
+	unsigned long pcache_file_kb = 0;
+	unsigned long direct_mb = 0;
+	char * direct_paths = NULL;
+	int nr_threads = 0;
+	int lowlevel = 0;
+	char cache_opts[256];
 	fuse_argv[fuse_argc++] = argv[0];
 	fuse_argv[fuse_argc++] = argv[1];    // mount point
-	if (argc > 3) {
-		fuse_argv[fuse_argc++] = argv[3];
+	for (i = 3; i < argc && fuse_argc < 18; i++) {
+		if (strncmp(argv[i], "--replicate=", 12) == 0)
+			replicate_sock = argv[i] + 12;
+		else if (strncmp(argv[i], "--standby=", 10) == 0)
+			standby_sock = argv[i] + 10;
+		else if (strncmp(argv[i], "--mem-budget=", 13) == 0)
+			mem_budget = strtoul(argv[i] + 13, NULL, 10);
+		else if (strncmp(argv[i], "--evict-dir=", 12) == 0)
+			evict_dir = argv[i] + 12;
+		else if (strncmp(argv[i], "--threads=", 10) == 0)
+			nr_threads = atoi(argv[i] + 10);
+		else if (strcmp(argv[i], "--lowlevel") == 0)
+			lowlevel = 1;
+		else if (strncmp(argv[i], "--cache=", 8) == 0) {
+			fs_cache.entry_timeout = fs_cache.attr_timeout = atof(argv[i] + 8);
+			fs_cache.keep_cache = 1;
+		} else if (strncmp(argv[i], "--negative-timeout=", 19) == 0)
+			fs_cache.negative_timeout = atof(argv[i] + 19);
+		else if (strcmp(argv[i], "--writeback") == 0)
+			fs_cache.writeback = 1;
+		else if (strncmp(argv[i], "--max-write=", 12) == 0)
+			fs_cache.max_write = strtoul(argv[i] + 12, NULL, 10) << 10;
+		else if (strncmp(argv[i], "--max-read=", 11) == 0)
+			fs_cache.max_read = strtoul(argv[i] + 11, NULL, 10) << 10;
+		else if (strncmp(argv[i], "--max-readahead=", 16) == 0)
+			fs_cache.max_readahead = strtoul(argv[i] + 16, NULL, 10) << 10;
+		else if (strncmp(argv[i], "--write-behind=", 15) == 0)
+			fs_cache.write_behind = strtoul(argv[i] + 15, NULL, 10) << 10;
+		else if (strncmp(argv[i], "--write-behind-ms=", 18) == 0)
+			fs_cache.write_behind_ms = strtoul(argv[i] + 18, NULL, 10);
+		else if (strncmp(argv[i], "--page-cache=", 13) == 0)
+			pcache_mb = strtoul(argv[i] + 13, NULL, 10);
+		else if (strncmp(argv[i], "--page-cache-file=", 18) == 0)
+			pcache_file_kb = strtoul(argv[i] + 18, NULL, 10);
+		else if (strncmp(argv[i], "--uring=", 8) == 0)
+			fs_cache.uring_depth = strtoul(argv[i] + 8, NULL, 10);
+		else if (strncmp(argv[i], "--direct-io=", 12) == 0)
+			direct_mb = strtoul(argv[i] + 12, NULL, 10);
+		else if (strncmp(argv[i], "--direct-io-path=", 17) == 0)
+			direct_paths = argv[i] + 17;
+		else if (strncmp(argv[i], "--promote=", 10) == 0)
+			fs_cache.promote_size = strtoull(argv[i] + 10, NULL, 10) << 30;
+		else if (strncmp(argv[i], "--atime=", 8) == 0) {
+			if (strcmp(argv[i] + 8, "strict") == 0)
+				fs_atime = ATIME_STRICT;
+			else if (strcmp(argv[i] + 8, "noatime") == 0)
+				fs_atime = ATIME_NOATIME;
+			else
+				fs_atime = ATIME_RELATIME;
+		}
+		else
+			fuse_argv[fuse_argc++] = argv[i];
+	}
+	// the path frontend takes its timeouts from libfuse, and our inode numbers only with use_ino;
+	// max_read is a mount option for both
+	if (lowlevel)
+		cache_opts[0] = '\0';
+	else
+		snprintf(cache_opts, sizeof(cache_opts), "use_ino,entry_timeout=%g,attr_timeout=%g,negative_timeout=%g,",
+				fs_cache.entry_timeout, fs_cache.attr_timeout, fs_cache.negative_timeout);
+	if (fs_cache.max_read > 0)
+		snprintf(cache_opts + strlen(cache_opts), sizeof(cache_opts) - strlen(cache_opts), "max_read=%u,", fs_cache.max_read);
+	if (cache_opts[0] != '\0') {
+		cache_opts[strlen(cache_opts) - 1] = '\0';
+		fuse_argv[fuse_argc++] = "-o";
+		fuse_argv[fuse_argc++] = cache_opts;
 	}
 	/*
 	for (i = 0; i < argc; i++) {
@@ -173,8 +486,24 @@ int main(int argc, char * argv[])
 	*/
 
 	fs_init(argv[1], argv[2]);
+	if (evict_init((uint64_t) mem_budget << 20, evict_dir) != SUCCESS)
+		return 1;
+	if (pcache_init((uint64_t) pcache_mb << 20, (uint64_t) pcache_file_kb << 10) != SUCCESS)
+		return 1;
+	if (file_direct_init((uint64_t) direct_mb << 20, direct_paths) != SUCCESS)
+		return 1;
+	if (standby_sock != NULL && replica_run_standby(standby_sock) != SUCCESS)
+		return 1;
+	// before the fork, so a standby that is not there stops the mount
+	if (replicate_sock != NULL && replica_init_primary(replicate_sock) != SUCCESS)
+		return 1;
 	printf("starting fuse main...\n");
-	ret = fuse_main(fuse_argc, fuse_argv, &fuse_ops, NULL);
+	if (lowlevel)
+		ret = fuse_run_lowlevel(fuse_argc, fuse_argv, nr_threads);
+	else if (nr_threads > 0)
+		ret = fuse_run_workers(fuse_argc, fuse_argv, nr_threads);
+	else
+		ret = fuse_main(fuse_argc, fuse_argv, &fuse_ops, NULL);
 	printf("fuse main finished, ret %d\n", ret);
 	fs_destroy();
 	return ret;
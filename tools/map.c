@@ -1,4 +1,16 @@
 #include "map.h"
+#include "slab.h"
+
+static struct slab_cache map_cache;
+static pthread_once_t map_once = PTHREAD_ONCE_INIT;
+
+static void map_cache_init() {
+    slab_cache_init(&map_cache, "map", sizeof(map_t));
+}
+
+void map_init() {
+    pthread_once(&map_once, map_cache_init);
+}
 
 map_t *get(root_t *root, char *str) {
    rb_node_t *node = root->rb_node; 
@@ -19,14 +31,6 @@ map_t *get(root_t *root, char *str) {
 }
 
 int put(root_t *root, char* key, uint64_t val) {
-    map_t *data = (map_t*)malloc(sizeof(map_t));
-	int key_len = strlen(key);
-	data->key = (char *)malloc(key_len + 1);
-    //data->key = (char*)malloc(sizeof(key));
-    strcpy(data->key, key);
-	data->key[key_len] = '\0';
-	data->val = val;
-    
     rb_node_t **new_node = &(root->rb_node), *parent = NULL;
     while (*new_node) {
         map_t *this_node = container_of(*new_node, map_t, node);
@@ -42,6 +46,13 @@ int put(root_t *root, char* key, uint64_t val) {
         }
     }
 
+    map_t *data = (map_t*)slab_alloc(&map_cache);
+	int key_len = strlen(key);
+	data->key = (char *)slab_alloc_size(key_len + 1);
+    memcpy(data->key, key, key_len);
+	data->key[key_len] = '\0';
+	data->val = val;
+
     rb_link_node(&data->node, parent, new_node);
     rb_insert_color(&data->node, root);
 
@@ -66,10 +77,10 @@ map_t *map_next(rb_node_t *node) {
 void map_free(map_t *node){
     if (node != NULL) {
         if (node->key != NULL) {
-            free(node->key);
+            slab_free_size(node->key, strlen(node->key) + 1);
             node->key = NULL;
     }
-        free(node);
+        slab_free(&map_cache, node);
         node = NULL;
     }
 }
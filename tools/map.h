@@ -19,6 +19,7 @@ typedef struct map map_t;
 typedef struct rb_root root_t;
 typedef struct rb_node rb_node_t;
 
+void map_init();
 map_t *get(root_t *root, char *str);
 int put(root_t *root, char* key, uint64_t val);
 void del(root_t *root, map_t *data);
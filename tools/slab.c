@@ -0,0 +1,264 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "slab.h"
+
+struct slab_magazine {
+	void *head;
+	int count;
+	uint64_t allocs;
+	uint64_t frees;
+};
+
+static struct slab_cache *caches[SLAB_MAX_CACHES];
+static int nr_caches = 0;
+static pthread_mutex_t caches_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t magazine_key;
+static pthread_once_t magazine_once = PTHREAD_ONCE_INIT;
+static __thread struct slab_magazine magazines[SLAB_MAX_CACHES];
+static __thread int magazine_registered = 0;
+
+// string size classes, anything larger goes to malloc
+static const size_t size_classes[] = {16, 32, 64, 128, 256};
+#define NR_SIZE_CLASSES (sizeof(size_classes) / sizeof(size_classes[0]))
+static struct slab_cache size_caches[NR_SIZE_CLASSES];
+static pthread_once_t size_once = PTHREAD_ONCE_INIT;
+
+static void magazine_exit(void *arg)
+{
+	slab_flush_thread();
+}
+
+static void magazine_key_init()
+{
+	pthread_key_create(&magazine_key, magazine_exit);
+}
+
+// the first refill or free on a thread, its magazines go back when it exits
+static void magazine_register()
+{
+	pthread_once(&magazine_once, magazine_key_init);
+	pthread_setspecific(magazine_key, magazines);
+	magazine_registered = 1;
+}
+
+void slab_cache_init(struct slab_cache *cache, const char *name, size_t obj_size)
+{
+	memset(cache, 0, sizeof(struct slab_cache));
+	cache->name = name;
+	if (obj_size < sizeof(void *))
+		obj_size = sizeof(void *);
+	// objects of a cache line or more start on their own line
+	if (obj_size >= SLAB_CACHE_LINE)
+		obj_size = (obj_size + SLAB_CACHE_LINE - 1) & ~(SLAB_CACHE_LINE - 1);
+	else
+		obj_size = (obj_size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+	cache->obj_size = obj_size;
+	pthread_mutex_init(&(cache->lock), NULL);
+
+	pthread_mutex_lock(&caches_lock);
+	cache->id = nr_caches;
+	caches[nr_caches++] = cache;
+	pthread_mutex_unlock(&caches_lock);
+}
+
+void slab_cache_destroy(struct slab_cache *cache)
+{
+	void *chunk = cache->chunks;
+	void *next = NULL;
+	while (chunk != NULL) {
+		next = *(void **) chunk;
+		free(chunk);
+		chunk = next;
+	}
+	cache->chunks = NULL;
+	cache->free_list = NULL;
+	cache->nr_free = 0;
+	pthread_mutex_destroy(&(cache->lock));
+}
+
+// cache->lock held
+static int slab_grow(struct slab_cache *cache)
+{
+	char *chunk = NULL;
+	size_t nr = (SLAB_CHUNK_SIZE - SLAB_CACHE_LINE) / cache->obj_size;
+	size_t i;
+	if (nr < SLAB_BATCH)
+		nr = SLAB_BATCH;
+	if (posix_memalign((void **) &chunk, SLAB_CACHE_LINE, SLAB_CACHE_LINE + nr * cache->obj_size) != 0)
+		return -1;
+	// first line of a chunk links the chunk list
+	*(void **) chunk = cache->chunks;
+	cache->chunks = chunk;
+	for (i = 0; i < nr; i++) {
+		void *obj = chunk + SLAB_CACHE_LINE + i * cache->obj_size;
+		*(void **) obj = cache->free_list;
+		cache->free_list = obj;
+	}
+	cache->nr_free += nr;
+	cache->nr_objs += nr;
+	cache->nr_chunks++;
+	return 0;
+}
+
+static void slab_refill(struct slab_cache *cache, struct slab_magazine *mag)
+{
+	int i;
+	void *obj = NULL;
+	if (!magazine_registered)
+		magazine_register();
+	pthread_mutex_lock(&(cache->lock));
+	for (i = 0; i < SLAB_BATCH; i++) {
+		if (cache->free_list == NULL && slab_grow(cache) != 0)
+			break;
+		obj = cache->free_list;
+		cache->free_list = *(void **) obj;
+		*(void **) obj = mag->head;
+		mag->head = obj;
+		mag->count++;
+		cache->nr_free--;
+	}
+	cache->refills++;
+	cache->allocs += mag->allocs;
+	cache->frees += mag->frees;
+	mag->allocs = 0;
+	mag->frees = 0;
+	pthread_mutex_unlock(&(cache->lock));
+}
+
+static void slab_spill(struct slab_cache *cache, struct slab_magazine *mag, int nr)
+{
+	void *obj = NULL;
+	pthread_mutex_lock(&(cache->lock));
+	while (nr-- > 0 && mag->head != NULL) {
+		obj = mag->head;
+		mag->head = *(void **) obj;
+		mag->count--;
+		*(void **) obj = cache->free_list;
+		cache->free_list = obj;
+		cache->nr_free++;
+	}
+	cache->spills++;
+	cache->allocs += mag->allocs;
+	cache->frees += mag->frees;
+	mag->allocs = 0;
+	mag->frees = 0;
+	pthread_mutex_unlock(&(cache->lock));
+}
+
+void *slab_alloc(struct slab_cache *cache)
+{
+	struct slab_magazine *mag = &magazines[cache->id];
+	void *obj = NULL;
+	if (mag->head == NULL) {
+		slab_refill(cache, mag);
+		if (mag->head == NULL)
+			return NULL;
+	}
+	obj = mag->head;
+	mag->head = *(void **) obj;
+	mag->count--;
+	mag->allocs++;
+	return obj;
+}
+
+void *slab_zalloc(struct slab_cache *cache)
+{
+	void *obj = slab_alloc(cache);
+	if (obj != NULL)
+		memset(obj, 0, cache->obj_size);
+	return obj;
+}
+
+void slab_free(struct slab_cache *cache, void *obj)
+{
+	struct slab_magazine *mag = &magazines[cache->id];
+	if (obj == NULL)
+		return;
+	// a thread that only frees hands its magazines back on exit too
+	if (!magazine_registered)
+		magazine_register();
+	*(void **) obj = mag->head;
+	mag->head = obj;
+	mag->count++;
+	mag->frees++;
+	if (mag->count >= 2 * SLAB_BATCH)
+		slab_spill(cache, mag, SLAB_BATCH);
+}
+
+static void size_caches_init()
+{
+	static char names[NR_SIZE_CLASSES][16];
+	size_t i;
+	for (i = 0; i < NR_SIZE_CLASSES; i++) {
+		sprintf(names[i], "size-%d", (int) size_classes[i]);
+		slab_cache_init(&size_caches[i], names[i], size_classes[i]);
+	}
+}
+
+static struct slab_cache *size_cache(size_t size)
+{
+	size_t i;
+	pthread_once(&size_once, size_caches_init);
+	for (i = 0; i < NR_SIZE_CLASSES; i++) {
+		if (size <= size_classes[i])
+			return &size_caches[i];
+	}
+	return NULL;
+}
+
+void *slab_alloc_size(size_t size)
+{
+	struct slab_cache *cache = size_cache(size);
+	if (cache == NULL)
+		return malloc(size);
+	return slab_alloc(cache);
+}
+
+void slab_free_size(void *obj, size_t size)
+{
+	struct slab_cache *cache = size_cache(size);
+	if (cache == NULL) {
+		free(obj);
+		return;
+	}
+	slab_free(cache, obj);
+}
+
+// hand every object cached by the calling thread back, e.g. on thread exit
+void slab_flush_thread()
+{
+	int i;
+	for (i = 0; i < nr_caches; i++) {
+		if (magazines[i].count > 0 || magazines[i].allocs > 0 || magazines[i].frees > 0)
+			slab_spill(caches[i], &magazines[i], magazines[i].count);
+	}
+}
+
+int slab_stats(char *buf, size_t size)
+{
+	int i;
+	int n = 0;
+	size_t len = 0;
+	struct slab_cache *cache = NULL;
+	for (i = 0; i < nr_caches && len + 1 < size; i++) {
+		cache = caches[i];
+		pthread_mutex_lock(&(cache->lock));
+		if (cache->nr_chunks == 0) {
+			pthread_mutex_unlock(&(cache->lock));
+			continue;
+		}
+		n = snprintf(buf + len, size - len,
+				"slab.%s obj_size %lu objs %lu free %lu chunks %lu allocs %lu frees %lu refills %lu spills %lu\n",
+				cache->name, (unsigned long) cache->obj_size, (unsigned long) cache->nr_objs,
+				(unsigned long) cache->nr_free, (unsigned long) cache->nr_chunks,
+				(unsigned long) cache->allocs, (unsigned long) cache->frees,
+				(unsigned long) cache->refills, (unsigned long) cache->spills);
+		pthread_mutex_unlock(&(cache->lock));
+		// a line cut short leaves len on the last byte, not past it
+		if (n > 0)
+			len = len + n < size ? len + n : size - 1;
+	}
+	return (int) len;
+}
@@ -0,0 +1,52 @@
+#ifndef _SLAB_H
+#define _SLAB_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#define SLAB_CACHE_LINE 64
+#define SLAB_MAX_CACHES 32
+#define SLAB_CHUNK_SIZE (256 << 10)    // bytes carved per refill from malloc
+#define SLAB_BATCH 64    // objects moved between a thread cache and the cache in one go
+
+/*
+ * Fixed size object cache. Each thread keeps a small magazine of free
+ * objects per cache, so the common alloc/free path takes no lock; the
+ * magazine refills from and spills back to the shared free list in
+ * batches of SLAB_BATCH objects.
+ *
+ * Chunks are only given back by slab_cache_destroy(). A cache stays at
+ * its high water mark, idle objects sit on the free list for the next
+ * burst; nr_free in slab_stats() shows how much of it is unused.
+ */
+struct slab_cache {
+	const char *name;
+	int id;
+	size_t obj_size;
+	pthread_mutex_t lock;
+	void *free_list;
+	void *chunks;    // every chunk we carved, freed on destroy
+	uint64_t nr_free;
+	uint64_t nr_objs;
+	uint64_t nr_chunks;
+	uint64_t allocs;    // folded in from the thread caches
+	uint64_t frees;
+	uint64_t refills;
+	uint64_t spills;
+} __attribute__((aligned(SLAB_CACHE_LINE)));
+
+void slab_cache_init(struct slab_cache *cache, const char *name, size_t obj_size);
+void slab_cache_destroy(struct slab_cache *cache);
+void *slab_alloc(struct slab_cache *cache);
+void *slab_zalloc(struct slab_cache *cache);
+void slab_free(struct slab_cache *cache, void *obj);
+
+// size classes for variable length objects such as key strings
+void *slab_alloc_size(size_t size);
+void slab_free_size(void *obj, size_t size);
+
+void slab_flush_thread();
+int slab_stats(char *buf, size_t size);
+
+#endif  //_SLAB_H